@@ -24,12 +24,12 @@
 
 #include "mydvi.h"
 
-dvi_context *dvi_context_new(fz_context *ctx, dvi_reshooks hooks)
+dvi_context *dvi_context_new(fz_context *ctx, dvi_resmanager *rm)
 {
   dvi_context *dc = fz_malloc_struct(ctx, dvi_context);
 
   dc->dev = NULL;
-  dc->resmanager = dvi_resmanager_new(ctx, hooks);
+  dc->resmanager = dvi_resmanager_keep(ctx, rm);
   dvi_scratch_init(&dc->scratch);
 
   dvi_state *st = &dc->root;
@@ -58,14 +58,27 @@ dvi_context_set_device(fz_context *ctx, dvi_context *dc, fz_device *dev)
 
 void dvi_context_free(fz_context *ctx, dvi_context *dc)
 {
+  fz_drop_text(ctx, dc->text);
+  fz_drop_path(ctx, dc->rules);
   dvi_context_set_device(ctx, dc, NULL);
-  dvi_resmanager_free(ctx, dc->resmanager);
+  dvi_resmanager_drop(ctx, dc->resmanager);
   dvi_scratch_release(ctx, &dc->scratch);
   fz_free(ctx, dc);
 }
 
 void dvi_context_begin_frame(fz_context *ctx, dvi_context *dc, fz_device *dev)
 {
+  // Drop output left over by a frame that was interrupted
+  if (dc->text)
+  {
+    fz_drop_text(ctx, dc->text);
+    dc->text = NULL;
+  }
+  if (dc->rules)
+  {
+    fz_drop_path(ctx, dc->rules);
+    dc->rules = NULL;
+  }
   dvi_context_set_device(ctx, dc, dev);
   dvi_state *st = &dc->root;
   st->registers_stack.depth = 0;
@@ -83,6 +96,8 @@ void dvi_context_begin_frame(fz_context *ctx, dvi_context *dc, fz_device *dev)
 
 void dvi_context_end_frame(fz_context *ctx, dvi_context *dc)
 {
+  if (dc->dev)
+    dvi_context_flush(ctx, dc, &dc->root);
   dvi_scratch_clear(ctx, &dc->scratch);
   dvi_context_set_device(ctx, dc, NULL);
 
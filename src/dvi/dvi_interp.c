@@ -377,6 +377,14 @@ bool dvi_interp_sub(fz_context *ctx, dvi_context *dc, dvi_state *st, const uint8
     {
       uint32_t k = read_uB(&buf, n);
       const char *ptr = (const char *)buf;
+      if (dc->vf_record)
+      {
+        // Specials depend on the state: the character is not flattened
+        dc->vf_record->failed = 1;
+        return 1;
+      }
+      // Specials can change the graphic state or draw
+      dvi_context_flush(ctx, dc, st);
       if (!dvi_exec_special(ctx, dc, st, ptr, ptr + k))
       {
         // fprintf(stderr, "interp: special failed: %.*s\n", k, ptr);
@@ -466,9 +474,11 @@ bool dvi_interp_sub(fz_context *ctx, dvi_context *dc, dvi_state *st, const uint8
     }
 
     case XDV_TEXT_GLYPHS:
-    xdv_chars_count = read_s16(&buf);
+    xdv_chars_count = read_u16(&buf);
     xdv_chars =
       DC_ALLOC(ctx, dc, uint16_t, xdv_chars_count);
+    for (int i = 0; i < xdv_chars_count; ++i)
+      xdv_chars[i] = read_u16(&buf);
 
     case XDV_GLYPHS:
     {
@@ -29,16 +29,49 @@
 
 #define color_params fz_default_color_params
 
-static void output_fill_rect(fz_context *ctx, dvi_context *dc, dvi_state *st, int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+static tex_vf_item *record_item(fz_context *ctx, tex_vf_recording *rec)
 {
-  if (ctx && dc->dev)
+  if (rec->count == rec->capacity)
   {
-    float s = dc->scale;
-    fz_path *path = fz_new_path(ctx);
-    fz_rectto(ctx, path, x0 * s, - y0 * s, x1 * s, - y1 * s);
-    fz_fill_path(ctx, dc->dev, path, 0, st->gs.ctm, fz_device_rgb(ctx),
-                 st->gs.colors.fill, 1.0, color_params);
-    fz_drop_path(ctx, path);
+    int capacity = rec->capacity ? rec->capacity * 2 : 16;
+    rec->items = fz_realloc(ctx, rec->items, sizeof(tex_vf_item) * capacity);
+    rec->capacity = capacity;
+  }
+  return &rec->items[rec->count++];
+}
+
+static void output_fill_rect(fz_context *ctx, dvi_context *dc, dvi_state *st, fz_matrix ctm, fz_rect r)
+{
+  if (dc->vf_record)
+  {
+    tex_vf_item *item = record_item(ctx, dc->vf_record);
+    item->ctm = ctm;
+    item->font = NULL;
+    item->glyph = item->ucs = 0;
+    item->rule = r;
+  }
+  else if (ctx && dc->dev)
+  {
+    // Rules are accumulated in a single path, transformed to device space.
+    // All rectangles are wound in the same direction, so that overlapping
+    // rules are filled as they would be by separate paths.
+    if (!dc->rules)
+      dc->rules = fz_new_path(ctx);
+    fz_point p0 = fz_transform_point_xy(r.x0, r.y0, ctm);
+    fz_point p1 = fz_transform_point_xy(r.x1, r.y0, ctm);
+    fz_point p2 = fz_transform_point_xy(r.x1, r.y1, ctm);
+    fz_point p3 = fz_transform_point_xy(r.x0, r.y1, ctm);
+    if ((r.x1 - r.x0) * (r.y1 - r.y0) * (ctm.a * ctm.d - ctm.b * ctm.c) < 0)
+    {
+      fz_point p = p1;
+      p1 = p3;
+      p3 = p;
+    }
+    fz_moveto(ctx, dc->rules, p0.x, p0.y);
+    fz_lineto(ctx, dc->rules, p1.x, p1.y);
+    fz_lineto(ctx, dc->rules, p2.x, p2.y);
+    fz_lineto(ctx, dc->rules, p3.x, p3.y);
+    fz_closepath(ctx, dc->rules);
   }
 }
 
@@ -54,8 +87,17 @@ static void output_debug_rect(fz_context *ctx, dvi_context *dc, dvi_state *st, i
   }
 }
 
-void dvi_context_flush_text(fz_context *ctx, dvi_context *dc, dvi_state *st)
+void dvi_context_flush(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
+  if (dc->rules)
+  {
+    if (!dc->dev)
+      abort();
+    fz_fill_path(ctx, dc->dev, dc->rules, 0, fz_identity, fz_device_rgb(ctx),
+                 st->gs.colors.fill, 1.0, color_params);
+    fz_drop_path(ctx, dc->rules);
+    dc->rules = NULL;
+  }
   if (dc->text)
   {
     if (!dc->dev)
@@ -74,11 +116,114 @@ static fz_text *get_text(fz_context *ctx, dvi_context *dc)
   return dc->text;
 }
 
+static void output_glyph(fz_context *ctx, dvi_context *dc, fz_font *font, fz_matrix ctm, int glyph, int ucs)
+{
+  if (dc->vf_record)
+  {
+    tex_vf_item *item = record_item(ctx, dc->vf_record);
+    item->ctm = ctm;
+    item->font = font;
+    item->glyph = glyph;
+    item->ucs = ucs;
+    item->rule = fz_empty_rect;
+  }
+  else if (dc->dev)
+    fz_show_glyph(ctx, get_text(ctx, dc), font, ctm, glyph, ucs, 0, 0,
+                  FZ_BIDI_LTR, FZ_LANG_UNSET);
+}
+
 static dvi_fontdef *dvi_current_font(fz_context *ctx, dvi_state *st)
 {
   return dvi_fonttable_get(ctx, st->fonts, st->f);
 }
 
+static void interp_vf_char(fz_context *ctx, dvi_context *dc, dvi_state *st,
+                           tex_vf *vf, tex_vf_char *vfc, fixed_t scale_factor)
+{
+  dvi_state vfst;
+  if (!dvi_state_enter_vf(dc, &vfst, st, tex_vf_fonttable(vf), tex_vf_default_font(vf), scale_factor))
+  {
+    fprintf(stderr, "VirtualFont: cannot enter state (vfc: %p)\n", vfc);
+    return;
+  }
+
+  int pos = 0, dvi_length = vfc->dvi_length;
+  const uint8_t *dvi = vfc->dvi;
+  while (pos < dvi_length)
+  {
+    int size = dvi_instr_size(dvi + pos, dvi_length - pos, DVI_VF);
+    if (size <= 0 || size > dvi_length - pos) break;
+    //fprintf(stderr, "VF: %s (%d) at offset %d/%d\n", dvi_opname(dvi[pos]), size, pos, dvi_length);
+    if (!dvi_interp_sub(ctx, dc, &vfst, dvi + pos))
+    {
+      fprintf(stderr, "VF: failed\n");
+      break;
+    }
+    pos += size;
+  }
+}
+
+// Interpret the character once with its origin at the identity, recording
+// what it draws (recursively flattening the virtual fonts it uses).
+static tex_vf_expansion *expand_vf_char(fz_context *ctx, dvi_context *dc, dvi_state *st,
+                                        tex_vf *vf, tex_vf_char *vfc, fixed_t scale_factor)
+{
+  dvi_state origin = *st;
+  origin.gs.ctm = fz_identity;
+  origin.gs.h = origin.registers.h;
+  origin.gs.v = origin.registers.v;
+
+  tex_vf_recording rec = {NULL, 0, 0, 0}, *saved = dc->vf_record;
+  tex_vf_expansion *exp = NULL;
+
+  dc->vf_record = &rec;
+  fz_try(ctx)
+  {
+    interp_vf_char(ctx, dc, &origin, vf, vfc, scale_factor);
+    exp = tex_vf_add_expansion(ctx, vfc, scale_factor, dc->scale,
+                               !rec.failed, rec.items, rec.count);
+  }
+  fz_always(ctx)
+  {
+    dc->vf_record = saved;
+    fz_free(ctx, rec.items);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return exp;
+}
+
+static void exec_vf_char(fz_context *ctx, dvi_context *dc, dvi_state *st,
+                         tex_vf *vf, tex_vf_char *vfc, fixed_t scale_factor)
+{
+  tex_vf_expansion *exp = tex_vf_find_expansion(vfc, scale_factor, dc->scale);
+  if (!exp)
+    exp = expand_vf_char(ctx, dc, st, vf, vfc, scale_factor);
+
+  if (!exp->flat)
+  {
+    interp_vf_char(ctx, dc, st, vf, vfc, scale_factor);
+    return;
+  }
+
+  if (!dc->vf_record && !dc->dev)
+    return;
+
+  fz_matrix ctm = dvi_get_ctm(dc, st);
+  for (int i = 0; i < exp->count; ++i)
+  {
+    tex_vf_item *item = &exp->items[i];
+    fz_matrix m = fz_concat(item->ctm, ctm);
+    if (item->font)
+      output_glyph(ctx, dc, item->font, m, item->glyph, item->ucs);
+    else
+      output_fill_rect(ctx, dc, st, m, item->rule);
+  }
+}
+
 void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c, bool set)
 {
   int debug = 0;
@@ -133,38 +278,16 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
         u = fz_encode_character(ctx, font->fz, c);
       }
 
-      if (dc->dev)
-      {
-        float s = dc->scale * scale_factor.value;
-        fz_show_glyph(ctx, get_text(ctx, dc), font->fz,
-                      fz_pre_scale(dvi_get_ctm(dc, st), s, s), u, c, 0, 0,
-                      FZ_BIDI_LTR, FZ_LANG_UNSET);
-      }
+      float s = dc->scale * scale_factor.value;
+      output_glyph(ctx, dc, font->fz, fz_pre_scale(dvi_get_ctm(dc, st), s, s), u, c);
     }
     else if (font->vf)
     {
-      dvi_state vfst;
       tex_vf_char *vfc = tex_vf_get(font->vf, c);
-      if (vfc &&
-          dvi_state_enter_vf(dc, &vfst, st, tex_vf_fonttable(font->vf), tex_vf_default_font(font->vf), scale_factor))
-      {
-        int pos = 0, dvi_length = vfc->dvi_length;
-        const uint8_t *dvi = vfc->dvi;
-        while (pos < dvi_length)
-        {
-          int size = dvi_instr_size(dvi + pos, dvi_length - pos, DVI_VF);
-          if (size <= 0 || size > dvi_length - pos) break;
-          //fprintf(stderr, "VF: %s (%d) at offset %d/%d\n", dvi_opname(dvi[pos]), size, pos, dvi_length);
-          if (!dvi_interp_sub(ctx, dc, &vfst, dvi + pos))
-          {
-            fprintf(stderr, "VF: failed\n");
-            break;
-          }
-          pos += size;
-        }
-      }
+      if (vfc)
+        exec_vf_char(ctx, dc, st, font->vf, vfc, scale_factor);
       else
-        fprintf(stderr, "VirtualFont: cannot enter state (vfc: %p)\n", vfc);
+        fprintf(stderr, "VirtualFont: undefined character %u in %s\n", c, font->name);
       if (vfc && set)
       {
         st->registers.h += fixed_mul(vfc->width, scale_factor).value;
@@ -203,9 +326,11 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
   }
 }
 
+// Push and pop only affect the registers: pending glyphs and rules are kept,
+// to be emitted with fewer device calls.
+
 bool dvi_exec_push(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
-  dvi_context_flush_text(ctx, dc, st);
   if (st->registers_stack.depth >= st->registers_stack.limit)
     return 0;
   st->registers_stack.base[st->registers_stack.depth] = st->registers;
@@ -215,7 +340,6 @@ bool dvi_exec_push(fz_context *ctx, dvi_context *dc, dvi_state *st)
 
 bool dvi_exec_pop(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
-  dvi_context_flush_text(ctx, dc, st);
   if (st->registers_stack.depth == 0)
     return 0;
   st->registers_stack.depth -= 1;
@@ -235,9 +359,12 @@ void dvi_exec_rule(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t w,
 {
   int32_t x = st->registers.h - st->gs.h;
   int32_t y = st->registers.v - st->gs.v;
+  int32_t x1 = x + w, y1 = y - h;
+  float s = dc->scale;
 
   //fprintf(stderr, "rule: (%fpt, %fpt, %fpt, %fpt)\n", fx, fy, fw, fh);
-  output_fill_rect(ctx, dc, st, x, y, x + w, y - h);
+  output_fill_rect(ctx, dc, st, st->gs.ctm,
+                   fz_make_rect(x * s, - y * s, x1 * s, - y1 * s));
 }
 
 bool dvi_exec_fnt_def(fz_context *ctx, dvi_context *dc, dvi_state *st,
@@ -290,7 +417,7 @@ bool dvi_exec_bop(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c[10
 
 void dvi_exec_eop(fz_context *ctx, dvi_context *dc, dvi_state *st)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  dvi_context_flush(ctx, dc, st);
   // fprintf(stderr, "end_of_page\n");
 }
 
@@ -318,9 +445,67 @@ void dvi_exec_xdvfontdef(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32
     def->kind = XDV_FONT;
     def->xdv_font.font = dvi_resmanager_get_xdv_font(ctx, dc->resmanager, name, name_len, index);
     def->xdv_font.spec = spec;
+    def->xdv_font.unicodes =
+      dvi_resmanager_get_font_unicodes(ctx, dc->resmanager, def->xdv_font.font,
+                                       &def->xdv_font.unicode_count);
   }
 }
 
+// Text of a glyph, for text extraction: additional characters are shown with
+// glyph -1 at the same position, as done by MuPDF for multi-character
+// ToUnicode entries.
+static void show_glyph_text(fz_context *ctx, fz_text *text, fz_font *font, fz_matrix ctm,
+                            int glyph, const uint32_t *ucs, int ucs_count)
+{
+  fz_show_glyph(ctx, text, font, ctm, glyph, ucs_count > 0 ? ucs[0] : 0, 0, 0,
+                FZ_BIDI_LTR, FZ_LANG_UNSET);
+  for (int i = 1; i < ucs_count; ++i)
+    fz_show_glyph(ctx, text, font, ctm, -1, ucs[i], 0, 0, FZ_BIDI_LTR,
+                  FZ_LANG_UNSET);
+}
+
+// Decode the UTF-16 text of a XDV_TEXT_AND_GLYPHS run
+static int decode_utf16(const uint16_t *chars, int count, uint32_t *out)
+{
+  int n = 0;
+  for (int i = 0; i < count; ++i)
+  {
+    uint32_t c = chars[i];
+    if (c >= 0xD800 && c < 0xDC00 && i + 1 < count &&
+        chars[i + 1] >= 0xDC00 && chars[i + 1] < 0xE000)
+    {
+      c = 0x10000 + ((c - 0xD800) << 10) + (chars[i + 1] - 0xDC00);
+      i += 1;
+    }
+    out[n++] = c;
+  }
+  return n;
+}
+
+// Characters of a glyph found in the charmap of the font, with the Latin
+// ligatures expanded so that the extracted text can be searched
+static int glyph_unicodes(const dvi_fontdef *def, int glyph, uint32_t out[3])
+{
+  static const char ligatures[7][4] =
+    {"ff", "fi", "fl", "ffi", "ffl", "st", "st"};
+
+  if (glyph < 0 || glyph >= def->xdv_font.unicode_count)
+    return 0;
+  uint32_t c = def->xdv_font.unicodes[glyph];
+  if (c == 0)
+    return 0;
+  if (c < 0xFB00 || c > 0xFB06)
+  {
+    out[0] = c;
+    return 1;
+  }
+
+  int n = 0;
+  for (const char *p = ligatures[c - 0xFB00]; *p; p++)
+    out[n++] = *p;
+  return n;
+}
+
 void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t width,
                 int char_count, uint16_t *chars,
                 int num_glyphs, fixed_t *dx, fixed_t dy0, fixed_t *dy, uint16_t *glyphs)
@@ -344,6 +529,16 @@ void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t
     int32_t sv = st->registers.v + dy0.value - st->gs.v;
     if (dc->dev)
     {
+      // With XDV_TEXT_AND_GLYPHS, the text is spread evenly over the glyphs
+      // (the run does not say which characters produced which glyph)
+      uint32_t *ucs = NULL;
+      int ucs_count = 0;
+      if (char_count > 0)
+      {
+        ucs = DC_ALLOC(ctx, dc, uint32_t, char_count);
+        ucs_count = decode_utf16(chars, char_count, ucs);
+      }
+
       fz_text *text = get_text(ctx, dc);
       for (int i = 0; i < num_glyphs; ++i)
       {
@@ -351,8 +546,18 @@ void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t
         int32_t v = dy ? sv + dy[i].value : sv;
         fz_matrix ctm =
             fz_pre_scale(fz_pre_translate(st->gs.ctm, h * ds, -v * ds), fs, fs);
-        fz_show_glyph(ctx, text, font, ctm, glyphs[i], 0, 0, 0, FZ_BIDI_LTR,
-                      FZ_LANG_UNSET);
+        if (ucs)
+        {
+          int lo = i * ucs_count / num_glyphs;
+          int hi = i + 1 == num_glyphs ? ucs_count : (i + 1) * ucs_count / num_glyphs;
+          show_glyph_text(ctx, text, font, ctm, glyphs[i], ucs + lo, hi - lo);
+        }
+        else
+        {
+          uint32_t buf[3];
+          int n = glyph_unicodes(def, glyphs[i], buf);
+          show_glyph_text(ctx, text, font, ctm, glyphs[i], buf, n);
+        }
       }
     }
   }
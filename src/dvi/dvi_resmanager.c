@@ -54,6 +54,9 @@ struct cell_fz_font {
   const char *name;
   int index;
   fz_font *font;
+  // Unicode character of each glyph (0 if unknown), computed on demand
+  uint32_t *unicodes;
+  int unicode_count;
   cell_fz_font *next;
 };
 
@@ -70,6 +73,7 @@ struct cell_image {
 };
 
 struct dvi_resmanager {
+  int refs;
   dvi_reshooks hooks;
   cell_dvi_font *first_dvi_font;
   cell_tex_enc  *first_tex_enc;
@@ -77,6 +81,7 @@ struct dvi_resmanager {
   cell_fz_font  *first_fz_font;
   cell_image    *first_image;
   tex_fontmap *map;
+  bool map_loaded;
 };
 
 static void
@@ -233,6 +238,19 @@ tectonic_hooks_open_file(fz_context *ctx, void *env, dvi_reskind kind, const cha
   return result;
 }
 
+static char *
+tectonic_hooks_find_file(fz_context *ctx, void *env, dvi_reskind kind, const char *name)
+{
+  if (kind != RES_MAP)
+    return NULL;
+  char name_with_ext[1024];
+  if (snprintf(name_with_ext, sizeof(name_with_ext), "%s%s", name,
+               strchr(name, '.') ? "" : ".map") >= sizeof(name_with_ext))
+    return NULL;
+  const char *path = tectonic_get_file_path(name_with_ext);
+  return path ? fz_strdup(ctx, path) : NULL;
+}
+
 dvi_reshooks dvi_tectonic_hooks(fz_context *ctx, const char *document_dir)
 {
   char *path = fz_strdup(ctx, document_dir ? document_dir : "");
@@ -240,6 +258,8 @@ dvi_reshooks dvi_tectonic_hooks(fz_context *ctx, const char *document_dir)
     .env = path,
     .free_env = default_hooks_free_env,
     .open_file = tectonic_hooks_open_file,
+    .find_file = tectonic_hooks_find_file,
+    .fontmap_cache = "tectonic-fontmap",
   };
 }
 
@@ -375,6 +395,19 @@ texlive_hooks_open_file(fz_context *ctx, void *env, dvi_reskind kind, const char
   return result;
 }
 
+static char *
+texlive_hooks_find_file(fz_context *ctx, void *env, dvi_reskind kind, const char *name)
+{
+  if (kind != RES_MAP)
+    return NULL;
+  char name_with_ext[1024];
+  if (snprintf(name_with_ext, sizeof(name_with_ext), "%s%s", name,
+               strchr(name, '.') ? "" : ".map") >= sizeof(name_with_ext))
+    return NULL;
+  const char *path = texlive_file_path(name_with_ext, NULL);
+  return path ? fz_strdup(ctx, path) : NULL;
+}
+
 dvi_reshooks dvi_texlive_hooks(fz_context *ctx, const char *document_dir)
 {
   char *path = fz_strdup(ctx, document_dir ? document_dir : "");
@@ -382,6 +415,8 @@ dvi_reshooks dvi_texlive_hooks(fz_context *ctx, const char *document_dir)
     .env = path,
     .free_env = default_hooks_free_env,
     .open_file = texlive_hooks_open_file,
+    .find_file = texlive_hooks_find_file,
+    .fontmap_cache = "texlive-fontmap",
   };
 }
 
@@ -400,6 +435,49 @@ static fz_stream *dvi_resmanager_open_file(fz_context *ctx, dvi_resmanager *rm,
   return rm->hooks.open_file(ctx, rm->hooks.env, kind, path);
 }
 
+static const char *fontmap_files[3] = {"pdftex.map", "kanjix.map", "ckx.map"};
+
+// Load the compiled font map from the cache, compile it if the map files
+// changed. Returns 0 if the hooks do not support caching.
+static bool load_cached_fontmap(fz_context *ctx, dvi_resmanager *rm)
+{
+  if (!rm->hooks.find_file || !rm->hooks.fontmap_cache)
+    return 0;
+
+  const char *path = cache_path("dvi", rm->hooks.fontmap_cache);
+  if (!path)
+    return 0;
+
+  // cache_path returns a static buffer
+  char *cache = fz_strdup(ctx, path);
+  char *paths[3] = {NULL,};
+  fz_var(paths);
+
+  fz_try(ctx)
+  {
+    rm->map = tex_fontmap_open_cache(ctx, cache);
+    if (!rm->map)
+    {
+      fprintf(stderr, "[dvi] compiling font maps\n");
+      for (int i = 0; i < 3; ++i)
+        paths[i] = rm->hooks.find_file(ctx, rm->hooks.env, RES_MAP, fontmap_files[i]);
+      rm->map = tex_fontmap_compile(ctx, cache, (const char **)paths, 3);
+    }
+  }
+  fz_always(ctx)
+  {
+    for (int i = 0; i < 3; ++i)
+      fz_free(ctx, paths[i]);
+    fz_free(ctx, cache);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return 1;
+}
+
 static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
 {
   if (rm->map)
@@ -408,13 +486,15 @@ static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
     rm->map = NULL;
   }
 
-  fz_stream *stm[3];
+  if (load_cached_fontmap(ctx, rm))
+    return;
+
+  fz_stream *stm[3] = {NULL,};
   fz_var(stm);
   fz_try(ctx)
   {
-    stm[0] = dvi_resmanager_open_file(ctx, rm, RES_MAP, "pdftex.map");
-    stm[1] = dvi_resmanager_open_file(ctx, rm, RES_MAP, "kanjix.map");
-    stm[2] = dvi_resmanager_open_file(ctx, rm, RES_MAP, "ckx.map");
+    for (int i = 0; i < 3; ++i)
+      stm[i] = dvi_resmanager_open_file(ctx, rm, RES_MAP, fontmap_files[i]);
 
     // printf(stm ? "FONT: loading fontmap\n" : "FONT: no fontmap\n");
     rm->map = tex_fontmap_load(ctx, stm, 3);
@@ -431,6 +511,7 @@ static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
 dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks)
 {
   dvi_resmanager *rm = fz_malloc_struct(ctx, dvi_resmanager);
+  rm->refs = 1;
   rm->first_dvi_font = NULL;
   rm->first_tex_enc = NULL;
   rm->first_pdf_doc = NULL;
@@ -438,13 +519,25 @@ dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks)
   rm->first_image = NULL;
   rm->hooks = hooks;
 
-  load_fontmap(ctx, rm);
+  // The font map is loaded on first use: opening a document that only uses
+  // native fonts (XDV) never needs it.
+  rm->map = NULL;
+  rm->map_loaded = 0;
+
+  return rm;
+}
 
+dvi_resmanager *dvi_resmanager_keep(fz_context *ctx, dvi_resmanager *rm)
+{
+  rm->refs += 1;
   return rm;
 }
 
-void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm)
+void dvi_resmanager_drop(fz_context *ctx, dvi_resmanager *rm)
 {
+  if (!rm || --rm->refs > 0)
+    return;
+
   dvi_free_hooks(ctx, &rm->hooks);
 
   if (rm->map)
@@ -479,6 +572,7 @@ void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm)
     fz_free(ctx, (void*)cell->name);
     if (cell->font)
       fz_drop_font(ctx, cell->font);
+    fz_free(ctx, cell->unicodes);
     fz_free(ctx, cell);
     cell = next;
   }
@@ -619,7 +713,20 @@ dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const
   cell->next = rm->first_dvi_font;
   rm->first_dvi_font = cell;
 
-  tex_fontmap_entry *e = tex_fontmap_lookup(rm->map, cell->font.name);
+  if (!rm->map_loaded)
+  {
+    rm->map_loaded = 1;
+    fz_try(ctx)
+    {
+      load_fontmap(ctx, rm);
+    }
+    fz_catch(ctx)
+    {
+      fz_warn(ctx, "cannot load font maps: %s", fz_caught_message(ctx));
+    }
+  }
+
+  tex_fontmap_entry *e = tex_fontmap_lookup(ctx, rm->map, cell->font.name);
 
   if (e && e->font_file_name)
   {
@@ -695,6 +802,58 @@ fz_font *dvi_resmanager_get_xdv_font(fz_context *ctx, dvi_resmanager *rm, const
   return dvi_resmanager_get_fz_font(ctx, rm, name, len, index);
 }
 
+// XDV_GLYPHS only carry glyph indices: invert the unicode charmap of the font
+// to recover the text. When several characters share a glyph, the lowest one
+// is used.
+static void compute_unicodes(fz_context *ctx, cell_fz_font *cell)
+{
+  FT_Face face = fz_font_ft_face(ctx, cell->font);
+  if (!face || face->num_glyphs <= 0)
+    return;
+
+  int count = face->num_glyphs;
+  uint32_t *unicodes = fz_malloc_struct_array(ctx, count, uint32_t);
+
+  fz_lock(ctx, FZ_LOCK_FREETYPE);
+  FT_CharMap charmap = face->charmap;
+  if (FT_Select_Charmap(face, FT_ENCODING_UNICODE) == 0)
+  {
+    FT_UInt gid;
+    FT_ULong code = FT_Get_First_Char(face, &gid);
+    while (gid != 0)
+    {
+      if (gid < (FT_UInt)count && unicodes[gid] == 0)
+        unicodes[gid] = code;
+      code = FT_Get_Next_Char(face, code, &gid);
+    }
+  }
+  if (charmap)
+    FT_Set_Charmap(face, charmap);
+  fz_unlock(ctx, FZ_LOCK_FREETYPE);
+
+  cell->unicodes = unicodes;
+  cell->unicode_count = count;
+}
+
+const uint32_t *dvi_resmanager_get_font_unicodes(fz_context *ctx, dvi_resmanager *rm, fz_font *font, int *count)
+{
+  *count = 0;
+  if (!font)
+    return NULL;
+
+  for (cell_fz_font *cell = rm->first_fz_font; cell; cell = cell->next)
+  {
+    if (cell->font != font)
+      continue;
+    if (!cell->unicodes)
+      compute_unicodes(ctx, cell);
+    *count = cell->unicode_count;
+    return cell->unicodes;
+  }
+
+  return NULL;
+}
+
 void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name)
 {
   switch (kind)
@@ -750,6 +909,7 @@ void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind
         fz_free(ctx, (void*)(*cell)->name);
         if ((*cell)->font)
           fz_drop_font(ctx, (*cell)->font);
+        fz_free(ctx, (*cell)->unicodes);
         cell_fz_font *next = (*cell)->next;
         fz_free(ctx, *cell);
         *cell = next;
@@ -986,7 +986,7 @@ yy78:
 static bool
 pdfcolorstack_current(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  dvi_context_flush(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
     fprintf(stderr, "pdfcolorstack_current %d: no such stack\n", index);
@@ -1004,7 +1004,7 @@ pdfcolorstack_current(fz_context *ctx, dvi_context *dc, dvi_state *st, int index
 static bool
 colorstack_push(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  dvi_context_flush(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
     fprintf(stderr, "pdfcolorstack_push %d: no such stack\n", index);
@@ -1038,7 +1038,7 @@ colorstack_push(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 static bool
 colorstack_pop(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  dvi_context_flush(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
     fprintf(stderr, "pdfcolorstack_pop %d: no such stack\n", index);
@@ -309,7 +309,7 @@ static bool parse_pdfcolor(dvi_colorstate *state, cursor_t cur, cursor_t lim)
 static bool
 pdfcolorstack_current(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  dvi_context_flush(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
     fprintf(stderr, "pdfcolorstack_current %d: no such stack\n", index);
@@ -327,7 +327,7 @@ pdfcolorstack_current(fz_context *ctx, dvi_context *dc, dvi_state *st, int index
 static bool
 colorstack_push(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  dvi_context_flush(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
     fprintf(stderr, "pdfcolorstack_push %d: no such stack\n", index);
@@ -361,7 +361,7 @@ colorstack_push(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 static bool
 colorstack_pop(fz_context *ctx, dvi_context *dc, dvi_state *st, int index)
 {
-  dvi_context_flush_text(ctx, dc, st);
+  dvi_context_flush(ctx, dc, st);
   if (index >= dc->pdfcolorstacks.capacity)
   {
     fprintf(stderr, "pdfcolorstack_pop %d: no such stack\n", index);
@@ -61,6 +61,29 @@ uint16_t tex_tfm_last_char(const tex_tfm *tfm);
 tex_tfm *tex_tfm_load(fz_context *ctx, fz_stream *stm);
 void tex_tfm_free(fz_context *ctx, tex_tfm *tfm);
 
+// Expansion of a virtual font character: the base glyphs and rules it draws,
+// positioned relative to the origin of the character
+
+typedef struct
+{
+  fz_matrix ctm;
+  fz_font *font; // NULL for a rule
+  int glyph, ucs;
+  fz_rect rule;
+} tex_vf_item;
+
+typedef struct tex_vf_expansion tex_vf_expansion;
+struct tex_vf_expansion
+{
+  tex_vf_expansion *next;
+  fixed_t scale;
+  float dvi_scale;
+  // A character using specials cannot be flattened, it is interpreted
+  bool flat;
+  int count;
+  tex_vf_item items[];
+};
+
 // TeX Virtual Font Character
 
 typedef struct
@@ -68,6 +91,7 @@ typedef struct
   const uint8_t *dvi;
   uint32_t dvi_length;
   fixed_t width;
+  tex_vf_expansion *expansions;
 } tex_vf_char;
 
 // TeX Virtual Font
@@ -78,6 +102,10 @@ tex_vf *tex_vf_load(fz_context *ctx, dvi_resmanager *manager, fz_stream *stm);
 void tex_vf_free(tex_vf *vf);
 tex_vf_char *tex_vf_get(tex_vf *vf, int code);
 int tex_vf_default_font(tex_vf *vf);
+tex_vf_expansion *tex_vf_find_expansion(tex_vf_char *c, fixed_t scale, float dvi_scale);
+tex_vf_expansion *tex_vf_add_expansion(fz_context *ctx, tex_vf_char *c,
+                                       fixed_t scale, float dvi_scale, bool flat,
+                                       const tex_vf_item *items, int count);
 
 // TeX FontMap Entry
 
@@ -97,8 +125,17 @@ typedef struct tex_fontmap tex_fontmap;
 
 tex_fontmap *tex_fontmap_load(fz_context *ctx, fz_stream **stm, int count);
 void tex_fontmap_free(fz_context *ctx, tex_fontmap *fm);
-tex_fontmap_entry *tex_fontmap_lookup(tex_fontmap *fm, const char *name);
-tex_fontmap_entry *tex_fontmap_iter(tex_fontmap *fm, unsigned *index);
+tex_fontmap_entry *tex_fontmap_lookup(fz_context *ctx, tex_fontmap *fm, const char *name);
+tex_fontmap_entry *tex_fontmap_iter(fz_context *ctx, tex_fontmap *fm, unsigned *index);
+
+// Compiled font maps are cached on disk and mapped in memory.
+// tex_fontmap_open_cache returns NULL if the cache is missing, or if one of
+// the map files it was compiled from changed (size or modification time).
+// tex_fontmap_compile parses the map files at PATHS (NULL entries are
+// skipped) and refreshes the cache.
+tex_fontmap *tex_fontmap_open_cache(fz_context *ctx, const char *cache);
+tex_fontmap *tex_fontmap_compile(fz_context *ctx, const char *cache,
+                                 const char **paths, int count);
 
 // TeX Encoding
 
@@ -162,6 +199,8 @@ typedef struct
     struct {
       fz_font *font;
       dvi_xdvfontspec spec;
+      const uint32_t *unicodes;
+      int unicode_count;
     } xdv_font;
   };
 } dvi_fontdef;
@@ -199,6 +238,10 @@ typedef struct {
   void *env;
   fz_stream *(*open_file)(fz_context *ctx, void *env, dvi_reskind kind, const char *name);
   void (*free_env)(fz_context *ctx, void *env);
+  // Optional: resolve a resource to a path (to be freed with fz_free), and
+  // name of the compiled font map in the cache directory
+  char *(*find_file)(fz_context *ctx, void *env, dvi_reskind kind, const char *name);
+  const char *fontmap_cache;
 } dvi_reshooks;
 
 dvi_reshooks dvi_tectonic_hooks(fz_context *ctx, const char *document_directory);
@@ -206,10 +249,16 @@ dvi_reshooks dvi_texlive_hooks(fz_context *ctx, const char *document_directory);
 
 void dvi_free_hooks(fz_context *ctx, const dvi_reshooks *hooks);
 
+// Resource managers are reference counted, so that documents rendered by the
+// same process can share fonts and graphics.
 dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks);
-void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm);
+dvi_resmanager *dvi_resmanager_keep(fz_context *ctx, dvi_resmanager *rm);
+void dvi_resmanager_drop(fz_context *ctx, dvi_resmanager *rm);
 dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int namelen);
 fz_font *dvi_resmanager_get_xdv_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int namelen, int index);
+// Unicode character of each glyph of a font returned by get_xdv_font (0 when
+// unknown), valid as long as the font is
+const uint32_t *dvi_resmanager_get_font_unicodes(fz_context *ctx, dvi_resmanager *rm, fz_font *font, int *count);
 pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename);
 fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char *filename);
 void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name);
@@ -319,11 +368,21 @@ typedef struct
   dvi_fonttable *fonts;
 } dvi_state;
 
+// Base glyphs and rules drawn while expanding a virtual font character
+typedef struct
+{
+  tex_vf_item *items;
+  int count, capacity;
+  bool failed;
+} tex_vf_recording;
+
 // Shared data common to DVI interpreter and renderer
 typedef struct
 {
   fz_device *dev;
+  // Glyphs and rules (in device space) drawn since the last flush
   fz_text *text;
+  fz_path *rules;
   fz_path *path;
   dvi_scratch scratch;
   dvi_resmanager *resmanager;
@@ -336,15 +395,20 @@ typedef struct
   // Pdf color stacks (introduced by pdftex)
   dvi_colorstacks pdfcolorstacks;
   float scale;
+
+  // When not NULL, glyphs and rules are recorded rather than drawn
+  tex_vf_recording *vf_record;
 } dvi_context;
 
 #define DC_ALLOC(ctx, dc, type, count) ((type*)dvi_scratch_alloc(ctx, &(dc)->scratch, sizeof(type) * (count)))
 
-dvi_context *dvi_context_new(fz_context *ctx, dvi_reshooks hooks);
+dvi_context *dvi_context_new(fz_context *ctx, dvi_resmanager *rm);
 void dvi_context_free(fz_context *ctx, dvi_context *dc);
 dvi_state *dvi_context_state(dvi_context *dc);
 bool dvi_state_enter_vf(dvi_context *dc, dvi_state *vfst, const dvi_state *st, dvi_fonttable *fonts, int font, fixed_t scale);
-void dvi_context_flush_text(fz_context *ctx, dvi_context *dc, dvi_state *st);
+// Emit pending glyphs and rules, filled with the current color. Must be called
+// before changing the graphic state or drawing anything else.
+void dvi_context_flush(fz_context *ctx, dvi_context *dc, dvi_state *st);
 void dvi_context_begin_frame(fz_context *ctx, dvi_context *dc, fz_device *dev);
 void dvi_context_end_frame(fz_context *ctx, dvi_context *dc);
 
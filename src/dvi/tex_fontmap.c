@@ -23,10 +23,21 @@
  */
 
 #include <string.h>
-#include <mupdf/fitz/context.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <mupdf/fitz.h>
 #include "mydvi.h"
 #include "fz_util.h"
 
+#ifndef __APPLE__
+# define st_mtime_ns(st) ((st)->st_mtim.tv_nsec)
+#else
+# define st_mtime_ns(st) ((st)->st_mtimespec.tv_nsec)
+#endif
+
 static unsigned long
 sdbm_hash(const void *p)
 {
@@ -41,10 +52,54 @@ sdbm_hash(const void *p)
 
 #define str_hash sdbm_hash
 
+/* Compiled font maps
+ *
+ * The parsed table is cached on disk so that a session does not have to parse
+ * several MB of map files again. The cache is mapped read-only and entries are
+ * decoded when looked up:
+ *
+ *   header, sources[source_count], slots[mask + 1], strings
+ *
+ * Slots are the open-addressing table built by tex_fontmap_load, with strings
+ * stored as offsets in the string area (0 for NULL). A source records the
+ * size and modification time of a map file: the cache is valid as long as
+ * they have not changed.
+ */
+
+#define FONTMAP_MAGIC "txpfmap1"
+
+typedef struct {
+  char magic[8];
+  uint32_t source_count, mask, strings_size, pad;
+} fontmap_header;
+
+typedef struct {
+  int64_t size, mtime, mtime_ns;
+  uint32_t path, pad; // path is empty for a missing file
+} fontmap_source;
+
+typedef struct {
+  uint32_t hash;
+  uint32_t pk_font_name, ps_font_name, ps_snippet, enc_file_name, font_file_name;
+} fontmap_slot;
+
+typedef struct decoded_entry decoded_entry;
+struct decoded_entry {
+  tex_fontmap_entry entry;
+  decoded_entry *next;
+};
+
 struct tex_fontmap {
   fz_buffer *buffer;
   int mask;
   tex_fontmap_entry *table;
+
+  // Compiled map, when loaded from the cache
+  void *image;
+  size_t image_len;
+  const fontmap_slot *slots;
+  const char *strings;
+  decoded_entry *decoded;
 };
 
 tex_fontmap *tex_fontmap_load(fz_context *ctx, fz_stream **streams, int count)
@@ -208,7 +263,9 @@ seek_next_line:
 #undef seek
 #undef fail_if
 
-    if (count + count / 4 > capacity)
+    if (capacity == 0)
+      capacity = 1;
+    else if (count + count / 4 > capacity)
       capacity *= 2;
 
     tex_fontmap_entry *hashtable =
@@ -252,11 +309,247 @@ seek_next_line:
 
 void tex_fontmap_free(fz_context *ctx, tex_fontmap *t)
 {
+  if (t->image)
+    munmap(t->image, t->image_len);
+  for (decoded_entry *d = t->decoded; d; )
+  {
+    decoded_entry *next = d->next;
+    fz_free(ctx, d);
+    d = next;
+  }
   fz_free(ctx, t->table);
   fz_drop_buffer(ctx, t->buffer);
   fz_free(ctx, t);
 }
 
+/* Cache management */
+
+static bool source_matches(const fontmap_source *src, const char *path)
+{
+  struct stat st;
+
+  if (!path[0])
+    return src->size == -1;
+
+  return stat(path, &st) == 0 &&
+         src->size == st.st_size &&
+         src->mtime == st.st_mtime &&
+         src->mtime_ns == st_mtime_ns(&st);
+}
+
+tex_fontmap *tex_fontmap_open_cache(fz_context *ctx, const char *cache)
+{
+  int fd = open(cache, O_RDONLY);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  void *image = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= sizeof(fontmap_header))
+    image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED)
+    return NULL;
+
+  const fontmap_header *hd = image;
+  size_t len = st.st_size;
+  size_t sources_size = (size_t)hd->source_count * sizeof(fontmap_source);
+  size_t slots_size = ((size_t)hd->mask + 1) * sizeof(fontmap_slot);
+
+  if (memcmp(hd->magic, FONTMAP_MAGIC, 8) != 0 ||
+      (hd->mask & (hd->mask + 1)) != 0 ||
+      sizeof(fontmap_header) + sources_size + slots_size + hd->strings_size != len ||
+      hd->strings_size == 0)
+    goto invalid;
+
+  const fontmap_source *sources = (const void*)(hd + 1);
+  const fontmap_slot *slots = (const void*)(sources + hd->source_count);
+  const char *strings = (const char *)(slots + hd->mask + 1);
+
+  // Strings are NUL-terminated because the area ends with a NUL
+  if (strings[hd->strings_size - 1] != '\0')
+    goto invalid;
+
+  for (int i = 0; i < hd->source_count; ++i)
+  {
+    if (sources[i].path >= hd->strings_size ||
+        !source_matches(&sources[i], strings + sources[i].path))
+      goto invalid;
+  }
+
+  for (int i = 0; i <= hd->mask; ++i)
+  {
+    const fontmap_slot *s = &slots[i];
+    if (s->pk_font_name >= hd->strings_size ||
+        s->ps_font_name >= hd->strings_size ||
+        s->ps_snippet >= hd->strings_size ||
+        s->enc_file_name >= hd->strings_size ||
+        s->font_file_name >= hd->strings_size)
+      goto invalid;
+  }
+
+  tex_fontmap *result = fz_malloc_struct(ctx, tex_fontmap);
+  result->mask = hd->mask;
+  result->image = image;
+  result->image_len = len;
+  result->slots = slots;
+  result->strings = strings;
+  return result;
+
+invalid:
+  munmap(image, len);
+  return NULL;
+}
+
+static uint32_t string_offset(fz_buffer *buffer, const char *str)
+{
+  // Offset 0 is the NUL byte preceding the buffer
+  return str ? (str - (const char *)buffer->data) + 1 : 0;
+}
+
+static void write_cache(fz_context *ctx, tex_fontmap *t, const char *cache,
+                        const char **paths, const struct stat *stats, int count)
+{
+  char tmp[1024];
+  if (snprintf(tmp, sizeof(tmp), "%s.%d", cache, (int)getpid()) >= sizeof(tmp))
+    return;
+
+  FILE *f = fopen(tmp, "wb");
+  if (!f)
+    return;
+
+  // String area: NUL, contents of the maps, paths of the sources
+  uint32_t strings_size = 1 + t->buffer->len;
+  fontmap_source sources[count];
+  for (int i = 0; i < count; ++i)
+  {
+    memset(&sources[i], 0, sizeof(sources[i]));
+    if (paths[i])
+    {
+      sources[i].size = stats[i].st_size;
+      sources[i].mtime = stats[i].st_mtime;
+      sources[i].mtime_ns = st_mtime_ns(&stats[i]);
+      sources[i].path = strings_size;
+      strings_size += strlen(paths[i]) + 1;
+    }
+    else
+    {
+      sources[i].size = -1;
+      sources[i].path = 0;
+    }
+  }
+
+  fontmap_header hd = {
+    .magic = FONTMAP_MAGIC,
+    .source_count = count,
+    .mask = t->mask,
+    .strings_size = strings_size,
+  };
+  fwrite(&hd, sizeof(hd), 1, f);
+  fwrite(sources, sizeof(fontmap_source), count, f);
+
+  for (int i = 0; i <= t->mask; ++i)
+  {
+    tex_fontmap_entry *e = &t->table[i];
+    fontmap_slot s = {
+      .hash = e->hash,
+      .pk_font_name = string_offset(t->buffer, e->pk_font_name),
+      .ps_font_name = string_offset(t->buffer, e->ps_font_name),
+      .ps_snippet = string_offset(t->buffer, e->ps_snippet),
+      .enc_file_name = string_offset(t->buffer, e->enc_file_name),
+      .font_file_name = string_offset(t->buffer, e->font_file_name),
+    };
+    fwrite(&s, sizeof(s), 1, f);
+  }
+
+  fputc(0, f);
+  fwrite(t->buffer->data, 1, t->buffer->len, f);
+  for (int i = 0; i < count; ++i)
+    if (paths[i])
+      fwrite(paths[i], 1, strlen(paths[i]) + 1, f);
+
+  bool failed = ferror(f);
+  if (fclose(f) != 0 || failed)
+  {
+    unlink(tmp);
+    return;
+  }
+
+  if (rename(tmp, cache) != 0)
+  {
+    perror("[dvi] fontmap cache");
+    unlink(tmp);
+  }
+}
+
+tex_fontmap *tex_fontmap_compile(fz_context *ctx, const char *cache,
+                                 const char **paths, int count)
+{
+  fz_stream *stm[count];
+  struct stat stats[count];
+  const char *found[count];
+  tex_fontmap *result = NULL;
+
+  for (int i = 0; i < count; ++i)
+  {
+    stm[i] = NULL;
+    found[i] = NULL;
+  }
+
+  fz_var(result);
+  fz_try(ctx)
+  {
+    for (int i = 0; i < count; ++i)
+    {
+      // Stat before reading: a concurrent change invalidates the cache
+      if (paths[i] && stat(paths[i], &stats[i]) == 0)
+      {
+        stm[i] = fz_open_file(ctx, paths[i]);
+        found[i] = paths[i];
+      }
+    }
+    result = tex_fontmap_load(ctx, stm, count);
+  }
+  fz_always(ctx)
+  {
+    for (int i = 0; i < count; ++i)
+      if (stm[i])
+        fz_drop_stream(ctx, stm[i]);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  if (cache)
+    write_cache(ctx, result, cache, found, stats, count);
+
+  return result;
+}
+
+static tex_fontmap_entry *decode_slot(fz_context *ctx, tex_fontmap *t, int index)
+{
+  const fontmap_slot *s = &t->slots[index];
+  decoded_entry *d;
+
+  for (d = t->decoded; d; d = d->next)
+    if (d->entry.pk_font_name == t->strings + s->pk_font_name)
+      return &d->entry;
+
+#define STR(field) (s->field ? t->strings + s->field : NULL)
+  d = fz_malloc_struct(ctx, decoded_entry);
+  d->entry.hash = s->hash;
+  d->entry.pk_font_name = STR(pk_font_name);
+  d->entry.ps_font_name = STR(ps_font_name);
+  d->entry.ps_snippet = STR(ps_snippet);
+  d->entry.enc_file_name = STR(enc_file_name);
+  d->entry.font_file_name = STR(font_file_name);
+#undef STR
+  d->next = t->decoded;
+  t->decoded = d;
+  return &d->entry;
+}
+
 #ifdef CALC_STATS
 int max_poschain = 0, max_negchain = 0, lookup_count = 0, lookup_probe = 0;
 
@@ -269,8 +562,30 @@ static void print_chain(void)
 }
 #endif
 
-tex_fontmap_entry *tex_fontmap_lookup(tex_fontmap *t, const char *name)
+static tex_fontmap_entry *lookup_compiled(fz_context *ctx, tex_fontmap *t, const char *name)
 {
+  uint32_t hash = str_hash(name);
+  int index = hash & t->mask;
+
+  while (t->slots[index].pk_font_name)
+  {
+    if (t->slots[index].hash == hash &&
+        !strcmp(t->strings + t->slots[index].pk_font_name, name))
+      return decode_slot(ctx, t, index);
+    index = (index + 1) & t->mask;
+  }
+
+  return NULL;
+}
+
+tex_fontmap_entry *tex_fontmap_lookup(fz_context *ctx, tex_fontmap *t, const char *name)
+{
+  if (!t)
+    return NULL;
+
+  if (t->slots)
+    return lookup_compiled(ctx, t, name);
+
 #ifdef CALC_STATS
   static int v = 0;
   if (!v)
@@ -312,13 +627,15 @@ tex_fontmap_entry *tex_fontmap_lookup(tex_fontmap *t, const char *name)
   return NULL;
 }
 
-tex_fontmap_entry *tex_fontmap_iter(tex_fontmap *t, unsigned *index)
+tex_fontmap_entry *tex_fontmap_iter(fz_context *ctx, tex_fontmap *t, unsigned *index)
 {
   while (*index <= t->mask)
   {
     unsigned i = *index;
     *index += 1;
-    if (t->table[i].pk_font_name)
+    if (t->slots && t->slots[i].pk_font_name)
+      return decode_slot(ctx, t, i);
+    if (!t->slots && t->table[i].pk_font_name)
       return &t->table[i];
   }
   return NULL;
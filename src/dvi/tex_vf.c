@@ -209,3 +209,37 @@ int tex_vf_default_font(tex_vf *vf)
 {
   return vf->default_font;
 }
+
+tex_vf_expansion *tex_vf_find_expansion(tex_vf_char *c, fixed_t scale, float dvi_scale)
+{
+  for (tex_vf_expansion *exp = c->expansions; exp; exp = exp->next)
+    if (exp->scale.value == scale.value && exp->dvi_scale == dvi_scale)
+      return exp;
+  return NULL;
+}
+
+tex_vf_expansion *tex_vf_add_expansion(fz_context *ctx, tex_vf_char *c,
+                                       fixed_t scale, float dvi_scale, bool flat,
+                                       const tex_vf_item *items, int count)
+{
+  if (!flat)
+    count = 0;
+
+  tex_vf_expansion *exp =
+    fz_malloc(ctx, sizeof(tex_vf_expansion) + sizeof(tex_vf_item) * count);
+  exp->scale = scale;
+  exp->dvi_scale = dvi_scale;
+  exp->flat = flat;
+  exp->count = count;
+  if (count > 0)
+    memcpy(exp->items, items, sizeof(tex_vf_item) * count);
+
+  // Base fonts can be invalidated while the virtual font is still in use
+  for (int i = 0; i < count; ++i)
+    if (exp->items[i].font)
+      fz_keep_font(ctx, exp->items[i].font);
+
+  exp->next = c->expansions;
+  c->expansions = exp;
+  return exp;
+}
@@ -34,6 +34,11 @@ tt_xetex_set_int_variable (const char *var_name, int value)
     semantic_pagination_enabled = (value != 0);
   else if (streq_ptr(var_name, "shell_escape_enabled"))
     shell_escape_enabled = (value != 0);
+  else if (streq_ptr(var_name, "hash_bits")) {
+    if (value < inf_hash_bits || value > sup_hash_bits)
+      return 1;
+    hash_bits = value;
+  }
   else
     return 1; /* Uh oh: unrecognized variable */
 
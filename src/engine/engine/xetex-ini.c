@@ -16,6 +16,9 @@
 #include "dpx-pdfobj.h" /* pdf_files_{init,close} */
 #include "xetex_bindings.h" /* FORMAT_SERIAL */
 
+#include <sys/mman.h>
+#include <unistd.h>
+
 /* All the following variables are declared in xetex-xetexd.h */
 bool shell_escape_enabled = false;
 memory_word *eqtb;
@@ -29,6 +32,7 @@ int32_t first;
 int32_t last;
 int32_t max_buf_stack;
 bool in_initex_mode;
+bool native_format = false;
 int32_t error_line;
 int32_t half_error_line;
 int32_t max_print_line;
@@ -120,6 +124,8 @@ int32_t hash_extra;
 int32_t hash_top;
 int32_t eqtb_top;
 int32_t hash_high;
+int32_t hash_bits = HASH_BITS;
+int32_t *hash_heads;
 bool no_new_control_sequence;
 int32_t cs_count;
 b32x2 prim[PRIM_SIZE + 1];
@@ -375,6 +381,16 @@ static b32x2 *yhash;
 
 #define FORMAT_HEADER_MAGIC 0x54544E43 /* "TTNC" in ASCII */
 #define FORMAT_FOOTER_MAGIC 0x0000029A
+#define FORMAT_NATIVE_MAGIC 0x54544E4E /* "TTNN", in host byte order */
+
+/* Sections of a native format are aligned so that they can be mapped at their
+   final address: this is a multiple of the page size of all supported hosts. */
+#define FORMAT_PAGE_SIZE 65536
+
+/* State of the format file being dumped or undumped */
+static bool fmt_native;
+static size_t fmt_offset;
+static int fmt_fd = -1;
 
 /* Read and write dump files.  As distributed, these files are
    architecture dependent; specifically, BigEndian and LittleEndian
@@ -447,6 +463,26 @@ swap_items (char *p, size_t nitems, size_t size)
 #endif
 
 
+/* Check that HEADER, the first bytes of a format file, describes a format
+   that this engine can load.  */
+
+bool
+format_header_current(const unsigned char *header, size_t len)
+{
+    int32_t w[3];
+
+    if (len < sizeof(w))
+        return false;
+
+    memcpy(w, header, sizeof(w));
+    if (w[0] == FORMAT_NATIVE_MAGIC)
+        return w[1] == FORMAT_PAGE_SIZE && w[2] == FORMAT_SERIAL;
+
+    swap_items ((char *) w, 2, sizeof(w[0]));
+    return w[0] == FORMAT_HEADER_MAGIC && w[1] == FORMAT_SERIAL;
+}
+
+
 /* Here we write NITEMS items, each item being ITEM_SIZE bytes long.
    The pointer to the stuff to write is P, and we write to the file
    OUT_FILE.  */
@@ -454,16 +490,19 @@ swap_items (char *p, size_t nitems, size_t size)
 static void
 do_dump (char *p, size_t item_size, size_t nitems, rust_output_handle_t out_file)
 {
-    swap_items (p, nitems, item_size);
+    if (!fmt_native)
+        swap_items (p, nitems, item_size);
 
     ssize_t r = ttstub_output_write (out_file, p, item_size * nitems);
     if (r < 0 || (size_t) r != item_size * nitems)
         _tt_abort ("could not write %"PRIuZ" %"PRIuZ"-byte item(s) to %s",
                    nitems, item_size, name_of_file);
+    fmt_offset += item_size * nitems;
 
     /* Have to restore the old contents of memory, since some of it might
        get used again.  */
-    swap_items (p, nitems, item_size);
+    if (!fmt_native)
+        swap_items (p, nitems, item_size);
 }
 
 
@@ -476,8 +515,180 @@ do_undump (char *p, size_t item_size, size_t nitems, rust_input_handle_t in_file
     if (r < 0 || (size_t) r != item_size * nitems)
         _tt_abort("could not undump %"PRIuZ" %"PRIuZ"-byte item(s) from %s",
                   nitems, item_size, name_of_file);
+    fmt_offset += item_size * nitems;
+
+    if (!fmt_native)
+        swap_items (p, nitems, item_size);
+}
+
+
+/* Native formats store the large arrays (string pool, mem, eqtb, hash and
+   font_info) in sections.  A section starts at a file offset congruent,
+   modulo FORMAT_PAGE_SIZE, to the offset of its first item from the start of
+   the array.  When the array is allocated with fmt_alloc, whole pages are
+   mapped copy-on-write from the file: forked processes share them until
+   they get modified, and nothing is copied or swapped at startup.
+
+   In portable formats, a section is just a sequence of items.  */
+
+static size_t
+section_offset(size_t array_offset)
+{
+    size_t mask = FORMAT_PAGE_SIZE - 1;
+    size_t pad = ((array_offset & mask) - (fmt_offset & mask)) & mask;
+    return fmt_offset + pad;
+}
+
+
+static void
+do_dump_section (char *p, size_t array_offset, size_t item_size, size_t nitems,
+                 rust_output_handle_t out_file)
+{
+    static const char zeroes[4096];
+
+    if (fmt_native) {
+        size_t pad = section_offset(array_offset) - fmt_offset;
+
+        while (pad > 0) {
+            size_t n = pad < sizeof(zeroes) ? pad : sizeof(zeroes);
+            do_dump ((char *) zeroes, 1, n, out_file);
+            pad -= n;
+        }
+    }
+
+    do_dump (p, item_size, nitems, out_file);
+}
+
 
-    swap_items (p, nitems, item_size);
+/* Arrays allocated with fmt_alloc.  They are anonymous mappings, so that
+   sections can replace their pages.  */
+
+#define FMT_MAX_MAPPINGS 8
+
+static struct {
+    void *base;
+    size_t len;
+} fmt_mappings[FMT_MAX_MAPPINGS];
+
+
+static void *
+fmt_alloc(size_t size)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    void *p;
+    int i;
+
+    if (!fmt_native || fmt_fd == -1 || page <= 0 || FORMAT_PAGE_SIZE % page != 0)
+        return xmalloc(size);
+
+    for (i = 0; i < FMT_MAX_MAPPINGS && fmt_mappings[i].base; i++)
+        ;
+    if (i == FMT_MAX_MAPPINGS)
+        return xmalloc(size);
+
+    size = (size + page - 1) & ~(size_t) (page - 1);
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return xmalloc(size);
+
+    fmt_mappings[i].base = p;
+    fmt_mappings[i].len = size;
+    return p;
+}
+
+#define fmt_alloc_array(type, size) (fmt_alloc((size + 1) * sizeof(type)))
+
+
+static bool
+fmt_mapped(const char *p)
+{
+    for (int i = 0; i < FMT_MAX_MAPPINGS; i++)
+        if (fmt_mappings[i].base == p)
+            return true;
+    return false;
+}
+
+
+static void
+fmt_free(void *p)
+{
+    if (p == NULL)
+        return;
+
+    for (int i = 0; i < FMT_MAX_MAPPINGS; i++) {
+        if (fmt_mappings[i].base == p) {
+            munmap(p, fmt_mappings[i].len);
+            fmt_mappings[i].base = NULL;
+            return;
+        }
+    }
+
+    free(p);
+}
+
+
+static bool
+pread_all(char *p, size_t len, size_t offset)
+{
+    while (len > 0) {
+        ssize_t r = pread(fmt_fd, p, len, offset);
+        if (r <= 0)
+            return false;
+        p += r;
+        len -= r;
+        offset += r;
+    }
+    return true;
+}
+
+
+/* Map the pages of [p, p + len) from the format file at OFFSET, and read the
+   partial pages at both ends.  */
+
+static bool
+map_section(char *p, size_t len, size_t offset)
+{
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    char *start = (char *) (((uintptr_t) p + page - 1) & ~(page - 1));
+    char *end = (char *) (((uintptr_t) p + len) & ~(page - 1));
+
+    if (start >= end)
+        return pread_all(p, len, offset);
+
+    if (mmap(start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+             fmt_fd, offset + (start - p)) == MAP_FAILED)
+        return pread_all(p, len, offset);
+
+    return pread_all(p, start - p, offset) &&
+        pread_all(end, p + len - end, offset + (end - p));
+}
+
+
+static void
+do_undump_section (char *p, const char *array, size_t item_size, size_t nitems,
+                   rust_input_handle_t in_file)
+{
+    size_t offset, len = item_size * nitems;
+
+    if (!fmt_native) {
+        do_undump (p, item_size, nitems, in_file);
+        return;
+    }
+
+    offset = section_offset(p - array);
+
+    if (fmt_fd != -1 && fmt_mapped(array)) {
+        if (!map_section(p, len, offset))
+            _tt_abort("could not map %"PRIuZ" %"PRIuZ"-byte item(s) from %s",
+                      nitems, item_size, name_of_file);
+        fmt_offset = offset + len;
+        ttstub_input_seek (in_file, fmt_offset, SEEK_SET);
+        return;
+    }
+
+    ttstub_input_seek (in_file, offset, SEEK_SET);
+    fmt_offset = offset;
+    do_undump (p, item_size, nitems, in_file);
 }
 
 
@@ -486,6 +697,14 @@ do_undump (char *p, size_t item_size, size_t nitems, rust_input_handle_t in_file
 #define undump_things(base, len) \
     do_undump ((char *) &(base), sizeof (base), (size_t) (len), fmt_in)
 
+/* ARRAY is the start of the allocation containing BASE */
+#define dump_section(array, base, len) \
+    do_dump_section ((char *) &(base), (char *) &(base) - (char *) (array), \
+                     sizeof (base), (size_t) (len), fmt_out)
+#define undump_section(array, base, len) \
+    do_undump_section ((char *) &(base), (char *) (array), sizeof (base), \
+                       (size_t) (len), fmt_in)
+
 /* Like do_undump, but check each value against LOW and HIGH.  The
    slowdown isn't significant, and this improves the chances of
    detecting incompatible format files.  In fact, Knuth himself noted
@@ -2141,7 +2360,15 @@ store_fmt_file(void)
 
     /* Header */
 
-    dump_int(FORMAT_HEADER_MAGIC);
+    fmt_native = native_format;
+    fmt_offset = 0;
+
+    if (fmt_native) {
+        dump_int(FORMAT_NATIVE_MAGIC);
+        dump_int(FORMAT_PAGE_SIZE);
+    } else {
+        dump_int(FORMAT_HEADER_MAGIC);
+    }
     dump_int(FORMAT_SERIAL);
     dump_int(hash_high);
 
@@ -2150,15 +2377,15 @@ store_fmt_file(void)
 
     dump_int(MEM_TOP);
     dump_int(EQTB_SIZE);
-    dump_int(HASH_PRIME);
+    dump_int(hash_bits);
     dump_int(HYPH_PRIME);
 
     /* string pool */
 
     dump_int(pool_ptr);
     dump_int(str_ptr);
-    dump_things(str_start[0], str_ptr - TOO_BIG_CHAR + 1);
-    dump_things(str_pool[0], pool_ptr);
+    dump_section(str_start, str_start[0], str_ptr - TOO_BIG_CHAR + 1);
+    dump_section(str_pool, str_pool[0], pool_ptr);
 
     print_ln();
     print_int(str_ptr);
@@ -2179,7 +2406,9 @@ store_fmt_file(void)
     q = rover;
     x = 0;
     do {
-        dump_things(mem[p], q + 2 - p);
+        /* A native format keeps the free blocks to store a single section */
+        if (!fmt_native)
+            dump_things(mem[p], q + 2 - p);
         x = x + q + 2 - p;
         var_used = var_used + q - p;
         p = q + mem[q].b32.s0;
@@ -2188,12 +2417,15 @@ store_fmt_file(void)
 
     var_used = var_used + lo_mem_max - p;
     dyn_used = mem_end + 1 - hi_mem_min;
-    dump_things(mem[p], lo_mem_max + 1 - p);
+    if (fmt_native)
+        dump_section(mem, mem[0], lo_mem_max + 1);
+    else
+        dump_things(mem[p], lo_mem_max + 1 - p);
 
     x = x + lo_mem_max + 1 - p;
     dump_int(hi_mem_min);
     dump_int(avail);
-    dump_things(mem[hi_mem_min], mem_end + 1 - hi_mem_min);
+    dump_section(mem, mem[hi_mem_min], mem_end + 1 - hi_mem_min);
 
     x = x + mem_end + 1 - hi_mem_min;
     p = avail;
@@ -2216,6 +2448,12 @@ store_fmt_file(void)
 
     k = ACTIVE_BASE;
 
+    /* A native format stores eqtb uncompressed, as a single section */
+    if (fmt_native) {
+        dump_section(eqtb, eqtb[ACTIVE_BASE], EQTB_SIZE + 1 + hash_high - ACTIVE_BASE);
+        goto eqtb_dumped;
+    }
+
     do {
         j = k;
 
@@ -2281,6 +2519,7 @@ store_fmt_file(void)
     if (hash_high > 0)
         dump_things(eqtb[EQTB_SIZE + 1], hash_high);
 
+eqtb_dumped:
     dump_int(par_loc);
     dump_int(write_loc);
 
@@ -2294,17 +2533,24 @@ store_fmt_file(void)
 
     for (p = HASH_BASE; p <= hash_used; p++) {
         if (hash[p].s1 != 0) {
-            dump_int(p);
-            dump_b32(hash[p]);
+            if (!fmt_native) {
+                dump_int(p);
+                dump_b32(hash[p]);
+            }
             cs_count++;
         }
     }
 
-    dump_things(hash[hash_used + 1], (UNDEFINED_CONTROL_SEQUENCE - 1) - hash_used);
+    /* A native format stores the sparse lower region as is */
+    if (fmt_native)
+        dump_section(yhash, hash[HASH_BASE], (UNDEFINED_CONTROL_SEQUENCE - 1) - HASH_BASE + 1);
+    else
+        dump_things(hash[hash_used + 1], (UNDEFINED_CONTROL_SEQUENCE - 1) - hash_used);
     if (hash_high > 0)
-        dump_things(hash[EQTB_SIZE + 1], hash_high);
+        dump_section(yhash, hash[EQTB_SIZE + 1], hash_high);
 
     dump_int(cs_count);
+    dump_section(hash_heads, hash_heads[0], 1 << hash_bits);
 
     print_ln();
     print_int(cs_count);
@@ -2313,7 +2559,7 @@ store_fmt_file(void)
     /* fonts */
 
     dump_int(fmem_ptr);
-    dump_things(font_info[0], fmem_ptr);
+    dump_section(font_info, font_info[0], fmem_ptr);
     dump_int(font_ptr);
     dump_things(font_check[FONT_BASE], font_ptr + 1);
     dump_things(font_size[FONT_BASE], font_ptr + 1);
@@ -2439,6 +2685,7 @@ store_fmt_file(void)
 
     INTPAR(tracing_stats) = 0; /*:1361*/
     ttstub_output_close(fmt_out);
+    fmt_native = false;
 }
 
 
@@ -2475,20 +2722,33 @@ load_fmt_file(void)
     cur_input.loc = j;
 
     if (in_initex_mode) {
-        free(font_info);
-        free(str_pool);
-        free(str_start);
-        free(yhash);
-        free(eqtb);
-        free(mem);
+        fmt_free(font_info);
+        fmt_free(str_pool);
+        fmt_free(str_start);
+        fmt_free(yhash);
+        fmt_free(hash_heads);
+        fmt_free(eqtb);
+        fmt_free(mem);
         mem = NULL;
     }
 
-    /* start reading the header */
+    /* start reading the header: the magic number tells native formats apart */
 
+    fmt_native = true;
+    fmt_offset = 0;
     undump_int(x);
-    if (x != FORMAT_HEADER_MAGIC)
-        goto bad_fmt;
+
+    if (x == FORMAT_NATIVE_MAGIC) {
+        undump_int(x);
+        if (x != FORMAT_PAGE_SIZE)
+            goto bad_fmt;
+        fmt_fd = ttstub_input_get_fd(fmt_in);
+    } else {
+        fmt_native = false;
+        swap_items ((char *) &x, 1, sizeof(x));
+        if (x != FORMAT_HEADER_MAGIC)
+            goto bad_fmt;
+    }
 
     undump_int(x);
     if (x != FORMAT_SERIAL)
@@ -2509,15 +2769,17 @@ load_fmt_file(void)
     else
         hash_top = eqtb_top;
 
-    yhash = xmalloc_array(b32x2, 1 + hash_top - hash_offset);
+    yhash = fmt_alloc_array(b32x2, 1 + hash_top - hash_offset);
     hash = yhash - hash_offset;
     hash[HASH_BASE].s0 = 0;
     hash[HASH_BASE].s1 = 0;
 
-    for (x = HASH_BASE + 1; x <= hash_top; x++)
-        hash[x] = hash[HASH_BASE];
+    /* Mapped memory is already zeroed */
+    if (!fmt_mapped((char *) yhash))
+        for (x = HASH_BASE + 1; x <= hash_top; x++)
+            hash[x] = hash[HASH_BASE];
 
-    eqtb = xmalloc_array(memory_word, eqtb_top + 1);
+    eqtb = fmt_alloc_array(memory_word, eqtb_top + 1);
     eqtb[UNDEFINED_CONTROL_SEQUENCE].b16.s1 = UNDEFINED_CS;
     eqtb[UNDEFINED_CONTROL_SEQUENCE].b32.s1 = TEX_NULL;
     eqtb[UNDEFINED_CONTROL_SEQUENCE].b16.s0 = LEVEL_ZERO;
@@ -2537,15 +2799,16 @@ load_fmt_file(void)
     cur_list.head = CONTRIB_HEAD;
     cur_list.tail = CONTRIB_HEAD;
     page_tail = PAGE_HEAD;
-    mem = xmalloc_array(memory_word, MEM_TOP + 1);
+    mem = fmt_alloc_array(memory_word, MEM_TOP + 1);
 
     undump_int(x);
     if (x != EQTB_SIZE)
         goto bad_fmt;
 
     undump_int(x);
-    if (x != HASH_PRIME)
+    if (x < inf_hash_bits || x > sup_hash_bits)
         goto bad_fmt;
+    hash_bits = x;
 
     undump_int(x);
     if (x != HYPH_PRIME)
@@ -2573,11 +2836,14 @@ load_fmt_file(void)
     if (max_strings < str_ptr + strings_free)
         max_strings = str_ptr + strings_free;
 
-    str_start = xmalloc_array(pool_pointer, max_strings);
-    undump_checked_things(0, pool_ptr, str_start[0], str_ptr - TOO_BIG_CHAR + 1);
-    str_pool = xmalloc_array(packed_UTF16_code, pool_size);
+    str_start = fmt_alloc_array(pool_pointer, max_strings);
+    undump_section(str_start, str_start[0], str_ptr - TOO_BIG_CHAR + 1);
+    for (x = 0; x <= str_ptr - TOO_BIG_CHAR; x++)
+        if (str_start[x] < 0 || str_start[x] > pool_ptr)
+            goto bad_fmt;
 
-    undump_things(str_pool[0], pool_ptr);
+    str_pool = fmt_alloc_array(packed_UTF16_code, pool_size);
+    undump_section(str_pool, str_pool[0], pool_ptr);
 
     init_str_ptr = str_ptr;
     init_pool_ptr = pool_ptr; /*:1345 */
@@ -2609,15 +2875,20 @@ load_fmt_file(void)
     p = 0;
     q = rover;
 
+    if (fmt_native)
+        undump_section(mem, mem[0], lo_mem_max + 1);
+
     do {
-        undump_things(mem[p], q + 2 - p);
+        if (!fmt_native)
+            undump_things(mem[p], q + 2 - p);
         p = q + mem[q].b32.s0;
         if (p > lo_mem_max || (q >= mem[q + 1].b32.s1 && mem[q + 1].b32.s1 != rover))
             goto bad_fmt;
         q = mem[q + 1].b32.s1;
     } while (q != rover);
 
-    undump_things(mem[p], lo_mem_max + 1 - p);
+    if (!fmt_native)
+        undump_things(mem[p], lo_mem_max + 1 - p);
 
     undump_int(x);
     if (x < lo_mem_max + 1 || x > PRE_ADJUST_HEAD)
@@ -2633,7 +2904,7 @@ load_fmt_file(void)
 
     mem_end = MEM_TOP;
 
-    undump_things(mem[hi_mem_min], mem_end + 1 - hi_mem_min);
+    undump_section(mem, mem[hi_mem_min], mem_end + 1 - hi_mem_min);
     undump_int(var_used);
     undump_int(dyn_used);
 
@@ -2648,6 +2919,11 @@ load_fmt_file(void)
 
     k = ACTIVE_BASE;
 
+    if (fmt_native) {
+        undump_section(eqtb, eqtb[ACTIVE_BASE], EQTB_SIZE + 1 + hash_high - ACTIVE_BASE);
+        goto eqtb_undumped;
+    }
+
     do {
         undump_int(x);
         if (x < 1 || k + x > EQTB_SIZE + 1)
@@ -2669,6 +2945,7 @@ load_fmt_file(void)
     if (hash_high > 0)
         undump_things(eqtb[EQTB_SIZE + 1], hash_high);
 
+eqtb_undumped:
     undump_int(x);
     if (x < HASH_BASE || x > hash_top)
         goto bad_fmt;
@@ -2703,22 +2980,36 @@ load_fmt_file(void)
 
     p = HASH_BASE - 1;
 
-    do {
-        undump_int(x);
-        if (x < p + 1 || x > hash_used)
-            goto bad_fmt;
-        else
-            p = x;
-        undump_b32(hash[p]);
-    } while (p != hash_used);
+    if (fmt_native) {
+        undump_section(yhash, hash[HASH_BASE], (UNDEFINED_CONTROL_SEQUENCE - 1) - HASH_BASE + 1);
+    } else {
+        do {
+            undump_int(x);
+            if (x < p + 1 || x > hash_used)
+                goto bad_fmt;
+            else
+                p = x;
+            undump_b32(hash[p]);
+        } while (p != hash_used);
 
-    undump_things(hash[hash_used + 1], (UNDEFINED_CONTROL_SEQUENCE - 1) - hash_used);
+        undump_things(hash[hash_used + 1], (UNDEFINED_CONTROL_SEQUENCE - 1) - hash_used);
+    }
 
     if (hash_high > 0)
-        undump_things(hash[EQTB_SIZE + 1], hash_high);
+        undump_section(yhash, hash[EQTB_SIZE + 1], hash_high);
 
     undump_int(cs_count);
 
+    hash_heads = fmt_alloc_array(int32_t, (1 << hash_bits) - 1);
+    undump_section(hash_heads, hash_heads[0], 1 << hash_bits);
+
+    for (x = 0; x < 1 << hash_bits; x++) {
+        p = hash_heads[x];
+        if (p != 0 && (p < HASH_BASE || p > UNDEFINED_CONTROL_SEQUENCE - 1) &&
+            (p <= EQTB_SIZE || p > EQTB_SIZE + hash_high))
+            goto bad_fmt;
+    }
+
     /* font info */
 
     undump_int(x);
@@ -2731,8 +3022,8 @@ load_fmt_file(void)
     if (fmem_ptr > font_mem_size)
         font_mem_size = fmem_ptr;
 
-    font_info = xmalloc_array(memory_word, font_mem_size);
-    undump_things(font_info[0], fmem_ptr);
+    font_info = fmt_alloc_array(memory_word, font_mem_size);
+    undump_section(font_info, font_info[0], fmem_ptr);
 
     undump_int(x);
     if (x < FONT_BASE)
@@ -2926,6 +3217,8 @@ load_fmt_file(void)
         goto bad_fmt;
 
     ttstub_input_close (fmt_in);
+    fmt_native = false;
+    fmt_fd = -1;
     return true;
 
 bad_fmt:
@@ -3518,12 +3811,13 @@ tt_cleanup(void) {
     free(native_text);
 
     // Free arrays allocated in load_fmt_file
-    free(yhash);
-    free(eqtb);
-    free(mem);
-    free(str_start);
-    free(str_pool);
-    free(font_info);
+    fmt_free(yhash);
+    fmt_free(hash_heads);
+    fmt_free(eqtb);
+    fmt_free(mem);
+    fmt_free(str_start);
+    fmt_free(str_pool);
+    fmt_free(font_info);
 
     free(font_mapping);
     free(font_layout_engine);
@@ -3641,6 +3935,8 @@ tt_run_engine(const char *dump_name, const char *input_file_name, time_t build_d
         for (hash_used = HASH_BASE + 1; hash_used <= hash_top; hash_used++)
             hash[hash_used] = hash[HASH_BASE];
 
+        hash_heads = xcalloc_array(int32_t, (1 << hash_bits) - 1);
+
         eqtb = xcalloc_array(memory_word, eqtb_top);
         str_start = xmalloc_array(pool_pointer, max_strings);
         str_pool = xmalloc_array(packed_UTF16_code, pool_size);
@@ -3658,7 +3954,7 @@ tt_run_engine(const char *dump_name, const char *input_file_name, time_t build_d
         bad = 2;
     if (1100 > MEM_TOP)
         bad = 4;
-    if (HASH_PRIME > HASH_SIZE)
+    if (hash_bits < inf_hash_bits || hash_bits > sup_hash_bits)
         bad = 5;
     if (max_in_open >= 128)
         bad = 6;
@@ -3873,7 +4169,9 @@ tt_run_engine(const char *dump_name, const char *input_file_name, time_t build_d
     synctex_init_command();
     start_input(input_file_name);
     history = HISTORY_SPOTLESS;
+    linebreak_memo_init();
     main_control();
+    profile_report();
     final_cleanup();
     close_files_and_terminate();
 
@@ -14,6 +14,9 @@
 #include "xetex-xetexd.h"
 #include "tectonic_bridge_core.h"
 
+#include <string.h>
+#include <sys/mman.h>
+
 #define AWFUL_BAD 0x3FFFFFFF
 
 #define VERY_LOOSE_FIT 0
@@ -58,6 +61,7 @@ static small_number active_node_size;
 static scaled_t fill_width[3];
 static scaled_t best_pl_short[4];
 static scaled_t best_pl_glue[4];
+static bool memo_replaying;
 
 
 static void post_line_break(bool d);
@@ -84,6 +88,387 @@ get_native_usv(int32_t p, int32_t i) {
     return c;
 }
 
+
+/* Line-break memoization.
+ *
+ * When TeXpresso rolls back to a snapshot, every paragraph after the snapshot
+ * is typeset again, usually with the exact same contents and parameters. The
+ * memo table remembers the outcome of the Knuth-Plass passes for such
+ * paragraphs so that they can be replayed without the dynamic programming:
+ *
+ *  - the key is a fingerprint of the hlist, as seen by the line breaker
+ *    (widths, penalties, glue, characters and their hyphenation codes), and of
+ *    the parameters that influence the choice of breakpoints;
+ *  - the value records how many passes ran, how many nodes each pass visited,
+ *    and the positions of the chosen breakpoints in the final list.
+ *
+ * On a hit, the passes are still run, but try_break is disabled: this keeps
+ * the side effects of the walk, in particular the discretionaries inserted by
+ * hyphenation, identical to the original computation. A fingerprint of the
+ * resulting list is compared with the recorded one before reusing the
+ * breakpoints; if they differ the paragraph is broken normally.
+ *
+ * The table lives in a shared anonymous mapping created before typesetting
+ * starts, so that it is inherited by the processes forked for each snapshot
+ * and that results computed by a process survive when TeXpresso kills it and
+ * resumes from one of its ancestors. Only one process of the tree runs at a
+ * time; a process killed while writing an entry leaves its key cleared.
+ */
+
+#define MEMO_SLOTS 2048
+#define MEMO_MAX_LINES 128
+#define MEMO_MAX_PASSES 3
+
+typedef struct {
+    uint64_t a, b;
+} memo_hash;
+
+typedef struct {
+    uint64_t key_a, key_b;  /* key_a is 0 when the slot is free */
+    uint64_t result;        /* fingerprint of the list after the last pass */
+    int32_t passes;
+    int32_t steps[MEMO_MAX_PASSES];
+    int32_t best_line;
+    scaled_t shortfall, glue;
+    int32_t lines;
+    int32_t breaks[MEMO_MAX_LINES]; /* node index, -1 for the end of the list */
+} memo_entry;
+
+static memo_entry *memo_table;
+
+
+void
+linebreak_memo_init(void)
+{
+    void *table;
+
+    if (memo_table != NULL)
+        return;
+
+    table = mmap(NULL, MEMO_SLOTS * sizeof(memo_entry), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table != MAP_FAILED)
+        memo_table = table;
+}
+
+
+static inline void
+memo_mix(memo_hash *h, int32_t v)
+{
+    h->a = (h->a ^ (uint32_t) v) * 0x100000001B3ULL;
+    h->b = (h->b + (uint32_t) v) * 0x9E3779B97F4A7C15ULL;
+    h->b ^= h->b >> 29;
+}
+
+
+static void
+memo_mix_glue(memo_hash *h, int32_t g)
+{
+    memo_mix(h, BOX_width(g));
+    memo_mix(h, GLUE_SPEC_stretch(g));
+    memo_mix(h, GLUE_SPEC_stretch_order(g));
+    memo_mix(h, GLUE_SPEC_shrink(g));
+    memo_mix(h, GLUE_SPEC_shrink_order(g));
+}
+
+
+static void
+memo_mix_protrusion(memo_hash *h, int32_t p)
+{
+    int32_t left = last_leftmost_char, right = last_rightmost_char;
+
+    memo_mix(h, char_pw(p, 0));
+    memo_mix(h, char_pw(p, 1));
+    last_leftmost_char = left;
+    last_rightmost_char = right;
+}
+
+
+/* Mix the nodes of list p, as far as line breaking and hyphenation can tell */
+static void
+memo_mix_list(memo_hash *h, int32_t p)
+{
+    bool protrusion = INTPAR(xetex_protrude_chars) > 0;
+    int32_t f, c, q;
+
+    for (; p != TEX_NULL; p = LLIST_link(p)) {
+        if (is_char_node(p)) {
+            f = CHAR_NODE_font(p);
+            c = CHAR_NODE_character(p);
+            memo_mix(h, f);
+            memo_mix(h, c);
+            memo_mix(h, FONT_CHARACTER_WIDTH(f, effective_char(true, f, c)));
+            memo_mix(h, LC_CODE(c));
+            memo_mix(h, hyphen_char[f]);
+            if (protrusion)
+                memo_mix_protrusion(h, p);
+            continue;
+        }
+
+        memo_mix(h, NODE_type(p));
+        memo_mix(h, NODE_subtype(p));
+
+        switch (NODE_type(p)) {
+        case HLIST_NODE:
+        case VLIST_NODE:
+        case RULE_NODE:
+        case KERN_NODE:
+        case MATH_NODE:
+            memo_mix(h, BOX_width(p));
+            break;
+
+        case GLUE_NODE:
+            memo_mix_glue(h, GLUE_NODE_glue_ptr(p));
+            break;
+
+        case PENALTY_NODE:
+            memo_mix(h, PENALTY_NODE_penalty(p));
+            break;
+
+        case LIGATURE_NODE:
+            f = LIGATURE_NODE_lig_font(p);
+            memo_mix(h, f);
+            memo_mix(h, LIGATURE_NODE_lig_char(p));
+            memo_mix(h, FONT_CHARACTER_WIDTH(f, effective_char(true, f, LIGATURE_NODE_lig_char(p))));
+            memo_mix(h, hyphen_char[f]);
+            for (q = LIGATURE_NODE_lig_ptr(p); q > TEX_NULL; q = LLIST_link(q)) {
+                memo_mix(h, CHAR_NODE_character(q));
+                memo_mix(h, LC_CODE(CHAR_NODE_character(q)));
+            }
+            if (protrusion)
+                memo_mix_protrusion(h, p);
+            break;
+
+        case DISC_NODE:
+            memo_mix_list(h, DISCRETIONARY_NODE_pre_break(p));
+            memo_mix(h, -1);
+            memo_mix_list(h, DISCRETIONARY_NODE_post_break(p));
+            memo_mix(h, -1);
+            break;
+
+        case WHATSIT_NODE:
+            switch (NODE_subtype(p)) {
+            case NATIVE_WORD_NODE:
+            case NATIVE_WORD_NODE_AT:
+                f = NATIVE_NODE_font(p);
+                memo_mix(h, f);
+                memo_mix(h, BOX_width(p));
+                memo_mix(h, hyphen_char[f]);
+                for (int32_t l = 0; l < NATIVE_NODE_length(p); l++) {
+                    c = get_native_usv(p, l);
+                    memo_mix(h, c);
+                    memo_mix(h, LC_CODE(c));
+                    if (c >= 65536L)
+                        l++;
+                }
+                if (protrusion)
+                    memo_mix_protrusion(h, p);
+                break;
+
+            case GLYPH_NODE:
+                memo_mix(h, NATIVE_NODE_font(p));
+                memo_mix(h, NATIVE_NODE_glyph(p));
+                memo_mix(h, BOX_width(p));
+                if (protrusion)
+                    memo_mix_protrusion(h, p);
+                break;
+
+            case PIC_NODE:
+            case PDF_NODE:
+                memo_mix(h, BOX_width(p));
+                break;
+
+            case LANGUAGE_NODE:
+                memo_mix(h, LANGUAGE_NODE_what_lang(p));
+                memo_mix(h, LANGUAGE_NODE_what_lhm(p));
+                memo_mix(h, LANGUAGE_NODE_what_rhm(p));
+                break;
+            }
+            break;
+        }
+    }
+}
+
+
+/* Fingerprint the paragraph and the parameters used to break it. Must be
+ * called once the line_break prologue has computed the background and
+ * par_shape variables. */
+static memo_hash
+memo_key(void)
+{
+    memo_hash h = { 0xCBF29CE484222325ULL, 0x84222325CBF29CE4ULL };
+
+    memo_mix_list(&h, LLIST_link(TEMP_HEAD));
+
+    memo_mix(&h, cur_list.prev_graf);
+    memo_mix(&h, init_cur_lang);
+    memo_mix(&h, init_l_hyf);
+    memo_mix(&h, init_r_hyf);
+    memo_mix(&h, hyph_count);
+
+    memo_mix(&h, DIMENPAR(hsize));
+    memo_mix(&h, DIMENPAR(hang_indent));
+    memo_mix(&h, INTPAR(hang_after));
+    memo_mix(&h, DIMENPAR(emergency_stretch));
+    memo_mix(&h, INTPAR(looseness));
+    memo_mix(&h, INTPAR(pretolerance));
+    memo_mix(&h, INTPAR(tolerance));
+    memo_mix(&h, INTPAR(line_penalty));
+    memo_mix(&h, INTPAR(hyphen_penalty));
+    memo_mix(&h, INTPAR(ex_hyphen_penalty));
+    memo_mix(&h, INTPAR(adj_demerits));
+    memo_mix(&h, INTPAR(double_hyphen_demerits));
+    memo_mix(&h, INTPAR(final_hyphen_demerits));
+    memo_mix(&h, INTPAR(last_line_fit));
+    memo_mix(&h, INTPAR(uc_hyph));
+    memo_mix(&h, INTPAR(xetex_use_glyph_metrics));
+    memo_mix(&h, INTPAR(xetex_protrude_chars));
+    memo_mix_glue(&h, GLUEPAR(left_skip));
+    memo_mix_glue(&h, GLUEPAR(right_skip));
+
+    if (LOCAL(par_shape) != TEX_NULL) {
+        int32_t n = LLIST_info(LOCAL(par_shape));
+
+        memo_mix(&h, n);
+        for (int32_t k = 1; k <= 2 * n; k++)
+            memo_mix(&h, mem[LOCAL(par_shape) + k].b32.s1);
+    }
+
+    if (h.a == 0)
+        h.a = 1;
+
+    return h;
+}
+
+
+static memo_entry *
+memo_slot(memo_hash key)
+{
+    return &memo_table[key.b % MEMO_SLOTS];
+}
+
+
+static memo_entry *
+memo_lookup(memo_hash key)
+{
+    memo_entry *e = memo_slot(key);
+
+    if (__atomic_load_n(&e->key_a, __ATOMIC_ACQUIRE) == key.a && e->key_b == key.b)
+        return e;
+
+    return NULL;
+}
+
+
+static uint64_t
+memo_result(void)
+{
+    memo_hash h = { 0xCBF29CE484222325ULL, 0x84222325CBF29CE4ULL };
+
+    memo_mix_list(&h, LLIST_link(TEMP_HEAD));
+    return h.a ^ h.b;
+}
+
+
+/* Record the outcome of the passes; called with best_bet chosen and the list
+ * in the state post_line_break will see. */
+static void
+memo_record(memo_hash key, int32_t passes, const int32_t *steps)
+{
+    memo_entry *e = memo_slot(key);
+    int32_t breaks[MEMO_MAX_LINES];
+    int32_t lines = 0, index = 0, k;
+    int32_t p, q;
+
+    for (q = ACTIVE_NODE_break_node(best_bet); q != TEX_NULL; q = PASSIVE_NODE_prev_break(q))
+        if (++lines > MEMO_MAX_LINES)
+            return;
+
+    k = lines;
+    for (q = ACTIVE_NODE_break_node(best_bet); q != TEX_NULL; q = PASSIVE_NODE_prev_break(q))
+        breaks[--k] = PASSIVE_NODE_cur_break(q);
+
+    /* Turn pointers into positions, breakpoints are in list order */
+    p = LLIST_link(TEMP_HEAD);
+    for (k = 0; k < lines; k++) {
+        if (breaks[k] == TEX_NULL) {
+            breaks[k] = -1;
+            continue;
+        }
+        while (p != TEX_NULL && p != breaks[k]) {
+            p = LLIST_link(p);
+            index++;
+        }
+        if (p == TEX_NULL)
+            return;
+        breaks[k] = index;
+    }
+
+    __atomic_store_n(&e->key_a, 0, __ATOMIC_RELEASE);
+
+    e->result = memo_result();
+    e->passes = passes;
+    for (k = 0; k < passes; k++)
+        e->steps[k] = steps[k];
+    e->best_line = ACTIVE_NODE_line_number(best_bet);
+    if (do_last_line_fit) {
+        e->shortfall = ACTIVE_NODE_shortfall(best_bet);
+        e->glue = ACTIVE_NODE_glue(best_bet);
+    }
+    e->lines = lines;
+    memcpy(e->breaks, breaks, lines * sizeof(int32_t));
+    e->key_b = key.b;
+
+    __atomic_store_n(&e->key_a, key.a, __ATOMIC_RELEASE);
+}
+
+
+/* Rebuild the break nodes of a memoized paragraph from the active node left
+ * by a replayed pass. Returns false if the list does not match the entry. */
+static bool
+memo_replay(const memo_entry *e)
+{
+    int32_t p, q, prev = TEX_NULL;
+    int32_t index = 0;
+
+    if (memo_result() != e->result)
+        return false;
+
+    p = LLIST_link(TEMP_HEAD);
+
+    for (int32_t k = 0; k < e->lines; k++) {
+        int32_t brk = TEX_NULL;
+
+        if (e->breaks[k] >= 0) {
+            while (p != TEX_NULL && index < e->breaks[k]) {
+                p = LLIST_link(p);
+                index++;
+            }
+            if (p == TEX_NULL)
+                return false;
+            brk = p;
+        }
+
+        q = get_node(PASSIVE_NODE_SIZE);
+        LLIST_link(q) = passive;
+        passive = q;
+        PASSIVE_NODE_cur_break(q) = brk;
+        PASSIVE_NODE_prev_break(q) = prev;
+        prev = q;
+    }
+
+    best_bet = LLIST_link(ACTIVE_LIST);
+    ACTIVE_NODE_break_node(best_bet) = prev;
+    ACTIVE_NODE_line_number(best_bet) = e->best_line;
+    if (do_last_line_fit) {
+        ACTIVE_NODE_shortfall(best_bet) = e->shortfall;
+        ACTIVE_NODE_glue(best_bet) = e->glue;
+    }
+    best_line = e->best_line;
+
+    return true;
+}
+
 /* Break a paragraph into lines (XTTP:843).
  *
  * d: true if we are breaking a partial paragraph preceding display math mode
@@ -107,6 +492,10 @@ line_break(bool d)
     int32_t l;
     int32_t i;
     int32_t for_end_1;
+    memo_hash key = { 0, 0 };
+    const memo_entry *memo = NULL;
+    int32_t pass = 0, steps[MEMO_MAX_PASSES];
+    bool memoize;
 
     pack_begin_line = cur_list.mode_line; /* "this is for over/underfull box messages" */
 
@@ -221,6 +610,17 @@ line_break(bool d)
     else
         easy_line = MAX_HALFWORD; /*:877*/
 
+    /* Reuse the breakpoints of an identical paragraph, if any */
+
+    memoize = memo_table != NULL && !semantic_pagination_enabled;
+
+    if (memoize) {
+        key = memo_key();
+        memo = memo_lookup(key);
+    }
+
+    memo_replaying = memo != NULL;
+
     /* Start finding optimal breakpoints (892) */
 
     threshold = INTPAR(pretolerance);
@@ -279,8 +679,15 @@ line_break(bool d)
 
         prev_p = global_prev_p = cur_p;
         first_p = cur_p;
+        steps[pass] = 0;
 
         while (cur_p != TEX_NULL && LLIST_link(ACTIVE_LIST) != LAST_ACTIVE) {
+            /* When replaying, the active list never empties: stop where the
+             * memoized pass stopped */
+            if (memo_replaying && steps[pass] == memo->steps[pass])
+                break;
+            steps[pass]++;
+
             /*895: "Call try_break if cur_p is a legal breakpoint; on the
              * second pass, also try to hyphenate the next word, if cur_p is a
              * glue node; then advance cur_p to the next node of the paragraph
@@ -841,7 +1248,17 @@ line_break(bool d)
             ; /*:895*/
         }
 
-        if (cur_p == TEX_NULL) {
+        if (memo_replaying) {
+            if (pass + 1 == memo->passes) {
+                if (cur_p == TEX_NULL && memo_replay(memo))
+                    goto done;
+
+                /* The list differs from the memoized one, break it normally
+                 * (the pass is run again below) */
+                memo_replaying = false;
+                memoize = false;
+            }
+        } else if (cur_p == TEX_NULL) {
             /*902: "Try the final line break at the end of the paragraph, and
              * goto done if the desired breakpoints have been found." */
             try_break(EJECT_PENALTY, HYPHENATED);
@@ -919,6 +1336,16 @@ line_break(bool d)
 
         /* ... resuming 892 ... */
 
+        if (!memo_replaying && memo != NULL) {
+            memo = NULL;
+            continue;
+        }
+
+        if (pass + 1 < MEMO_MAX_PASSES)
+            pass++;
+        else
+            memoize = false;
+
         if (!second_pass) {
             threshold = INTPAR(tolerance);
             second_pass = true;
@@ -930,6 +1357,11 @@ line_break(bool d)
     }
 
 done:
+    if (memo_replaying)
+        memo_replaying = false;
+    else if (memoize)
+        memo_record(key, pass + 1, steps);
+
     if (do_last_line_fit) { /*1641:*/
         if (ACTIVE_NODE_shortfall(best_bet) == 0) {
             do_last_line_fit = false;
@@ -1420,6 +1852,10 @@ try_break(int32_t pi, small_number break_type)
     if (semantic_pagination_enabled && cur_p != TEX_NULL)
         return;
 
+    /* Replaying a memoized paragraph: the breakpoints are already known */
+    if (memo_replaying)
+        return;
+
     if (abs(pi) >= INF_PENALTY) {
         if (pi > 0)
             return;
@@ -21,25 +21,24 @@ capture_to_diagnostic(ttbc_diagnostic_t *diagnostic)
 }
 
 static void
-diagnostic_print_file_line(ttbc_diagnostic_t *diagnostic)
+diagnostic_set_file_line(ttbc_diagnostic_t *diagnostic)
 {
-    // Add file/line number information
+    // Record file/line number information, it is sent apart from the message
+    // so that the driver does not have to parse it back.
     // This duplicates logic from print_file_line
 
     int32_t level = in_open;
     while (level > 0 && full_source_filename_stack[level] == 0)
         level--;
 
-    if (level == 0) {
-        ttbc_diag_append(diagnostic, "!");
-    } else {
+    if (level != 0) {
         int32_t source_line = line;
         if (level != in_open) {
             source_line = line_stack[level + 1];
         }
 
         char* filename = gettexstring(full_source_filename_stack[level]);
-        ttstub_diag_printf(diagnostic, "%s:%d: ", filename, source_line);
+        ttstub_diag_set_location(diagnostic, filename, source_line);
         free(filename);
     }
 }
@@ -48,7 +47,16 @@ ttbc_diagnostic_t *
 diagnostic_begin_capture_warning_here(void)
 {
     ttbc_diagnostic_t *warning = ttbc_diag_begin_warning();
-    diagnostic_print_file_line(warning);
+    diagnostic_set_file_line(warning);
+    capture_to_diagnostic(warning);
+    return warning;
+}
+
+ttbc_diagnostic_t *
+diagnostic_begin_capture_badbox_here(void)
+{
+    ttbc_diagnostic_t *warning = ttstub_diag_begin_badbox();
+    diagnostic_set_file_line(warning);
     capture_to_diagnostic(warning);
     return warning;
 }
@@ -58,7 +66,7 @@ ttbc_diagnostic_t *
 error_here_with_diagnostic(const char* message)
 {
     ttbc_diagnostic_t *error = ttbc_diag_begin_error();
-    diagnostic_print_file_line(error);
+    diagnostic_set_file_line(error);
     ttstub_diag_printf(error, "%s", message);
 
     if (file_line_error_style_p)
@@ -0,0 +1,275 @@
+/* xetex-profile.c: sampling profiler of macro expansion
+   Licensed under the MIT License.
+*/
+
+/* Time is measured every PROFILE_SAMPLE_MASK + 1 tokens (see get_next) and
+ * the time elapsed since the previous sample is attributed to:
+ *
+ *  - the innermost macro being expanded ("self" time),
+ *  - every distinct macro on the input stack ("total" time),
+ *  - the current line of the innermost input file.
+ *
+ * When TeXpresso drives the engine, processes fork at each snapshot and the
+ * child inherits the tables: a report covers the whole path that led to the
+ * final document, not just the part computed by the last process.
+ */
+
+#include "xetex-core.h"
+#include "xetex-xetexd.h"
+#include "xetex-stringpool.h"
+#include "tectonic_bridge_core.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROFILE_REPORT_ENTRIES 100
+
+bool profile_enabled = false;
+
+typedef struct {
+    int32_t key, line;  /* control sequence, or file name and line */
+    uint32_t stamp;     /* last sample that counted this entry */
+    uint64_t self_ns, total_ns;
+} profile_cell;
+
+typedef struct {
+    profile_cell *cells;
+    int32_t count, cap;
+} profile_table;
+
+static profile_table macros, locations;
+static uint64_t last_sample;
+static uint32_t sample_stamp;
+static pid_t sample_pid;
+
+
+static uint32_t
+cell_hash(int32_t key, int32_t line)
+{
+    return ((uint32_t) key * 2654435761U) ^ ((uint32_t) line * 40503U);
+}
+
+
+static profile_cell *
+table_find(profile_cell *cells, int32_t cap, int32_t key, int32_t line)
+{
+    uint32_t mask = cap - 1;
+    uint32_t i = cell_hash(key, line) & mask;
+
+    while (cells[i].stamp != 0 && (cells[i].key != key || cells[i].line != line))
+        i = (i + 1) & mask;
+
+    return &cells[i];
+}
+
+
+static profile_cell *
+table_get(profile_table *t, int32_t key, int32_t line)
+{
+    profile_cell *c;
+
+    if (t->count * 4 >= t->cap * 3) {
+        int32_t cap = t->cap ? t->cap * 2 : 1024;
+        profile_cell *cells = xcalloc(cap, sizeof(profile_cell));
+
+        for (int32_t i = 0; i < t->cap; i++)
+            if (t->cells[i].stamp != 0)
+                *table_find(cells, cap, t->cells[i].key, t->cells[i].line) = t->cells[i];
+
+        free(t->cells);
+        t->cells = cells;
+        t->cap = cap;
+    }
+
+    c = table_find(t->cells, t->cap, key, line);
+    if (c->stamp == 0) {
+        c->key = key;
+        c->line = line;
+        c->stamp = (uint32_t) -1;
+        t->count++;
+    }
+    return c;
+}
+
+
+static uint64_t
+profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static void
+sample_macro(const input_state_t *in, uint64_t elapsed, bool *innermost)
+{
+    profile_cell *c;
+
+    if (in->state != TOKEN_LIST || in->index != MACRO)
+        return;
+
+    c = table_get(&macros, in->name, 0);
+    if (*innermost) {
+        c->self_ns += elapsed;
+        *innermost = false;
+    }
+    /* A recursive macro is counted once per sample */
+    if (c->stamp != sample_stamp) {
+        c->total_ns += elapsed;
+        c->stamp = sample_stamp;
+    }
+}
+
+
+void
+profile_sample(void)
+{
+    uint64_t now = profile_now(), elapsed;
+    bool innermost = true;
+    profile_cell *c;
+    pid_t pid = getpid();
+
+    /* First sample, or first sample of a forked snapshot: the parent might
+     * have been waiting for a long time, don't count that. */
+    if (pid != sample_pid) {
+        sample_pid = pid;
+        last_sample = now;
+        return;
+    }
+
+    elapsed = now - last_sample;
+    last_sample = now;
+
+    /* 0 and -1 are reserved to mark free and fresh cells */
+    if (++sample_stamp == (uint32_t) -1)
+        sample_stamp = 1;
+
+    sample_macro(&cur_input, elapsed, &innermost);
+    for (int32_t i = input_ptr - 1; i >= 0; i--)
+        sample_macro(&input_stack[i], elapsed, &innermost);
+
+    c = table_get(&locations, in_open > 0 ? full_source_filename_stack[in_open] : 0,
+                  in_open > 0 ? line : 0);
+    c->self_ns += elapsed;
+}
+
+
+static int
+compare_cells(const void *a, const void *b)
+{
+    const profile_cell *ca = a, *cb = b;
+
+    if (ca->self_ns != cb->self_ns)
+        return ca->self_ns < cb->self_ns ? 1 : -1;
+    return ca->total_ns < cb->total_ns ? 1 : ca->total_ns > cb->total_ns ? -1 : 0;
+}
+
+
+/* Sort the cells of a table by decreasing self time, keeping at most
+ * PROFILE_REPORT_ENTRIES.  */
+static int32_t
+sorted_cells(profile_table *t, profile_cell **result)
+{
+    profile_cell *cells = xcalloc(t->count + 1, sizeof(profile_cell));
+    int32_t n = 0;
+
+    for (int32_t i = 0; i < t->cap; i++)
+        if (t->cells[i].stamp != 0)
+            cells[n++] = t->cells[i];
+
+    qsort(cells, n, sizeof(profile_cell), compare_cells);
+    *result = cells;
+    return n < PROFILE_REPORT_ENTRIES ? n : PROFILE_REPORT_ENTRIES;
+}
+
+
+static char *
+cs_name(int32_t p)
+{
+    selector_t old_setting = selector;
+    str_number s;
+    char *name;
+
+    selector = SELECTOR_NEW_STRING;
+    sprint_cs(p);
+    selector = old_setting;
+
+    s = make_string();
+    name = gettexstring(s);
+    str_ptr--;
+    pool_ptr = str_start[str_ptr - TOO_BIG_CHAR];
+
+    return name;
+}
+
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} report_buffer;
+
+
+static void
+report_printf(report_buffer *b, const char *format, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, format);
+    n = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+
+    if (b->len + n + 1 > b->cap) {
+        b->cap = (b->len + n + 1) * 2;
+        b->data = xrealloc(b->data, b->cap);
+    }
+
+    va_start(ap, format);
+    vsnprintf(b->data + b->len, n + 1, format, ap);
+    va_end(ap);
+    b->len += n;
+}
+
+
+/* Send the aggregates to the driver, one entry per line, times in
+ * microseconds:
+ *
+ *   macro <self> <total> <control sequence>
+ *   line <line> <self> <file>
+ */
+void
+profile_report(void)
+{
+    report_buffer b = { NULL, 0, 0 };
+    profile_cell *cells;
+    int32_t n;
+
+    if (!profile_enabled)
+        return;
+
+    n = sorted_cells(&macros, &cells);
+    for (int32_t i = 0; i < n; i++) {
+        char *name = cs_name(cells[i].key);
+        report_printf(&b, "macro %llu %llu %s\n",
+                      (unsigned long long) (cells[i].self_ns / 1000),
+                      (unsigned long long) (cells[i].total_ns / 1000), name);
+        free(name);
+    }
+    free(cells);
+
+    n = sorted_cells(&locations, &cells);
+    for (int32_t i = 0; i < n; i++) {
+        char *name = cells[i].key ? gettexstring(cells[i].key) : xstrdup("");
+        report_printf(&b, "line %d %llu %s\n", cells[i].line,
+                      (unsigned long long) (cells[i].self_ns / 1000), name);
+        free(name);
+    }
+    free(cells);
+
+    ttstub_profile_report(b.data, b.len);
+    free(b.data);
+}
@@ -127,6 +127,119 @@ static struct {
 };
 
 
+/*  TeXpresso binary encoding.  When talking to TeXpresso (that is when
+ *  synctex_texpresso_extension is set), records are not printed as text lines
+ *  but encoded as the character that starts the textual line followed by the
+ *  integer fields in zigzag LEB128 varints.  Tags, lines and positions are
+ *  coded as differences with the previous record; the base is reset to 0 at
+ *  each sheet such that a page can be decoded on its own.  The stream starts
+ *  with a 0 byte (a textual stream starts with "SyncTeX").  Anchors, content
+ *  and post scriptum lines are not emitted.
+ *  The decoder lives in TeXpresso frontend (src/frontend/synctex.c). */
+
+#define SYNCTEX_BIN_HEADER 0
+
+static struct {
+    unsigned char buf[64];
+    int len;
+    int32_t tag, line, h, v;    /* base for delta coding */
+} synctex_bin;
+
+static void
+synctex_bin_int(int32_t i)
+{
+    uint32_t u = ((uint32_t) i << 1) ^ (uint32_t) (i >> 31);
+
+    while (u >= 0x80) {
+        synctex_bin.buf[synctex_bin.len++] = (u & 0x7F) | 0x80;
+        u >>= 7;
+    }
+    synctex_bin.buf[synctex_bin.len++] = u;
+}
+
+static void
+synctex_bin_begin(char op)
+{
+    synctex_bin.len = 0;
+    synctex_bin.buf[synctex_bin.len++] = op;
+    if (op == '{') {
+        synctex_bin.tag = synctex_bin.line = 0;
+        synctex_bin.h = synctex_bin.v = 0;
+    }
+}
+
+static void
+synctex_bin_point(int32_t h, int32_t v)
+{
+    synctex_bin_int(h - synctex_bin.h);
+    synctex_bin_int(v - synctex_bin.v);
+    synctex_bin.h = h;
+    synctex_bin.v = v;
+}
+
+static int
+synctex_bin_end(void)
+{
+    return ttstub_output_write(synctex_ctxt.file, (const char *) synctex_bin.buf,
+                               synctex_bin.len);
+}
+
+/*  Record of a node: "<op>tag,line:h,v" followed by ":width" if size == 1
+ *  or ":width,height,depth" if size == 3. */
+static int
+synctex_write_node(char op, int size, int32_t tag, int32_t line,
+                   int32_t h, int32_t v, int32_t width, int32_t height, int32_t depth)
+{
+    if (synctex_texpresso_extension) {
+        synctex_bin_begin(op);
+        synctex_bin_int(tag - synctex_bin.tag);
+        synctex_bin_int(line - synctex_bin.line);
+        synctex_bin.tag = tag;
+        synctex_bin.line = line;
+        synctex_bin_point(h, v);
+        if (size > 0)
+            synctex_bin_int(width);
+        if (size > 1) {
+            synctex_bin_int(height);
+            synctex_bin_int(depth);
+        }
+        return synctex_bin_end();
+    }
+
+    if (size == 0)
+        return ttstub_fprintf(synctex_ctxt.file, "%c%i,%i:%i,%i\n",
+                              op, tag, line, h, v);
+    if (size == 1)
+        return ttstub_fprintf(synctex_ctxt.file, "%c%i,%i:%i,%i:%i\n",
+                              op, tag, line, h, v, width);
+    return ttstub_fprintf(synctex_ctxt.file, "%c%i,%i:%i,%i:%i,%i,%i\n",
+                          op, tag, line, h, v, width, height, depth);
+}
+
+/*  Record of the form "<op>value" */
+static int
+synctex_write_int(char op, int32_t value)
+{
+    if (synctex_texpresso_extension) {
+        synctex_bin_begin(op);
+        synctex_bin_int(value);
+        return synctex_bin_end();
+    }
+    return ttstub_fprintf(synctex_ctxt.file, "%c%i\n", op, value);
+}
+
+/*  Record made of a single character */
+static int
+synctex_write_op(char op)
+{
+    if (synctex_texpresso_extension) {
+        synctex_bin_begin(op);
+        return synctex_bin_end();
+    }
+    return ttstub_fprintf(synctex_ctxt.file, "%c\n", op);
+}
+
+
 static char *
 get_current_name (void)
 {
@@ -373,7 +486,7 @@ void synctex_end_file_reading(void)
     int tag = cur_input.synctex_tag;
 
     if (synctex_ctxt.file && tag > 0)
-        len = ttstub_fprintf(synctex_ctxt.file, "/%i\n", tag);
+        len = synctex_write_int('/', tag);
 
     if (len > 0)
         synctex_ctxt.total_length += len;
@@ -717,10 +830,9 @@ synctex_current(void)
     if (SYNCTEX_IGNORE(nothing))
         return;
 
-    len = ttstub_fprintf(synctex_ctxt.file, "x%i,%i:%i,%i\n",
-                  synctex_ctxt.tag,synctex_ctxt.line,
-                  SYNCTEX_CURH / synctex_ctxt.unit,
-                  SYNCTEX_CURV / synctex_ctxt.unit);
+    len = synctex_write_node('x', 0, synctex_ctxt.tag, synctex_ctxt.line,
+                             SYNCTEX_CURH / synctex_ctxt.unit,
+                             SYNCTEX_CURV / synctex_ctxt.unit, 0, 0, 0);
     synctex_ctxt.lastv = SYNCTEX_CURV;
 
     if (len > 0)
@@ -753,9 +865,15 @@ synctex_record_settings(void)
     if (NULL == synctex_ctxt.file)
         return 0;
 
-    len = ttstub_fprintf(synctex_ctxt.file, "Output:pdf\nMagnification:%i\nUnit:%i\nX Offset:0\nY Offset:0\n",
-                  synctex_ctxt.magnification,
-                  synctex_ctxt.unit); /* magic pt/in conversion */
+    if (synctex_texpresso_extension) {
+        synctex_bin_begin('O');
+        synctex_bin_int(synctex_ctxt.magnification);
+        synctex_bin_int(synctex_ctxt.unit);
+        len = synctex_bin_end();
+    } else
+        len = ttstub_fprintf(synctex_ctxt.file, "Output:pdf\nMagnification:%i\nUnit:%i\nX Offset:0\nY Offset:0\n",
+                      synctex_ctxt.magnification,
+                      synctex_ctxt.unit); /* magic pt/in conversion */
 
     if (len > 0) {
         synctex_ctxt.total_length += len;
@@ -769,7 +887,14 @@ synctex_record_settings(void)
 static inline int
 synctex_record_preamble(void)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "SyncTeX Version:%i\n", SYNCTEX_VERSION);
+    int len;
+
+    if (synctex_texpresso_extension) {
+        synctex_bin_begin(SYNCTEX_BIN_HEADER);
+        synctex_bin_int(SYNCTEX_VERSION);
+        len = synctex_bin_end();
+    } else
+        len = ttstub_fprintf(synctex_ctxt.file, "SyncTeX Version:%i\n", SYNCTEX_VERSION);
 
     if (len > 0) {
         synctex_ctxt.total_length = len; /* XXX: should this be `+=`? */
@@ -783,7 +908,18 @@ synctex_record_preamble(void)
 static inline int
 synctex_record_input(int32_t tag, char *name)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "Input:%i:%s\n", tag, name);
+    int len;
+
+    if (synctex_texpresso_extension) {
+        size_t name_len = strlen(name);
+        synctex_bin_begin('I');
+        synctex_bin_int(tag);
+        synctex_bin_int(name_len);
+        len = synctex_bin_end();
+        if (len > 0)
+            len += ttstub_output_write(synctex_ctxt.file, name, name_len);
+    } else
+        len = ttstub_fprintf(synctex_ctxt.file, "Input:%i:%s\n", tag, name);
 
     if (len > 0) {
         synctex_ctxt.total_length += len;
@@ -797,6 +933,9 @@ synctex_record_input(int32_t tag, char *name)
 static inline int
 synctex_record_anchor(void)
 {
+    if (synctex_texpresso_extension)
+        return 0;
+
     int len = ttstub_fprintf(synctex_ctxt.file, "!%i\n", synctex_ctxt.total_length);
 
     if (len > 0) {
@@ -812,6 +951,9 @@ synctex_record_anchor(void)
 static inline int
 synctex_record_content(void)
 {
+    if (synctex_texpresso_extension)
+        return 0;
+
     int len = ttstub_fprintf(synctex_ctxt.file, "Content:\n");
 
     if (len > 0) {
@@ -827,7 +969,7 @@ static inline int
 synctex_record_sheet(int32_t sheet)
 {
     if (0 == synctex_record_anchor()) {
-        int len = ttstub_fprintf(synctex_ctxt.file, "{%i\n", sheet);
+        int len = synctex_write_int('{', sheet);
         SYNCTEX_RECORD_LEN_AND_RETURN_NOERR;
     }
 
@@ -841,7 +983,7 @@ static inline int
 synctex_record_teehs(int32_t sheet)
 {
     if (0 == synctex_record_anchor()) {
-        int len = ttstub_fprintf(synctex_ctxt.file, "}%i\n", sheet);
+        int len = synctex_write_int('}', sheet);
         SYNCTEX_RECORD_LEN_AND_RETURN_NOERR;
     }
 
@@ -900,8 +1042,7 @@ synctex_record_pdfxform(int32_t form)
         int len;
         /* XXX Tectonic: guessing that SYNCTEX_PDF_CUR_FORM = synctex_ctxt.form_depth here */
         ++synctex_ctxt.form_depth;
-        len = ttstub_fprintf(synctex_ctxt.file, "<%i\n",
-                             synctex_ctxt.form_depth);
+        len = synctex_write_int('<', synctex_ctxt.form_depth);
         SYNCTEX_RECORD_LEN_AND_RETURN_NOERR;
     }
 
@@ -917,7 +1058,7 @@ synctex_record_mrofxfdp(void)
         int len;
         /* XXX Tectonic: mistake here in original source, no %d in format string */
         --synctex_ctxt.form_depth;
-        len = ttstub_fprintf(synctex_ctxt.file, ">\n");
+        len = synctex_write_op('>');
         SYNCTEX_RECORD_LEN_AND_RETURN_NOERR;
     }
 
@@ -937,10 +1078,17 @@ synctex_record_node_pdfrefxform(int objnum) /* UNUSED form JL */
         return 0;
     } else {
         int len = 0;
-        len = ttstub_fprintf(synctex_ctxt.file, "f%i:%i,%i\n",
-                             objnum,
-                             SYNCTEX_CURH / synctex_ctxt.unit,
-                             SYNCTEX_CURV / synctex_ctxt.unit);
+        if (synctex_texpresso_extension) {
+            synctex_bin_begin('f');
+            synctex_bin_int(objnum);
+            synctex_bin_point(SYNCTEX_CURH / synctex_ctxt.unit,
+                              SYNCTEX_CURV / synctex_ctxt.unit);
+            len = synctex_bin_end();
+        } else
+            len = ttstub_fprintf(synctex_ctxt.file, "f%i:%i,%i\n",
+                                 objnum,
+                                 SYNCTEX_CURH / synctex_ctxt.unit,
+                                 SYNCTEX_CURV / synctex_ctxt.unit);
         synctex_ctxt.lastv = SYNCTEX_CURV;
         SYNCTEX_RECORD_LEN_AND_RETURN_NOERR;
     }
@@ -952,7 +1100,7 @@ synctex_record_node_pdfrefxform(int objnum) /* UNUSED form JL */
 static inline void
 synctex_record_node_void_vlist(int32_t p)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "v%i,%i:%i,%i:%i,%i,%i\n",
+    int len = synctex_write_node('v', 3,
                       SYNCTEX_TAG_MODEL(p,BOX),
                       SYNCTEX_LINE_MODEL(p,BOX),
                       synctex_ctxt.curh / synctex_ctxt.unit,
@@ -977,14 +1125,14 @@ synctex_record_node_vlist(int32_t p)
 
     synctex_ctxt.flags.not_void = 1;
 
-    len = ttstub_fprintf(synctex_ctxt.file, "[%i,%i:%i,%i:%i,%i,%i\n",
-                  SYNCTEX_TAG_MODEL(p,BOX),
-                  SYNCTEX_LINE_MODEL(p,BOX),
-                  synctex_ctxt.curh / synctex_ctxt.unit,
-                  synctex_ctxt.curv / synctex_ctxt.unit,
-                  SYNCTEX_WIDTH(p) / synctex_ctxt.unit,
-                  SYNCTEX_HEIGHT(p) / synctex_ctxt.unit,
-                  SYNCTEX_DEPTH(p) / synctex_ctxt.unit);
+    len = synctex_write_node('[', 3,
+                      SYNCTEX_TAG_MODEL(p,BOX),
+                      SYNCTEX_LINE_MODEL(p,BOX),
+                      synctex_ctxt.curh / synctex_ctxt.unit,
+                      synctex_ctxt.curv / synctex_ctxt.unit,
+                      SYNCTEX_WIDTH(p) / synctex_ctxt.unit,
+                      SYNCTEX_HEIGHT(p) / synctex_ctxt.unit,
+                      SYNCTEX_DEPTH(p) / synctex_ctxt.unit);
     synctex_ctxt.lastv = SYNCTEX_CURV;
 
     if (len > 0) {
@@ -998,7 +1146,7 @@ synctex_record_node_vlist(int32_t p)
 static inline void
 synctex_record_node_tsilv(int32_t p __attribute__ ((unused)))
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "]\n");
+    int len = synctex_write_op(']');
 
     if (len > 0) {
         synctex_ctxt.total_length += len;
@@ -1011,7 +1159,7 @@ synctex_record_node_tsilv(int32_t p __attribute__ ((unused)))
 static inline void
 synctex_record_node_void_hlist(int32_t p)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "h%i,%i:%i,%i:%i,%i,%i\n",
+    int len = synctex_write_node('h', 3,
                       SYNCTEX_TAG_MODEL(p,BOX),
                       SYNCTEX_LINE_MODEL(p,BOX),
                       synctex_ctxt.curh / synctex_ctxt.unit,
@@ -1036,14 +1184,14 @@ synctex_record_node_hlist(int32_t p)
 
     synctex_ctxt.flags.not_void = 1;
 
-    len = ttstub_fprintf(synctex_ctxt.file, "(%i,%i:%i,%i:%i,%i,%i\n",
-                  SYNCTEX_TAG_MODEL(p,BOX),
-                  SYNCTEX_LINE_MODEL(p,BOX),
-                  synctex_ctxt.curh / synctex_ctxt.unit,
-                  synctex_ctxt.curv / synctex_ctxt.unit,
-                  SYNCTEX_WIDTH(p) / synctex_ctxt.unit,
-                  SYNCTEX_HEIGHT(p) / synctex_ctxt.unit,
-                  SYNCTEX_DEPTH(p) / synctex_ctxt.unit);
+    len = synctex_write_node('(', 3,
+                      SYNCTEX_TAG_MODEL(p,BOX),
+                      SYNCTEX_LINE_MODEL(p,BOX),
+                      synctex_ctxt.curh / synctex_ctxt.unit,
+                      synctex_ctxt.curv / synctex_ctxt.unit,
+                      SYNCTEX_WIDTH(p) / synctex_ctxt.unit,
+                      SYNCTEX_HEIGHT(p) / synctex_ctxt.unit,
+                      SYNCTEX_DEPTH(p) / synctex_ctxt.unit);
     synctex_ctxt.lastv = SYNCTEX_CURV;
 
     if (len > 0) {
@@ -1057,7 +1205,7 @@ synctex_record_node_hlist(int32_t p)
 static inline void
 synctex_record_node_tsilh(int32_t p __attribute__ ((unused)))
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, ")\n");
+    int len = synctex_write_op(')');
 
     if (len > 0) {
         synctex_ctxt.total_length += len;
@@ -1085,7 +1233,15 @@ static inline int
 synctex_record_postamble(void)
 {
     if (0 == synctex_record_anchor()) {
-        int len = ttstub_fprintf(synctex_ctxt.file, "Postamble:\n");
+        int len;
+
+        if (synctex_texpresso_extension) {
+            synctex_bin_begin('P');
+            synctex_bin_int(synctex_ctxt.count);
+            return synctex_bin_end() > 0 ? 0 : -1;
+        }
+
+        len = ttstub_fprintf(synctex_ctxt.file, "Postamble:\n");
         if (len > 0) {
             synctex_ctxt.total_length += len;
             if (!synctex_record_count() && !synctex_record_anchor()) {
@@ -1105,11 +1261,11 @@ synctex_record_postamble(void)
 static inline void
 synctex_record_node_glue(int32_t p)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "g%i,%i:%i,%i\n",
+    int len = synctex_write_node('g', 0,
                       SYNCTEX_TAG_MODEL(p,GLUE),
                       SYNCTEX_LINE_MODEL(p,GLUE),
                       synctex_ctxt.curh / synctex_ctxt.unit,
-                      synctex_ctxt.curv / synctex_ctxt.unit);
+                      synctex_ctxt.curv / synctex_ctxt.unit, 0, 0, 0);
     synctex_ctxt.lastv = SYNCTEX_CURV;
 
     if (len > 0) {
@@ -1123,12 +1279,12 @@ synctex_record_node_glue(int32_t p)
 static inline void
 synctex_record_node_kern(int32_t p)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "k%i,%i:%i,%i:%i\n",
+    int len = synctex_write_node('k', 1,
                       SYNCTEX_TAG_MODEL(p,GLUE),
                       SYNCTEX_LINE_MODEL(p,GLUE),
                       synctex_ctxt.curh / synctex_ctxt.unit,
                       synctex_ctxt.curv / synctex_ctxt.unit,
-                      SYNCTEX_WIDTH(p) / synctex_ctxt.unit);
+                      SYNCTEX_WIDTH(p) / synctex_ctxt.unit, 0, 0);
     synctex_ctxt.lastv = SYNCTEX_CURV;
 
     if (len > 0) {
@@ -1142,7 +1298,7 @@ synctex_record_node_kern(int32_t p)
 static inline void
 synctex_record_node_rule(int32_t p)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "r%i,%i:%i,%i:%i,%i,%i\n",
+    int len = synctex_write_node('r', 3,
                       SYNCTEX_TAG_MODEL(p,RULE),
                       SYNCTEX_LINE_MODEL(p,RULE),
                       synctex_ctxt.curh / synctex_ctxt.unit,
@@ -1163,11 +1319,11 @@ synctex_record_node_rule(int32_t p)
 static void
 synctex_record_node_math(int32_t p)
 {
-    int len = ttstub_fprintf(synctex_ctxt.file, "$%i,%i:%i,%i\n",
+    int len = synctex_write_node('$', 0,
                       SYNCTEX_TAG_MODEL(p,MATH),
                       SYNCTEX_LINE_MODEL(p,MATH),
                       synctex_ctxt.curh / synctex_ctxt.unit,
-                      synctex_ctxt.curv / synctex_ctxt.unit);
+                      synctex_ctxt.curv / synctex_ctxt.unit, 0, 0, 0);
     synctex_ctxt.lastv = SYNCTEX_CURV;
 
     if (len > 0) {
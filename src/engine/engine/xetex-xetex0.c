@@ -13,6 +13,12 @@
 
 int xetex_tokens = 0;
 
+/* Check for driver requests (e.g. snapshots) every 8192 tokens */
+#define DRIVER_POLL_MASK 0x1FFF
+
+/* Sample the profiler (if enabled) every 1024 tokens */
+#define PROFILE_SAMPLE_MASK 0x3FF
+
 static void
 int_error(int32_t n)
 {
@@ -3693,6 +3699,29 @@ void not_native_font_error(int32_t cmd, int32_t c, int32_t f)
 /*:1434*/
 
 
+/* Hash of the control sequence name in buffer[j..j+l-1]: FNV-1a over the
+ * scalar values, followed by a final avalanche so that the low bits used to
+ * index hash_heads depend on every character. */
+
+static uint32_t
+cs_hash(int32_t j, int32_t l)
+{
+    uint32_t h = 2166136261U;
+
+    for (int32_t k = j; k < j + l; k++) {
+        h ^= (uint32_t) buffer[k];
+        h *= 16777619U;
+    }
+
+    h ^= h >> 16;
+    h *= 0x7feb352dU;
+    h ^= h >> 15;
+    h *= 0x846ca68bU;
+    h ^= h >> 16;
+    return h;
+}
+
+
 int32_t
 id_lookup(int32_t j, int32_t l)
 {
@@ -3701,16 +3730,13 @@ id_lookup(int32_t j, int32_t l)
     int32_t p;
     int32_t k;
     int32_t ll;
+    int32_t last;
 
-    h = 0;
-
-    for (k = j; k <= j + l - 1; k++) {
-        h = h + h + buffer[k];
-        while (h >= HASH_PRIME)
-            h = h - 8501;
-    }
-
-    p = h + HASH_BASE;
+    /* hash_heads[h] is the first control sequence of bucket h, the others
+     * are chained through hash[p].s0. */
+    h = cs_hash(j, l) & ((1 << hash_bits) - 1);
+    p = hash_heads[h];
+    last = 0;
     ll = l;
 
     for (d = 0; d <= l - 1; d++) {
@@ -3718,7 +3744,7 @@ id_lookup(int32_t j, int32_t l)
             ll++;
     }
 
-    while (true) {
+    while (p != 0) {
         if (hash[p].s1 > 0) {
             if (length(hash[p].s1) == ll) {
                 if (str_eq_buf(hash[p].s1, j))
@@ -3726,59 +3752,63 @@ id_lookup(int32_t j, int32_t l)
             }
         }
 
-        if (hash[p].s0 == 0) {
-            if (no_new_control_sequence) {
-                p = UNDEFINED_CONTROL_SEQUENCE;
-            } else { /*269:*/
-                if (hash[p].s1 > 0) {
-                    if (hash_high < hash_extra) {
-                        hash_high++;
-                        hash[p].s0 = hash_high + EQTB_SIZE;
-                        p = hash_high + EQTB_SIZE;
-                    } else {
-                        do {
-                            if (hash_used == HASH_BASE)
-                                overflow("hash size", HASH_SIZE + hash_extra);
-                            hash_used--;
-                        } while (hash[hash_used].s1 != 0);
+        last = p;
+        p = hash[p].s0;
+    }
 
-                        hash[p].s0 = hash_used;
-                        p = hash_used;
-                    }
-                }
+    if (no_new_control_sequence) {
+        p = UNDEFINED_CONTROL_SEQUENCE;
+        goto found;
+    }
+
+    /* Names are allocated downward from hash_used first, so that the region
+     * above hash_used stays dense, then in the extra region. */
+    if (hash_used > HASH_BASE) {
+        do {
+            hash_used--;
+        } while (hash[hash_used].s1 != 0 && hash_used > HASH_BASE);
+    }
 
-                if (pool_ptr + ll > pool_size)
-                    overflow("pool size", pool_size - init_pool_ptr);
+    if (hash[hash_used].s1 == 0) {
+        p = hash_used;
+    } else if (hash_high < hash_extra) {
+        hash_high++;
+        p = hash_high + EQTB_SIZE;
+    } else {
+        overflow("hash size", HASH_SIZE + hash_extra);
+    }
 
-                d = cur_length();
+    hash[p].s0 = 0;
+    if (last != 0)
+        hash[last].s0 = p;
+    else
+        hash_heads[h] = p;
 
-                while (pool_ptr > str_start[str_ptr - TOO_BIG_CHAR]) {
-                    pool_ptr--;
-                    str_pool[pool_ptr + l] = str_pool[pool_ptr];
-                }
+    if (pool_ptr + ll > pool_size)
+        overflow("pool size", pool_size - init_pool_ptr);
 
-                for (k = j; k <= j + l - 1; k++) {
-                    if (buffer[k] < 65536L) {
-                        str_pool[pool_ptr] = buffer[k];
-                        pool_ptr++;
-                    } else {
-                        str_pool[pool_ptr] = 0xD800 + (buffer[k] - 65536L) / 1024;
-                        pool_ptr++;
-                        str_pool[pool_ptr] = 0xDC00 + (buffer[k] - 65536L) % 1024;
-                        pool_ptr++;
-                    }
-                }
+    d = cur_length();
 
-                hash[p].s1 = make_string();
-                pool_ptr += d;
-            }
-            goto found;
+    while (pool_ptr > str_start[str_ptr - TOO_BIG_CHAR]) {
+        pool_ptr--;
+        str_pool[pool_ptr + l] = str_pool[pool_ptr];
+    }
 
+    for (k = j; k <= j + l - 1; k++) {
+        if (buffer[k] < 65536L) {
+            str_pool[pool_ptr] = buffer[k];
+            pool_ptr++;
+        } else {
+            str_pool[pool_ptr] = 0xD800 + (buffer[k] - 65536L) / 1024;
+            pool_ptr++;
+            str_pool[pool_ptr] = 0xDC00 + (buffer[k] - 65536L) % 1024;
+            pool_ptr++;
         }
-
-        p = hash[p].s0;
     }
 
+    hash[p].s1 = make_string();
+    pool_ptr += d;
+
 found:
     return p;
 }
@@ -5169,6 +5199,10 @@ get_next(void)
 restart:
     cur_cs = 0;
     xetex_tokens++;
+    if ((xetex_tokens & DRIVER_POLL_MASK) == 0)
+        ttstub_poll_driver();
+    if (profile_enabled && (xetex_tokens & PROFILE_SAMPLE_MASK) == 0)
+        profile_sample();
 
     if (cur_input.state != TOKEN_LIST) { /*355:*/
     texswitch:
@@ -12442,7 +12476,7 @@ int32_t hpack(int32_t p, scaled_t w, small_number m)
                 if (last_badness > INTPAR(hbadness)) {
                     print_ln();
 
-                    diagnostic_begin_capture_warning_here();
+                    diagnostic_begin_capture_badbox_here();
 
                     if (last_badness > 100)
                         print_nl_cstr("Underfull");
@@ -12487,7 +12521,7 @@ int32_t hpack(int32_t p, scaled_t w, small_number m)
                 }
                 print_ln();
 
-                diagnostic_begin_capture_warning_here();
+                diagnostic_begin_capture_badbox_here();
                 print_nl_cstr("Overfull \\hbox (");
                 print_scaled(-(int32_t) x - total_shrink[NORMAL]);
                 print_cstr("pt too wide");
@@ -12500,7 +12534,7 @@ int32_t hpack(int32_t p, scaled_t w, small_number m)
                 if (last_badness > INTPAR(hbadness)) {
                     print_ln();
 
-                    diagnostic_begin_capture_warning_here();
+                    diagnostic_begin_capture_badbox_here();
                     print_nl_cstr("Tight \\hbox (badness ");
                     print_int(last_badness);
                     goto common_ending;
@@ -12713,7 +12747,7 @@ int32_t vpackage(int32_t p, scaled_t h, small_number m, scaled_t l)
                 if (last_badness > INTPAR(vbadness)) {
                     print_ln();
 
-                    diagnostic_begin_capture_warning_here();
+                    diagnostic_begin_capture_badbox_here();
                     if (last_badness > 100)
                         print_nl_cstr("Underfull");
                     else
@@ -12750,7 +12784,7 @@ int32_t vpackage(int32_t p, scaled_t h, small_number m, scaled_t l)
                 || (INTPAR(vbadness) < 100)) {
                 print_ln();
 
-                diagnostic_begin_capture_warning_here();
+                diagnostic_begin_capture_badbox_here();
                 print_nl_cstr("Overfull \\vbox (");
                 print_scaled(-(int32_t) x - total_shrink[NORMAL]);
                 print_cstr("pt too high");
@@ -12763,7 +12797,7 @@ int32_t vpackage(int32_t p, scaled_t h, small_number m, scaled_t l)
                 if (last_badness > INTPAR(vbadness)) {
                     print_ln();
 
-                    diagnostic_begin_capture_warning_here();
+                    diagnostic_begin_capture_badbox_here();
                     print_nl_cstr("Tight \\vbox (badness ");
                     print_int(last_badness);
                     goto common_ending;
@@ -387,6 +387,8 @@ extern int32_t first;
 extern int32_t last;
 extern int32_t max_buf_stack;
 extern bool in_initex_mode;
+extern bool native_format;
+bool format_header_current(const unsigned char *header, size_t len);
 extern int32_t error_line;
 extern int32_t half_error_line;
 extern int32_t max_print_line;
@@ -478,6 +480,19 @@ extern int32_t hash_extra;
 extern int32_t hash_top;
 extern int32_t eqtb_top;
 extern int32_t hash_high;
+
+/* Number of buckets of the control sequence hash table, as a power of two.
+ * It is chosen when building a format and stored in it; the table has to be
+ * much larger than the 8501 buckets of HASH_PRIME for LaTeX3 and TikZ, that
+ * define more than 50000 control sequences. */
+#ifndef HASH_BITS
+#define HASH_BITS 17
+#endif
+#define inf_hash_bits 8
+#define sup_hash_bits 24
+
+extern int32_t hash_bits;
+extern int32_t *hash_heads;
 extern bool no_new_control_sequence;
 extern int32_t cs_count;
 extern b32x2 prim[PRIM_SIZE + 1];
@@ -941,6 +956,7 @@ void trie_pack(trie_pointer p);
 void trie_fix(trie_pointer p);
 void init_trie(void);
 void line_break(bool d);
+void linebreak_memo_init(void);
 bool eTeX_enabled(bool b, uint16_t j, int32_t k);
 void show_save_groups(void);
 int32_t prune_page_top(int32_t p, bool s);
@@ -1066,6 +1082,9 @@ void flush_math(void);
 // that we haven't yet wired up anything that uses it.
 ttbc_diagnostic_t *diagnostic_begin_capture_warning_here(void);
 
+// Same, for the over/underfull box warnings of hpack and vpack.
+ttbc_diagnostic_t *diagnostic_begin_capture_badbox_here(void);
+
 // A lower-level API to begin or end the capture of messages into the diagnostic
 // buffer. You can start capture by obtaining a diagnostic_t and passing it to
 // this function -- however, the other functions in this API generally do this
@@ -1120,6 +1139,12 @@ void print_ucs_code(UnicodeScalar n);
 void initialize_pagebuilder_variables(void);
 void build_page(void);
 
+/* xetex-profile */
+
+extern bool profile_enabled;
+void profile_sample(void);
+void profile_report(void);
+
 /* xetex-scaledmath */
 
 int32_t tex_round(double);
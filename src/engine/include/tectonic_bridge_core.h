@@ -225,6 +225,11 @@ PRINTF_FUNC(1,2) void ttstub_issue_error(const char *format, ...);
 
 void ttstub_diag_finish(ttbc_diagnostic_t *diag);
 
+/* Structured diagnostics: source location of a diagnostic, and warnings
+ * about over/underfull boxes that editors can tell apart from others. */
+void ttstub_diag_set_location(ttbc_diagnostic_t *diag, const char *file, int line);
+ttbc_diagnostic_t *ttstub_diag_begin_badbox(void);
+
 rust_output_handle_t ttstub_output_open(char const *path, int is_gz);
 rust_output_handle_t ttstub_output_open_format(char const *path, int is_gz);
 rust_output_handle_t ttstub_output_open_stdout(void);
@@ -239,6 +244,7 @@ rust_input_handle_t ttstub_input_open_primary(void);
 ssize_t ttstub_get_last_input_abspath(char *buffer, size_t len);
 size_t ttstub_input_get_size(rust_input_handle_t handle);
 time_t ttstub_input_get_mtime(rust_input_handle_t handle);
+int ttstub_input_get_fd(rust_input_handle_t handle);
 size_t ttstub_input_seek(rust_input_handle_t handle, ssize_t offset, int whence);
 ssize_t ttstub_input_read(rust_input_handle_t handle, char *data, size_t len);
 int ttstub_input_getc(rust_input_handle_t handle);
@@ -246,6 +252,8 @@ int ttstub_input_ungetc(rust_input_handle_t handle, int ch);
 int ttstub_input_close(rust_input_handle_t handle);
 int ttstub_pic_get_cached_bounds(const char *name, int type, int page, float bounds[4]);
 void ttstub_pic_set_cached_bounds(const char *name, int type, int page, const float bounds[4]);
+void ttstub_poll_driver(void);
+void ttstub_profile_report(const char *data, size_t len);
 
 int ttstub_get_file_md5(char const *path, char *digest);
 
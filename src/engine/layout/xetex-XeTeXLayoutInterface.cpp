@@ -75,28 +75,51 @@ struct XeTeXLayoutEngine_rec
 /* Glyph bounding box cache to speed up \XeTeXuseglyphmetrics mode */
 /*******************************************************************/
 #include <map>
+#include <vector>
 
-// key is combined value representing (font_id << 16) + glyph
+// Dense tables indexed by font then glyph, grown on demand: glyph ids are
+// small and the glyphs of a font are measured again and again, a lookup is
+// two array accesses rather than a walk in a tree shared by all fonts.
 // value is glyph bounding box in TeX points
-static std::map<uint32_t,GlyphBBox> sGlyphBoxes;
+struct CachedGlyphBBox {
+    GlyphBBox bbox;
+    bool valid;
+};
+
+static std::vector<std::vector<CachedGlyphBBox> > sGlyphBoxes;
+
+// Size of a dense table that can hold index, at least min entries
+static size_t
+denseTableSize(size_t index, size_t min)
+{
+    size_t size = min;
+    while (size <= index)
+        size *= 2;
+    return size;
+}
 
 int
 getCachedGlyphBBox(uint16_t fontID, uint16_t glyphID, GlyphBBox* bbox)
 {
-    uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    std::map<uint32_t,GlyphBBox>::const_iterator i = sGlyphBoxes.find(key);
-    if (i == sGlyphBoxes.end()) {
+    if (fontID >= sGlyphBoxes.size() || glyphID >= sGlyphBoxes[fontID].size())
         return 0;
-    }
-    *bbox = i->second;
+    const CachedGlyphBBox& cached = sGlyphBoxes[fontID][glyphID];
+    if (!cached.valid)
+        return 0;
+    *bbox = cached.bbox;
     return 1;
 }
 
 void
 cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox)
 {
-    uint32_t key = ((uint32_t)fontID << 16) + glyphID;
-    sGlyphBoxes[key] = *bbox;
+    if (fontID >= sGlyphBoxes.size())
+        sGlyphBoxes.resize(fontID + 1);
+    std::vector<CachedGlyphBBox>& boxes = sGlyphBoxes[fontID];
+    if (glyphID >= boxes.size())
+        boxes.resize(denseTableSize(glyphID, 256), CachedGlyphBBox());
+    boxes[glyphID].bbox = *bbox;
+    boxes[glyphID].valid = true;
 }
 
 /* The following code used to be in a file called "hz.cpp" and there's no
@@ -104,50 +127,74 @@ cacheGlyphBBox(uint16_t fontID, uint16_t glyphID, const GlyphBBox* bbox)
  * name so I wanted to get rid of it. The functions are invoked from the C
  * code. */
 
+// Protrusion codes are looked up for the first and last character of every
+// line. Codes are glyph ids for native fonts and characters of the BMP for
+// TFM fonts: they are stored in a dense table per font, a code of 0 meaning
+// that none was set. Codes outside the BMP are rare and go to a map.
+
+#define DENSE_CP_CODES 0x10000
+
 typedef std::pair<int, unsigned int> GlyphId;
 typedef std::map<GlyphId, int>  ProtrusionFactor;
-ProtrusionFactor leftProt, rightProt;
 
-void
-set_cp_code(int fontNum, unsigned int code, int side, int value)
-{
-    GlyphId id(fontNum, code);
+struct ProtrusionCodes {
+    std::vector<std::vector<int> > dense;
+    ProtrusionFactor sparse;
+};
+
+static ProtrusionCodes leftProt, rightProt;
 
+static ProtrusionCodes *
+cp_codes(int side)
+{
     switch (side) {
     case LEFT_SIDE:
-        leftProt[id] = value;
-        break;
+        return &leftProt;
     case RIGHT_SIDE:
-        rightProt[id] = value;
-        break;
+        return &rightProt;
     default:
         assert(0); // we should not reach here
+        return NULL;
     }
 }
 
+void
+set_cp_code(int fontNum, unsigned int code, int side, int value)
+{
+    ProtrusionCodes *codes = cp_codes(side);
+
+    if (fontNum < 0 || code >= DENSE_CP_CODES) {
+        codes->sparse[GlyphId(fontNum, code)] = value;
+        return;
+    }
+
+    if ((size_t) fontNum >= codes->dense.size())
+        codes->dense.resize(fontNum + 1);
+    std::vector<int>& font = codes->dense[fontNum];
+    if (code >= font.size())
+        font.resize(denseTableSize(code, 128), 0);
+    font[code] = value;
+}
+
 
 int
 get_cp_code(int fontNum, unsigned int code, int side)
 {
-    GlyphId id(fontNum, code);
-    ProtrusionFactor *container;
+    ProtrusionCodes *codes = cp_codes(side);
 
-    switch (side) {
-    case LEFT_SIDE:
-        container = &leftProt;
-        break;
-    case RIGHT_SIDE:
-        container = &rightProt;
-        break;
-    default:
-        assert(0); // we should not reach here
+    if (fontNum < 0 || code >= DENSE_CP_CODES) {
+        ProtrusionFactor::iterator it = codes->sparse.find(GlyphId(fontNum, code));
+        if (it == codes->sparse.end())
+            return 0;
+        return it->second;
     }
 
-    ProtrusionFactor::iterator it = container->find(id);
-    if (it == container->end())
+    if ((size_t) fontNum >= codes->dense.size())
         return 0;
-
-    return it->second;
+    const std::vector<int>& font = codes->dense[fontNum];
+    if (code >= font.size())
+        return 0;
+    return font[code];
 }
 
 
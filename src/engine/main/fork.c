@@ -94,9 +94,12 @@ pid_t texpresso_fork_with_channel(int fd, uint32_t time)
 
       // Ignore any flush message, the buffers have been flushed
       // anyway before starting the fork.
+      // Ignore snapshot requests too, we are a snapshot.
     } while (recvd == 4 &&
-             answer[0] == 'F' && answer[1] == 'L' &&
-             answer[2] == 'S' && answer[3] == 'H');
+             ((answer[0] == 'F' && answer[1] == 'L' &&
+               answer[2] == 'S' && answer[3] == 'H') ||
+              (answer[0] == 'S' && answer[1] == 'N' &&
+               answer[2] == 'A' && answer[3] == 'P')));
 
     PASSERT(recvd == 4 &&
             answer[0] == 'D' && answer[1] == 'O' &&
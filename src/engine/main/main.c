@@ -42,6 +42,14 @@ txp_client *texpresso = NULL;
 // Generate a new format file
 bool regenerate_format = 0;
 
+// The format to use is native-endian and page-aligned (see native_format in
+// xetex-ini.c), it is cached separately from the portable one.
+#define FORMAT_EXT (native_format ? ".nfmt" : ".fmt")
+
+// The format is generated in a temporary file then renamed: other processes
+// might have the previous one mapped in memory.
+#define FORMAT_TMP_EXT (native_format ? ".nfmt.tmp" : ".fmt.tmp")
+
 // A file in which dependencies are recorded (or NULL if not necessary)
 FILE *dependency_tape;
 
@@ -204,7 +212,7 @@ ttbc_input_handle_t *ttstub_input_open(const char *path,
 
   if (texpresso && format == TTBC_FILE_FORMAT_FORMAT)
   {
-    const char *cached = format_path(".fmt");
+    const char *cached = format_path(FORMAT_EXT);
     if (!cached)
       return NULL;
 
@@ -255,7 +263,7 @@ ttbc_input_handle_t *ttstub_input_open(const char *path,
 
   if (!f && format == TTBC_FILE_FORMAT_FORMAT)
   {
-    const char *cached = format_path(".fmt");
+    const char *cached = format_path(FORMAT_EXT);
     if (cached)
       f = fopen(cached, "rb");
   }
@@ -400,6 +408,18 @@ int ttstub_input_getc(ttbc_input_handle_t *handle)
   return getc(input_as_file(handle));
 }
 
+int ttstub_input_get_fd(ttbc_input_handle_t *handle)
+{
+  if (texpresso)
+  {
+    txp_input *input = input_as_txp(handle);
+    if (input->id == -1)
+      return fileno(input->file);
+    return -1;
+  }
+  return fileno(input_as_file(handle));
+}
+
 time_t ttstub_input_get_mtime(ttbc_input_handle_t *handle)
 {
   struct stat file_stat;
@@ -661,7 +681,7 @@ ttbc_output_handle_t *ttstub_output_open_format(char const *path, int is_gz)
   log_proc(logging, "path:%s, is_gz:%d", path, is_gz);
   if (texpresso || !in_initex_mode)
     abort();
-  path = format_path(".fmt");
+  path = format_path(FORMAT_TMP_EXT);
   if (!path)
     return NULL;
   return file_as_output(fopen(path, "wb"));
@@ -715,6 +735,7 @@ enum
 {
   DIAG_NONE,
   DIAG_WARN,
+  DIAG_BADBOX,
   DIAG_ERROR,
 } diag_kind;
 
@@ -722,6 +743,21 @@ char diag_buf[1024];
 size_t diag_len = 0;
 intptr_t curr_diag = 0;
 
+// Source location of the current diagnostic, diag_file is empty if unknown
+char diag_file[1024];
+int diag_line = 0;
+
+static ttbc_diagnostic_t *diag_begin(int kind)
+{
+  if (diag_kind != DIAG_NONE)
+    do_abortf("diagnostic: unexpected nested diagnostics");
+  diag_kind = kind;
+  diag_len = 0;
+  diag_file[0] = '\0';
+  diag_line = 0;
+  return (void *)(++curr_diag);
+}
+
 static void diag_write(ttbc_diagnostic_t *diag, const char *buf, ssize_t len)
 {
   if ((intptr_t)diag != curr_diag)
@@ -739,34 +775,47 @@ void ttbc_diag_append(ttbc_diagnostic_t *diag, const char *text)
 
 ttbc_diagnostic_t *ttbc_diag_begin_error(void)
 {
-  if (diag_kind != DIAG_NONE)
-    do_abortf("diagnostic: unexpected nested diagnostics");
-  diag_kind = DIAG_ERROR;
-  diag_len = 0;
-  return (void *)(++curr_diag);
+  return diag_begin(DIAG_ERROR);
 }
 
 ttbc_diagnostic_t *ttbc_diag_begin_warning(void)
 {
-  if (diag_kind != DIAG_NONE)
-    do_abortf("Unexpected nested diagnostics");
-  diag_kind = DIAG_WARN;
-  diag_len = 0;
-  return (void *)(++curr_diag);
+  return diag_begin(DIAG_WARN);
+}
+
+ttbc_diagnostic_t *ttstub_diag_begin_badbox(void)
+{
+  return diag_begin(DIAG_BADBOX);
+}
+
+void ttstub_diag_set_location(ttbc_diagnostic_t *diag, const char *file, int line)
+{
+  if ((intptr_t)diag != curr_diag)
+    do_abortf("diagnostic: use after free");
+  snprintf(diag_file, sizeof(diag_file), "%s", file);
+  diag_line = line;
 }
 
 void ttstub_diag_finish(ttbc_diagnostic_t *diag)
 {
   if ((intptr_t)diag != curr_diag)
     do_abortf("diagnostic: use after free");
+  enum txp_diag_kind kind;
   switch (diag_kind)
   {
     case DIAG_WARN:
       fprintf(stderr, "Warning: ");
+      kind = TXP_DIAG_WARNING;
+      break;
+
+    case DIAG_BADBOX:
+      fprintf(stderr, "Warning: ");
+      kind = TXP_DIAG_BADBOX;
       break;
 
     case DIAG_ERROR:
       fprintf(stderr, "Error: ");
+      kind = TXP_DIAG_ERROR;
       break;
 
     default:
@@ -774,7 +823,12 @@ void ttstub_diag_finish(ttbc_diagnostic_t *diag)
   }
   diag_kind = DIAG_NONE;
 
+  if (diag_file[0])
+    fprintf(stderr, "%s:%d: ", diag_file, diag_line);
   fprintf(stderr, "%.*s\n", (int)diag_len, diag_buf);
+
+  if (texpresso)
+    txp_diag(texpresso, kind, diag_file, diag_line, diag_buf, diag_len);
 }
 
 static void diag_vprintf(ttbc_diagnostic_t *diag,
@@ -832,6 +886,25 @@ void ttstub_pic_set_cached_bounds(const char *name, int type, int page, const fl
     txp_spic(texpresso, name, type, page, bounds);
 }
 
+// Called regularly while TeX is computing: the driver might have requested a
+// snapshot (e.g. before an edit, to avoid killing a busy worker)
+
+void ttstub_poll_driver(void)
+{
+  if (texpresso)
+    txp_poll(texpresso);
+}
+
+// Aggregates of the macro profiler (-profile), sent at the end of the run
+
+void ttstub_profile_report(const char *data, size_t len)
+{
+  if (texpresso)
+    txp_prof(texpresso, data, len);
+  else
+    fwrite(data, 1, len, stderr);
+}
+
 // Entry point
 
 static void usage(char *argv0)
@@ -839,7 +912,7 @@ static void usage(char *argv0)
   fprintf(
       stderr,
       "Usage: %s [-texlive] [-tectonic] [-texpresso] [-regenerate-format] "
-      "<path.tex>\n"
+      "[-profile] [-native-format] <path.tex>\n"
       "Run XeTeX engine on <path.tex> using packages from a TeX distribution.\n"
       "\n"
       "Options:\n"
@@ -847,6 +920,9 @@ static void usage(char *argv0)
       "  -tectonic    Use Tectonic packages (need tectonic command)\n"
       "  -texpresso   Internal (route I/O through TeXpresso)\n"
       "  -regenerate-format  Force generation of a fresh format file\n"
+      "  -profile     Report time spent per macro and per input line\n"
+      "  -native-format  Use a native-endian format, mapped in memory\n"
+      "               (also enabled by setting TEXPRESSO_NATIVE_FORMAT)\n"
       "Default: try TeXlive first, then Tectonic, then fails\n",
       argv0);
 }
@@ -871,8 +947,18 @@ static bool validate_format(void)
 
   const char *path;
 
-  path = format_path(".fmt");
-  if (!path || access(path, R_OK) != 0)
+  path = format_path(FORMAT_EXT);
+  if (!path)
+    return 0;
+
+  // A format written by an older engine has to be regenerated
+  FILE *fmt = fopen(path, "rb");
+  if (!fmt)
+    return 0;
+  unsigned char header[12];
+  size_t len = fread(header, 1, sizeof(header), fmt);
+  fclose(fmt);
+  if (!format_header_current(header, len))
     return 0;
 
   path = format_path(".deps");
@@ -941,8 +1027,19 @@ static bool bootstrap_format(void)
       break;
   }
 
+  // format_path returns a static buffer
+  char tmp[PATH_MAX + 1];
+  strcpy(tmp, format_path(FORMAT_TMP_EXT));
   if (result != HISTORY_SPOTLESS)
-    unlink(format_path(".fmt"));
+  {
+    unlink(tmp);
+    unlink(format_path(FORMAT_EXT));
+  }
+  else if (rename(tmp, format_path(FORMAT_EXT)) != 0)
+  {
+    perror("rename format");
+    return 0;
+  }
 
   return (result == HISTORY_SPOTLESS);
 }
@@ -964,6 +1061,10 @@ int main(int argc, char **argv)
         use_texpresso = 1;
       else if (strcmp(argv[i], "-regenerate-format") == 0)
         regenerate_format = 1;
+      else if (strcmp(argv[i], "-profile") == 0)
+        profile_enabled = 1;
+      else if (strcmp(argv[i], "-native-format") == 0)
+        native_format = 1;
       else if (strcmp(argv[i], "--") == 0)
         dashdash = 1;
       else
@@ -1035,6 +1136,11 @@ int main(int argc, char **argv)
     fprintf(stderr, "Using Tectonic.\n");
 
   // Generate format if necessary
+  // The driver launches the engine, let it opt in through the environment
+  const char *native_env = getenv("TEXPRESSO_NATIVE_FORMAT");
+  if (native_env && *native_env && strcmp(native_env, "0") != 0)
+    native_format = 1;
+
   format_name = "xelatex.ini";
   if (!validate_format() && !bootstrap_format())
   {
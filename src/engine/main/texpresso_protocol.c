@@ -1,11 +1,26 @@
 #include "texpresso_protocol.h"
 #include <string.h>
+#include <poll.h>
 
 #define BUF_SIZE 4096
 
+// Number of bytes received from the server that stdio has buffered but not
+// returned yet. poll() does not see them: txp_poll has to check first.
+// Where the FILE structure is opaque, the input stream is unbuffered instead.
+#if defined(__GLIBC__)
+#define BUFFERED_INPUT(f) ((f)->_IO_read_end - (f)->_IO_read_ptr)
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__OpenBSD__) || defined(__DragonFly__)
+#define BUFFERED_INPUT(f) ((f)->_r)
+#endif
+
 struct txp_client
 {
-  FILE *file;
+  // Queries are written to file, answers are read from in: both streams are
+  // on the same descriptor. A stream opened for both cannot be written to
+  // while it has buffered unread input, and asks of the server (FLSH, SNAP)
+  // can be received with an answer.
+  FILE *file, *in;
   uint32_t generation;
   uint32_t seen_pos;
   txp_file_id seen_file;
@@ -35,6 +50,9 @@ enum tag
   T_SPIC = FOURCC('S', 'P', 'I', 'C'),
   T_APND = FOURCC('A', 'P', 'N', 'D'),
   T_MTIM = FOURCC('M', 'T', 'I', 'M'),
+  T_SNAP = FOURCC('S', 'N', 'A', 'P'),
+  T_PROF = FOURCC('P', 'R', 'O', 'F'),
+  T_DIAG = FOURCC('D', 'I', 'A', 'G'),
 };
 
 _Noreturn
@@ -58,12 +76,19 @@ static void read_exact(FILE *file, void *data, int len)
 
 txp_client *txp_connect(FILE *file)
 {
+  FILE *in = fdopen(fileno(file), "r");
+  if (in == NULL)
+    ppanic("Cannot open input stream");
+#ifndef BUFFERED_INPUT
+  setvbuf(in, NULL, _IONBF, 0);
+#endif
+
   write_or_panic(file, "TEXPRESSOC01", 12);
   if (fflush(file) != 0)
     ppanic("Cannot flush");
 
   char buf[12];
-  read_exact(file, buf, 12);
+  read_exact(in, buf, 12);
   if (memcmp (buf, "TEXPRESSOS01", 12) != 0)
     ppanic("Invalid handshake");
   fprintf(stderr, "texpresso: handshake success\n");
@@ -73,6 +98,7 @@ txp_client *txp_connect(FILE *file)
     ppanic("Cannot allocate client");
 
   client->file = file;
+  client->in = in;
   client->generation = 0;
   client->seen_pos = 0;
   client->append_len = 0;
@@ -103,7 +129,7 @@ static void txp_io_send_u32(txp_client *io, uint32_t i)
 static uint32_t txp_io_recv_u32(txp_client *io)
 {
   uint8_t buf[4];
-  read_exact(io->file, buf, 4);
+  read_exact(io->in, buf, 4);
   return (buf[0] | (buf[1] << 8) | (buf[2] << 16) | (buf[3] << 24));
 }
 
@@ -148,9 +174,12 @@ static enum tag txp_io_recv_tag(txp_client *io)
   while (1)
   {
     enum tag t = txp_io_recv_u32(io);
-    if (t != T_FLSH)
+    if (t == T_FLSH)
+      io->generation += 1;
+    // A snapshot request is satisfied by any query: the server now knows
+    // where the client stands
+    else if (t != T_SNAP)
       return t;
-    io->generation += 1;
   }
 }
 
@@ -245,7 +274,7 @@ char *txp_open(txp_client *io,
         fprintf(stderr, "Cannot allocate filename (length: %d)\n", size);
         exit(1);
       }
-      read_exact(io->file, buf, size);
+      read_exact(io->in, buf, size);
       buf[size] = 0;
       return buf;
     }
@@ -277,7 +306,7 @@ size_t txp_read(txp_client *io,
         uint32_t size = txp_io_recv_u32(io);
         if (size > len)
           exit(1);
-        read_exact(io->file, buf, size);
+        read_exact(io->in, buf, size);
         return size;
       }
       default:
@@ -397,6 +426,57 @@ void txp_spic(txp_client *io,
   txp_io_check_done(io);
 }
 
+void txp_prof(txp_client *io, const void *buf, size_t len)
+{
+  txp_io_send_tag(io, T_PROF);
+  txp_io_send_u32(io, len);
+  write_or_panic(io->file, buf, len);
+  txp_io_check_done(io);
+}
+
+void txp_diag(txp_client *io, enum txp_diag_kind kind, const char *file,
+              int32_t line, const char *msg, size_t len)
+{
+  txp_io_send_tag(io, T_DIAG);
+  txp_io_send_u32(io, kind);
+  txp_io_send_u32(io, line);
+  txp_io_send_str(io, file);
+  txp_io_send_u32(io, len);
+  write_or_panic(io->file, msg, len);
+  txp_io_check_done(io);
+}
+
+// Check for messages sent by the server while the client was computing.
+// Only asks (FLSH, SNAP) can be pending: no query is outstanding.
+static bool txp_io_pending(txp_client *io)
+{
+#ifdef BUFFERED_INPUT
+  if (BUFFERED_INPUT(io->in) > 0)
+    return 1;
+#endif
+  struct pollfd pfd = { .fd = fileno(io->in), .events = POLLIN };
+  return (poll(&pfd, 1, 0) == 1);
+}
+
+void txp_poll(txp_client *io)
+{
+  bool snapshot = 0;
+
+  while (txp_io_pending(io))
+  {
+    enum tag t = txp_io_recv_u32(io);
+    if (t == T_FLSH)
+      io->generation += 1;
+    else if (t == T_SNAP)
+      snapshot = 1;
+    else
+      panic_tag(t);
+  }
+
+  if (snapshot)
+    txp_fork(io);
+}
+
 // Get the current generation of the client
 uint32_t txp_generation(txp_client *client)
 {
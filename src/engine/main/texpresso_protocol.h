@@ -46,6 +46,14 @@ enum txp_open_mode
   TXP_WRITE
 };
 
+// Kind of diagnostics
+enum txp_diag_kind
+{
+  TXP_DIAG_ERROR   = FOURCC('E','R','R', 0 ),
+  TXP_DIAG_WARNING = FOURCC('W','A','R','N'),
+  TXP_DIAG_BADBOX  = FOURCC('B','O','X', 0 ),
+};
+
 extern pid_t texpresso_fork_with_channel(int fd, uint32_t time);
 
 // File descriptors and client identifiers
@@ -90,9 +98,19 @@ bool txp_gpic(txp_client *client, const char *path, int typ, int page, float *bo
 // Cache bounds of graphic object (spic)
 void txp_spic(txp_client *client, const char *path, int typ, int page, const float *bounds);
 
+// Send a profiling report
+void txp_prof(txp_client *client, const void *buf, size_t len);
+
+// Report a diagnostic (error or warning) with its source location
+void txp_diag(txp_client *client, enum txp_diag_kind kind, const char *file,
+              int32_t line, const char *msg, size_t len);
+
 // Fork the client
 pid_t txp_fork(txp_client *client);
 
+// Process pending server messages, forking if a snapshot was requested
+void txp_poll(txp_client *client);
+
 // File mtime
 uint32_t txp_mtime(txp_client *client, txp_file_id file);
 
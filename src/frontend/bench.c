@@ -0,0 +1,504 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* texpresso-bench: replay a recorded editor session and measure latencies.
+ *
+ * Commands are read from stdin (all of them, before starting), then replayed
+ * one at a time. Each edit is applied only once the engine has caught up with
+ * the previous one: measurements do not depend on the typing speed of the
+ * original session.
+ *
+ * For each edit, three latencies are measured from the beginning of the
+ * change transaction:
+ * - rollback: until the engine restarted from a snapshot,
+ * - page-ready: until the displayed page has been produced again,
+ * - raster-ready: until this page has been rasterized.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <mupdf/fitz.h>
+#include "mydvi.h"
+#include "providers.h"
+#include "engine.h"
+#include "editor.h"
+#include "editing.h"
+#include "startup.h"
+#include "vstack.h"
+#include "prot_parser.h"
+#include "trace.h"
+
+#ifdef __APPLE__
+#include <sys/syslimits.h>
+#else
+#include <linux/limits.h>
+#endif
+
+/* Measurements */
+
+typedef struct {
+  int64_t *data;
+  int len, cap;
+} samples_t;
+
+static void samples_add(samples_t *s, int64_t value)
+{
+  if (s->len == s->cap)
+  {
+    s->cap = s->cap == 0 ? 64 : s->cap * 2;
+    s->data = realloc(s->data, sizeof(int64_t) * s->cap);
+    if (!s->data)
+      abort();
+  }
+  s->data[s->len++] = value;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile, samples must be sorted
+static int64_t samples_percentile(samples_t *s, int p)
+{
+  if (s->len == 0)
+    return 0;
+  int rank = (p * s->len + 99) / 100;
+  if (rank < 1)
+    rank = 1;
+  return s->data[rank - 1];
+}
+
+static int64_t now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Replay */
+
+typedef struct {
+  fz_context *ctx;
+  txp_engine *eng;
+  const char *doc_path;
+  int page;
+  float zoom;
+  bool paused;
+
+  int edits, noop_edits;
+  samples_t rollback, page_ready, raster_ready, forks;
+} bench_t;
+
+// Step the engine until the target page is available.
+// Return false if the page cannot be produced (document ended before, or the
+// engine waits for a file that the session never provides).
+static bool advance_to_page(bench_t *b)
+{
+  while (send(page_count, b->eng) <= b->page)
+  {
+    if (send(get_status, b->eng) != DOC_RUNNING)
+    {
+      int page_count = send(page_count, b->eng);
+      if (page_count == 0)
+        return 0;
+      b->page = page_count - 1;
+      return 1;
+    }
+
+    if (send(step, b->eng, b->ctx, false))
+      continue;
+
+    int fd = send(wait_fd, b->eng);
+    if (fd == -1)
+      return 0;
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR);
+  }
+  return 1;
+}
+
+static void rasterize_page(bench_t *b)
+{
+  fz_context *ctx = b->ctx;
+  fz_display_list *dl = send(render_page, b->eng, ctx, b->page);
+  fz_matrix ctm = fz_scale(b->zoom, b->zoom);
+  fz_irect bbox =
+    fz_round_rect(fz_transform_rect(fz_bound_display_list(ctx, dl), ctm));
+  fz_pixmap *pix =
+    fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 0);
+  fz_clear_pixmap_with_value(ctx, pix, 255);
+  fz_device *dev = fz_new_draw_device(ctx, ctm, pix);
+  fz_run_display_list(ctx, dl, dev, fz_identity, fz_infinite_rect, NULL);
+  fz_close_device(ctx, dev);
+  fz_drop_device(ctx, dev);
+  fz_drop_pixmap(ctx, pix);
+  fz_drop_display_list(ctx, dl);
+}
+
+static void apply_edit(bench_t *b, struct editor_command *cmd)
+{
+  switch (cmd->tag)
+  {
+    case EDIT_OPEN:
+      if (cmd->open.base64)
+        editing_open_base64(b->ctx, b->eng, b->doc_path, cmd->open.path,
+                            cmd->open.data, cmd->open.length);
+      else
+        editing_open(b->ctx, b->eng, b->doc_path, cmd->open.path,
+                     cmd->open.data, cmd->open.length);
+      break;
+    case EDIT_CLOSE:
+      editing_close(b->ctx, b->eng, b->doc_path, cmd->close.path);
+      break;
+    case EDIT_CHANGE:
+      editing_change(b->ctx, b->eng, b->doc_path, &cmd->change);
+      break;
+    case EDIT_RESCAN:
+      send(detect_changes, b->eng, b->ctx);
+      break;
+    default:
+      break;
+  }
+}
+
+static void replay_edit(bench_t *b, struct editor_command *cmd)
+{
+  txp_engine_stats before, after;
+  send(stats, b->eng, &before);
+
+  b->edits += 1;
+  int64_t start = now_us();
+  send(begin_changes, b->eng, b->ctx);
+  apply_edit(b, cmd);
+  bool changed = send(end_changes, b->eng, b->ctx);
+  if (!changed)
+  {
+    b->noop_edits += 1;
+    return;
+  }
+  if (!b->paused)
+    send(step, b->eng, b->ctx, true);
+  samples_add(&b->rollback, now_us() - start);
+
+  if (b->paused || !advance_to_page(b))
+    return;
+  samples_add(&b->page_ready, now_us() - start);
+
+  rasterize_page(b);
+  samples_add(&b->raster_ready, now_us() - start);
+
+  send(stats, b->eng, &after);
+  samples_add(&b->forks, after.forks - before.forks);
+}
+
+static void replay_command(bench_t *b, vstack *stack, val command)
+{
+  struct editor_command cmd;
+  if (!editor_parse(b->ctx, stack, command, &cmd))
+    return;
+
+  switch (cmd.tag)
+  {
+    case EDIT_OPEN:
+    case EDIT_CLOSE:
+    case EDIT_CHANGE:
+    case EDIT_RESCAN:
+      replay_edit(b, &cmd);
+      break;
+
+    case EDIT_REGISTER:
+      editing_register(b->ctx, b->eng, b->doc_path, cmd.reg.path);
+      break;
+
+    case EDIT_PREVIOUS_PAGE:
+      if (b->page > 0)
+        b->page -= 1;
+      break;
+
+    case EDIT_NEXT_PAGE:
+      b->page += 1;
+      break;
+
+    case EDIT_PAUSE:
+      b->paused = true;
+      break;
+
+    case EDIT_RESUME:
+      b->paused = false;
+      send(step, b->eng, b->ctx, true);
+      break;
+
+    default:
+      // Window management and display settings don't affect the engine
+      break;
+  }
+}
+
+/* Report */
+
+static void report_line(FILE *f, const char *name, samples_t *s)
+{
+  qsort(s->data, s->len, sizeof(int64_t), compare_int64);
+  fprintf(f, "%-14s %6d %10.2f %10.2f %10.2f %10.2f\n", name, s->len,
+          samples_percentile(s, 50) / 1000.0,
+          samples_percentile(s, 95) / 1000.0,
+          samples_percentile(s, 99) / 1000.0,
+          s->len ? s->data[s->len - 1] / 1000.0 : 0.0);
+}
+
+static double maxrss_mib(int who)
+{
+  struct rusage ru;
+  if (getrusage(who, &ru) != 0)
+    return 0;
+#ifdef __APPLE__
+  return ru.ru_maxrss / (1024.0 * 1024.0);
+#else
+  return ru.ru_maxrss / 1024.0;
+#endif
+}
+
+/* Entry point */
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: texpresso-bench [-I path]* [-json] [-texlive] [-tectonic] "
+          "[-page n] [-zoom z] [-trace file] root_file.tex < session\n");
+  fprintf(stderr,
+          " Replay the editor commands of session (as sent to texpresso "
+          "stdin)\n and report latency percentiles (in milliseconds).\n");
+  fprintf(stderr,
+          " -I path    Add a path to included directories\n"
+          " -json      Session uses json rather than s-exp protocol\n"
+          " -texlive   Load TeX packages from TeXlive installation\n"
+          " -tectonic  Load TeX packages from tectonic installation\n"
+          " -page n    Page to wait for and rasterize after each edit "
+          "(default: 0)\n"
+          " -zoom z    Rasterization scale (default: 2)\n"
+          " -trace f   Export a Chrome trace of the replay to f\n");
+}
+
+static fz_buffer *read_stdin(fz_context *ctx)
+{
+  fz_buffer *buf = fz_new_buffer(ctx, 4096);
+  char chunk[4096];
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, chunk, sizeof(chunk))) != 0)
+  {
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("reading session");
+      exit(1);
+    }
+    fz_append_data(ctx, buf, chunk, n);
+  }
+  return buf;
+}
+
+int main(int argc, const char **argv)
+{
+  const char *doc_arg = NULL;
+  enum editor_protocol protocol = EDITOR_SEXP;
+  bool use_tectonic = 0, use_texlive = 0;
+  int page = 0;
+  float zoom = 2;
+  const char *trace_path = NULL;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    if (arg[0] != '-')
+    {
+      if (doc_arg)
+      {
+        usage();
+        exit(1);
+      }
+      doc_arg = arg;
+    }
+    else if (strcmp(arg, "-json") == 0)
+      protocol = EDITOR_JSON;
+    else if (strcmp(arg, "-texlive") == 0)
+      use_texlive = 1;
+    else if (strcmp(arg, "-tectonic") == 0)
+      use_tectonic = 1;
+    else if (i + 1 < argc && strcmp(arg, "-I") == 0)
+      i++;
+    else if (i + 1 < argc && strcmp(arg, "-page") == 0)
+      page = atoi(argv[++i]);
+    else if (i + 1 < argc && strcmp(arg, "-zoom") == 0)
+      zoom = atof(argv[++i]);
+    else if (i + 1 < argc && strcmp(arg, "-trace") == 0)
+      trace_path = argv[++i];
+    else
+    {
+      fprintf(stderr, "[error] Unknown option %s\n", arg);
+      usage();
+      exit(1);
+    }
+  }
+
+  if (doc_arg == NULL || (use_tectonic && use_texlive) || zoom <= 0)
+  {
+    usage();
+    exit(1);
+  }
+
+  char *inclusion_path = startup_inclusion_path(argc, argv);
+  use_texlive = startup_use_texlive(use_texlive, use_tectonic);
+
+  char exe_path[PATH_MAX], engine_path[PATH_MAX];
+  startup_find_engine(engine_path, startup_executable_path(exe_path, argv[0])
+                                     ? exe_path : NULL);
+
+  // The trace is exported after moving to the document directory
+  char trace_buf[PATH_MAX], cwd[PATH_MAX];
+  if (trace_path && trace_path[0] != '/' && getcwd(cwd, PATH_MAX))
+  {
+    snprintf(trace_buf, PATH_MAX, "%s/%s", cwd, trace_path);
+    trace_path = trace_buf;
+  }
+
+  char doc_path[PATH_MAX];
+  if (!realpath(doc_arg, doc_path))
+  {
+    perror("finding document path");
+    exit(1);
+  }
+  char *doc_name = strrchr(doc_path, '/');
+  *doc_name++ = '\0';
+  if (chdir(doc_path) == -1)
+  {
+    perror("chdir to document path");
+    exit(1);
+  }
+
+  // Editor messages are not interesting here, keep stdout for the report
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  if (!report || !freopen("/dev/null", "w", stdout))
+  {
+    perror("redirecting stdout");
+    exit(1);
+  }
+  editor_set_protocol(protocol);
+
+  fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+  fz_register_document_handlers(ctx);
+
+  fz_buffer *session = read_stdin(ctx);
+
+  dvi_resmanager *rm =
+    dvi_resmanager_new(ctx, use_texlive ? dvi_texlive_hooks(ctx, doc_path)
+                                        : dvi_tectonic_hooks(ctx, doc_path));
+  bench_t b = {0,};
+  b.ctx = ctx;
+  b.doc_path = doc_path;
+  b.page = page;
+  b.zoom = zoom;
+  b.eng = txp_create_tex_engine(ctx, engine_path, use_texlive, false,
+                                inclusion_path, doc_name, rm);
+  dvi_resmanager_drop(ctx, rm);
+
+  // Cold start
+  int64_t start = now_us();
+  send(step, b.eng, ctx, true);
+  bool cold_ready = advance_to_page(&b);
+  int64_t cold_page = now_us() - start;
+  if (cold_ready)
+    rasterize_page(&b);
+  int64_t cold_raster = now_us() - start;
+
+  // Replay session
+  vstack *stack = vstack_new(ctx);
+  prot_parser parser;
+  prot_initialize(&parser, protocol == EDITOR_JSON);
+
+  const char *ptr = (const char *)session->data,
+             *lim = (const char *)session->data + session->len;
+  fz_try(ctx)
+  {
+    while ((ptr = prot_parse(ctx, &parser, stack, ptr, lim)))
+    {
+      val cmds = vstack_get_values(ctx, stack);
+      int n_cmds = val_array_length(ctx, stack, cmds);
+      for (int i = 0; i < n_cmds; i++)
+        replay_command(&b, stack, val_array_get(ctx, stack, cmds, i));
+    }
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[fatal] invalid session: %s\n", fz_caught_message(ctx));
+    exit(1);
+  }
+
+  if (trace_path)
+    trace_export(trace_path);
+
+  txp_engine_stats stats;
+  send(stats, b.eng, &stats);
+  send(destroy, b.eng, ctx);
+  while (waitpid(-1, NULL, 0) > 0 || errno == EINTR);
+
+  fprintf(report, "texpresso-bench: %s, %d edits (%d without effect)\n",
+          doc_name, b.edits, b.noop_edits);
+  if (cold_ready)
+    fprintf(report, "cold start: page %d ready in %.2fms, rasterized in %.2fms\n",
+            b.page, cold_page / 1000.0, cold_raster / 1000.0);
+  else
+    fprintf(report, "cold start: page %d not produced\n", b.page);
+  fprintf(report, "%-14s %6s %10s %10s %10s %10s\n",
+          "(ms)", "count", "p50", "p95", "p99", "max");
+  report_line(report, "rollback", &b.rollback);
+  report_line(report, "page-ready", &b.page_ready);
+  report_line(report, "raster-ready", &b.raster_ready);
+  qsort(b.forks.data, b.forks.len, sizeof(int64_t), compare_int64);
+  fprintf(report, "forks per edit: p50 %d, max %d\n",
+          (int)samples_percentile(&b.forks, 50),
+          b.forks.len ? (int)b.forks.data[b.forks.len - 1] : 0);
+  fprintf(report, "processes: %d launched, %d forks, %d killed\n",
+          stats.launches, stats.forks, stats.kills);
+  fprintf(report, "peak RSS: driver %.1fMiB, largest worker %.1fMiB\n",
+          maxrss_mib(RUSAGE_SELF), maxrss_mib(RUSAGE_CHILDREN));
+  fclose(report);
+
+  vstack_free(ctx, stack);
+  fz_drop_buffer(ctx, session);
+  fz_drop_context(ctx);
+  free(inclusion_path);
+  return 0;
+}
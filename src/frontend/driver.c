@@ -24,9 +24,11 @@
 
 #include <unistd.h>
 #include <signal.h>
+#include <pthread.h>
 #include <mupdf/fitz.h>
 #include "logo.h"
 #include "driver.h"
+#include "startup.h"
 
 #ifdef __APPLE__
 #include <sys/syslimits.h>
@@ -40,12 +42,12 @@ Uint32 custom_event = 0;
 
 void schedule_event(enum custom_events ev)
 {
-  static char scheduled[EVENT_COUNT] = {0,};
+  // Events are scheduled from the main thread and the reactor thread
+  static SDL_atomic_t scheduled[EVENT_COUNT];
 
-  char *sched = scheduled + ev;
-  if (!*sched)
+  SDL_atomic_t *sched = scheduled + ev;
+  if (SDL_AtomicCAS(sched, 0, 1))
   {
-    *sched = 1;
     SDL_Event event;
     SDL_zero(event);
     event.type = custom_event;
@@ -56,6 +58,32 @@ void schedule_event(enum custom_events ev)
   }
 }
 
+/* Locking, so that the context can be cloned for worker threads (PDF export) */
+
+static pthread_mutex_t mupdf_locks[FZ_LOCK_MAX];
+
+static void lock_mutex(void *user, int lock)
+{
+  pthread_mutex_lock(&mupdf_locks[lock]);
+}
+
+static void unlock_mutex(void *user, int lock)
+{
+  pthread_mutex_unlock(&mupdf_locks[lock]);
+}
+
+static fz_context *new_locked_context(void)
+{
+  for (int i = 0; i < FZ_LOCK_MAX; i++)
+    pthread_mutex_init(&mupdf_locks[i], NULL);
+  fz_locks_context locks = {
+    .user = NULL,
+    .lock = lock_mutex,
+    .unlock = unlock_mutex,
+  };
+  return fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+}
+
 static void signal_usr1(int sig)
 {
   (void)sig;
@@ -84,29 +112,48 @@ static char *last_index(char *path, char needle)
   return result;
 }
 
-static bool get_executable_path(char path[PATH_MAX])
+static bool should_reload_binary(void)
 {
-#ifdef __APPLE__
-  uint32_t size = PATH_MAX;
-  char exe_path[PATH_MAX];
-  if (_NSGetExecutablePath(exe_path, &size) != 0)
-    return 0;
-#else
-  char *exe_path = "/proc/self/exe";
-#endif
-  return realpath(exe_path, path);
+  return 0;
 }
 
-static bool should_reload_binary(void)
+// Resolve the path of a document argument in `path` (a buffer of PATH_MAX
+// bytes), which is cut into the directory and the returned file name.
+static char *resolve_document(const char *arg, const char *work_dir,
+                              bool stream_mode, char *path)
 {
-  return 0;
+  if (!realpath(arg, path))
+  {
+    if (stream_mode)
+    {
+      // In stream mode, the file may not exist on disk yet.
+      // Absolute paths used as-is; relative paths resolved against cwd.
+      if (arg[0] == '/')
+        snprintf(path, PATH_MAX, "%s", arg);
+      else
+        snprintf(path, PATH_MAX, "%s/%s", work_dir, arg);
+    }
+    else
+    {
+      perror("finding document path");
+      abort();
+    }
+  }
+
+  char *name = last_index(path, '/');
+  if (path == name) abort();
+  name[-1] = '\x00';
+  return name;
 }
 
 static void usage(void)
 {
   fprintf(stderr,
           "Usage: texpresso [-I path]* [-json] [-lines] [-texlive] [-tectonic] "
-          "[-test-initialize] [-stream] root_file.tex\n");
+          "[-test-initialize] [-stream] [-binary] [-follow] root_file.tex [other_root.tex ...]\n");
+  fprintf(stderr,
+          " Several root documents of the same directory can be given: they\n"
+          "    share loaded files and resources, the first one is displayed\n");
   fprintf(stderr,
           " -I path    Add a path to included directories. \n"
           "    Files are looked up relative to document directory and all "
@@ -125,6 +172,10 @@ static void usage(void)
           " -test-initialize  Run a single cycle for test purposes\n");
   fprintf(stderr,
           " -stream   Skip filesystem lookups; files are pushed via editor commands\n");
+  fprintf(stderr,
+          " -binary   Accept open-bytes and change-bytes commands, followed by raw data\n");
+  fprintf(stderr,
+          " -follow   When displaying a DVI or XDV file, reload it as it is written\n");
 }
 
 int main(int argc, const char **argv)
@@ -141,7 +192,7 @@ int main(int argc, const char **argv)
 
   char exe_path[PATH_MAX];
 
-  if (!get_executable_path(exe_path) && !realpath(argv[0], exe_path))
+  if (!startup_executable_path(exe_path, argv[0]))
   {
     perror("finding executable path");
     abort();
@@ -149,14 +200,17 @@ int main(int argc, const char **argv)
   fprintf(stderr, "[info] executable path: %s\n", exe_path);
 
   const char *doc_arg = NULL;
+  const char *other_args[MAX_ROOTS - 1];
+  int other_count = 0;
   enum editor_protocol protocol = EDITOR_SEXP;
   bool line_output = 0;
   bool use_tectonic = 0;
   bool use_texlive = 0;
   bool initialize_only = 0;
   bool stream_mode = 0;
+  bool binary_input = 0;
+  bool follow = 0;
 
-  int inclusion_path_size = 1;
   for (int i = 1; i < argc; i++)
   {
     const char *arg = argv[i];
@@ -176,7 +230,6 @@ int main(int argc, const char **argv)
           usage();
           exit(1);
         }
-        inclusion_path_size += 1 + strlen(argv[i]);
       }
       else if (strcmp(arg, "-lines") == 0)
       {
@@ -198,6 +251,14 @@ int main(int argc, const char **argv)
       {
         stream_mode = 1;
       }
+      else if (strcmp(arg, "-binary") == 0)
+      {
+        binary_input = 1;
+      }
+      else if (strcmp(arg, "-follow") == 0)
+      {
+        follow = 1;
+      }
       else
       {
         fprintf(stderr, "[error] Unknown option %s\n", arg);
@@ -214,8 +275,14 @@ int main(int argc, const char **argv)
       continue;
     }
 
-    fprintf(stderr, "[error] Expecting a single document argument, got %s and %s\n",
-            doc_arg, arg);
+    if (other_count < MAX_ROOTS - 1)
+    {
+      other_args[other_count++] = arg;
+      continue;
+    }
+
+    fprintf(stderr, "[error] Expecting at most %d documents, got %s\n",
+            MAX_ROOTS, arg);
     usage();
     exit(1);
   }
@@ -233,54 +300,38 @@ int main(int argc, const char **argv)
     exit(1);
   }
 
-  char *inclusion_path = malloc(inclusion_path_size);
-  if (!inclusion_path) abort();
-
-  char *p = inclusion_path;
-  for (int i = 1; i < argc; i++)
-  {
-    if (argv[i][0] == '-' && argv[i][1] == 'I' && argv[i][2] == '\0')
-    {
-      i += 1;
-      p = stpcpy(p, argv[i]) + 1;
-    }
-  }
-  *p = '\0';
+  char *inclusion_path = startup_inclusion_path(argc, argv);
 
   // Move to TeX document directory
   char doc_path[PATH_MAX];
-  if (!realpath(doc_arg, doc_path))
+  char *doc_name = resolve_document(doc_arg, work_dir, stream_mode, doc_path);
+
+  fprintf(stderr, "[info] document path: %s\n", doc_path);
+  fprintf(stderr, "[info] document name: %s\n", doc_name);
+
+  const char *other_roots[MAX_ROOTS - 1];
+  for (int i = 0; i < other_count; i++)
   {
-    if (stream_mode)
+    char other_path[PATH_MAX];
+    char *other_name =
+      resolve_document(other_args[i], work_dir, stream_mode, other_path);
+    if (strcmp(other_path, doc_path) != 0)
     {
-      // In stream mode, the file may not exist on disk yet.
-      // Absolute paths used as-is; relative paths resolved against cwd.
-      if (doc_arg[0] == '/')
-        snprintf(doc_path, PATH_MAX, "%s", doc_arg);
-      else
-        snprintf(doc_path, PATH_MAX, "%s/%s", work_dir, doc_arg);
-    }
-    else
-    {
-      perror("finding document path");
-      abort();
+      fprintf(stderr, "[error] %s is not in the directory of %s\n",
+              other_args[i], doc_arg);
+      exit(1);
     }
+    other_roots[i] = strdup(other_name);
+    fprintf(stderr, "[info] other document: %s\n", other_roots[i]);
   }
 
-  char *doc_name = last_index(doc_path, '/');
-  if (doc_path == doc_name) abort();
-  doc_name[-1] = '\x00';
-
-  fprintf(stderr, "[info] document path: %s\n", doc_path);
-  fprintf(stderr, "[info] document name: %s\n", doc_name);
-
   if (chdir(doc_path) == -1)
   {
     perror("chdir to document path");
     abort();
   }
 
-  fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+  fz_context *ctx = new_locked_context();
   fz_register_document_handlers(ctx);
 
   bool init = 0;
@@ -339,14 +390,20 @@ int main(int argc, const char **argv)
       .should_reload_binary = &should_reload_binary,
 
       .line_output = line_output,
+      .binary_input = binary_input,
       .use_tectonic = use_tectonic,
       .use_texlive = use_texlive,
       .initialize_only = initialize_only,
       .stream_mode = stream_mode,
+      .follow = follow,
+      .other_root_count = other_count,
       // In stream mode, start paused: editor primes the VFS before (resume).
       .paused = stream_mode,
   };
 
+  for (int i = 0; i < other_count; i++)
+    pstate.other_roots[i] = other_roots[i];
+
   int exit_code = 0;
 
   if (initialize_only)
@@ -35,13 +35,18 @@ enum custom_events {
   RENDER_EVENT,
   RELOAD_EVENT,
   STDIN_EVENT,
+  WORKER_EVENT,
 
   EVENT_COUNT,
 };
 
+// Maximum number of root documents hosted by one driver
+#define MAX_ROOTS 8
+
 struct initial_state
 {
   int initialized;
+  int root;
   int page;
   int need_synctex;
   int zoom;
@@ -69,7 +74,12 @@ struct persistent_state {
 
   const char *exe_path, *doc_path, *doc_name, *inclusion_path;
 
-  bool line_output, use_tectonic, use_texlive, initialize_only, stream_mode;
+  // Other root documents, in the directory of the first one
+  const char *other_roots[MAX_ROOTS - 1];
+  int other_root_count;
+
+  bool line_output, binary_input, use_tectonic, use_texlive, initialize_only,
+       stream_mode, follow;
   bool paused;
 };
 
@@ -0,0 +1,448 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "editing.h"
+#include "base64.h"
+#include "utf_mapping.h"
+
+const char *editing_relative_path(const char *path, const char *dir, int *go_up)
+{
+  const char *rel_path = path, *dir_path = dir;
+
+  // Skip common parts
+  while (*rel_path && *rel_path == *dir_path)
+  {
+    if (*rel_path == '/')
+    {
+      while (*rel_path == '/') rel_path += 1;
+      while (*dir_path == '/') dir_path += 1;
+    }
+    else
+    {
+      rel_path += 1;
+      dir_path += 1;
+    }
+  }
+
+  // Go back to last directory separator
+  if (*rel_path && *dir_path)
+  {
+    rel_path -= 1;
+    dir_path -= 1;
+    while (path < rel_path && *rel_path != '/')
+    {
+      rel_path -= 1;
+      dir_path -= 1;
+    }
+    if (*rel_path == '/')
+    {
+      if (*dir_path != '/') abort();
+      rel_path += 1;
+      dir_path += 1;
+    }
+  }
+
+  // Count number of '../'
+  *go_up = 0;
+  if (*dir_path)
+  {
+    *go_up = 1;
+    while (*dir_path)
+    {
+      if (*dir_path == '/')
+      {
+        *go_up += 1;
+        while (*dir_path == '/')
+          dir_path += 1;
+      }
+      else
+        dir_path += 1;
+    }
+  }
+
+  while (*rel_path == '/')
+    rel_path += 1;
+
+  return rel_path;
+}
+
+static int find_diff(const fz_buffer *buf, const void *data, int size)
+{
+  const unsigned char *ptr = data;
+  int i, len = fz_mini(buf->len, size);
+  for (i = 0; i < len && buf->data[i] == ptr[i]; ++i);
+  fprintf(stderr, "i:%d len:%d size:%d\n", i, (int)buf->len, size);
+  return i;
+}
+
+char *editing_change(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                     const struct editor_change *op)
+{
+  int go_up = 0;
+  const char *path = editing_relative_path(op->path, doc_path, &go_up);
+  if (go_up > 0)
+  {
+    fprintf(stderr, "[command] change %s: file has a different root, skipping\n", path);
+    return NULL;
+  }
+
+  fileentry_t *e = send(find_file, eng, ctx, path);
+  if (!e)
+  {
+    fprintf(stderr, "[command] change %s: file not found, skipping\n", path);
+    return NULL;
+  }
+
+  fz_buffer *b = e->edit_data;
+  if (!b)
+  {
+    fprintf(stderr, "[command] change %s: file not opened, skipping\n", path);
+    return NULL;
+  }
+
+  int offset = op->span.offset, remove = op->span.remove, length = op->length;
+
+  if (op->base == BASE_LINE)
+  {
+    // Compute byte offsets from line offsets
+    int line = offset, count = remove;
+
+    offset = remove = 0;
+
+    uint8_t *p = b->data;
+    size_t len = b->len;
+
+    while (line > 0 && offset < len)
+    {
+      if (p[offset] == '\n')
+        line -= 1;
+      offset++;
+    }
+
+    if (line > 0)
+    {
+      fprintf(stderr, "[command] change line %s: invalid line number, skipping\n", path);
+      return NULL;
+    }
+
+    remove = offset;
+    while (count > 0 && remove < len)
+    {
+      if (p[remove] == '\n')
+        count -= 1;
+      remove++;
+    }
+
+    if (count > 1)
+    {
+      fprintf(stderr, "[command] change line %s: invalid line count, skipping\n", path);
+      return NULL;
+    }
+
+    remove -= offset;
+  }
+  else if (op->base == BASE_RANGE)
+  {
+    // Compute byte offsets from line offsets
+    int line = op->range.start_line;
+    offset = remove = 0;
+
+    uint8_t *p = b->data;
+    size_t len = b->len;
+
+    while (line > 0 && offset < len)
+    {
+      if (p[offset] == '\n')
+        line -= 1;
+      offset++;
+    }
+
+    if (line > 0)
+    {
+      fprintf(stderr, "[command] change range %s: invalid start line, skipping\n", path);
+      return NULL;
+    }
+
+    int start_char_offset = utf16_to_utf8_offset(p + offset, p + len, op->range.start_char);
+    if (start_char_offset == -1)
+    {
+      fprintf(stderr, "[command] change range %s: invalid start char, skipping\n", path);
+      return NULL;
+    }
+
+    remove = offset;
+    offset += start_char_offset;
+
+    line = op->range.end_line - op->range.start_line;
+    if (line < 0)
+    {
+      fprintf(stderr, "[command] change range %s: invalid end line, skipping\n", path);
+      return NULL;
+    }
+
+    while (line > 0 && remove < len)
+    {
+      if (p[remove] == '\n')
+        line -= 1;
+      remove++;
+    }
+
+    if (line > 0)
+    {
+      fprintf(stderr, "[command] change range %s: invalid end line, skipping\n", path);
+      return NULL;
+    }
+
+    int end_char_offset = utf16_to_utf8_offset(p + remove, p + len, op->range.end_char);
+    if (end_char_offset == -1)
+    {
+      fprintf(stderr, "[command] change range %s: invalid end char, skipping\n", path);
+      return NULL;
+    }
+
+    remove += end_char_offset;
+    remove -= offset;
+  }
+
+  if (remove < 0 || offset < 0 || offset + remove > b->len)
+  {
+    fprintf(stderr, "[command] change %s: invalid range, skipping\n", path);
+    return NULL;
+  }
+
+  if (b->len - remove + length > b->cap)
+    fz_resize_buffer(ctx, b, b->len - remove + length + 128);
+
+  memmove(b->data + offset + length, b->data + offset + remove,
+          b->len - offset - remove);
+
+  b->len = b->len - remove + length;
+
+  if (op->data)
+    memmove(b->data + offset, op->data, length);
+
+  fprintf(stderr, "[command] change %s: changed offset %d\n", path, offset);
+  send(notify_file_changes, eng, ctx, e, offset);
+  return (char *)b->data + offset;
+}
+
+static fileentry_t *open_entry(fz_context *ctx, txp_engine *eng,
+                               const char *doc_path, const char **path)
+{
+  if ((*path)[0] == '/')
+  {
+    int go_up = 0;
+    *path = editing_relative_path(*path, doc_path, &go_up);
+    if (go_up > 0)
+    {
+      fprintf(stderr, "[command] open %s: file has a different root, skipping\n", *path);
+      return NULL;
+    }
+  }
+
+  fileentry_t *e = send(find_file, eng, ctx, *path);
+  if (!e)
+    fprintf(stderr, "[command] open %s: file not found, skipping\n", *path);
+  return e;
+}
+
+static void notify_open(fz_context *ctx, txp_engine *eng, fileentry_t *e,
+                        const char *path, int changed, bool had_edit_data)
+{
+  if (changed >= 0)
+  {
+    if (e->promised && !had_edit_data)
+      fprintf(stderr, "[command] open %s: resolving deferred query\n", path);
+    else
+    {
+      fprintf(stderr, "[command] open %s: changed offset is %d\n", path, changed);
+      send(notify_file_changes, eng, ctx, e, changed);
+    }
+  }
+}
+
+void editing_open(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                  const char *path, const void *data, int size)
+{
+  fileentry_t *e = open_entry(ctx, eng, doc_path, &path);
+  if (!e)
+    return;
+
+  int changed = -1;
+  bool had_edit_data = (e->edit_data != NULL);
+
+  if (e->edit_data)
+  {
+    fprintf(stderr, "[command] open %s: known file, updating\n", path);
+    changed = find_diff(e->edit_data, data, size);
+    if (e->edit_data->cap < size)
+      fz_resize_buffer(ctx, e->edit_data, size + 128);
+    e->edit_data->len = size;
+    memcpy(e->edit_data->data, data, size);
+  }
+  else
+  {
+    fprintf(stderr, "[command] open %s: new file\n", path);
+    e->edit_data = fz_new_buffer_from_copied_data(ctx, data, size);
+    if (e->fs_data)
+      changed = find_diff(e->fs_data, data, size);
+    else if (e->seen >= 0)
+      changed = 0;
+  }
+
+  notify_open(ctx, eng, e, path, changed, had_edit_data);
+}
+
+void editing_open_buffer(fz_context *ctx, txp_engine *eng,
+                         const char *doc_path, const char *path,
+                         fz_buffer *data)
+{
+  fileentry_t *e = open_entry(ctx, eng, doc_path, &path);
+  if (!e)
+  {
+    fz_drop_buffer(ctx, data);
+    return;
+  }
+
+  int changed = -1;
+  bool had_edit_data = (e->edit_data != NULL);
+
+  if (e->edit_data)
+  {
+    fprintf(stderr, "[command] open %s: known file, updating\n", path);
+    changed = find_diff(e->edit_data, data->data, data->len);
+    fz_drop_buffer(ctx, e->edit_data);
+  }
+  else
+  {
+    fprintf(stderr, "[command] open %s: new file\n", path);
+    if (e->fs_data)
+      changed = find_diff(e->fs_data, data->data, data->len);
+    else if (e->seen >= 0)
+      changed = 0;
+  }
+  e->edit_data = data;
+
+  notify_open(ctx, eng, e, path, changed, had_edit_data);
+}
+
+void editing_open_base64(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                         const char *path, const void *data, int size)
+{
+  unsigned char *buf = malloc(size);
+  if (!buf)
+    return;
+  memcpy(buf, data, size);
+  int decoded_len = base64_decode(buf, size);
+  if (decoded_len < 0)
+    fprintf(stderr, "[command] open-base64: invalid base64 data\n");
+  else
+    editing_open(ctx, eng, doc_path, path, (const char *)buf, decoded_len);
+  free(buf);
+}
+
+void editing_close(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                   const char *path)
+{
+  int go_up = 0;
+  path = editing_relative_path(path, doc_path, &go_up);
+  if (go_up > 0)
+  {
+    fprintf(stderr, "[command] close %s: file has a different root, skipping\n", path);
+    return;
+  }
+
+  fileentry_t *e = send(find_file, eng, ctx, path);
+  if (!e)
+  {
+    fprintf(stderr, "[command] close %s: file not found, skipping\n", path);
+    return;
+  }
+
+  if (!e->edit_data)
+  {
+    fprintf(stderr, "[command] close %s: file not opened, skipping\n", path);
+    return;
+  }
+
+  int changed = 0;
+
+  if (e->fs_data)
+    changed = find_diff(e->fs_data, e->edit_data->data, e->edit_data->len);
+
+  fz_drop_buffer(ctx, e->edit_data);
+  e->edit_data = NULL;
+
+  fprintf(stderr, "[command] close %s: closing, changed offset %d\n", path,
+          changed);
+
+  send(notify_file_changes, eng, ctx, e, changed);
+}
+
+bool editing_will_open(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                       const char *path)
+{
+  int go_up = 0;
+  if (path[0] == '/')
+    path = editing_relative_path(path, doc_path, &go_up);
+  return go_up == 0 && send(find_file, eng, ctx, path);
+}
+
+bool editing_will_close(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                        const char *path)
+{
+  int go_up = 0;
+  path = editing_relative_path(path, doc_path, &go_up);
+  if (go_up > 0)
+    return 0;
+  fileentry_t *e = send(find_file, eng, ctx, path);
+  return e && e->edit_data;
+}
+
+void editing_register(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                      const char *path)
+{
+  if (path[0] == '/')
+  {
+    int go_up = 0;
+    path = editing_relative_path(path, doc_path, &go_up);
+    if (go_up > 0)
+    {
+      fprintf(stderr, "[command] register %s: file has a different root, skipping\n", path);
+      return;
+    }
+  }
+
+  fileentry_t *e = send(find_file, eng, ctx, path);
+  if (!e)
+  {
+    fprintf(stderr, "[command] register %s: file not found, skipping\n", path);
+    return;
+  }
+
+  e->promised = true;
+  fprintf(stderr, "[command] register %s: marked as promised\n", path);
+}
@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef EDITING_H_
+#define EDITING_H_
+
+#include "engine.h"
+#include "editor.h"
+
+/* Apply editor commands to the VFS of an engine.
+ * Paths are made relative to `doc_path` (the document directory), files
+ * outside of it are ignored. Open and register commands also accept paths
+ * that are already relative. */
+
+// Express `path` relative to `dir`; `go_up` is the number of "../" needed
+const char *editing_relative_path(const char *path, const char *dir, int *go_up);
+
+void editing_open(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                  const char *path, const void *data, int size);
+// Same as editing_open, taking ownership of `data`
+void editing_open_buffer(fz_context *ctx, txp_engine *eng,
+                         const char *doc_path, const char *path,
+                         fz_buffer *data);
+void editing_open_base64(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                         const char *path, const void *data, int size);
+void editing_close(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                   const char *path);
+// Return the location of the inserted text in the file buffer, or NULL if the
+// change was skipped. If `op->data` is NULL, the caller fills it.
+char *editing_change(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                     const struct editor_change *op);
+void editing_register(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                      const char *path);
+
+// Whether editing_open or editing_close would update a file, without logging.
+// Delayed changes only have to be applied before such updates.
+bool editing_will_open(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                       const char *path);
+bool editing_will_close(fz_context *ctx, txp_engine *eng, const char *doc_path,
+                        const char *path);
+
+#endif // EDITING_H_
@@ -1,9 +1,13 @@
+#include <limits.h>
 #include "editor.h"
 #include "driver.h"
 #include "vstack.h"
 
 static enum editor_protocol protocol = EDITOR_SEXP;
 static bool line_output = 0;
+static bool binary_input = 0;
+static bool muted = 0;
+static const char *muted_root = NULL;
 
 void editor_set_protocol(enum editor_protocol aprotocol)
 {
@@ -14,6 +18,17 @@ void editor_set_line_output(bool v)
 {
   line_output = v;
 }
+
+void editor_set_binary_input(bool v)
+{
+  binary_input = v;
+}
+
+void editor_set_muted(const char *root)
+{
+  muted = (root != NULL);
+  muted_root = root;
+}
 // Processing input
 
 static void parse_color(fz_context *ctx, vstack *stack, float out[3], val col)
@@ -30,6 +45,48 @@ static bool truth_value(fz_context *ctx, vstack *t, val v)
   return !(val_is_name(v) && strcmp(val_as_name(ctx, t, v), "nil") == 0);
 }
 
+static const char *command_verb(fz_context *ctx, vstack *stack, val command)
+{
+  val vverb = val_array_get(ctx, stack, command, 0);
+  if (val_is_name(vverb))
+    return val_as_name(ctx, stack, vverb);
+  if (val_is_string(vverb) && (protocol == EDITOR_JSON))
+    return val_as_string(ctx, stack, vverb);
+  return NULL;
+}
+
+// Check the size of the payload of a binary command
+static bool valid_payload_size(fz_context *ctx, val size)
+{
+  return val_is_number(size) &&
+         val_number(ctx, size) >= 0 &&
+         val_number(ctx, size) <= EDITOR_MAX_PAYLOAD;
+}
+
+int editor_payload_size(fz_context *ctx, vstack *stack, val command)
+{
+  if (!binary_input || !val_is_array(command))
+    return -1;
+
+  int len = val_array_length(ctx, stack, command);
+  if (len == 0)
+    return -1;
+
+  const char *verb = command_verb(ctx, stack, command);
+  if (!verb ||
+      (strcmp(verb, "open-bytes") != 0 && strcmp(verb, "change-bytes") != 0))
+    return -1;
+
+  // The size is the last argument, even if the others are wrong
+  val size = val_array_get(ctx, stack, command, len - 1);
+  if (!val_is_number(size))
+    return -1;
+  float n = val_number(ctx, size);
+  if (!(n >= 0 && n <= INT_MAX))
+    return -1;
+  return n;
+}
+
 bool editor_parse(fz_context *ctx,
                   vstack *stack,
                   val command,
@@ -48,12 +105,7 @@ bool editor_parse(fz_context *ctx,
     return 0;
   }
 
-  val vverb = val_array_get(ctx, stack, command, 0);
-  const char *verb = NULL;
-  if (val_is_name(vverb))
-    verb = val_as_name(ctx, stack, vverb);
-  else if (val_is_string(vverb) && (protocol == EDITOR_JSON))
-    verb = val_as_string(ctx, stack, vverb);
+  const char *verb = command_verb(ctx, stack, command);
 
   if (!verb)
   {
@@ -81,6 +133,27 @@ bool editor_parse(fz_context *ctx,
 
     };
   }
+  else if (strcmp(verb, "open-bytes") == 0)
+  {
+    if (!binary_input)
+      goto binary;
+    if (len != 3)
+      goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    val size = val_array_get(ctx, stack, command, 2);
+    if (!val_is_string(path) || !valid_payload_size(ctx, size))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_OPEN,
+        .open =
+            {
+                .path = val_string(ctx, stack, path),
+                .data = NULL,
+                .length = val_number(ctx, size),
+                .base64 = 0,
+            },
+    };
+  }
   else if (strcmp(verb, "close") == 0)
   {
     if (len != 2) goto arity;
@@ -124,6 +197,36 @@ bool editor_parse(fz_context *ctx,
             },
     };
   }
+  else if (strcmp(verb, "change-bytes") == 0)
+  {
+    if (!binary_input)
+      goto binary;
+    if (len != 5) goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    val offset = val_array_get(ctx, stack, command, 2);
+    val length = val_array_get(ctx, stack, command, 3);
+    val size = val_array_get(ctx, stack, command, 4);
+    if (!val_is_string(path) ||
+        !val_is_number(offset) ||
+        !val_is_number(length) ||
+        !valid_payload_size(ctx, size))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_CHANGE,
+        .change =
+            {
+                .path = val_string(ctx, stack, path),
+                .data = NULL,
+                .length = val_number(ctx, size),
+                .base = BASE_BYTE,
+                .span =
+                    {
+                        .offset = val_number(ctx, offset),
+                        .remove = val_number(ctx, length),
+                    },
+            },
+    };
+  }
   else if (strcmp(verb, "change-lines") == 0)
   {
     if (len != 5) goto arity;
@@ -305,6 +408,63 @@ bool editor_parse(fz_context *ctx,
       goto arity;
     *out = (struct editor_command){.tag = EDIT_RESUME, .resume = {}};
   }
+  else if (strcmp(verb, "export-trace") == 0)
+  {
+    if (len != 2)
+      goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    if (!val_is_string(path))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_EXPORT_TRACE,
+        .export_trace = { .path = val_string(ctx, stack, path) },
+    };
+  }
+  else if (strcmp(verb, "export-pdf") == 0)
+  {
+    if (len != 2)
+      goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    if (!val_is_string(path))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_EXPORT_PDF,
+        .export_pdf = { .path = val_string(ctx, stack, path) },
+    };
+  }
+  else if (strcmp(verb, "profile") == 0)
+  {
+    if (len != 2)
+      goto arity;
+    bool status =
+        truth_value(ctx, stack, val_array_get(ctx, stack, command, 1));
+    *out = (struct editor_command){.tag = EDIT_PROFILE,
+                                   .profile = {.status = status}};
+  }
+  else if (strcmp(verb, "select-root") == 0)
+  {
+    if (len != 2)
+      goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    if (!val_is_string(path))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_SELECT_ROOT,
+        .select_root = { .path = val_string(ctx, stack, path) },
+    };
+  }
+  else if (strcmp(verb, "search") == 0)
+  {
+    if (len != 2)
+      goto arity;
+    val text = val_array_get(ctx, stack, command, 1);
+    if (!val_is_string(text))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_SEARCH,
+        .search = { .text = val_string(ctx, stack, text) },
+    };
+  }
   else
   {
     fprintf(stderr, "[command] unknown verb: %s\n", verb);
@@ -319,6 +479,10 @@ arity:
 arguments:
   fprintf(stderr, "[command] %s: invalid arguments\n", verb);
   return 0;
+
+binary:
+  fprintf(stderr, "[command] %s: only available with -binary\n", verb);
+  return 0;
 }
 
 // Sending output
@@ -452,21 +616,76 @@ static const char *editor_info_buffer(enum EDITOR_INFO_BUFFER name)
   }
 }
 
-void editor_append(enum EDITOR_INFO_BUFFER name, fz_buffer *buf, int pos)
+void editor_lines_update(fz_context *ctx, editor_lines *lines, fz_buffer *buf)
 {
+  if (lines->buf != buf)
+  {
+    // Another buffer, index it from scratch
+    fz_drop_buffer(ctx, lines->buf);
+    lines->buf = fz_keep_buffer(ctx, buf);
+    lines->scanned = 0;
+    lines->count = 0;
+  }
+
   if (!buf)
     return;
+
+  int len = buf->len;
+
+  if (len < lines->scanned)
+  {
+    // Truncated: drop the lines that ended in the removed part
+    while (lines->count > 0 && lines->ends[lines->count - 1] >= len)
+      lines->count--;
+    lines->scanned = len;
+    return;
+  }
+
+  for (int i = lines->scanned; i < len; ++i)
+  {
+    if (buf->data[i] != '\n')
+      continue;
+    if (lines->count == lines->capacity)
+    {
+      int capacity = lines->capacity ? lines->capacity * 2 : 256;
+      lines->ends = fz_realloc(ctx, lines->ends, sizeof(int) * capacity);
+      lines->capacity = capacity;
+    }
+    lines->ends[lines->count++] = i;
+  }
+  lines->scanned = len;
+}
+
+void editor_lines_free(fz_context *ctx, editor_lines *lines)
+{
+  fz_free(ctx, lines->ends);
+  fz_drop_buffer(ctx, lines->buf);
+  lines->ends = NULL;
+  lines->buf = NULL;
+  lines->scanned = lines->count = lines->capacity = 0;
+}
+
+void editor_append(enum EDITOR_INFO_BUFFER name, editor_lines *lines, int pos)
+{
+  fz_buffer *buf = lines->buf;
+  if (!buf || muted)
+    return;
   const char *data = (const char *)buf->data;
   if (line_output)
   {
-    int next = pos;
-    while (next < buf->len && buf->data[next] != '\n') next++;
-    if (next == buf->len)
+    // First line that ends after pos: the previous ones have been sent
+    int lo = 0, hi = lines->count;
+    while (lo < hi)
+    {
+      int mid = lo + (hi - lo) / 2;
+      if (lines->ends[mid] < pos)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == lines->count)
       return;
 
-    // Find where line begins and ends
-    while (pos > 0 && data[pos - 1] != '\n') pos--;
-
     // Header
     switch (protocol)
     {
@@ -474,19 +693,12 @@ void editor_append(enum EDITOR_INFO_BUFFER name, fz_buffer *buf, int pos)
       case EDITOR_JSON: fprintf(stdout, "[\"append-lines\", \"%s\"", editor_info_buffer(name)); break;
     }
 
-    // pos points to the beginning of a line,
-    // next points to the ending '\n'
-    while (next < buf->len)
+    for (int i = lo; i < lines->count; ++i)
     {
-      // Not a well-formed line
+      int start = i > 0 ? lines->ends[i - 1] + 1 : 0;
       fprintf(stdout, protocol == EDITOR_SEXP ? " \"" : ", \"");
-      output_data_string(stdout, data + pos, next - pos);
+      output_data_string(stdout, data + start, lines->ends[i] - start);
       fprintf(stdout, "\"");
-      pos = next;
-      do {
-        next++;
-      }
-      while (next < buf->len && buf->data[next] != '\n');
     }
 
     // Trailer
@@ -514,17 +726,15 @@ void editor_append(enum EDITOR_INFO_BUFFER name, fz_buffer *buf, int pos)
   }
 }
 
-void editor_truncate(enum EDITOR_INFO_BUFFER name, fz_buffer *buf)
+void editor_truncate(enum EDITOR_INFO_BUFFER name, editor_lines *lines)
 {
-  int count = buf ? buf->len : 0;
+  if (muted)
+    return;
 
-  if (line_output && buf)
-  {
-    count = 0;
-    for (int i = 0; i < buf->len; ++i)
-      if (buf->data[i] == '\n')
-        count++;
-  }
+  int count = 0;
+
+  if (lines && lines->buf)
+    count = line_output ? lines->count : lines->buf->len;
 
   const char *suffix = line_output ? "-lines" : "";
 
@@ -539,6 +749,92 @@ void editor_truncate(enum EDITOR_INFO_BUFFER name, fz_buffer *buf)
   }
 }
 
+void editor_append_diagnostics(editor_lines *lines, int pos)
+{
+  fz_buffer *buf = lines->buf;
+  if (!buf || muted)
+    return;
+
+  // First diagnostic that ends after pos
+  int lo = 0, hi = lines->count;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (lines->ends[mid] < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == lines->count)
+    return;
+
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "(append-diagnostics"); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"append-diagnostics\""); break;
+  }
+
+  for (int i = lo; i < lines->count; ++i)
+  {
+    const char *ptr = (const char *)buf->data + (i > 0 ? lines->ends[i - 1] + 1 : 0);
+    const char *lim = (const char *)buf->data + lines->ends[i];
+
+    // Split the four fields
+    const char *field[4], *end[4];
+    for (int f = 0; f < 4; ++f)
+    {
+      field[f] = ptr;
+      end[f] = f < 3 ? memchr(ptr, '\t', lim - ptr) : NULL;
+      if (!end[f])
+        end[f] = lim;
+      ptr = end[f] < lim ? end[f] + 1 : lim;
+    }
+
+    int line = atoi(field[1]);
+    switch (protocol)
+    {
+      case EDITOR_SEXP:
+        fprintf(stdout, " (%.*s \"", (int)(end[0] - field[0]), field[0]);
+        output_data_string(stdout, field[2], end[2] - field[2]);
+        fprintf(stdout, "\" %d \"", line);
+        output_data_string(stdout, field[3], end[3] - field[3]);
+        fprintf(stdout, "\")");
+        break;
+      case EDITOR_JSON:
+        fprintf(stdout, ", [\"%.*s\", \"", (int)(end[0] - field[0]), field[0]);
+        output_data_string(stdout, field[2], end[2] - field[2]);
+        fprintf(stdout, "\", %d, \"", line);
+        output_data_string(stdout, field[3], end[3] - field[3]);
+        fprintf(stdout, "\"]");
+        break;
+    }
+  }
+
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, ")\n"); break;
+    case EDITOR_JSON: fprintf(stdout, "]\n"); break;
+  }
+}
+
+void editor_truncate_diagnostics(editor_lines *lines)
+{
+  if (muted)
+    return;
+
+  int count = (lines && lines->buf) ? lines->count : 0;
+
+  switch (protocol)
+  {
+    case EDITOR_SEXP:
+      fprintf(stdout, "(truncate-diagnostics %d)\n", count);
+      break;
+    case EDITOR_JSON:
+      fprintf(stdout, "[\"truncate-diagnostics\", %d]\n", count);
+      break;
+  }
+}
+
 void editor_flush(void)
 {
   switch (protocol)
@@ -590,6 +886,21 @@ void editor_reset_sync(void)
   }
 }
 
+// Messages that editors must act on even for a root that is not displayed
+// end with the path of this root
+static void output_muted_root(void)
+{
+  if (!muted)
+    return;
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, " \""); break;
+    case EDITOR_JSON: fprintf(stdout, ", \""); break;
+  }
+  output_data_string(stdout, muted_root, strlen(muted_root));
+  fputc('"', stdout);
+}
+
 void editor_notify_file_opened(int index, const char *path, int len)
 {
   if (len == 0)
@@ -604,10 +915,12 @@ void editor_notify_file_opened(int index, const char *path, int len)
       break;
   }
   output_data_string(stdout, path, len);
+  fputc('"', stdout);
+  output_muted_root();
   switch (protocol)
   {
-    case EDITOR_SEXP: fprintf(stdout, "\")\n"); break;
-    case EDITOR_JSON: fprintf(stdout, "\"]\n"); break;
+    case EDITOR_SEXP: fprintf(stdout, ")\n"); break;
+    case EDITOR_JSON: fprintf(stdout, "]\n"); break;
   }
 }
 
@@ -645,9 +958,94 @@ void editor_notify_lookup(const char *path,
   }
 
   output_data_string(stdout, path, len);
+  fputc('"', stdout);
+  output_muted_root();
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, ")\n"); break;
+    case EDITOR_JSON: fprintf(stdout, "]\n"); break;
+  }
+}
+
+// Output the entries of a profiling report starting with `kind`, a line of
+// the report being "<kind> <int> <int> <name>"
+static void output_profile_entries(const char *data, int len, const char *kind)
+{
+  const char *sep = "";
+  int klen = strlen(kind);
+  const char *ptr = data, *lim = data + len;
+
+  while (ptr < lim)
+  {
+    const char *eol = memchr(ptr, '\n', lim - ptr);
+    if (!eol)
+      eol = lim;
+
+    long long a, b;
+    int name = 0;
+    if (eol - ptr > klen && strncmp(ptr, kind, klen) == 0 && ptr[klen] == ' ' &&
+        sscanf(ptr + klen, " %lld %lld %n", &a, &b, &name) == 2 && name > 0 &&
+        ptr + klen + name <= eol)
+    {
+      const char *nptr = ptr + klen + name;
+      switch (protocol)
+      {
+        case EDITOR_SEXP: fprintf(stdout, "%s(\"", sep); break;
+        case EDITOR_JSON: fprintf(stdout, "%s[\"", sep); break;
+      }
+      output_data_string(stdout, nptr, eol - nptr);
+      switch (protocol)
+      {
+        case EDITOR_SEXP:
+          fprintf(stdout, "\" %lld %lld)", a, b);
+          sep = " ";
+          break;
+        case EDITOR_JSON:
+          fprintf(stdout, "\", %lld, %lld]", a, b);
+          sep = ", ";
+          break;
+      }
+    }
+
+    ptr = eol + 1;
+  }
+}
+
+void editor_profile(const char *data, int len)
+{
+  if (muted)
+    return;
+
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "(profile ("); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"profile\", ["); break;
+  }
+  output_profile_entries(data, len, "macro");
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, ") ("); break;
+    case EDITOR_JSON: fprintf(stdout, "], ["); break;
+  }
+  output_profile_entries(data, len, "line");
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "))\n"); break;
+    case EDITOR_JSON: fprintf(stdout, "]]\n"); break;
+  }
+}
+
+void editor_search_result(const char *text, int page, int pages)
+{
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "(search-result \""); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"search-result\", \""); break;
+  }
+  output_data_string(stdout, text, strlen(text));
   switch (protocol)
   {
-    case EDITOR_SEXP: fprintf(stdout, "\")\n"); break;
-    case EDITOR_JSON: fprintf(stdout, "\"]\n"); break;
+    case EDITOR_SEXP: fprintf(stdout, "\" %d %d)\n", page, pages); break;
+    case EDITOR_JSON: fprintf(stdout, "\", %d, %d]\n", page, pages); break;
   }
 }
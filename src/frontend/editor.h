@@ -6,6 +6,13 @@
 
 void editor_set_protocol(enum editor_protocol protocol);
 void editor_set_line_output(bool line);
+void editor_set_binary_input(bool binary);
+// When muted by passing the path of a root that is not displayed, messages
+// describing its outputs (out/log, diagnostics, synctex, profiles) are
+// dropped. File notifications (input-file, lookup-file) are still sent,
+// tagged with the root, because the editor may have to provide the files.
+// Pass NULL to unmute.
+void editor_set_muted(const char *root);
 
 // Receiving commands
 
@@ -35,6 +42,11 @@ enum EDITOR_COMMAND
   EDIT_REGISTER,
   EDIT_PAUSE,
   EDIT_RESUME,
+  EDIT_EXPORT_TRACE,
+  EDIT_EXPORT_PDF,
+  EDIT_PROFILE,
+  EDIT_SELECT_ROOT,
+  EDIT_SEARCH,
 };
 
 struct editor_change
@@ -65,6 +77,9 @@ struct editor_change
 struct editor_command
 {
   enum EDITOR_COMMAND tag;
+  // With binary input, `open-bytes` and `change-bytes` produce EDIT_OPEN and
+  // EDIT_CHANGE commands with a NULL `data`: `length` bytes of raw payload
+  // follow the command on stdin.
   union {
     struct {
       const char *path;
@@ -127,6 +142,26 @@ struct editor_command
 
     struct {
     } resume;
+
+    struct {
+      const char *path;
+    } export_trace;
+
+    struct {
+      const char *path;
+    } export_pdf;
+
+    struct {
+      bool status;
+    } profile;
+
+    struct {
+      const char *path;
+    } select_root;
+
+    struct {
+      const char *text;
+    } search;
   };
 };
 
@@ -135,6 +170,15 @@ bool editor_parse(fz_context *ctx,
                   val command,
                   struct editor_command *out);
 
+// Largest payload accepted by open-bytes and change-bytes
+#define EDITOR_MAX_PAYLOAD (256 << 20)
+
+// Size of the payload that follows a binary command (open-bytes,
+// change-bytes), or -1 if there is none. The payload has to be skipped when
+// editor_parse rejects the command, otherwise its bytes would be read as
+// commands.
+int editor_payload_size(fz_context *ctx, vstack *stack, val command);
+
 // Sending message
 
 enum EDITOR_INFO_BUFFER
@@ -143,8 +187,29 @@ enum EDITOR_INFO_BUFFER
   BUF_LOG, // TeX output log file
 };
 
-void editor_append(enum EDITOR_INFO_BUFFER name, fz_buffer *buf, int pos);
-void editor_truncate(enum EDITOR_INFO_BUFFER name, fz_buffer *buf);
+// Line index of an output buffer: offsets of the '\n' ending each complete
+// line. It is updated incrementally, following appends and truncations of
+// the buffer, so that messages cost O(changed lines) rather than O(buffer).
+typedef struct
+{
+  // Indexed buffer, a reference is kept so that another buffer allocated at
+  // the same address is not mistaken for it
+  fz_buffer *buf;
+  int scanned;
+  int count, capacity;
+  int *ends;
+} editor_lines;
+
+void editor_lines_update(fz_context *ctx, editor_lines *lines, fz_buffer *buf);
+void editor_lines_free(fz_context *ctx, editor_lines *lines);
+
+void editor_append(enum EDITOR_INFO_BUFFER name, editor_lines *lines, int pos);
+void editor_truncate(enum EDITOR_INFO_BUFFER name, editor_lines *lines);
+
+// Diagnostics reported by the engine are stored one per line, as
+// "kind\tline\tfile\tmessage", and forwarded like the lines of an output.
+void editor_append_diagnostics(editor_lines *lines, int pos);
+void editor_truncate_diagnostics(editor_lines *lines);
 void editor_flush(void);
 void editor_synctex(const char *dirname, const char *basename, int basename_len, int line, int column);
 void editor_reset_sync(void);
@@ -162,4 +227,11 @@ void editor_notify_lookup(const char *path,
                           bool read,
                           enum EDITOR_LOOKUP_STATUS status);
 
+// Forward a profiling report of the worker (see PROF in SERVER-PROTOCOL.md)
+void editor_profile(const char *data, int len);
+
+// Result of a search: `page` is the page displayed (starting from 1, 0 if the
+// text was not found), `pages` the number of pages containing the text
+void editor_search_result(const char *text, int page, int pages);
+
 #endif  // EDITOR_H_
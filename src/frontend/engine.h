@@ -37,25 +37,41 @@
 
 typedef struct txp_engine_s txp_engine;
 
+// The DVI engines keep a reference to the resource manager `rm`: engines of
+// the same process can share it and load fonts and graphics only once.
 txp_engine *txp_create_tex_engine(fz_context *ctx,
                                   const char *engine_path,
                                   bool use_texlive,
                                   bool stream_mode,
                                   const char *inclusion_path,
                                   const char *tex_name,
-                                  dvi_reshooks hooks);
+                                  dvi_resmanager *rm);
 
-txp_engine *txp_create_pdf_engine(fz_context *ctx, const char *pdf_path);
+// `notify` is called from a background thread when a new version of the PDF
+// has been loaded: the caller should then call detect_changes to install it.
+txp_engine *txp_create_pdf_engine(fz_context *ctx, const char *pdf_path,
+                                  void (*notify)(void));
 
+// If `notify` is not NULL, the file is followed: `notify` is called from a
+// background thread when it changes on disk, the caller should then call
+// detect_changes to read the new pages.
 txp_engine *txp_create_dvi_engine(fz_context *ctx,
                                   const char *dvi_path,
-                                  dvi_reshooks hooks);
+                                  dvi_resmanager *rm,
+                                  void (*notify)(void));
 
 typedef enum {
   DOC_RUNNING,
   DOC_TERMINATED
 } txp_engine_status;
 
+// Counters for benchmarking
+typedef struct {
+  int launches;  // worker processes started from scratch
+  int forks;     // snapshots received from workers
+  int kills;     // workers killed because they were not responding
+} txp_engine_stats;
+
 struct txp_engine_s {
   struct txp_engine_class *_class;
 };
@@ -74,6 +90,19 @@ struct txp_engine_class
   synctex_t *(*synctex)(txp_engine *self, fz_buffer **buf);
   fileentry_t *(*find_file)(txp_engine *self, fz_context *ctx, const char *path);
   void (*notify_file_changes)(txp_engine *self, fz_context *ctx, fileentry_t *entry, int offset);
+  // File descriptor that becomes readable when `step` can make progress,
+  // or -1 if the engine is not waiting on any
+  int (*wait_fd)(txp_engine *self);
+  void (*stats)(txp_engine *self, txp_engine_stats *stats);
+  // Enable or disable the macro profiler of the worker. Must be called
+  // between begin_changes and end_changes: the document is typeset again.
+  void (*set_profiling)(txp_engine *self, fz_context *ctx, bool enabled);
+  // Send the whole log and standard output to the editor, replacing what it
+  // has (when the driver switches to another root document)
+  void (*resend_outputs)(txp_engine *self);
+  // Text of a complete page, normalized for searching (see textindex.h), or
+  // NULL. The caller drops the buffer.
+  fz_buffer *(*page_text)(txp_engine *self, fz_context *ctx, int page);
 };
 
 #define TXP_ENGINE_DEF_CLASS                                                \
@@ -93,6 +122,13 @@ struct txp_engine_class
                                        const char *path);                   \
   static void engine_notify_file_changes(txp_engine *self, fz_context *ctx, \
                                          fileentry_t *entry, int offset);   \
+  static int engine_wait_fd(txp_engine *_self);                             \
+  static void engine_stats(txp_engine *_self, txp_engine_stats *stats);     \
+  static void engine_set_profiling(txp_engine *_self, fz_context *ctx,      \
+                                   bool enabled);                           \
+  static void engine_resend_outputs(txp_engine *_self);                     \
+  static fz_buffer *engine_page_text(txp_engine *_self, fz_context *ctx,    \
+                                     int page);                             \
                                                                             \
   static struct txp_engine_class _class = {                                 \
       .destroy = engine_destroy,                                            \
@@ -107,6 +143,11 @@ struct txp_engine_class
       .detect_changes = engine_detect_changes,                              \
       .end_changes = engine_end_changes,                                    \
       .notify_file_changes = engine_notify_file_changes,                    \
+      .wait_fd = engine_wait_fd,                                            \
+      .stats = engine_stats,                                                \
+      .set_profiling = engine_set_profiling,                                \
+      .resend_outputs = engine_resend_outputs,                              \
+      .page_text = engine_page_text,                                        \
   }
 
 #endif // GENERIC_ENGINE_H_
@@ -22,16 +22,58 @@
  * IN THE SOFTWARE.
  */
 
+/* DVI engine: display a DVI or XDV file.
+ *
+ * In follow mode, the file is expected to be written by an external process
+ * (latex, xelatex -no-pdf, ...). A thread watches it (inotify on Linux,
+ * polling elsewhere) and asks for a rescan when it changes: only the bytes
+ * appended since the last scan are read, and incdvi exposes new pages as soon
+ * as their EOP is written. If the file has been rewritten instead, the new
+ * contents are compared with the previous ones and the pages are truncated at
+ * the first difference.
+ */
+
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include <mupdf/fitz.h>
 #include "engine.h"
 #include "incdvi.h"
+#include "mydvi_opcodes.h"
+
+// Size of the chunks read to check that the known contents did not change
+#define PROBE_SIZE 16384
+
+#ifndef __APPLE__
+# define st_mtime_ns(st) ((st)->st_mtim.tv_nsec)
+#else
+# define st_mtime_ns(st) ((st)->st_mtimespec.tv_nsec)
+#endif
 
 struct dvi_engine
 {
   struct txp_engine_class *_class;
   fz_buffer *buffer;
   incdvi_t *dvi;
+
+  // Follow mode
+  char *path;
+  void (*notify)(void);
+  struct stat st;
+  bool changed;
+  pthread_t watcher;
+  int wake[2];
+#ifdef __linux__
+  int inotify_fd;
+#endif
 };
 
 #define SELF struct dvi_engine *self = (struct dvi_engine*)_self
@@ -40,9 +82,219 @@ struct dvi_engine
 
 TXP_ENGINE_DEF_CLASS;
 
+static bool read_at(int fd, unsigned char *data, size_t len, off_t offset)
+{
+  while (len > 0)
+  {
+    ssize_t n = pread(fd, data, len, offset);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    data += n;
+    len -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+static bool same_mtime(const struct stat *st1, const struct stat *st2)
+{
+  return st1->st_mtime == st2->st_mtime &&
+         st_mtime_ns(st1) == st_mtime_ns(st2);
+}
+
+// A complete DVI file ends with post_post, a pointer, the id byte and at
+// least four 223 bytes
+static bool dvi_complete(fz_buffer *buf)
+{
+  size_t i = buf->len;
+  while (i > 0 && buf->data[i - 1] == 223)
+    i--;
+  return buf->len - i >= 4 && i >= 6 && buf->data[i - 6] == POST_POST;
+}
+
+/* Watching */
+
+static const char *base_name(const char *path)
+{
+  const char *base = strrchr(path, '/');
+  return base ? base + 1 : path;
+}
+
+static void *watch_main(void *data)
+{
+  struct dvi_engine *self = data;
+  struct pollfd fds[2] = {
+    { .fd = self->wake[0], .events = POLLIN },
+#ifdef __linux__
+    { .fd = self->inotify_fd, .events = POLLIN },
+#endif
+  };
+#ifdef __linux__
+  const char *name = base_name(self->path);
+  int nfds = 2, timeout = -1;
+#else
+  struct stat last = self->st;
+  int nfds = 1, timeout = 250;
+#endif
+
+  while (1)
+  {
+    int n = poll(fds, nfds, timeout);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("[dvi] poll");
+      break;
+    }
+    if (fds[0].revents)
+      break;
+
+#ifdef __linux__
+    char events[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(self->inotify_fd, events, sizeof(events));
+    if (len <= 0)
+    {
+      if (len == -1 && errno == EINTR)
+        continue;
+      break;
+    }
+
+    bool relevant = 0;
+    for (char *p = events; p < events + len; )
+    {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      if (ev->len > 0 && strcmp(ev->name, name) == 0)
+        relevant = 1;
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+    if (relevant)
+      self->notify();
+#else
+    struct stat st;
+    if (stat(self->path, &st) == 0 &&
+        (st.st_size != last.st_size || !same_mtime(&st, &last) ||
+         st.st_ino != last.st_ino))
+    {
+      last = st;
+      self->notify();
+    }
+#endif
+  }
+  return NULL;
+}
+
+static bool start_watching(struct dvi_engine *self)
+{
+#ifdef __linux__
+  char dir[4096];
+  const char *name = base_name(self->path);
+  if (name == self->path)
+    strcpy(dir, ".");
+  else
+    snprintf(dir, sizeof(dir), "%.*s", (int)(name - self->path), self->path);
+
+  // Watch the directory: the file can be replaced (by rename or unlink) by
+  // the process that writes it
+  self->inotify_fd = inotify_init1(IN_CLOEXEC);
+  if (self->inotify_fd == -1 ||
+      inotify_add_watch(self->inotify_fd, dir,
+                        IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_MOVED_TO) == -1)
+  {
+    perror("[dvi] inotify");
+    return 0;
+  }
+#endif
+
+  if (pipe(self->wake) == -1)
+  {
+    perror("[dvi] pipe");
+    return 0;
+  }
+
+  if (pthread_create(&self->watcher, NULL, watch_main, self) != 0)
+  {
+    perror("[dvi] pthread_create");
+    return 0;
+  }
+
+  return 1;
+}
+
+static void stop_watching(struct dvi_engine *self)
+{
+  if (write(self->wake[1], "q", 1) != 1)
+    perror("[dvi] write");
+  pthread_join(self->watcher, NULL);
+  close(self->wake[0]);
+  close(self->wake[1]);
+#ifdef __linux__
+  close(self->inotify_fd);
+#endif
+}
+
+/* Following */
+
+static void ensure_capacity(fz_context *ctx, fz_buffer *buf, size_t len)
+{
+  if (buf->cap < len)
+    fz_resize_buffer(ctx, buf, fz_maxz(len, buf->cap * 2));
+}
+
+// Check that the bytes already known are still in the file. Only reading is
+// proportional to the file size, pages are parsed again only after a rewrite.
+static bool same_prefix(int fd, fz_buffer *buf)
+{
+  unsigned char probe[PROBE_SIZE];
+
+  for (size_t pos = 0; pos < buf->len; pos += PROBE_SIZE)
+  {
+    size_t len = fz_minz(buf->len - pos, PROBE_SIZE);
+    if (!read_at(fd, probe, len, pos) ||
+        memcmp(probe, buf->data + pos, len) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// The file has been rewritten: keep the pages of the common prefix
+static void reload(fz_context *ctx, struct dvi_engine *self, int fd,
+                   size_t size)
+{
+  fz_buffer *buf = fz_new_buffer(ctx, size + 1);
+  if (!read_at(fd, buf->data, size, 0))
+  {
+    fz_drop_buffer(ctx, buf);
+    return;
+  }
+  buf->len = size;
+
+  fz_buffer *old = self->buffer;
+  size_t common = 0, len = fz_minz(old->len, size);
+  while (common < len && old->data[common] == buf->data[common])
+    common++;
+
+  // Even if the page count does not change, the last pages might differ
+  if (common < old->len)
+    self->changed = 1;
+  old->len = common;
+  incdvi_update(ctx, self->dvi, old);
+  fprintf(stderr, "[dvi] rewritten, %d pages unchanged\n",
+          incdvi_page_count(self->dvi));
+
+  fz_drop_buffer(ctx, old);
+  self->buffer = buf;
+}
+
 static void engine_destroy(txp_engine *_self, fz_context *ctx)
 {
   SELF;
+  if (self->notify)
+    stop_watching(self);
+  fz_free(ctx, self->path);
   fz_drop_buffer(ctx, self->buffer);
   incdvi_free(ctx, self->dvi);
 }
@@ -76,10 +328,53 @@ static void engine_begin_changes(txp_engine *_self, fz_context *ctx)
 
 static void engine_detect_changes(txp_engine *_self, fz_context *ctx)
 {
+  SELF;
+  if (!self->notify)
+    return;
+
+  // The file might be missing while it is being replaced
+  int fd = open(self->path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    close(fd);
+    return;
+  }
+
+  fz_buffer *buf = self->buffer;
+  size_t size = st.st_size;
+  int pages = incdvi_page_count(self->dvi);
+
+  bool same_file = st.st_dev == self->st.st_dev && st.st_ino == self->st.st_ino;
+  if (same_file && size > buf->len && same_prefix(fd, buf))
+  {
+    // Pure append
+    ensure_capacity(ctx, buf, size);
+    if (read_at(fd, buf->data + buf->len, size - buf->len, buf->len))
+      buf->len = size;
+  }
+  else if (!same_file || size != buf->len || !same_mtime(&st, &self->st))
+    // Rewritten, possibly in place and with the same size
+    reload(ctx, self, fd, size);
+  close(fd);
+  self->st = st;
+
+  incdvi_update(ctx, self->dvi, self->buffer);
+  if (incdvi_page_count(self->dvi) != pages)
+    self->changed = 1;
 }
 
 static bool engine_end_changes(txp_engine *_self, fz_context *ctx)
 {
+  SELF;
+  if (self->changed)
+  {
+    self->changed = 0;
+    return 1;
+  }
   return 0;
 }
 
@@ -92,9 +387,12 @@ static int engine_page_count(txp_engine *_self)
 
 static txp_engine_status engine_get_status(txp_engine *_self)
 {
+  SELF;
+  // A followed file is complete once its postamble has been written
+  if (self->notify && !dvi_complete(self->buffer))
+    return DOC_RUNNING;
   return DOC_TERMINATED;
 }
-
 static float engine_scale_factor(txp_engine *_self)
 {
   SELF;
@@ -118,13 +416,46 @@ static void engine_notify_file_changes(txp_engine *_self,
 {
 }
 
-txp_engine *txp_create_dvi_engine(fz_context *ctx, const char *dvi_path, dvi_reshooks hooks)
+static int engine_wait_fd(txp_engine *_self)
+{
+  return -1;
+}
+
+static void engine_stats(txp_engine *_self, txp_engine_stats *stats)
+{
+  *stats = (txp_engine_stats){0,};
+}
+
+static void engine_set_profiling(txp_engine *_self, fz_context *ctx, bool enabled)
+{
+}
+
+static void engine_resend_outputs(txp_engine *_self)
+{
+}
+
+static fz_buffer *engine_page_text(txp_engine *_self, fz_context *ctx, int page)
+{
+  SELF;
+  return incdvi_page_text(ctx, self->dvi, self->buffer, page);
+}
+
+txp_engine *txp_create_dvi_engine(fz_context *ctx, const char *dvi_path,
+                                  dvi_resmanager *rm, void (*notify)(void))
 {
-  fz_buffer *buffer = fz_read_file(ctx, dvi_path);
   struct dvi_engine *self = fz_malloc_struct(ctx, struct dvi_engine);
   self->_class = &_class;
-  self->buffer = buffer;
-  self->dvi = incdvi_new(ctx, hooks);
-  incdvi_update(ctx, self->dvi, buffer);
+  self->path = fz_strdup(ctx, dvi_path);
+  if (stat(dvi_path, &self->st) == -1)
+    memset(&self->st, 0, sizeof(self->st));
+  self->buffer = fz_read_file(ctx, dvi_path);
+  self->dvi = incdvi_new(ctx, rm);
+  incdvi_update(ctx, self->dvi, self->buffer);
+  if (notify)
+  {
+    self->notify = notify;
+    if (!start_watching(self))
+      self->notify = NULL;
+  }
   return (txp_engine*)self;
 }
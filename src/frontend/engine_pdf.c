@@ -22,17 +22,75 @@
  * IN THE SOFTWARE.
  */
 
+/* PDF engine: display a PDF produced by an external tool (latexmk, ...).
+ *
+ * When the file changes, the new version is read and parsed by a background
+ * thread while the previous one stays displayed. Each page is fingerprinted
+ * by hashing its content streams and the objects it references (resources,
+ * annotations, ...): display lists of pages whose fingerprint did not change
+ * are kept from one version to the next.
+ *
+ * Tools often rewrite a PDF by appending an incremental update. This is
+ * detected by checking that the previous version is a prefix of the new one;
+ * the digests of objects that are not redefined by the update are then
+ * reused rather than computed again.
+ */
+
 #include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
 #include "engine.h"
+#include "textindex.h"
+
+#ifndef __APPLE__
+# define st_mtime_ns(st) ((st)->st_mtim.tv_nsec)
+#else
+# define st_mtime_ns(st) ((st)->st_mtimespec.tv_nsec)
+#endif
+
+typedef struct
+{
+  unsigned char digest[16];
+  bool valid;
+} page_digest;
+
+// Digests of the objects of a PDF, indexed by object number
+typedef struct
+{
+  int len;
+  page_digest *objects;
+} object_memo;
+
+// A version of the document, as read from the file system
+typedef struct
+{
+  struct stat st;
+  fz_buffer *data;
+  fz_document *doc;
+  int page_count;
+  page_digest *pages;
+  object_memo memo;
+} pdf_version;
 
 struct pdf_engine
 {
   struct txp_engine_class *_class;
   char *path;
-  int page_count;
-  fz_document *doc;
+  pdf_version *current;
+  fz_display_list **lists;
   bool changed;
+
+  // Background loading
+  void (*notify)(void);
+  fz_context *loader_ctx;
+  pthread_t loader;
+  pthread_mutex_t lock;
+  bool loading, loaded, rescan;
+  pdf_version *next;
 };
 
 #define SELF struct pdf_engine *self = (struct pdf_engine*)_self
@@ -41,11 +99,427 @@ struct pdf_engine
 
 TXP_ENGINE_DEF_CLASS;
 
+static bool same_file(const struct stat *a, const struct stat *b)
+{
+  return a->st_dev == b->st_dev &&
+         a->st_ino == b->st_ino &&
+         a->st_size == b->st_size &&
+         a->st_mtime == b->st_mtime &&
+         st_mtime_ns(a) == st_mtime_ns(b);
+}
+
+static void free_version(fz_context *ctx, pdf_version *v)
+{
+  if (!v)
+    return;
+  fz_drop_document(ctx, v->doc);
+  fz_drop_buffer(ctx, v->data);
+  free(v->pages);
+  free(v->memo.objects);
+  free(v);
+}
+
+/* Incremental updates */
+
+// Invalidate the digests of the objects defined in `data` (the bytes appended
+// by an update), by looking for "num gen obj" headers. Objects hidden in an
+// object stream cannot be found this way: return false if there is one.
+static bool invalidate_updated(object_memo *memo, const unsigned char *data,
+                               size_t len)
+{
+  static const char objstm[] = "/ObjStm";
+  for (size_t i = 0; i + sizeof(objstm) - 1 <= len; i++)
+    if (memcmp(data + i, objstm, sizeof(objstm) - 1) == 0)
+      return 0;
+
+  for (size_t i = 1; i + 3 <= len; i++)
+  {
+    if (memcmp(data + i, "obj", 3) != 0 ||
+        (i + 3 < len && isalnum(data[i + 3])))
+      continue;
+
+    // Walk back over " gen " and "num"
+    size_t j = i;
+    while (j > 0 && isspace(data[j - 1])) j--;
+    size_t gen_end = j;
+    while (j > 0 && isdigit(data[j - 1])) j--;
+    if (j == gen_end) continue;
+    while (j > 0 && isspace(data[j - 1])) j--;
+    size_t num_end = j;
+    while (j > 0 && isdigit(data[j - 1])) j--;
+    if (j == num_end) continue;
+
+    int num = 0;
+    for (size_t k = j; k < num_end && num < memo->len; k++)
+      num = num * 10 + data[k] - '0';
+    if (num < memo->len)
+      memo->objects[num].valid = 0;
+  }
+  return 1;
+}
+
+// Prepare the object digests of a new version from those of the previous one
+static void inherit_memo(pdf_version *v, const pdf_version *prev, int xref_len)
+{
+  v->memo.len = xref_len;
+  v->memo.objects = calloc(xref_len, sizeof(page_digest));
+  if (!v->memo.objects)
+    abort();
+
+  if (!prev || !prev->data || !prev->memo.objects)
+    return;
+
+  size_t old_len = prev->data->len, new_len = v->data->len;
+  if (new_len <= old_len ||
+      memcmp(prev->data->data, v->data->data, old_len) != 0)
+    return;
+
+  int len = prev->memo.len < xref_len ? prev->memo.len : xref_len;
+  memcpy(v->memo.objects, prev->memo.objects, len * sizeof(page_digest));
+  if (invalidate_updated(&v->memo, v->data->data + old_len, new_len - old_len))
+    fprintf(stderr, "[pdf] incremental update of %d bytes\n",
+            (int)(new_len - old_len));
+  else
+    memset(v->memo.objects, 0, xref_len * sizeof(page_digest));
+}
+
+/* Page fingerprints */
+
+typedef struct
+{
+  pdf_document *doc;
+  object_memo *memo;
+
+  // Objects reached from the page being hashed
+  int *stamp, current;
+  int *todo, todo_len, todo_cap;
+} page_hasher;
+
+static void push_ref(page_hasher *h, int num)
+{
+  if (num <= 0 || num >= h->memo->len || h->stamp[num] == h->current)
+    return;
+  h->stamp[num] = h->current;
+  if (h->todo_len == h->todo_cap)
+  {
+    h->todo_cap = h->todo_cap ? h->todo_cap * 2 : 64;
+    h->todo = realloc(h->todo, h->todo_cap * sizeof(int));
+    if (!h->todo)
+      abort();
+  }
+  h->todo[h->todo_len++] = num;
+}
+
+static void hash_int(fz_md5 *md5, int64_t v)
+{
+  if (md5)
+    fz_md5_update(md5, (const unsigned char *)&v, sizeof(v));
+}
+
+static void hash_bytes(fz_md5 *md5, const void *data, size_t len)
+{
+  hash_int(md5, len);
+  if (md5)
+    fz_md5_update(md5, data, len);
+}
+
+// Hash a direct object (if md5 is not NULL) and collect its references.
+// Back-references (to the parent page tree or from annotations to their page)
+// are skipped: they would make each page depend on the whole document.
+static void scan_object(fz_context *ctx, page_hasher *h, fz_md5 *md5,
+                        pdf_obj *obj)
+{
+  if (pdf_is_indirect(ctx, obj))
+  {
+    hash_int(md5, 'R');
+    hash_int(md5, pdf_to_num(ctx, obj));
+    hash_int(md5, pdf_to_gen(ctx, obj));
+    push_ref(h, pdf_to_num(ctx, obj));
+  }
+  else if (pdf_is_array(ctx, obj))
+  {
+    int n = pdf_array_len(ctx, obj);
+    hash_int(md5, '[');
+    hash_int(md5, n);
+    for (int i = 0; i < n; i++)
+      scan_object(ctx, h, md5, pdf_array_get(ctx, obj, i));
+  }
+  else if (pdf_is_dict(ctx, obj))
+  {
+    int n = pdf_dict_len(ctx, obj);
+    hash_int(md5, '<');
+    for (int i = 0; i < n; i++)
+    {
+      pdf_obj *key = pdf_dict_get_key(ctx, obj, i);
+      if (pdf_name_eq(ctx, key, PDF_NAME(Parent)) ||
+          pdf_name_eq(ctx, key, PDF_NAME(P)))
+        continue;
+      const char *name = pdf_to_name(ctx, key);
+      hash_bytes(md5, name, strlen(name));
+      scan_object(ctx, h, md5, pdf_dict_get_val(ctx, obj, i));
+    }
+    hash_int(md5, '>');
+  }
+  else if (pdf_is_name(ctx, obj))
+  {
+    const char *name = pdf_to_name(ctx, obj);
+    hash_int(md5, '/');
+    hash_bytes(md5, name, strlen(name));
+  }
+  else if (pdf_is_string(ctx, obj))
+  {
+    hash_int(md5, '(');
+    hash_bytes(md5, pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+  }
+  else if (pdf_is_int(ctx, obj))
+  {
+    hash_int(md5, 'i');
+    hash_int(md5, pdf_to_int64(ctx, obj));
+  }
+  else if (pdf_is_real(ctx, obj))
+  {
+    float f = pdf_to_real(ctx, obj);
+    hash_int(md5, 'f');
+    hash_bytes(md5, &f, sizeof(f));
+  }
+  else if (pdf_is_bool(ctx, obj))
+  {
+    hash_int(md5, 'b');
+    hash_int(md5, pdf_to_bool(ctx, obj));
+  }
+  else
+    hash_int(md5, 'n');
+}
+
+// Digest of an indirect object alone: its dictionary and its raw stream
+static void object_digest(fz_context *ctx, page_hasher *h, int num)
+{
+  page_digest *d = &h->memo->objects[num];
+  pdf_obj *obj = pdf_load_object(ctx, h->doc, num);
+  fz_buffer *stream = NULL;
+
+  fz_var(stream);
+
+  fz_try(ctx)
+  {
+    if (d->valid)
+      scan_object(ctx, h, NULL, obj);
+    else
+    {
+      fz_md5 md5;
+      fz_md5_init(&md5);
+      scan_object(ctx, h, &md5, obj);
+      if (pdf_obj_num_is_stream(ctx, h->doc, num))
+      {
+        stream = pdf_load_raw_stream_number(ctx, h->doc, num);
+        hash_bytes(&md5, stream->data, stream->len);
+      }
+      fz_md5_final(&md5, d->digest);
+      d->valid = 1;
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_drop_buffer(ctx, stream);
+    pdf_drop_obj(ctx, obj);
+  }
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+}
+
+// The fingerprint of a page combines the digests of all the objects reachable
+// from it, and of the attributes it inherits from the page tree.
+static void page_fingerprint(fz_context *ctx, page_hasher *h, int index,
+                             page_digest *out)
+{
+  pdf_obj *inherited[] = {
+    PDF_NAME(Resources), PDF_NAME(MediaBox), PDF_NAME(CropBox), PDF_NAME(Rotate)
+  };
+  pdf_obj *page = pdf_lookup_page_obj(ctx, h->doc, index);
+  fz_md5 md5;
+  fz_md5_init(&md5);
+
+  h->current = index + 1;
+  h->todo_len = 0;
+
+  for (int i = 0; i < 4; i++)
+    scan_object(ctx, h, &md5, pdf_dict_get_inheritable(ctx, page, inherited[i]));
+  push_ref(h, pdf_to_num(ctx, page));
+
+  for (int i = 0; i < h->todo_len; i++)
+  {
+    int num = h->todo[i];
+    object_digest(ctx, h, num);
+    hash_int(&md5, num);
+    fz_md5_update(&md5, h->memo->objects[num].digest, 16);
+  }
+
+  fz_md5_final(&md5, out->digest);
+  out->valid = 1;
+}
+
+static void fingerprint_pages(fz_context *ctx, pdf_version *v,
+                              const pdf_version *prev)
+{
+  pdf_document *pdoc = pdf_document_from_fz_document(ctx, v->doc);
+  if (!pdoc)
+    return;
+
+  int xref_len = pdf_xref_len(ctx, pdoc);
+  inherit_memo(v, prev, xref_len);
+
+  page_hasher h = {
+    .doc = pdoc,
+    .memo = &v->memo,
+    .stamp = calloc(xref_len, sizeof(int)),
+  };
+  if (!h.stamp)
+    abort();
+
+  for (int i = 0; i < v->page_count; i++)
+  {
+    fz_try(ctx)
+      page_fingerprint(ctx, &h, i, &v->pages[i]);
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[pdf] cannot fingerprint page %d: %s\n", i + 1,
+              fz_caught_message(ctx));
+      v->pages[i].valid = 0;
+    }
+  }
+
+  free(h.stamp);
+  free(h.todo);
+}
+
+/* Loading */
+
+// Read and parse the file; `prev` is only read, it can be in use by another
+// thread.
+static pdf_version *load_version(fz_context *ctx, const char *path,
+                                 const pdf_version *prev)
+{
+  pdf_version *v = calloc(1, sizeof(pdf_version));
+  if (!v)
+    abort();
+
+  if (stat(path, &v->st) == -1)
+  {
+    perror("[pdf] stat");
+    free(v);
+    return NULL;
+  }
+
+  fz_try(ctx)
+  {
+    v->data = fz_read_file(ctx, path);
+    v->doc = fz_open_document_with_buffer(ctx, path, v->data);
+    v->page_count = fz_count_pages(ctx, v->doc);
+    v->pages = calloc(v->page_count + 1, sizeof(page_digest));
+    if (!v->pages)
+      abort();
+    fingerprint_pages(ctx, v, prev);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[pdf] cannot load %s: %s\n", path,
+            fz_caught_message(ctx));
+    fz_drop_document(ctx, v->doc);
+    v->doc = NULL;
+  }
+
+  return v;
+}
+
+static void *loader_main(void *data)
+{
+  struct pdf_engine *self = data;
+  pdf_version *v = load_version(self->loader_ctx, self->path, self->current);
+
+  pthread_mutex_lock(&self->lock);
+  self->next = v;
+  self->loaded = 1;
+  pthread_mutex_unlock(&self->lock);
+
+  if (self->notify)
+    self->notify();
+  return NULL;
+}
+
+// Replace the current version, keeping the display lists of unchanged pages
+static void install_version(fz_context *ctx, struct pdf_engine *self,
+                            pdf_version *v)
+{
+  if (!v)
+    return;
+
+  if (!v->doc)
+  {
+    // Remember the file to not retry before it changes again
+    self->current->st = v->st;
+    free_version(ctx, v);
+    return;
+  }
+
+  pdf_version *old = self->current;
+  fz_display_list **lists = calloc(v->page_count + 1, sizeof(fz_display_list *));
+  if (!lists)
+    abort();
+
+  int kept = 0;
+  for (int i = 0; i < v->page_count; i++)
+  {
+    if (!v->pages[i].valid)
+      continue;
+    // Look at the same index first, then anywhere (pages might have moved)
+    for (int k = 0; k <= old->page_count; k++)
+    {
+      int j = k == 0 ? i : k - 1;
+      if (j >= old->page_count || !self->lists[j] || !old->pages[j].valid ||
+          memcmp(old->pages[j].digest, v->pages[i].digest, 16) != 0)
+        continue;
+      lists[i] = self->lists[j];
+      self->lists[j] = NULL;
+      kept += 1;
+      break;
+    }
+  }
+
+  for (int j = 0; j < old->page_count; j++)
+    fz_drop_display_list(ctx, self->lists[j]);
+  free(self->lists);
+  free_version(ctx, old);
+
+  fprintf(stderr, "[pdf] reloaded %d pages, kept %d\n", v->page_count, kept);
+  self->current = v;
+  self->lists = lists;
+  self->changed = 1;
+}
+
+static void finish_loading(fz_context *ctx, struct pdf_engine *self)
+{
+  pthread_join(self->loader, NULL);
+  self->loading = self->loaded = 0;
+  install_version(ctx, self, self->next);
+  self->next = NULL;
+}
+
 static void engine_destroy(txp_engine *_self, fz_context *ctx)
 {
   SELF;
+  if (self->loading)
+  {
+    pthread_join(self->loader, NULL);
+    free_version(ctx, self->next);
+  }
+  if (self->loader_ctx)
+    fz_drop_context(self->loader_ctx);
+  pthread_mutex_destroy(&self->lock);
+  for (int i = 0; i < self->current->page_count; i++)
+    fz_drop_display_list(ctx, self->lists[i]);
+  free(self->lists);
+  free_version(ctx, self->current);
   fz_free(ctx, self->path);
-  fz_drop_document(ctx, self->doc);
 }
 
 static fz_display_list *engine_render_page(txp_engine *_self,
@@ -53,10 +527,17 @@ static fz_display_list *engine_render_page(txp_engine *_self,
                                            int index)
 {
   SELF;
-  fz_page *page = fz_load_page(ctx, self->doc, index);
-  fz_display_list *dl = fz_new_display_list_from_page(ctx, page);
-  fz_drop_page(ctx, page);
-  return dl;
+  if (!self->lists[index])
+  {
+    fz_page *page = fz_load_page(ctx, self->current->doc, index);
+    fz_try(ctx)
+      self->lists[index] = fz_new_display_list_from_page(ctx, page);
+    fz_always(ctx)
+      fz_drop_page(ctx, page);
+    fz_catch(ctx)
+      fz_rethrow(ctx);
+  }
+  return fz_keep_display_list(ctx, self->lists[index]);
 }
 
 static bool engine_step(txp_engine *_self,
@@ -73,14 +554,35 @@ static void engine_begin_changes(txp_engine *_self, fz_context *ctx)
 static void engine_detect_changes(txp_engine *_self, fz_context *ctx)
 {
   SELF;
-  fz_document *doc = fz_open_document(ctx, self->path);
-  if (!doc)
+
+  if (self->loading)
+  {
+    pthread_mutex_lock(&self->lock);
+    bool loaded = self->loaded;
+    if (!loaded)
+      self->rescan = 1;
+    pthread_mutex_unlock(&self->lock);
+    if (!loaded)
+      return;
+    finish_loading(ctx, self);
+    if (!self->rescan)
+      return;
+  }
+  self->rescan = 0;
+
+  struct stat st;
+  if (stat(self->path, &st) == -1 || same_file(&st, &self->current->st))
     return;
 
-  fz_drop_document(ctx, self->doc);
-  self->doc = doc;
-  self->page_count = fz_count_pages(ctx, doc);
-  self->changed = 1;
+  // Parse the new version in the background, the current one stays displayed
+  if (self->loader_ctx &&
+      pthread_create(&self->loader, NULL, loader_main, self) == 0)
+  {
+    self->loading = 1;
+    return;
+  }
+
+  install_version(ctx, self, load_version(ctx, self->path, self->current));
 }
 
 static bool engine_end_changes(txp_engine *_self, fz_context *ctx)
@@ -98,9 +600,8 @@ static bool engine_end_changes(txp_engine *_self, fz_context *ctx)
 static int engine_page_count(txp_engine *_self)
 {
   SELF;
-  return self->page_count;
+  return self->current->page_count;
 }
-
 static txp_engine_status engine_get_status(txp_engine *_self)
 {
   return DOC_TERMINATED;
@@ -128,18 +629,65 @@ static void engine_notify_file_changes(txp_engine *_self,
 {
 }
 
-txp_engine *txp_create_pdf_engine(fz_context *ctx, const char *pdf_path)
+static int engine_wait_fd(txp_engine *_self)
+{
+  return -1;
+}
+
+static void engine_stats(txp_engine *_self, txp_engine_stats *stats)
+{
+  *stats = (txp_engine_stats){0,};
+}
+
+static void engine_set_profiling(txp_engine *_self, fz_context *ctx, bool enabled)
+{
+}
+
+static void engine_resend_outputs(txp_engine *_self)
+{
+}
+
+static fz_buffer *engine_page_text(txp_engine *_self, fz_context *ctx, int page)
 {
-  fz_document *doc = fz_open_document(ctx, pdf_path);
-  if (!doc)
+  SELF;
+  if (page < 0 || page >= self->current->page_count)
     return NULL;
+  fz_display_list *dl = engine_render_page(_self, ctx, page);
+  fz_buffer *text = NULL;
+  fz_try(ctx)
+    text = txp_text_from_display_list(ctx, dl);
+  fz_always(ctx)
+    fz_drop_display_list(ctx, dl);
+  fz_catch(ctx)
+    fz_rethrow(ctx);
+  return text;
+}
+
+txp_engine *txp_create_pdf_engine(fz_context *ctx, const char *pdf_path,
+                                  void (*notify)(void))
+{
+  pdf_version *v = load_version(ctx, pdf_path, NULL);
+  if (!v)
+    return NULL;
+  if (!v->doc)
+  {
+    free_version(ctx, v);
+    return NULL;
+  }
 
   struct pdf_engine *self = fz_malloc_struct(ctx, struct pdf_engine);
   self->_class = &_class;
 
   self->path = fz_strdup(ctx, pdf_path);
-  self->doc = doc;
-  self->page_count = fz_count_pages(ctx, doc);
+  self->current = v;
+  self->lists = calloc(v->page_count + 1, sizeof(fz_display_list *));
+  if (!self->lists)
+    abort();
+
+  // Background loading needs a context that can be cloned (with locks)
+  self->notify = notify;
+  self->loader_ctx = fz_clone_context(ctx);
+  pthread_mutex_init(&self->lock, NULL);
 
   return (txp_engine*)self;
 }
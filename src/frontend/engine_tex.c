@@ -24,6 +24,7 @@
 
 #include <mupdf/fitz/buffer.h>
 #include <stdlib.h>
+#include <ctype.h>
 #include <limits.h>
 #include <unistd.h>
 #include <string.h>
@@ -37,7 +38,10 @@
 #include "mydvi.h"
 #include "state.h"
 #include "synctex.h"
+#include "picache.h"
+#include "providers.h"
 #include "editor.h"
+#include "trace.h"
 
 typedef struct
 {
@@ -60,7 +64,12 @@ typedef struct
 
 enum
 {
-  MAX_PROCESS = 32
+  MAX_PROCESS = 32,
+  // How long to wait (in ms) for a busy worker to honor a snapshot request
+  SNAPSHOT_TIMEOUT = 50,
+  // How long to wait (in ms) for pending messages of a busy worker that
+  // cannot be asked to snapshot, before killing it
+  PENDING_TIMEOUT = 10,
 };
 
 struct tex_engine
@@ -72,6 +81,7 @@ struct tex_engine
   char *inclusion_path;
   bool use_texlive;
   bool stream_mode;
+  bool profile;
 
   filesystem_t *fs;
   state_t st;
@@ -89,9 +99,20 @@ struct tex_engine
 
   incdvi_t *dvi;
   synctex_t *stex;
+  picache_t *pics;
+
+  // Line indices of st.stdout and st.log, kept up-to-date even when muted
+  editor_lines out_lines, log_lines;
+
+  // Diagnostics reported by the worker, one per line. The entry is not part
+  // of the filesystem, it is only used to roll them back with the outputs.
+  fileentry_t diagnostics;
+  editor_lines diag_lines;
 
   struct {
     int trace_len, offset, flush;
+    // Replace all processes, including those that did not read anything
+    bool relaunch;
   } rollback;
 
   struct {
@@ -99,6 +120,8 @@ struct tex_engine
     query_t query;
     char path[1024];
   } deferred;
+
+  txp_engine_stats stats;
 };
 
 // Backtrackable process state & VFS representation
@@ -183,12 +206,13 @@ static pid_t exec_xelatex_generic(char **args, int *fd)
   return pid;
 }
 
-static pid_t exec_xelatex(char *engine_path, bool use_texlive, const char *filename, int *fd)
+static pid_t exec_xelatex(char *engine_path, bool use_texlive, bool profile, const char *filename, int *fd)
 {
   char *args[] = {
     engine_path,
     (use_texlive ? "-texlive" : "-tectonic"),
     "-texpresso",
+    (profile ? "-profile" : "--"),
     (char*)filename,
     NULL
   };
@@ -206,7 +230,10 @@ static void prepare_process(fz_context *ctx, struct tex_engine *self)
     log_rollback(ctx, self->log, self->restart);
     self->process_count = 1;
     process_t *p = get_process(self);
-    p->pid = exec_xelatex(self->engine_path, self->use_texlive, self->name, &p->fd);
+    p->pid = exec_xelatex(self->engine_path, self->use_texlive, self->profile,
+                          self->name, &p->fd);
+    self->stats.launches += 1;
+    trace_instant("process", "launch", p->pid);
     p->trace_len = 0;
     if (!channel_handshake(self->c, p->fd))
       mabort();
@@ -320,6 +347,10 @@ static void engine_destroy(txp_engine *_self, fz_context *ctx)
     pop_process(ctx, self);
   incdvi_free(ctx, self->dvi);
   synctex_free(ctx, self->stex);
+  picache_free(ctx, self->pics);
+  editor_lines_free(ctx, &self->out_lines);
+  editor_lines_free(ctx, &self->log_lines);
+  editor_lines_free(ctx, &self->diag_lines);
   fz_free(ctx, self->name);
   fz_free(ctx, self->engine_path);
   fz_free(ctx, self->inclusion_path);
@@ -426,6 +457,18 @@ static fz_buffer *entry_data(fileentry_t *e)
   return e->fs_data;
 }
 
+// Identify the version of a file read by TeX, to validate cached picture bounds
+static bool pic_fingerprint_entry(fz_context *ctx, fileentry_t *e, pic_fingerprint *fp)
+{
+  if (e->saved.level != FILE_READ)
+    return 0;
+  if (e->fs_stat.st_ino != 0 && !e->edit_data)
+    pic_fingerprint_stat(ctx, &e->fs_stat, fp);
+  else
+    pic_fingerprint_data(ctx, entry_data(e), fp);
+  return 1;
+}
+
 static fz_buffer *output_data(fileentry_t *e)
 {
   if (!e)
@@ -433,6 +476,35 @@ static fz_buffer *output_data(fileentry_t *e)
   return e->saved.data;
 }
 
+// Append a field of a diagnostic record, without surrounding spaces and with
+// separators (tabs and newlines) replaced by spaces
+static void append_diagnostic_field(fz_context *ctx, fz_buffer *buf, const char *s, int len)
+{
+  while (len > 0 && isspace((unsigned char)s[0]))
+    s++, len--;
+  while (len > 0 && isspace((unsigned char)s[len - 1]))
+    len--;
+  for (int i = 0; i < len; ++i)
+    fz_append_byte(ctx, buf, (s[i] == '\t' || s[i] == '\n' || s[i] == '\r') ? ' ' : s[i]);
+}
+
+// Store a diagnostic as a "kind\tline\tfile\tmessage\n" record
+static void append_diagnostic(fz_context *ctx, fz_buffer *buf, query_t *q)
+{
+  const char *kind;
+  switch (q->diag.kind)
+  {
+    case TXP_DIAG_ERROR: kind = "error"; break;
+    case TXP_DIAG_BADBOX: kind = "badbox"; break;
+    default: kind = "warning"; break;
+  }
+  fz_append_printf(ctx, buf, "%s\t%d\t", kind, q->diag.line);
+  append_diagnostic_field(ctx, buf, q->diag.file, strlen(q->diag.file));
+  fz_append_byte(ctx, buf, '\t');
+  append_diagnostic_field(ctx, buf, q->diag.msg, q->diag.size);
+  fz_append_byte(ctx, buf, '\n');
+}
+
 static const char *
 lookup_path(struct tex_engine *self, const char *path, char buf[1024], struct stat *st)
 {
@@ -452,6 +524,38 @@ lookup_path(struct tex_engine *self, const char *path, char buf[1024], struct st
   return fs_path;
 }
 
+// TeX asks for the cached bounds of a picture before opening it. Load the
+// file as Q_OPRD would, such that it can be fingerprinted (also on its first
+// use in a session) and scanned for changes.
+static fileentry_t *pic_entry(fz_context *ctx, struct tex_engine *self,
+                              const char *path)
+{
+  fileentry_t *e = filesystem_lookup(self->fs, path);
+  if (e && e->saved.level >= FILE_READ)
+    return e;
+
+  char fs_path_buffer[1024];
+  const char *fs_path = NULL;
+  if (!(self->stream_mode && e && e->edit_data))
+    fs_path = lookup_path(self, path, fs_path_buffer, NULL);
+  if (!fs_path && !(e && e->edit_data))
+    return NULL;
+
+  if (!e)
+    e = filesystem_lookup_or_create(ctx, self->fs, path);
+  log_fileentry(ctx, self->log, e);
+  if (!fs_path)
+    memset(&e->fs_stat, 0, sizeof(e->fs_stat));
+  else
+  {
+    if (fs_path == path)
+      fs_path = e->path;
+    e->fs_data = filesystem_read_file(ctx, fs_path, &e->fs_stat);
+  }
+  e->saved.level = FILE_READ;
+  return e;
+}
+
 static bool need_snapshot(fz_context *ctx, struct tex_engine *self, int time)
 {
   // Fences are pending: don't snapshot now
@@ -502,6 +606,7 @@ static bool need_snapshot(fz_context *ctx, struct tex_engine *self, int time)
 
 static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
 {
+  trace_time start = trace_now();
   process_t *p = get_process(self);
   answer_t a;
   switch (q->tag)
@@ -601,9 +706,8 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
           {
             if (fs_path == q->open.path)
               fs_path = e->path;
-            e->fs_data = fz_read_file(ctx, fs_path);
+            e->fs_data = filesystem_read_file(ctx, fs_path, &e->fs_stat);
             e->saved.level = FILE_READ;
-            stat(fs_path, &e->fs_stat);
           }
         }
       }
@@ -796,9 +900,15 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
           fprintf(stderr, "[info] synctex used %d input files, is %d pages long\n", ninput, npage);
       }
       else if (self->st.log.entry == e)
-        editor_append(BUF_LOG, output_data(e), pos);
+      {
+        editor_lines_update(ctx, &self->log_lines, output_data(e));
+        editor_append(BUF_LOG, &self->log_lines, pos);
+      }
       else if (self->st.stdout.entry == e)
-        editor_append(BUF_OUT, output_data(e), pos);
+      {
+        editor_lines_update(ctx, &self->out_lines, output_data(e));
+        editor_append(BUF_OUT, &self->out_lines, pos);
+      }
       a.tag = A_DONE;
       channel_write_answer(self->c, p->fd, &a);
       break;
@@ -820,6 +930,7 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
       {
         log_filecell(ctx, self->log, &self->st.stdout);
         self->st.stdout.entry = NULL;
+        editor_lines_update(ctx, &self->out_lines, NULL);
       }
 
       if (self->st.document.entry == e)
@@ -833,6 +944,7 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
       {
         log_filecell(ctx, self->log, &self->st.log);
         self->st.log.entry = NULL;
+        editor_lines_update(ctx, &self->log_lines, NULL);
       }
 
       a.tag = A_DONE;
@@ -902,15 +1014,16 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
     }
     case Q_GPIC:
     {
-      fileentry_t *e = filesystem_lookup(self->fs, q->gpic.path);
-      if (e && e->saved.level == FILE_READ &&
-          e->pic_cache.type == q->gpic.type &&
-          e->pic_cache.page == q->gpic.page)
+      fileentry_t *e = pic_entry(ctx, self, q->gpic.path);
+      pic_fingerprint fp;
+      if (e && pic_fingerprint_entry(ctx, e, &fp) &&
+          picache_get(self->pics, e->path, &fp, q->gpic.type, q->gpic.page,
+                      a.gpic.bounds))
       {
-        a.gpic.bounds[0] = e->pic_cache.bounds[0];
-        a.gpic.bounds[1] = e->pic_cache.bounds[1];
-        a.gpic.bounds[2] = e->pic_cache.bounds[2];
-        a.gpic.bounds[3] = e->pic_cache.bounds[3];
+        // TeX will not open the picture: any change to it must roll back
+        fprintf(stderr, "[picache] %s: using cached bounds\n", e->path);
+        log_fileentry(ctx, self->log, e);
+        record_seen(self, e, INT_MAX, q->time);
         a.tag = A_GPIC;
       }
       else
@@ -921,8 +1034,12 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
     case Q_SPIC:
     {
       fileentry_t *e = filesystem_lookup(self->fs, q->spic.path);
-      if (e && e->saved.level == FILE_READ)
-          e->pic_cache = q->spic.cache;
+      pic_fingerprint fp;
+      if (e && pic_fingerprint_entry(ctx, e, &fp))
+      {
+        fprintf(stderr, "[picache] %s: storing bounds\n", e->path);
+        picache_set(ctx, self->pics, e->path, &fp, &q->spic.cache);
+      }
       a.tag = A_DONE;
       channel_write_answer(self->c, p->fd, &a);
       break;
@@ -937,6 +1054,7 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
       }
       channel_reset(self->c);
       self->process_count += 1;
+      self->stats.forks += 1;
       process_t *p2 = get_process(self);
       p->snap = log_snapshot(ctx, self->log);
       p2->fd = q->chld.fd;
@@ -944,9 +1062,38 @@ static void answer_query(fz_context *ctx, struct tex_engine *self, query_t *q)
       p2->trace_len = p->trace_len;
       a.tag = A_DONE;
       channel_write_answer(self->c, p->fd, &a);
+      trace_instant("process", "fork", p2->pid);
+      break;
+    }
+
+    case Q_PROF:
+    {
+      editor_profile(q->prof.buf, q->prof.size);
+      a.tag = A_DONE;
+      channel_write_answer(self->c, p->fd, &a);
+      break;
+    }
+
+    case Q_DIAG:
+    {
+      fileentry_t *e = &self->diagnostics;
+      log_fileentry(ctx, self->log, e);
+      if (e->saved.data == NULL)
+      {
+        e->saved.data = fz_new_buffer(ctx, 1024);
+        e->saved.level = FILE_WRITE;
+      }
+      int pos = e->saved.data->len;
+      append_diagnostic(ctx, e->saved.data, q);
+      editor_lines_update(ctx, &self->diag_lines, e->saved.data);
+      editor_append_diagnostics(&self->diag_lines, pos);
+      a.tag = A_DONE;
+      channel_write_answer(self->c, p->fd, &a);
       break;
     }
   }
+  trace_span("query", query_to_string(q->tag), start,
+             get_process(self)->trace_len);
 }
 
 static int output_length(fileentry_t *entry)
@@ -962,6 +1109,8 @@ static void revert_trace(trace_entry_t *te)
   te->entry->seen = te->seen;
 }
 
+static void rollback_outputs(fz_context *ctx, struct tex_engine *self);
+
 static void rollback_processes(fz_context *ctx, struct tex_engine *self, int reverted, int trace)
 {
   self->deferred.active = false;
@@ -1011,6 +1160,13 @@ static void rollback_processes(fz_context *ctx, struct tex_engine *self, int rev
     : 0
   );
 
+  rollback_outputs(ctx, self);
+}
+
+// Bring the views on the outputs (DVI, SyncTeX, stdout and log) in sync with
+// the state of the last process
+static void rollback_outputs(fz_context *ctx, struct tex_engine *self)
+{
   if (self->st.document.entry)
   {
     fprintf(stderr, "[info] before rollback: %d pages\n", incdvi_page_count(self->dvi));
@@ -1027,8 +1183,12 @@ static void rollback_processes(fz_context *ctx, struct tex_engine *self, int rev
   }
   else
     synctex_rollback(ctx, self->stex, 0);
-  editor_truncate(BUF_OUT, output_data(self->st.stdout.entry));
-  editor_truncate(BUF_LOG, output_data(self->st.log.entry));
+  editor_lines_update(ctx, &self->out_lines, output_data(self->st.stdout.entry));
+  editor_lines_update(ctx, &self->log_lines, output_data(self->st.log.entry));
+  editor_truncate(BUF_OUT, &self->out_lines);
+  editor_truncate(BUF_LOG, &self->log_lines);
+  editor_lines_update(ctx, &self->diag_lines, self->diagnostics.saved.data);
+  editor_truncate_diagnostics(&self->diag_lines);
 }
 
 static bool possible_fence(trace_entry_t *te)
@@ -1042,6 +1202,7 @@ static bool possible_fence(trace_entry_t *te)
 
 static int compute_fences(fz_context *ctx, struct tex_engine *self, int trace, int offset)
 {
+  trace_time start = trace_now();
   self->fence_pos = -1;
 
   if (trace <= 0)
@@ -1093,6 +1254,7 @@ static int compute_fences(fz_context *ctx, struct tex_engine *self, int trace, i
     trace -= 1;
   }
 
+  trace_span("rollback", "fences", start, self->fence_pos + 1);
   return trace;
 }
 
@@ -1105,6 +1267,7 @@ static int engine_page_count(txp_engine *_self)
 static fz_display_list *engine_render_page(txp_engine *_self, fz_context *ctx, int page)
 {
   SELF;
+  trace_time start = trace_now();
 
   float pw, ph;
   bool landscape;
@@ -1117,6 +1280,7 @@ static fz_display_list *engine_render_page(txp_engine *_self, fz_context *ctx, i
   incdvi_render_page(ctx, self->dvi, data, page, dev);
   fz_close_device(ctx, dev);
   fz_drop_device(ctx, dev);
+  trace_span("render", "display list", start, page);
   return dl;
 }
 
@@ -1146,7 +1310,9 @@ static bool engine_step(txp_engine *_self, fz_context *ctx, bool restart_if_need
     int fd = get_process(self)->fd;
     if (fd == -1)
       return 0;
-    if (!channel_has_pending_query(self->c, fd, 10))
+    // Don't wait: the driver watches engine_wait_fd and calls us back when
+    // the worker has something to say
+    if (!channel_has_pending_query(self->c, fd, 0))
       return 0;
     if (!read_query(self, self->c, &q))
     {
@@ -1184,7 +1350,6 @@ static int scan_entry(fz_context *ctx, struct tex_engine *self, fileentry_t *e)
   if (stat_same(&st, &e->fs_stat))
     return -1;
 
-  e->fs_stat = st;
   fprintf(stderr, "[scan] file %s has changed\n", e->path);
 
   fz_buffer *buf;
@@ -1192,14 +1357,13 @@ static int scan_entry(fz_context *ctx, struct tex_engine *self, fileentry_t *e)
 
   fz_try(ctx)
   {
-    buf = fz_read_file(ctx, fs_path);
+    buf = filesystem_read_file(ctx, fs_path, &st);
   }
   fz_catch(ctx)
   {
     return -1;
   }
-
-  e->pic_cache.type = -1;
+  e->fs_stat = st;
 
   int olen = e->fs_data->len, nlen = buf->len;
   int len = olen < nlen ? olen : nlen;
@@ -1242,6 +1406,7 @@ static void rollback_begin(fz_context *ctx, struct tex_engine *self)
   self->rollback.trace_len = get_process(self)->trace_len;
   self->rollback.offset = -1;
   self->rollback.flush = 0;
+  self->rollback.relaunch = 0;
 }
 
 static bool rollback_end(fz_context *ctx, struct tex_engine *self, int *tracep, int *offsetp)
@@ -1257,7 +1422,7 @@ static bool rollback_end(fz_context *ctx, struct tex_engine *self, int *tracep,
   process_t *p = get_process(self);
 
   // Check if nothing changed
-  if (trace_len == p->trace_len)
+  if (trace_len == p->trace_len && !self->rollback.relaunch)
   {
     if (!self->rollback.flush)
       return false;
@@ -1289,6 +1454,17 @@ static bool rollback_end(fz_context *ctx, struct tex_engine *self, int *tracep,
   return true;
 }
 
+static bool can_snapshot_on_demand(struct tex_engine *self)
+{
+#ifdef __APPLE__
+  // Same workaround as need_snapshot: don't fork the root process before
+  // output started
+  if (self->process_count == 1 && !incdvi_output_started(self->dvi))
+    return 0;
+#endif
+  return 1;
+}
+
 // Return false if some contents had not been observed: caller should recheck
 // for changed contents.
 // Return true otherwise (process is ready to be flushed).
@@ -1306,38 +1482,57 @@ static bool process_pending_messages(fz_context *ctx, struct tex_engine *self)
     return 1;
 
   // Synchronize with the child process:
-  // - kill if stuck
   // - check pending SEEN messages to update vision of the process
+  // - if it is busy computing, ask it to snapshot at the next safe point:
+  //   it flushes its SEEN messages and forks, so the work done so far is kept
+  // - kill if stuck
   int nothing_seen = 1;
-  do {
-    if (!channel_has_pending_query(self->c, p->fd, 10))
+  bool asked = 0;
+  bool can_snapshot = can_snapshot_on_demand(self);
+  while (1)
+  {
+    int timeout = asked ? SNAPSHOT_TIMEOUT : can_snapshot ? 0 : PENDING_TIMEOUT;
+    if (!channel_has_pending_query(self->c, p->fd, timeout))
     {
+      if (!asked && can_snapshot)
+      {
+        ask_t a;
+        a.tag = C_SNAP;
+        channel_write_ask(self->c, p->fd, &a);
+        channel_flush(self->c, p->fd);
+        asked = 1;
+        continue;
+      }
       fprintf(stderr, "[kill] worker might be stuck, killing\n");
-      // The process hasn't answered in 10ms
-      // It might be stuck in long computation or a loop, kill it to start from the previous one.
+      self->stats.kills += 1;
+      trace_instant("process", "kill", p->pid);
+      // The process did not reach a safe point in time.
+      // It might be stuck in a loop, kill it to start from the previous one.
       close_process(p);
       break;
     }
-    // Process only pending SEEN to have an updated view on process state
-    switch (channel_peek_query(self->c, p->fd))
+
+    // Only process messages that update the view on process state, or the
+    // snapshot itself. Any other query means the process is waiting for us.
+    enum query tag = channel_peek_query(self->c, p->fd);
+    if (tag != Q_SEEN && tag != Q_APND && tag != Q_DIAG && tag != Q_CHLD)
+      break;
+
+    query_t q;
+    if (!read_query(self, self->c, &q))
+      break;
+    answer_query(ctx, self, &q);
+    channel_flush(self->c, p->fd);
+
+    if (q.tag == Q_SEEN)
+      nothing_seen = 0;
+    else if (q.tag == Q_CHLD)
     {
-      case Q_SEEN:
-        {
-          query_t q;
-          if (!read_query(self, self->c, &q))
-          {
-            close(p->fd);
-            p->fd = -1;
-            break;
-          }
-          answer_query(ctx, self, &q);
-          nothing_seen = 0;
-          continue;
-        }
-      default:
-        break;
+      fprintf(stderr, "[snapshot] worker forked on demand at trace position %d\n",
+              get_process(self)->trace_len);
+      break;
     }
-  } while(0);
+  }
 
   self->rollback.flush = 1;
   return nothing_seen;
@@ -1418,15 +1613,71 @@ static bool engine_end_changes(txp_engine *_self, fz_context *ctx)
   SELF;
   int reverted, trace, offset;
 
+  trace_time start = trace_now();
   if (!rollback_end(ctx, self, &reverted, &offset))
     return false;
 
   trace = reverted >= 0 ? compute_fences(ctx, self, reverted, offset) : 0;
   rollback_processes(ctx, self, reverted, trace);
 
+  if (self->rollback.relaunch)
+  {
+    // Processes that did not read anything survive a rollback to the
+    // beginning: get rid of them too
+    self->rollback.relaunch = 0;
+    while (self->process_count > 0)
+      pop_process(ctx, self);
+    rollback_outputs(ctx, self);
+  }
+  trace_span("rollback", "rollback", start, reverted);
+
   return true;
 }
 
+static void engine_set_profiling(txp_engine *_self, fz_context *ctx, bool enabled)
+{
+  SELF;
+  if (self->profile == enabled)
+    return;
+
+  self->profile = enabled;
+  fprintf(stderr, "[profile] %s\n", enabled ? "enabled" : "disabled");
+
+  // No worker yet: the next launch uses the new setting
+  if (self->rollback.trace_len == NOT_IN_TRANSACTION)
+    return;
+
+  // The setting is passed on the command-line: typeset again from scratch
+  int trace_len = self->rollback.trace_len;
+  while (trace_len > 0)
+  {
+    trace_len--;
+    revert_trace(&self->trace[trace_len]);
+  }
+  self->rollback.trace_len = 0;
+  self->rollback.offset = -1;
+  self->rollback.relaunch = 1;
+}
+
+static void engine_resend_outputs(txp_engine *_self)
+{
+  SELF;
+  editor_truncate(BUF_OUT, NULL);
+  editor_append(BUF_OUT, &self->out_lines, 0);
+  editor_truncate(BUF_LOG, NULL);
+  editor_append(BUF_LOG, &self->log_lines, 0);
+  editor_truncate_diagnostics(NULL);
+  editor_append_diagnostics(&self->diag_lines, 0);
+}
+
+static fz_buffer *engine_page_text(txp_engine *_self, fz_context *ctx, int page)
+{
+  SELF;
+  if (!self->st.document.entry)
+    return NULL;
+  return incdvi_page_text(ctx, self->dvi, self->st.document.entry->saved.data, page);
+}
+
 static txp_engine_status engine_get_status(txp_engine *_self)
 {
   SELF;
@@ -1435,6 +1686,21 @@ static txp_engine_status engine_get_status(txp_engine *_self)
   return get_process(self)->fd > -1 ? DOC_RUNNING : DOC_TERMINATED;
 }
 
+static int engine_wait_fd(txp_engine *_self)
+{
+  SELF;
+  // A deferred query is waiting for the editor, not for the worker
+  if (self->deferred.active || self->process_count == 0)
+    return -1;
+  return get_process(self)->fd;
+}
+
+static void engine_stats(txp_engine *_self, txp_engine_stats *stats)
+{
+  SELF;
+  *stats = self->stats;
+}
+
 static float engine_scale_factor(txp_engine *_self)
 {
   SELF;
@@ -1461,7 +1727,7 @@ txp_engine *txp_create_tex_engine(fz_context *ctx,
                                   bool stream_mode,
                                   const char *inclusion_path,
                                   const char *tex_name,
-                                  dvi_reshooks hooks)
+                                  dvi_resmanager *rm)
 {
   struct tex_engine *self = fz_malloc_struct(ctx, struct tex_engine);
   self->_class = &_class;
@@ -1479,11 +1745,14 @@ txp_engine *txp_create_tex_engine(fz_context *ctx,
   self->c = channel_new();
   self->process_count = 0;
 
-  self->dvi = incdvi_new(ctx, hooks);
+  self->dvi = incdvi_new(ctx, rm);
+  self->diagnostics.path = "diagnostics";
   self->use_texlive = use_texlive;
   self->stream_mode = stream_mode;
+  self->profile = false;
 
   self->stex = synctex_new(ctx);
+  self->pics = picache_new(ctx, cache_path(NULL, "pic-bounds"));
   self->rollback.trace_len = NOT_IN_TRANSACTION;
   self->deferred.active = false;
 
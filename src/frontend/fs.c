@@ -166,7 +166,6 @@ fileentry_t *filesystem_lookup_or_create(fz_context *ctx, filesystem_t *fs, cons
   entry->path = fz_strdup(ctx, path);
   entry->saved.level = FILE_NONE;
   entry->seen = -1;
-  entry->pic_cache.type = -1;
   entry->fs_stat.st_ino = 0;
   cell->entry = entry;
 
@@ -194,3 +193,107 @@ fileentry_t *filesystem_scan(filesystem_t *fs, int *index)
   }
   return NULL;
 }
+
+/* Content store shared by all filesystems */
+
+typedef struct
+{
+  struct stat st;
+  fz_buffer *data;
+} storecell;
+
+static struct
+{
+  int count, cap;
+  storecell *table;
+} store;
+
+static unsigned long store_hash(struct stat *st)
+{
+  return ((unsigned long)st->st_ino * 2654435761) ^ (unsigned long)st->st_dev;
+}
+
+static storecell *store_get(int cap, storecell *table, struct stat *st)
+{
+  unsigned long mask = cap - 1;
+  int index = store_hash(st) & mask;
+
+  while (table[index].data &&
+         (table[index].st.st_ino != st->st_ino ||
+          table[index].st.st_dev != st->st_dev))
+    index = (index + 1) & mask;
+
+  return &table[index];
+}
+
+// Rebuild the table, forgetting the contents that are not used anymore
+static void store_resize(fz_context *ctx)
+{
+  int live = 0;
+  for (int i = 0; i < store.cap; ++i)
+  {
+    fz_buffer *data = store.table[i].data;
+    if (data && data->refs > 1)
+      live += 1;
+  }
+
+  int cap = 64;
+  while (live * 2 >= cap)
+    cap *= 2;
+
+  storecell *table = fz_malloc_struct_array(ctx, cap, storecell);
+  for (int i = 0; i < store.cap; ++i)
+  {
+    storecell *cell = &store.table[i];
+    if (!cell->data)
+      continue;
+    if (cell->data->refs > 1)
+      *store_get(cap, table, &cell->st) = *cell;
+    else
+      fz_drop_buffer(ctx, cell->data);
+  }
+
+  fz_free(ctx, store.table);
+  store.table = table;
+  store.cap = cap;
+  store.count = live;
+}
+
+fz_buffer *filesystem_read_file(fz_context *ctx, const char *path, struct stat *st)
+{
+  if (stat(path, st) == -1)
+    return fz_read_file(ctx, path);
+
+  if (!store.table)
+  {
+    store.cap = 64;
+    store.table = fz_malloc_struct_array(ctx, store.cap, storecell);
+  }
+
+  storecell *cell = store_get(store.cap, store.table, st);
+  if (cell->data && stat_same(&cell->st, st))
+    return fz_keep_buffer(ctx, cell->data);
+
+  fz_buffer *data = fz_read_file(ctx, path);
+
+  // Don't share contents that changed while being read
+  struct stat st2;
+  if (stat(path, &st2) == -1 || !stat_same(st, &st2))
+  {
+    if (stat(path, st) == -1)
+      memset(st, 0, sizeof(*st));
+    return data;
+  }
+
+  if (cell->data)
+    fz_drop_buffer(ctx, cell->data);
+  else
+    store.count += 1;
+  cell->st = *st;
+  cell->data = fz_keep_buffer(ctx, data);
+
+  if (store.count * 4 >= store.cap * 3)
+    store_resize(ctx);
+
+  return data;
+}
@@ -0,0 +1,672 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/* texpresso-headless: typeset a document and write page images, without SDL.
+ *
+ * The document is processed to completion (or until the last requested page
+ * is complete), then the selected pages are rasterized from their display
+ * lists, by a pool of threads, and saved as PNG or QOI images.
+ *
+ * With -pdf, the whole document is also written to a PDF file, from the same
+ * display lists (see pdfexport.h).
+ *
+ * With -watch, editor commands (as sent to texpresso stdin) are read from
+ * stdin: after each batch of changes, the engine resumes from its snapshots,
+ * only the pages after the rollback point are rasterized again, and only
+ * those whose rendering changed are written again.
+ * Paths of written images (and of the PDF) are printed on stdout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <mupdf/fitz.h>
+#include "mydvi.h"
+#include "providers.h"
+#include "engine.h"
+#include "editor.h"
+#include "editing.h"
+#include "startup.h"
+#include "vstack.h"
+#include "prot_parser.h"
+#include "pdfexport.h"
+#define QOI_IMPLEMENTATION
+#include "qoi.h"
+
+#ifdef __APPLE__
+#include <sys/syslimits.h>
+#else
+#include <linux/limits.h>
+#endif
+
+#define MAX_RANGES 64
+#define MAX_JOBS 64
+
+enum image_format { FORMAT_PNG, FORMAT_QOI };
+
+typedef struct
+{
+  // Selected pages (0-based, last = -1 for "until the end")
+  struct { int first, last; } ranges[MAX_RANGES];
+  int range_count;
+  float zoom;
+  int jobs;
+  enum image_format format;
+  const char *prefix;
+  FILE *report;
+
+  // Also export the document to this PDF file, or NULL
+  const char *pdf_path;
+  bool images;
+
+  // Digest of the last image written for each page
+  unsigned char (*digests)[16];
+  int digest_count;
+
+  // Pages before this one were not rolled back since they were last
+  // rendered, their images are up-to-date
+  int valid_pages;
+} headless_t;
+
+/* Page selection */
+
+static bool parse_pages(headless_t *h, const char *spec)
+{
+  while (*spec)
+  {
+    if (h->range_count == MAX_RANGES)
+      return 0;
+    char *end;
+    long first = strtol(spec, &end, 10), last = first;
+    if (end == spec || first < 1)
+      return 0;
+    if (*end == '-')
+    {
+      spec = end + 1;
+      if (*spec == '\0' || *spec == ',')
+        last = 0;
+      else
+      {
+        last = strtol(spec, &end, 10);
+        if (end == spec || last < first)
+          return 0;
+      }
+    }
+    h->ranges[h->range_count].first = first - 1;
+    h->ranges[h->range_count].last = last - 1;
+    h->range_count += 1;
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      return 0;
+    spec = end;
+  }
+  return 1;
+}
+
+static bool page_selected(headless_t *h, int page)
+{
+  if (h->range_count == 0)
+    return 1;
+  for (int i = 0; i < h->range_count; i++)
+    if (page >= h->ranges[i].first &&
+        (h->ranges[i].last == -1 || page <= h->ranges[i].last))
+      return 1;
+  return 0;
+}
+
+// Last page that has to be produced, or -1 if the whole document is needed
+static int last_selected_page(headless_t *h)
+{
+  int last = -1;
+  for (int i = 0; i < h->range_count; i++)
+  {
+    if (h->ranges[i].last == -1)
+      return -1;
+    if (h->ranges[i].last > last)
+      last = h->ranges[i].last;
+  }
+  return last;
+}
+
+// Pages that the engine rolled back have to be rendered again
+static void invalidate_pages(headless_t *h, txp_engine *eng)
+{
+  // The last page might be incomplete
+  int complete = send(page_count, eng) - 1;
+  if (complete < h->valid_pages)
+    h->valid_pages = complete < 0 ? 0 : complete;
+}
+
+static bool target_reached(headless_t *h, txp_engine *eng)
+{
+  if (send(get_status, eng) != DOC_RUNNING)
+    return 1;
+  int last = h->pdf_path ? -1 : last_selected_page(h);
+  // The last page reported by the engine might still be incomplete
+  return last >= 0 && send(page_count, eng) > last + 1;
+}
+
+/* Rasterization */
+
+typedef struct
+{
+  headless_t *h;
+  fz_context *ctx;
+  fz_display_list **lists;
+  int *pages;
+  int count;
+
+  pthread_mutex_t lock;
+  int next;
+} render_batch;
+
+static void write_image(fz_context *ctx, headless_t *h, fz_pixmap *pix,
+                        const char *path)
+{
+  if (h->format == FORMAT_PNG)
+  {
+    fz_save_pixmap_as_png(ctx, pix, path);
+    return;
+  }
+
+  if (fz_pixmap_stride(ctx, pix) != fz_pixmap_width(ctx, pix) * 3)
+    fz_throw(ctx, FZ_ERROR_GENERIC, "unexpected pixmap layout");
+  qoi_desc desc = {
+    .width = fz_pixmap_width(ctx, pix),
+    .height = fz_pixmap_height(ctx, pix),
+    .channels = 3,
+    .colorspace = QOI_SRGB,
+  };
+  if (!qoi_write(path, fz_pixmap_samples(ctx, pix), &desc))
+    fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write %s", path);
+}
+
+static void render_one(fz_context *ctx, render_batch *b, int index)
+{
+  headless_t *h = b->h;
+  int page = b->pages[index];
+  fz_display_list *dl = b->lists[index];
+  fz_pixmap *pix = NULL;
+  fz_device *dev = NULL;
+
+  fz_var(pix);
+  fz_var(dev);
+
+  fz_try(ctx)
+  {
+    fz_matrix ctm = fz_scale(h->zoom, h->zoom);
+    fz_irect bbox =
+      fz_round_rect(fz_transform_rect(fz_bound_display_list(ctx, dl), ctm));
+    pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 0);
+    fz_clear_pixmap_with_value(ctx, pix, 255);
+    dev = fz_new_draw_device(ctx, ctm, pix);
+    fz_run_display_list(ctx, dl, dev, fz_identity, fz_infinite_rect, NULL);
+    fz_close_device(ctx, dev);
+
+    unsigned char digest[16];
+    fz_md5_pixmap(ctx, pix, digest);
+    if (memcmp(digest, h->digests[page], 16) != 0)
+    {
+      char path[PATH_MAX];
+      snprintf(path, PATH_MAX, "%s-%d.%s", h->prefix, page + 1,
+               h->format == FORMAT_PNG ? "png" : "qoi");
+      write_image(ctx, h, pix, path);
+      memcpy(h->digests[page], digest, 16);
+      pthread_mutex_lock(&b->lock);
+      fprintf(h->report, "%s\n", path);
+      pthread_mutex_unlock(&b->lock);
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_pixmap(ctx, pix);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[headless] cannot render page %d: %s\n", page + 1,
+            fz_caught_message(ctx));
+  }
+}
+
+static void *render_worker(void *data)
+{
+  render_batch *b = data;
+  fz_context *ctx = fz_clone_context(b->ctx);
+  if (!ctx)
+    abort();
+
+  while (1)
+  {
+    pthread_mutex_lock(&b->lock);
+    int index = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (index >= b->count)
+      break;
+    render_one(ctx, b, index);
+  }
+
+  fz_drop_context(ctx);
+  return NULL;
+}
+
+static void render_pages(fz_context *ctx, headless_t *h, txp_engine *eng)
+{
+  int page_count = send(page_count, eng);
+  // While running, the last page is not complete
+  if (send(get_status, eng) == DOC_RUNNING && page_count > 0)
+    page_count -= 1;
+
+  if (page_count > h->digest_count)
+  {
+    h->digests = realloc(h->digests, sizeof(*h->digests) * page_count);
+    if (!h->digests)
+      abort();
+    memset(h->digests + h->digest_count, 0,
+           sizeof(*h->digests) * (page_count - h->digest_count));
+    h->digest_count = page_count;
+  }
+
+  render_batch b = {
+    .h = h,
+    .ctx = ctx,
+    .lists = malloc(sizeof(fz_display_list *) * (page_count + 1)),
+    .pages = malloc(sizeof(int) * (page_count + 1)),
+    .next = 0,
+  };
+  if (!b.lists || !b.pages)
+    abort();
+
+  // Display lists are produced by the engine, which is not thread-safe
+  for (int page = h->valid_pages; page < page_count; page++)
+  {
+    if (!page_selected(h, page))
+      continue;
+    b.lists[b.count] = send(render_page, eng, ctx, page);
+    b.pages[b.count] = page;
+    b.count += 1;
+  }
+
+  pthread_mutex_init(&b.lock, NULL);
+  int jobs = h->jobs < b.count ? h->jobs : b.count;
+  pthread_t threads[MAX_JOBS];
+  int started = 0;
+  for (; started < jobs; started++)
+    if (pthread_create(&threads[started], NULL, render_worker, &b) != 0)
+      break;
+  if (started == 0)
+    render_worker(&b);
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+  pthread_mutex_destroy(&b.lock);
+  fflush(h->report);
+
+  for (int i = 0; i < b.count; i++)
+    fz_drop_display_list(ctx, b.lists[i]);
+  free(b.lists);
+  free(b.pages);
+  h->valid_pages = page_count;
+}
+
+static void update_outputs(fz_context *ctx, headless_t *h, txp_engine *eng)
+{
+  if (h->images)
+    render_pages(ctx, h, eng);
+  if (h->pdf_path && txp_export_pdf(ctx, eng, h->pdf_path) >= 0)
+  {
+    fprintf(h->report, "%s\n", h->pdf_path);
+    fflush(h->report);
+  }
+}
+
+/* Locking for multithreaded rendering */
+
+static pthread_mutex_t mupdf_locks[FZ_LOCK_MAX];
+
+static void lock_mutex(void *user, int lock)
+{
+  pthread_mutex_lock(&mupdf_locks[lock]);
+}
+
+static void unlock_mutex(void *user, int lock)
+{
+  pthread_mutex_unlock(&mupdf_locks[lock]);
+}
+
+static fz_context *new_locked_context(void)
+{
+  for (int i = 0; i < FZ_LOCK_MAX; i++)
+    pthread_mutex_init(&mupdf_locks[i], NULL);
+  fz_locks_context locks = {
+    .user = NULL,
+    .lock = lock_mutex,
+    .unlock = unlock_mutex,
+  };
+  return fz_new_context(NULL, &locks, FZ_STORE_DEFAULT);
+}
+
+/* Editor commands */
+
+static bool apply_command(fz_context *ctx, txp_engine *eng,
+                          const char *doc_path, vstack *stack, val command)
+{
+  struct editor_command cmd;
+  if (!editor_parse(ctx, stack, command, &cmd))
+    return 0;
+
+  switch (cmd.tag)
+  {
+    case EDIT_OPEN:
+      if (cmd.open.base64)
+        editing_open_base64(ctx, eng, doc_path, cmd.open.path,
+                            cmd.open.data, cmd.open.length);
+      else
+        editing_open(ctx, eng, doc_path, cmd.open.path,
+                     cmd.open.data, cmd.open.length);
+      return 1;
+    case EDIT_CLOSE:
+      editing_close(ctx, eng, doc_path, cmd.close.path);
+      return 1;
+    case EDIT_CHANGE:
+      editing_change(ctx, eng, doc_path, &cmd.change);
+      return 1;
+    case EDIT_REGISTER:
+      editing_register(ctx, eng, doc_path, cmd.reg.path);
+      return 1;
+    case EDIT_RESCAN:
+      send(detect_changes, eng, ctx);
+      return 1;
+    default:
+      // Other commands are about the display
+      return 0;
+  }
+}
+
+// Read and apply available editor commands, return false at end of input
+static bool read_commands(fz_context *ctx, headless_t *h, txp_engine *eng,
+                          const char *doc_path, prot_parser *parser,
+                          vstack *stack, bool *changed)
+{
+  char buffer[4096];
+  ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+  if (n == -1)
+    return errno == EINTR;
+  if (n == 0)
+    return 0;
+
+  send(begin_changes, eng, ctx);
+  fz_try(ctx)
+  {
+    const char *ptr = buffer, *lim = buffer + n;
+    while ((ptr = prot_parse(ctx, parser, stack, ptr, lim)))
+    {
+      val cmds = vstack_get_values(ctx, stack);
+      int n_cmds = val_array_length(ctx, stack, cmds);
+      for (int i = 0; i < n_cmds; i++)
+        apply_command(ctx, eng, doc_path, stack,
+                      val_array_get(ctx, stack, cmds, i));
+    }
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[headless] invalid command: %s\n",
+            fz_caught_message(ctx));
+    vstack_reset(ctx, stack);
+    prot_reinitialize(parser);
+  }
+  if (send(end_changes, eng, ctx))
+  {
+    invalidate_pages(h, eng);
+    *changed = 1;
+    send(step, eng, ctx, true);
+  }
+  return 1;
+}
+
+/* Entry point */
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: texpresso-headless [-I path]* [-texlive] [-tectonic] "
+          "[-pages list] [-zoom z] [-j n] [-qoi] [-o prefix] [-pdf path] "
+          "[-watch [-json]] root_file.tex\n");
+  fprintf(stderr,
+          " -I path      Add a path to included directories\n"
+          " -texlive     Load TeX packages from TeXlive installation\n"
+          " -tectonic    Load TeX packages from tectonic installation\n"
+          " -pages list  Pages to render, e.g. 1,3-5,8- (default: all)\n"
+          " -zoom z      Rasterization scale (default: 2)\n"
+          " -j n         Number of rendering threads (default: 4)\n"
+          " -qoi         Write QOI rather than PNG images\n"
+          " -o prefix    Images are written to prefix-<page>.png "
+          "(default: document name)\n"
+          " -pdf path    Write the document to a PDF file (pages are not "
+          "rasterized\n"
+          "              unless -pages is also given)\n"
+          " -watch       Read editor commands from stdin and update images\n"
+          " -json        Editor commands use json rather than s-exp protocol\n");
+}
+
+int main(int argc, const char **argv)
+{
+  const char *doc_arg = NULL, *prefix = NULL, *pdf_arg = NULL;
+  enum editor_protocol protocol = EDITOR_SEXP;
+  bool use_tectonic = 0, use_texlive = 0, watch = 0;
+  headless_t h = {0,};
+  h.zoom = 2;
+  h.jobs = 4;
+  h.format = FORMAT_PNG;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    if (arg[0] != '-')
+    {
+      if (doc_arg)
+      {
+        usage();
+        exit(1);
+      }
+      doc_arg = arg;
+    }
+    else if (strcmp(arg, "-json") == 0)
+      protocol = EDITOR_JSON;
+    else if (strcmp(arg, "-texlive") == 0)
+      use_texlive = 1;
+    else if (strcmp(arg, "-tectonic") == 0)
+      use_tectonic = 1;
+    else if (strcmp(arg, "-watch") == 0)
+      watch = 1;
+    else if (strcmp(arg, "-qoi") == 0)
+      h.format = FORMAT_QOI;
+    else if (i + 1 < argc && strcmp(arg, "-I") == 0)
+      i++;
+    else if (i + 1 < argc && strcmp(arg, "-pages") == 0)
+    {
+      if (!parse_pages(&h, argv[++i]))
+      {
+        fprintf(stderr, "[error] Invalid page list %s\n", argv[i]);
+        exit(1);
+      }
+    }
+    else if (i + 1 < argc && strcmp(arg, "-zoom") == 0)
+      h.zoom = atof(argv[++i]);
+    else if (i + 1 < argc && strcmp(arg, "-j") == 0)
+      h.jobs = atoi(argv[++i]);
+    else if (i + 1 < argc && strcmp(arg, "-o") == 0)
+      prefix = argv[++i];
+    else if (i + 1 < argc && strcmp(arg, "-pdf") == 0)
+      pdf_arg = argv[++i];
+    else
+    {
+      fprintf(stderr, "[error] Unknown option %s\n", arg);
+      usage();
+      exit(1);
+    }
+  }
+
+  if (doc_arg == NULL || (use_tectonic && use_texlive) || h.zoom <= 0 ||
+      h.jobs < 1 || h.jobs > MAX_JOBS)
+  {
+    usage();
+    exit(1);
+  }
+
+  char *inclusion_path = startup_inclusion_path(argc, argv);
+  use_texlive = startup_use_texlive(use_texlive, use_tectonic);
+
+  char exe_path[PATH_MAX], engine_path[PATH_MAX];
+  startup_find_engine(engine_path, startup_executable_path(exe_path, argv[0])
+                                     ? exe_path : NULL);
+
+  // Images are written relative to the working directory, resolve the prefix
+  // before moving to the document directory
+  char work_dir[PATH_MAX], prefix_buf[PATH_MAX];
+  if (!getcwd(work_dir, PATH_MAX))
+  {
+    perror("get working directory");
+    exit(1);
+  }
+  if (!prefix)
+  {
+    const char *base = strrchr(doc_arg, '/');
+    base = base ? base + 1 : doc_arg;
+    const char *ext = strrchr(base, '.');
+    snprintf(prefix_buf, PATH_MAX, "%s/%.*s", work_dir,
+             ext ? (int)(ext - base) : (int)strlen(base), base);
+  }
+  else if (prefix[0] != '/')
+    snprintf(prefix_buf, PATH_MAX, "%s/%s", work_dir, prefix);
+  else
+    snprintf(prefix_buf, PATH_MAX, "%s", prefix);
+  h.prefix = prefix_buf;
+
+  char pdf_buf[PATH_MAX];
+  if (pdf_arg)
+  {
+    if (pdf_arg[0] != '/')
+      snprintf(pdf_buf, PATH_MAX, "%s/%s", work_dir, pdf_arg);
+    else
+      snprintf(pdf_buf, PATH_MAX, "%s", pdf_arg);
+    h.pdf_path = pdf_buf;
+  }
+  h.images = !pdf_arg || h.range_count > 0;
+
+  char doc_path[PATH_MAX];
+  if (!realpath(doc_arg, doc_path))
+  {
+    perror("finding document path");
+    exit(1);
+  }
+  char *doc_name = strrchr(doc_path, '/');
+  *doc_name++ = '\0';
+  if (chdir(doc_path) == -1)
+  {
+    perror("chdir to document path");
+    exit(1);
+  }
+
+  // Keep stdout for the list of images, editor messages are not needed
+  h.report = fdopen(dup(STDOUT_FILENO), "w");
+  if (!h.report || !freopen("/dev/null", "w", stdout))
+  {
+    perror("redirecting stdout");
+    exit(1);
+  }
+  editor_set_protocol(protocol);
+
+  fz_context *ctx = new_locked_context();
+  fz_register_document_handlers(ctx);
+
+  dvi_resmanager *rm =
+    dvi_resmanager_new(ctx, use_texlive ? dvi_texlive_hooks(ctx, doc_path)
+                                        : dvi_tectonic_hooks(ctx, doc_path));
+  txp_engine *eng = txp_create_tex_engine(ctx, engine_path, use_texlive,
+                                          false, inclusion_path, doc_name,
+                                          rm);
+  dvi_resmanager_drop(ctx, rm);
+
+  vstack *stack = vstack_new(ctx);
+  prot_parser parser;
+  prot_initialize(&parser, protocol == EDITOR_JSON);
+
+  bool stdin_open = watch, changed = 1;
+  send(step, eng, ctx, true);
+
+  while (1)
+  {
+    invalidate_pages(&h, eng);
+    bool reached = target_reached(&h, eng);
+    if (!reached && send(step, eng, ctx, false))
+      continue;
+
+    if (reached && changed)
+    {
+      update_outputs(ctx, &h, eng);
+      changed = 0;
+    }
+
+    struct pollfd fds[2];
+    int nfds = 0;
+    int worker_fd = reached ? -1 : send(wait_fd, eng);
+    if (worker_fd != -1)
+      fds[nfds++] = (struct pollfd){ .fd = worker_fd, .events = POLLIN };
+    if (stdin_open)
+      fds[nfds++] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+
+    if (nfds == 0)
+    {
+      // Nothing more can happen (the engine might be waiting for a file)
+      if (changed)
+        update_outputs(ctx, &h, eng);
+      break;
+    }
+
+    if (poll(fds, nfds, -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if (stdin_open && fds[nfds - 1].revents)
+      stdin_open =
+        read_commands(ctx, &h, eng, doc_path, &parser, stack, &changed);
+  }
+
+  send(destroy, eng, ctx);
+  vstack_free(ctx, stack);
+  fz_drop_context(ctx);
+  fclose(h.report);
+  free(h.digests);
+  free(inclusion_path);
+  return 0;
+}
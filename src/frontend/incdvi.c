@@ -28,6 +28,8 @@
 #include "mydvi.h"
 #include "mydvi_interp.h"
 #include "mydvi_opcodes.h"
+#include "textindex.h"
+#include "trace.h"
 
 struct incdvi_s
 {
@@ -36,6 +38,13 @@ struct incdvi_s
   int page_len, page_cap;
   int *pages;
   dvi_context *dc;
+
+  // Text index: texts[i] is the text of page i for i < text_len (entries
+  // above are stale and dropped when replaced). Once enabled, the text of
+  // pages is extracted as soon as they are complete.
+  fz_buffer **texts;
+  int text_len, text_cap;
+  bool index_text;
 };
 
 static int add_page(fz_context *ctx, incdvi_t *d)
@@ -61,10 +70,10 @@ static int add_page(fz_context *ctx, incdvi_t *d)
   return result;
 }
 
-incdvi_t *incdvi_new(fz_context *ctx, dvi_reshooks hooks)
+incdvi_t *incdvi_new(fz_context *ctx, dvi_resmanager *rm)
 {
   incdvi_t *d = fz_malloc_struct(ctx, incdvi_t);
-  d->dc = dvi_context_new(ctx, hooks);
+  d->dc = dvi_context_new(ctx, rm);
   return d;
 }
 
@@ -72,6 +81,9 @@ void incdvi_free(fz_context *ctx, incdvi_t *d)
 {
   if (d->pages)
     fz_free(ctx, d->pages);
+  for (int i = 0; i < d->text_cap; i++)
+    fz_drop_buffer(ctx, d->texts[i]);
+  fz_free(ctx, d->texts);
   dvi_context_free(ctx, d->dc);
   fz_free(ctx, d);
 }
@@ -81,8 +93,11 @@ void incdvi_reset(incdvi_t *d)
   d->offset = 0;
   d->fontdef_offset = 0;
   d->page_len = 0;
+  d->text_len = 0;
 }
 
+static void index_pages(fz_context *ctx, incdvi_t *d, fz_buffer *buf);
+
 void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
 {
   if (buf == NULL)
@@ -91,6 +106,7 @@ void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
     return;
   }
 
+  trace_time start = trace_now();
   int len = buf->len;
 
   if (d->offset > len)
@@ -138,6 +154,15 @@ void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
 
   if (d->fontdef_offset > d->offset)
     d->fontdef_offset = d->offset;
+
+  // A page that is still complete has not changed
+  if (d->text_len > incdvi_page_count(d))
+    d->text_len = incdvi_page_count(d);
+
+  trace_span("incdvi", "update", start, d->page_len);
+
+  if (d->index_text)
+    index_pages(ctx, d, buf);
 }
 
 bool incdvi_output_started(incdvi_t *d)
@@ -210,6 +235,93 @@ void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page,
   dvi_context_end_frame(ctx, dc);
 }
 
+static fz_buffer *extract_text(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page)
+{
+  float width, height;
+  incdvi_page_dim(d, buf, page, &width, &height, NULL);
+
+  fz_stext_page *stext = fz_new_stext_page(ctx, fz_make_rect(0, 0, width, height));
+  fz_device *dev = NULL;
+  fz_buffer *text = NULL;
+
+  fz_var(dev);
+
+  fz_try(ctx)
+  {
+    dev = fz_new_stext_device(ctx, stext, NULL);
+    incdvi_render_page(ctx, d, buf, page, dev);
+    fz_close_device(ctx, dev);
+    text = txp_text_from_stext(ctx, stext);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_stext_page(ctx, stext);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return text;
+}
+
+// Extract the text of the complete pages that are not indexed yet
+static void index_pages(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
+{
+  int count = incdvi_page_count(d);
+  if (d->text_len >= count)
+    return;
+
+  trace_time start = trace_now();
+
+  if (count > d->text_cap)
+  {
+    int cap = d->text_cap == 0 ? 64 : d->text_cap;
+    while (cap < count)
+      cap *= 2;
+    fz_buffer **texts = fz_malloc_struct_array(ctx, cap, fz_buffer *);
+    if (d->text_cap > 0)
+    {
+      memcpy(texts, d->texts, sizeof(fz_buffer *) * d->text_cap);
+      fz_free(ctx, d->texts);
+    }
+    d->texts = texts;
+    d->text_cap = cap;
+  }
+
+  int first = d->text_len;
+  while (d->text_len < count)
+  {
+    fz_buffer *text = NULL;
+    fz_try(ctx)
+    {
+      text = extract_text(ctx, d, buf, d->text_len);
+    }
+    fz_catch(ctx)
+    {
+      // Index the page as empty rather than failing again at each update
+      fprintf(stderr, "[incdvi] cannot extract text of page %d: %s\n",
+              d->text_len + 1, fz_caught_message(ctx));
+      text = txp_text_normalize(ctx, "", 0);
+    }
+    fz_drop_buffer(ctx, d->texts[d->text_len]);
+    d->texts[d->text_len] = text;
+    d->text_len += 1;
+  }
+
+  trace_span("incdvi", "index text", start, count - first);
+}
+
+fz_buffer *incdvi_page_text(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page)
+{
+  if (page < 0 || page >= incdvi_page_count(d))
+    return NULL;
+  d->index_text = 1;
+  index_pages(ctx, d, buf);
+  return fz_keep_buffer(ctx, d->texts[page]);
+}
+
 float incdvi_tex_scale_factor(incdvi_t *d)
 {
   if (d->page_len == 0)
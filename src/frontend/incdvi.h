@@ -31,7 +31,7 @@
 
 typedef struct incdvi_s incdvi_t;
 
-incdvi_t *incdvi_new(fz_context *ctx, dvi_reshooks hooks);
+incdvi_t *incdvi_new(fz_context *ctx, dvi_resmanager *rm);
 void incdvi_free(fz_context *ctx, incdvi_t *d);
 void incdvi_reset(incdvi_t *d);
 void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf);
@@ -42,4 +42,10 @@ void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page,
 void incdvi_find_page_loc(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page);
 float incdvi_tex_scale_factor(incdvi_t *d);
 
+// Text of a complete page, normalized for searching (see textindex.h), or NULL
+// if the page does not exist. The first call enables the text index: from
+// then on, pages are indexed by incdvi_update as they are completed, and
+// remain indexed until a rollback invalidates them.
+fz_buffer *incdvi_page_text(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page);
+
 #endif /*!INCDVI_H*/
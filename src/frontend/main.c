@@ -38,7 +38,12 @@
 #include "vstack.h"
 #include "prot_parser.h"
 #include "editor.h"
-#include "base64.h"
+#include "editing.h"
+#include "trace.h"
+#include "pdfexport.h"
+#include "reactor.h"
+#include "textindex.h"
+#include "startup.h"
 
 struct persistent_state *pstate;
 
@@ -52,45 +57,6 @@ static bool should_reload_binary(void)
   return pstate->should_reload_binary();
 }
 
-#ifdef __APPLE__
-# define st_time(a) st_##a##timespec
-#else
-# define st_time(a) st_##a##tim
-#endif
-
-static bool is_more_recent(uint64_t *time, char *candidate)
-{
-  struct stat st;
-  if (stat(candidate, &st) == 0 && st.st_time(c).tv_sec > *time)
-  {
-    *time = st.st_time(c).tv_sec;
-    return 1;
-  }
-  return 0;
-}
-
-static void set_more_recent(uint64_t *time, char **result, char *candidate)
-{
-  if (is_more_recent(time, candidate))
-    *result = candidate;
-}
-
-static void find_engine(char engine_path[4096], const char *exec_path)
-{
-  strcpy(engine_path, exec_path);
-  char *basename = NULL;
-  for (int i = 0; i < 4096 && engine_path[i]; ++i)
-    if (engine_path[i] == '/')
-      basename = engine_path + i + 1;
-  uint64_t time = 0;
-  if (basename)
-  {
-    strcpy(basename, "texpresso-xetex");
-    if (!is_more_recent(&time, engine_path))
-      strcpy(engine_path, "texpresso-xetex");
-  }
-}
-
 /* UI state */
 
 enum ui_mouse_status {
@@ -100,7 +66,16 @@ enum ui_mouse_status {
 };
 
 typedef struct {
+  // Engine of the displayed document
   txp_engine *eng;
+
+  // All the root documents hosted by the driver, with the page that was
+  // displayed when they were last selected
+  txp_engine *roots[MAX_ROOTS];
+  const char *root_names[MAX_ROOTS];
+  int root_pages[MAX_ROOTS];
+  int root_count, root, next_background;
+
   txp_renderer *doc_renderer;
   SDL_Renderer *sdl_renderer;
   SDL_Window *window;
@@ -109,11 +84,14 @@ typedef struct {
   int need_synctex;
   int zoom;
 
+  // Text of the last search, highlighted on the pages displayed
+  char *search;
+
   // Mouse input state
   int last_mouse_x, last_mouse_y;
   uint32_t last_click_ticks;
   enum ui_mouse_status mouse_status;
-  bool advancing;
+  bool advancing, looking_ahead;
 } ui_state;
 
 /* UI rendering */
@@ -167,7 +145,40 @@ static bool need_advance(fz_context *ctx, ui_state *ui)
   return (need && send(get_status, ui->eng) == DOC_RUNNING);
 }
 
-static bool advance_engine(fz_context *ctx, ui_state *ui)
+// Number of pages typeset ahead of the displayed one when nothing else has to
+// be done, so that moving to the next pages does not wait for TeX. The worker
+// stops there: the most recent snapshots, that are kept densely (see
+// decimate_processes in engine_tex.c), stay close to the viewport and an edit
+// of the visible pages resumes from a nearby one.
+#define LOOKAHEAD_PAGES 2
+
+static bool need_lookahead(ui_state *ui)
+{
+  return (send(page_count, ui->eng) <= ui->page + LOOKAHEAD_PAGES &&
+          send(get_status, ui->eng) == DOC_RUNNING);
+}
+
+static bool poll_stdin(void)
+{
+  struct pollfd fd;
+  fd.fd = STDIN_FILENO;
+  fd.events = POLLRDNORM;
+  fd.revents = 0;
+  return (poll(&fd, 1, 0) == 1) && ((fd.revents & POLLRDNORM) != 0);
+}
+
+static bool events_pending(bool watch_stdin)
+{
+  SDL_PumpEvents();
+  return SDL_HasEvents(SDL_FIRSTEVENT, SDL_LASTEVENT) ||
+         (watch_stdin && poll_stdin());
+}
+
+// Run the engine until it has produced what the UI needs, it has to wait for
+// the worker, or another event needs to be handled.
+// Returns true only in the last case: the engine can still progress without
+// waiting.
+static bool advance_engine(fz_context *ctx, ui_state *ui, bool watch_stdin)
 {
   bool need = need_advance(ctx, ui);
   if (!need && ui->advancing)
@@ -176,34 +187,125 @@ static bool advance_engine(fz_context *ctx, ui_state *ui)
   if (!need)
     return false;
 
-  struct timespec start;
-  clock_gettime(CLOCK_MONOTONIC, &start);
-
   int steps = 10;
   while (need)
   {
     if (!send(step, ui->eng, ctx, false))
-      break;
+      return false;
 
-    steps -= 1;
     need = need_advance(ctx, ui);
 
+    steps -= 1;
     if (steps == 0)
     {
       steps = 10;
+      if (need && events_pending(watch_stdin))
+        return true;
+    }
+  }
+  return false;
+}
 
-      struct timespec curr;
-      clock_gettime(CLOCK_MONOTONIC, &curr);
+// Typeset the pages that follow the displayed one, by slices of a few steps
+// to remain responsive. Returns true if there is more to do.
+static bool advance_lookahead(fz_context *ctx, ui_state *ui)
+{
+  if (ui->advancing)
+    return false;
 
-      int delta =
-        (curr.tv_sec - start.tv_sec) * 1000 * 1000 * 1000 +
-        (curr.tv_nsec - start.tv_nsec);
+  // Outputs produced since the displayed page became available are only
+  // flushed once the lookahead is done
+  bool need = need_lookahead(ui);
+  if (!need && ui->looking_ahead)
+    editor_flush();
+  ui->looking_ahead = need;
+  if (!need)
+    return false;
 
-      if (delta > 5000000)
-        break;
+  int steps = 10;
+  while (steps > 0 && send(step, ui->eng, ctx, false))
+    steps -= 1;
+  return (steps == 0 && need_lookahead(ui));
+}
+
+/* Root documents */
+
+// Editor messages only describe the displayed root
+static void follow_root(ui_state *ui, txp_engine *eng)
+{
+  const char *root = NULL;
+  if (eng != ui->eng)
+    for (int i = 0; i < ui->root_count; i++)
+      if (ui->roots[i] == eng)
+        root = ui->root_names[i];
+  editor_set_muted(root);
+}
+
+static void begin_changes_all(fz_context *ctx, ui_state *ui)
+{
+  for (int i = 0; i < ui->root_count; i++)
+  {
+    follow_root(ui, ui->roots[i]);
+    send(begin_changes, ui->roots[i], ctx);
+  }
+  editor_set_muted(0);
+}
+
+static void detect_changes_all(fz_context *ctx, ui_state *ui)
+{
+  for (int i = 0; i < ui->root_count; i++)
+  {
+    follow_root(ui, ui->roots[i]);
+    send(detect_changes, ui->roots[i], ctx);
+  }
+  editor_set_muted(0);
+}
+
+// Restart the roots affected by the changes.
+// Return true if the displayed one has to be reloaded.
+static bool end_changes_all(fz_context *ctx, ui_state *ui, bool paused)
+{
+  bool reload = 0;
+  for (int i = 0; i < ui->root_count; i++)
+  {
+    txp_engine *eng = ui->roots[i];
+    follow_root(ui, eng);
+    if (send(end_changes, eng, ctx))
+    {
+      if (!paused)
+        send(step, eng, ctx, true);
+      if (eng == ui->eng)
+        reload = 1;
     }
   }
-  return need;
+  editor_set_muted(0);
+  return reload;
+}
+
+// Answer the workers of the roots that are not displayed, a few queries each
+// and starting from a different root every time, so that none is starved.
+// Return true if some of them might have more to do.
+static bool advance_background(fz_context *ctx, ui_state *ui)
+{
+  bool pending = 0;
+
+  for (int n = 0; n < ui->root_count; n++)
+  {
+    txp_engine *eng = ui->roots[(ui->next_background + n) % ui->root_count];
+    if (eng == ui->eng || send(get_status, eng) != DOC_RUNNING)
+      continue;
+
+    follow_root(ui, eng);
+    int steps = 10;
+    while (steps > 0 && send(step, eng, ctx, false))
+      steps -= 1;
+    if (steps == 0)
+      pending = 1;
+  }
+  editor_set_muted(0);
+
+  ui->next_background = (ui->next_background + 1) % ui->root_count;
+  return pending;
 }
 
 static fz_point get_scale_factor(SDL_Window *window)
@@ -350,78 +452,18 @@ static void ui_mouse_wheel(fz_context *ctx, ui_state *ui, float dx, float dy, in
   }
 }
 
-/* Stdin polling */
-
-static int SDLCALL poll_stdin_thread_main(void *data)
-{
-  int *pipes = data;
-  char c;
-  int n;
-
-  while (1)
-  {
-    n = read(pipes[0], &c, 1);
-    if (n == -1)
-    {
-      if (errno == EINTR)
-        continue;
-      return 1;
-    }
-
-    if (n == 0)
-      return 1;
-
-    if (c == 'q')
-      return 0;
-
-    if (c != 'c')
-      abort();
-
-    struct pollfd fds[2];
-    fds[0].fd = STDIN_FILENO;
-    fds[0].events = POLLRDNORM;
-    fds[0].revents = 0;
-    fds[1].fd = pipes[0];
-    fds[1].events = POLLRDNORM;
-    fds[1].revents = 0;
-
-    while (1)
-    {
-      n = poll(fds, 2, -1);
-      if (n == -1)
-      {
-        if (errno == EINTR)
-          continue;
-        return 1;
-      }
-      if ((fds[0].revents & POLLRDNORM) != 0)
-        schedule_event(STDIN_EVENT);
-      break;
-    }
-  }
-}
+/* Stdin and worker polling */
 
-static bool poll_stdin(void)
+static void reactor_notify(enum reactor_source source)
 {
-  struct pollfd fd;
-  fd.fd = STDIN_FILENO;
-  fd.events = POLLRDNORM;
-  fd.revents = 0;
-  return (poll(&fd, 1, 0) == 1) && ((fd.revents & POLLRDNORM) != 0);
+  // Called from the reactor thread
+  schedule_event(source == REACTOR_STDIN ? STDIN_EVENT : WORKER_EVENT);
 }
 
-static void wakeup_poll_thread(int poll_stdin_pipe[2], char c)
+static void engine_notify(void)
 {
-  while (1)
-  {
-    int n = write(poll_stdin_pipe[1], &c, 1);
-    if (n == 1)
-      break;
-    if (n == -1 && errno == EINTR)
-      continue;
-    perror("write(poll_stdin_pipe, _, _)");
-    break;
-  }
+  // Called from a background thread of the PDF or DVI engine
+  schedule_event(SCAN_EVENT);
 }
 
 /* Command interpreter */
@@ -501,228 +543,6 @@ static void ui_pan(fz_context *ctx, ui_state *ui, float factor)
   schedule_event(RENDER_EVENT);
 }
 
-static const char *relative_path(const char *path, const char *dir, int *go_up)
-{
-  const char *rel_path = path, *dir_path = dir;
-
-  // Skip common parts
-  while (*rel_path && *rel_path == *dir_path)
-  {
-    if (*rel_path == '/')
-    {
-      while (*rel_path == '/') rel_path += 1;
-      while (*dir_path == '/') dir_path += 1;
-    }
-    else
-    {
-      rel_path += 1;
-      dir_path += 1;
-    }
-  }
-
-  // Go back to last directory separator
-  if (*rel_path && *dir_path)
-  {
-    rel_path -= 1;
-    dir_path -= 1;
-    while (path < rel_path && *rel_path != '/')
-    {
-      rel_path -= 1;
-      dir_path -= 1;
-    }
-    if (*rel_path == '/')
-    {
-      if (*dir_path != '/') abort();
-      rel_path += 1;
-      dir_path += 1;
-    }
-  }
-
-  // Count number of '../'
-  *go_up = 0;
-  if (*dir_path)
-  {
-    *go_up = 1;
-    while (*dir_path)
-    {
-      if (*dir_path == '/')
-      {
-        *go_up += 1;
-        while (*dir_path == '/')
-          dir_path += 1;
-      }
-      else
-        dir_path += 1;
-    }
-  }
-
-  while (*rel_path == '/')
-    rel_path += 1;
-
-  return rel_path;
-}
-
-static int find_diff(const fz_buffer *buf, const void *data, int size)
-{
-  const unsigned char *ptr = data;
-  int i, len = fz_mini(buf->len, size);
-  for (i = 0; i < len && buf->data[i] == ptr[i]; ++i);
-  fprintf(stderr, "i:%d len:%d size:%d\n", i, (int)buf->len, size);
-  return i;
-}
-
-#include "utf_mapping.h"
-
-static void realize_change(struct persistent_state *ps,
-                           ui_state *ui,
-                           struct editor_change *op)
-{
-  int go_up = 0;
-  const char *path = relative_path(op->path, ps->doc_path, &go_up);
-  if (go_up > 0)
-  {
-    fprintf(stderr, "[command] change %s: file has a different root, skipping\n", path);
-    return;
-  }
-
-  fileentry_t *e = send(find_file, ui->eng, ps->ctx, path);
-  if (!e)
-  {
-    fprintf(stderr, "[command] change %s: file not found, skipping\n", path);
-    return;
-  }
-
-  fz_buffer *b = e->edit_data;
-  if (!b)
-  {
-    fprintf(stderr, "[command] change %s: file not opened, skipping\n", path);
-    return;
-  }
-
-  int offset = op->span.offset, remove = op->span.remove, length = op->length;
-
-  if (op->base == BASE_LINE)
-  {
-    // Compute byte offsets from line offsets
-    int line = offset, count = remove;
-
-    offset = remove = 0;
-
-    uint8_t *p = b->data;
-    size_t len = b->len;
-
-    while (line > 0 && offset < len)
-    {
-      if (p[offset] == '\n')
-        line -= 1;
-      offset++;
-    }
-
-    if (line > 0)
-    {
-      fprintf(stderr, "[command] change line %s: invalid line number, skipping\n", path);
-      return;
-    }
-
-    remove = offset;
-    while (count > 0 && remove < len)
-    {
-      if (p[remove] == '\n')
-        count -= 1;
-      remove++;
-    }
-
-    if (count > 1)
-    {
-      fprintf(stderr, "[command] change line %s: invalid line count, skipping\n", path);
-      return;
-    }
-
-    remove -= offset;
-  }
-  else if (op->base == BASE_RANGE)
-  {
-    // Compute byte offsets from line offsets
-    int line = op->range.start_line;
-    offset = remove = 0;
-
-    uint8_t *p = b->data;
-    size_t len = b->len;
-
-    while (line > 0 && offset < len)
-    {
-      if (p[offset] == '\n')
-        line -= 1;
-      offset++;
-    }
-
-    if (line > 0)
-    {
-      fprintf(stderr, "[command] change range %s: invalid start line, skipping\n", path);
-      return;
-    }
-
-    int start_char_offset = utf16_to_utf8_offset(p + offset, p + len, op->range.start_char);
-    if (start_char_offset == -1)
-    {
-      fprintf(stderr, "[command] change range %s: invalid start char, skipping\n", path);
-      return;
-    }
-
-    remove = offset;
-    offset += start_char_offset;
-
-    line = op->range.end_line - op->range.start_line;
-    if (line < 0)
-    {
-      fprintf(stderr, "[command] change range %s: invalid end line, skipping\n", path);
-      return;
-    }
-
-    while (line > 0 && remove < len)
-    {
-      if (p[remove] == '\n')
-        line -= 1;
-      remove++;
-    }
-
-    if (line > 0)
-    {
-      fprintf(stderr, "[command] change range %s: invalid end line, skipping\n", path);
-      return;
-    }
-
-    int end_char_offset = utf16_to_utf8_offset(p + remove, p + len, op->range.end_char);
-    if (end_char_offset == -1)
-    {
-      fprintf(stderr, "[command] change range %s: invalid end char, skipping\n", path);
-      return;
-    }
-
-    remove += end_char_offset;
-    remove -= offset;
-  }
-
-  if (remove < 0 || offset < 0 || offset + remove > b->len)
-  {
-    fprintf(stderr, "[command] change %s: invalid range, skipping\n", path);
-    return;
-  }
-
-  if (b->len - remove + length > b->cap)
-    fz_resize_buffer(ps->ctx, b, b->len - remove + length + 128);
-
-  memmove(b->data + offset + length, b->data + offset + remove,
-          b->len - offset - remove);
-
-  b->len = b->len - remove + length;
-
-  memmove(b->data + offset, op->data, length);
-
-  fprintf(stderr, "[command] change %s: changed offset %d\n", path, offset);
-  send(notify_file_changes, ui->eng, ps->ctx, e, offset);
-}
-
 #define BUFFERED_OPS 64
 #define BUFFERED_CHARS 4096
 
@@ -733,6 +553,23 @@ struct {
   int count;
 } delayed_changes = {0,};
 
+// Apply a change to all roots. Return the location of the change in the
+// displayed one, or NULL if it was skipped.
+static char *change_all(struct persistent_state *ps, ui_state *ui,
+                        const struct editor_change *op)
+{
+  char *result = NULL;
+  for (int i = 0; i < ui->root_count; i++)
+  {
+    follow_root(ui, ui->roots[i]);
+    char *data = editing_change(ps->ctx, ui->roots[i], ps->doc_path, op);
+    if (ui->roots[i] == ui->eng)
+      result = data;
+  }
+  editor_set_muted(0);
+  return result;
+}
+
 static void flush_changes(struct persistent_state *ps,
                           ui_state *ui)
 {
@@ -744,7 +581,7 @@ static void flush_changes(struct persistent_state *ps,
     for (int i = 0; i < count; ++i)
     {
       struct editor_change *op = &delayed_changes.op[i];
-      realize_change(ps, ui, op);
+      change_all(ps, ui, op);
     }
   }
 }
@@ -778,111 +615,10 @@ static void interpret_change(struct persistent_state *ps,
   else
   {
     flush_changes(ps, ui);
-    realize_change(ps, ui, op);
-  }
-}
-
-static void interpret_open(struct persistent_state *ps,
-                           ui_state *ui,
-                           const char *path,
-                           const void *data,
-                           int size)
-{
-  if (path[0] == '/')
-  {
-    int go_up = 0;
-    path = relative_path(path, ps->doc_path, &go_up);
-    if (go_up > 0)
-    {
-      fprintf(stderr, "[command] open %s: file has a different root, skipping\n", path);
-      return;
-    }
-  }
-
-  fileentry_t *e = send(find_file, ui->eng, ps->ctx, path);
-  if (!e)
-  {
-    fprintf(stderr, "[command] open %s: file not found, skipping\n", path);
-    return;
-  }
-
-  flush_changes(ps, ui);
-
-  int changed = -1;
-  bool had_edit_data = (e->edit_data != NULL);
-
-  if (e->edit_data)
-  {
-    fprintf(stderr, "[command] open %s: known file, updating\n", path);
-    changed = find_diff(e->edit_data, data, size);
-    if (e->edit_data->cap < size)
-      fz_resize_buffer(ps->ctx, e->edit_data, size + 128);
-    e->edit_data->len = size;
-    memcpy(e->edit_data->data, data, size);
-  }
-  else
-  {
-    fprintf(stderr, "[command] open %s: new file\n", path);
-    e->edit_data = fz_new_buffer_from_copied_data(ps->ctx, data, size);
-    if (e->fs_data)
-      changed = find_diff(e->fs_data, data, size);
-    else if (e->seen >= 0)
-      changed = 0;
-  }
-
-  if (changed >= 0)
-  {
-    if (e->promised && !had_edit_data)
-      fprintf(stderr, "[command] open %s: resolving deferred query\n", path);
-    else
-    {
-      fprintf(stderr, "[command] open %s: changed offset is %d\n", path, changed);
-      send(notify_file_changes, ui->eng, ps->ctx, e, changed);
-    }
+    change_all(ps, ui, op);
   }
 }
 
-static void interpret_close(struct persistent_state *ps,
-                            ui_state *ui,
-                            const char *path)
-{
-  int go_up = 0;
-  path = relative_path(path, ps->doc_path, &go_up);
-  if (go_up > 0)
-  {
-    fprintf(stderr, "[command] close %s: file has a different root, skipping\n", path);
-    return;
-  }
-
-  fileentry_t *e = send(find_file, ui->eng, ps->ctx, path);
-  if (!e)
-  {
-    fprintf(stderr, "[command] close %s: file not found, skipping\n", path);
-    return;
-  }
-
-  if (!e->edit_data)
-  {
-    fprintf(stderr, "[command] close %s: file not opened, skipping\n", path);
-    return;
-  }
-
-  flush_changes(ps, ui);
-
-  int changed = 0;
-
-  if (e->fs_data)
-    changed = find_diff(e->fs_data, e->edit_data->data, e->edit_data->len);
-
-  fz_drop_buffer(ps->ctx, e->edit_data);
-  e->edit_data = NULL;
-
-  fprintf(stderr, "[command] close %s: closing, changed offset %d\n", path,
-          changed);
-
-  send(notify_file_changes, ui->eng, ps->ctx, e, changed);
-}
-
 static uint32_t convert_color(fz_context *ctx, vstack *stack, float frgb[3])
 {
   uint8_t rgb[3];
@@ -898,6 +634,8 @@ static void display_page(struct persistent_state *ps, ui_state *ui)
   fz_display_list *dl = send(render_page, ui->eng, ps->ctx, ui->page);
   txp_renderer_set_contents(ps->ctx, ui->doc_renderer, dl);
   fz_drop_display_list(ps->ctx, dl);
+  if (ui->search)
+    txp_renderer_select_text(ps->ctx, ui->doc_renderer, ui->search);
   schedule_event(RENDER_EVENT);
 }
 
@@ -913,65 +651,266 @@ SDL_SetWindowAlwaysOnTop(SDL_Window *window, SDL_bool state)
 #endif
 
 
-static void interpret_register(struct persistent_state *ps,
-                               ui_state *ui,
-                               const char *path)
+// Remaining input read from stdin
+typedef struct
 {
-  if (path[0] == '/')
+  const char *ptr, *lim;
+} stdin_cursor;
+
+// Read the raw payload of a binary command, first from the bytes already read
+// then directly from stdin. If `data` is NULL, the payload is skipped.
+static bool read_payload(stdin_cursor *in, char *data, int size)
+{
+  int avail = fz_mini(in->lim - in->ptr, size);
+  if (data)
+    memcpy(data, in->ptr, avail);
+  in->ptr += avail;
+
+  char scratch[4096];
+  int pos = avail;
+  while (pos < size)
   {
-    int go_up = 0;
-    path = relative_path(path, ps->doc_path, &go_up);
-    if (go_up > 0)
+    int count = data ? size - pos : fz_mini(size - pos, sizeof(scratch));
+    int n = read(STDIN_FILENO, data ? data + pos : scratch, count);
+    if (n == -1)
     {
-      fprintf(stderr, "[command] register %s: file has a different root, skipping\n", path);
+      if (errno == EINTR)
+        continue;
+      perror("reading payload");
+      return 0;
+    }
+    if (n == 0)
+    {
+      fprintf(stderr, "[command] payload truncated (%d/%d bytes)\n", pos, size);
+      return 0;
+    }
+    pos += n;
+  }
+  return 1;
+}
+
+static void interpret_payload(struct persistent_state *ps,
+                              ui_state *ui,
+                              struct editor_command *cmd,
+                              stdin_cursor *in)
+{
+  if (cmd->tag == EDIT_OPEN)
+  {
+    if (editing_will_open(ps->ctx, ui->eng, ps->doc_path, cmd->open.path))
+      flush_changes(ps, ui);
+    fz_buffer *buf = NULL;
+    fz_var(buf);
+    fz_try(ps->ctx)
+    {
+      buf = fz_new_buffer(ps->ctx, fz_maxi(cmd->open.length, 1));
+    }
+    fz_catch(ps->ctx)
+    {
+      fprintf(stderr, "[command] open %s: cannot allocate %d bytes: %s\n",
+              cmd->open.path, cmd->open.length, fz_caught_message(ps->ctx));
+      read_payload(in, NULL, cmd->open.length);
+      return;
+    }
+    if (!read_payload(in, (char *)buf->data, cmd->open.length))
+    {
+      fz_drop_buffer(ps->ctx, buf);
+      return;
+    }
+    buf->len = cmd->open.length;
+    for (int i = 0; i < ui->root_count; i++)
+    {
+      if (ui->roots[i] == ui->eng)
+        continue;
+      follow_root(ui, ui->roots[i]);
+      editing_open(ps->ctx, ui->roots[i], ps->doc_path, cmd->open.path,
+                   buf->data, buf->len);
+    }
+    editor_set_muted(0);
+    editing_open_buffer(ps->ctx, ui->eng, ps->doc_path, cmd->open.path, buf);
+  }
+  else
+  {
+    flush_changes(ps, ui);
+    char *data = NULL;
+    fz_var(data);
+    fz_try(ps->ctx)
+    {
+      data = editing_change(ps->ctx, ui->eng, ps->doc_path, &cmd->change);
+    }
+    fz_catch(ps->ctx)
+    {
+      fprintf(stderr, "[command] change %s: %s\n", cmd->change.path,
+              fz_caught_message(ps->ctx));
+      data = NULL;
+    }
+    if (!read_payload(in, data, cmd->change.length) && data)
+      // Don't leave uninitialized bytes in the file
+      memset(data, ' ', cmd->change.length);
+
+    // Other roots receive a copy of the bytes read for the displayed one
+    if (!data)
       return;
+    struct editor_change op = cmd->change;
+    op.data = data;
+    for (int i = 0; i < ui->root_count; i++)
+    {
+      if (ui->roots[i] == ui->eng)
+        continue;
+      follow_root(ui, ui->roots[i]);
+      editing_change(ps->ctx, ui->roots[i], ps->doc_path, &op);
     }
+    editor_set_muted(0);
   }
+}
 
-  fileentry_t *e = send(find_file, ui->eng, ps->ctx, path);
-  if (!e)
+static void select_root(struct persistent_state *ps, ui_state *ui,
+                        const char *path)
+{
+  int go_up = 0;
+  if (path[0] == '/')
+    path = editing_relative_path(path, ps->doc_path, &go_up);
+
+  int index = -1;
+  for (int i = 0; i < ui->root_count && go_up == 0; i++)
+    if (strcmp(ui->root_names[i], path) == 0)
+      index = i;
+
+  if (index == -1)
   {
-    fprintf(stderr, "[command] register %s: file not found, skipping\n", path);
+    fprintf(stderr, "[command] select-root %s: unknown document\n", path);
     return;
   }
+  fprintf(stderr, "[command] select-root %s\n", path);
+  if (index == ui->root)
+    return;
+
+  ui->root_pages[ui->root] = ui->page;
+  ui->root = index;
+  ui->eng = ui->roots[index];
+  ui->page = ui->root_pages[index];
+  synctex_set_target(send(synctex, ui->eng, NULL), 0, NULL, 0);
 
-  e->promised = true;
-  fprintf(stderr, "[command] register %s: marked as promised\n", path);
+  // The editor was following the previous root
+  send(resend_outputs, ui->eng);
+  schedule_event(RELOAD_EVENT);
+}
+
+// Display the next page containing `text`: starting from the displayed page
+// for a new search, from the following one when the search is repeated.
+static void search_text(struct persistent_state *ps, ui_state *ui,
+                        const char *text)
+{
+  fz_context *ctx = ps->ctx;
+  bool again = ui->search && strcmp(ui->search, text) == 0;
+
+  fz_free(ctx, ui->search);
+  ui->search = NULL;
+
+  if (!*text)
+  {
+    // An empty search clears the highlight
+    editor_search_result(text, 0, 0);
+    schedule_event(RELOAD_EVENT);
+    return;
+  }
+  ui->search = fz_strdup(ctx, text);
+
+  trace_time start = trace_now();
+  int page_count = send(page_count, ui->eng);
+  int from = again ? ui->page + 1 : ui->page;
+  int found = -1, pages = 0;
+  fz_buffer *needle = txp_text_normalize(ctx, text, strlen(text));
+
+  fz_try(ctx)
+  {
+    for (int i = 0; i < page_count; i++)
+    {
+      fz_buffer *page_text = send(page_text, ui->eng, ctx, i);
+      if (!page_text)
+        continue;
+      if (txp_text_contains(page_text, needle))
+      {
+        pages += 1;
+        if (found < from && (found == -1 || i >= from))
+          found = i;
+      }
+      fz_drop_buffer(ctx, page_text);
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_drop_buffer(ctx, needle);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[command] search: %s\n", fz_caught_message(ctx));
+  }
+  trace_span("search", "pages", start, pages);
+
+  fprintf(stderr, "[command] search \"%s\": %d pages\n", text, pages);
+  editor_search_result(text, found + 1, pages);
+
+  if (found != -1 && found != ui->page)
+  {
+    synctex_set_target(send(synctex, ui->eng, NULL), 0, NULL, 0);
+    ui->page = found;
+    pan_to(ctx, ui, PAN_TO_TOP);
+  }
+  schedule_event(RELOAD_EVENT);
 }
 
 static void interpret_command(struct persistent_state *ps,
                               ui_state *ui,
                               vstack *stack,
-                              val command)
+                              val command,
+                              stdin_cursor *in)
 {
   struct editor_command cmd;
   if (!editor_parse(ps->ctx, stack, command, &cmd))
+  {
+    int size = editor_payload_size(ps->ctx, stack, command);
+    if (size >= 0)
+    {
+      fprintf(stderr, "[command] skipping payload of %d bytes\n", size);
+      read_payload(in, NULL, size);
+    }
     return;
+  }
+
+  if ((cmd.tag == EDIT_OPEN && !cmd.open.data) ||
+      (cmd.tag == EDIT_CHANGE && !cmd.change.data))
+  {
+    interpret_payload(ps, ui, &cmd, in);
+    return;
+  }
 
   switch (cmd.tag)
   {
     case EDIT_OPEN:
-      if (cmd.open.base64)
+      if (editing_will_open(ps->ctx, ui->eng, ps->doc_path, cmd.open.path))
+        flush_changes(ps, ui);
+      for (int i = 0; i < ui->root_count; i++)
       {
-        unsigned char *buf = malloc(cmd.open.length);
-        if (!buf) break;
-        memcpy(buf, cmd.open.data, cmd.open.length);
-        int decoded_len = base64_decode(buf, cmd.open.length);
-        if (decoded_len < 0)
-        {
-          fprintf(stderr, "[command] open-base64: invalid base64 data\n");
-          free(buf);
-          break;
-        }
-        interpret_open(ps, ui, cmd.open.path, (const char *)buf, decoded_len);
-        free(buf);
+        follow_root(ui, ui->roots[i]);
+        if (cmd.open.base64)
+          editing_open_base64(ps->ctx, ui->roots[i], ps->doc_path,
+                              cmd.open.path, cmd.open.data, cmd.open.length);
+        else
+          editing_open(ps->ctx, ui->roots[i], ps->doc_path, cmd.open.path,
+                       cmd.open.data, cmd.open.length);
       }
-      else
-        interpret_open(ps, ui, cmd.open.path, cmd.open.data, cmd.open.length);
+      editor_set_muted(0);
       break;
 
     case EDIT_CLOSE:
-      interpret_close(ps, ui, cmd.close.path);
+      if (editing_will_close(ps->ctx, ui->eng, ps->doc_path, cmd.close.path))
+        flush_changes(ps, ui);
+      for (int i = 0; i < ui->root_count; i++)
+      {
+        follow_root(ui, ui->roots[i]);
+        editing_close(ps->ctx, ui->roots[i], ps->doc_path, cmd.close.path);
+      }
+      editor_set_muted(0);
       break;
 
     case EDIT_CHANGE:
@@ -1049,7 +988,7 @@ static void interpret_command(struct persistent_state *ps,
       fz_buffer *buf;
       synctex_t *stx = send(synctex, ui->eng, &buf);
       int go_up = 0;
-      const char *path = relative_path(cmd.synctex_forward.path, ps->doc_path, &go_up);
+      const char *path = editing_relative_path(cmd.synctex_forward.path, ps->doc_path, &go_up);
       if (go_up > 0)
       {
         fprintf(stderr,
@@ -1082,7 +1021,12 @@ static void interpret_command(struct persistent_state *ps,
     break;
 
     case EDIT_REGISTER:
-      interpret_register(ps, ui, cmd.reg.path);
+      for (int i = 0; i < ui->root_count; i++)
+      {
+        follow_root(ui, ui->roots[i]);
+        editing_register(ps->ctx, ui->roots[i], ps->doc_path, cmd.reg.path);
+      }
+      editor_set_muted(0);
       break;
 
     case EDIT_PAUSE:
@@ -1093,24 +1037,82 @@ static void interpret_command(struct persistent_state *ps,
     case EDIT_RESUME:
       ps->paused = false;
       fprintf(stderr, "[command] resume: engine stepping enabled\n");
-      // Spawn the worker if -stream started paused (no-op otherwise)
-      send(step, ui->eng, ps->ctx, true);
+      // Spawn the workers if -stream started paused (no-op otherwise)
+      for (int i = 0; i < ui->root_count; i++)
+      {
+        follow_root(ui, ui->roots[i]);
+        send(step, ui->roots[i], ps->ctx, true);
+      }
+      editor_set_muted(0);
       schedule_event(SCAN_EVENT);
       break;
+
+    case EDIT_EXPORT_TRACE:
+      trace_export(cmd.export_trace.path);
+      break;
+
+    case EDIT_EXPORT_PDF:
+      txp_export_pdf(ps->ctx, ui->eng, cmd.export_pdf.path);
+      break;
+
+    case EDIT_PROFILE:
+      send(set_profiling, ui->eng, ps->ctx, cmd.profile.status);
+      break;
+
+    case EDIT_SELECT_ROOT:
+      flush_changes(ps, ui);
+      select_root(ps, ui, cmd.select_root.path);
+      break;
+
+    case EDIT_SEARCH:
+      search_text(ps, ui, cmd.search.text);
+      break;
   }
 }
 
 /* Entry point */
 
+static txp_engine *create_engine(struct persistent_state *ps,
+                                 const char *doc_name,
+                                 const char *engine_path,
+                                 bool using_texlive,
+                                 dvi_resmanager **rm)
+{
+  const char *doc_ext = NULL;
+
+  for (const char *ptr = doc_name; *ptr; ptr++)
+    if (*ptr == '.')
+      doc_ext = ptr + 1;
+
+  if (doc_ext && strcmp(doc_ext, "pdf") == 0)
+    return txp_create_pdf_engine(ps->ctx, doc_name, engine_notify);
+
+  if (!*rm)
+    *rm = dvi_resmanager_new(ps->ctx,
+                             using_texlive
+                               ? dvi_texlive_hooks(ps->ctx, ps->doc_path)
+                               : dvi_tectonic_hooks(ps->ctx, ps->doc_path));
+
+  if (doc_ext && (strcmp(doc_ext, "dvi") == 0 || strcmp(doc_ext, "xdv") == 0))
+    return txp_create_dvi_engine(ps->ctx, doc_name, *rm,
+                                 ps->follow ? engine_notify : NULL);
+
+  return txp_create_tex_engine(ps->ctx, engine_path, using_texlive,
+                               ps->stream_mode, ps->inclusion_path,
+                               doc_name, *rm);
+}
+
 bool texpresso_main(struct persistent_state *ps)
 {
   editor_set_protocol(ps->protocol);
   editor_set_line_output(ps->line_output);
+  editor_set_binary_input(ps->binary_input);
   pstate = ps;
 
   ui_state raw_ui, *ui = &raw_ui;
 
   ui->window = ps->window;
+  ui->search = NULL;
 
   bool using_texlive = 0;
 
@@ -1143,33 +1145,31 @@ bool texpresso_main(struct persistent_state *ps)
     return 0;
   }
 
-  const char *doc_ext = NULL;
-
-  for (const char *ptr = ps->doc_name; *ptr; ptr++)
-    if (*ptr == '.')
-      doc_ext = ptr + 1;
-
   char engine_path[4096];
-  find_engine(engine_path, ps->exe_path);
+  startup_find_engine(engine_path, ps->exe_path);
   fprintf(stderr, "[info] engine path: %s\n", engine_path);
 
-  if (doc_ext && strcmp(doc_ext, "pdf") == 0)
-    ui->eng = txp_create_pdf_engine(ps->ctx, ps->doc_name);
-  else
+  // Roots share the file contents read from disk (see filesystem_read_file)
+  // and the fonts and graphics loaded by the DVI renderer
+  dvi_resmanager *rm = NULL;
+  ui->root_count = 1 + ps->other_root_count;
+  ui->root_names[0] = ps->doc_name;
+  for (int i = 0; i < ps->other_root_count; i++)
+    ui->root_names[i + 1] = ps->other_roots[i];
+  for (int i = 0; i < ui->root_count; i++)
   {
-    dvi_reshooks hooks;
-    if (using_texlive)
-      hooks = dvi_texlive_hooks(ps->ctx, ps->doc_path);
-    else
-      hooks = dvi_tectonic_hooks(ps->ctx, ps->doc_path);
-
-    if (doc_ext && (strcmp(doc_ext, "dvi") == 0 || strcmp(doc_ext, "xdv") == 0))
-      ui->eng = txp_create_dvi_engine(ps->ctx, ps->doc_name, hooks);
-    else
-      ui->eng = txp_create_tex_engine(ps->ctx, engine_path, using_texlive,
-                                      ps->stream_mode, ps->inclusion_path,
-                                      ps->doc_name, hooks);
+    ui->roots[i] = create_engine(ps, ui->root_names[i], engine_path,
+                                 using_texlive, &rm);
+    ui->root_pages[i] = 0;
   }
+  if (rm)
+    dvi_resmanager_drop(ps->ctx, rm);
+
+  ui->root = 0;
+  ui->next_background = 0;
+  if (ps->initial.initialized && ps->initial.root < ui->root_count)
+    ui->root = ps->initial.root;
+  ui->eng = ui->roots[ui->root];
 
   ui->sdl_renderer = ps->renderer;
   ui->doc_renderer = txp_renderer_new(ps->ctx, ui->sdl_renderer);
@@ -1195,10 +1195,18 @@ bool texpresso_main(struct persistent_state *ps)
   ui->last_mouse_x = -1000;
   ui->last_mouse_y = -1000;
   ui->last_click_ticks = SDL_GetTicks() - 200000000;
+  ui->advancing = ui->looking_ahead = 0;
 
   bool quit = 0, reload = 0;
   if (!ps->paused)
-    send(step, ui->eng, ps->ctx, true);
+  {
+    for (int i = 0; i < ui->root_count; i++)
+    {
+      follow_root(ui, ui->roots[i]);
+      send(step, ui->roots[i], ps->ctx, true);
+    }
+    editor_set_muted(0);
+  }
   render(ps->ctx, ui);
   schedule_event(RELOAD_EVENT);
 
@@ -1209,16 +1217,8 @@ bool texpresso_main(struct persistent_state *ps)
   prot_parser cmd_parser;
   prot_initialize(&cmd_parser, (ps->protocol == EDITOR_JSON));
 
-  // Start watching stdin
-  int poll_stdin_pipe[2];
-  if (pipe(poll_stdin_pipe) == -1)
-  {
-    perror("pipe");
-    abort();
-  }
-
-  SDL_Thread *poll_stdin_thread =
-    SDL_CreateThread(poll_stdin_thread_main, "poll_stdin_thread", poll_stdin_pipe);
+  // Watch stdin and the worker while waiting for SDL events
+  reactor_t *reactor = reactor_new(reactor_notify);
   bool stdin_eof = 0;
 
   while (!quit)
@@ -1227,7 +1227,7 @@ bool texpresso_main(struct persistent_state *ps)
     bool has_event = SDL_PollEvent(&e);
 
     // Process stdin
-    send(begin_changes, ui->eng, ps->ctx);
+    begin_changes_all(ps->ctx, ui);
     char buffer[4096];
     int n = -1;
     while (!stdin_eof && poll_stdin() && (n = read(STDIN_FILENO, buffer, 4096)) != 0)
@@ -1240,19 +1240,21 @@ bool texpresso_main(struct persistent_state *ps)
         break;
       }
 
-      fprintf(stderr, "stdin: %.*s\n", n, buffer);
+      // Binary payloads are not worth logging
+      if (!ps->binary_input)
+        fprintf(stderr, "stdin: %.*s\n", n, buffer);
 
-      const char *ptr = buffer, *lim = buffer + n;
+      stdin_cursor in = { .ptr = buffer, .lim = buffer + n };
       fz_try(ps->ctx)
       {
-        while ((ptr = prot_parse(ps->ctx, &cmd_parser, cmd_stack, ptr, lim)))
+        while ((in.ptr = prot_parse(ps->ctx, &cmd_parser, cmd_stack, in.ptr, in.lim)))
         {
           val cmds = vstack_get_values(ps->ctx, cmd_stack);
           int n_cmds = val_array_length(ps->ctx, cmd_stack, cmds);
           for (int i = 0; i < n_cmds; i++)
           {
             val cmd = val_array_get(ps->ctx, cmd_stack, cmds, i);
-            interpret_command(ps, ui, cmd_stack, cmd);
+            interpret_command(ps, ui, cmd_stack, cmd, &in);
           }
         }
       }
@@ -1266,17 +1268,19 @@ bool texpresso_main(struct persistent_state *ps)
     }
     if (n == 0) stdin_eof = 1;
 
-    if (send(end_changes, ui->eng, ps->ctx))
-    {
-      if (!ps->paused)
-        send(step, ui->eng, ps->ctx, true);
+    if (end_changes_all(ps->ctx, ui, ps->paused))
       schedule_event(RELOAD_EVENT);
-    }
 
     // Process document
     {
       int before_page_count = send(page_count, ui->eng);
-      bool advance = !ps->paused && advance_engine(ps->ctx, ui);
+      bool advance = !ps->paused && advance_engine(ps->ctx, ui, !stdin_eof);
+      // Reaching the displayed page comes first: other roots and the pages
+      // after it are only processed when it is available
+      if (!ps->paused && advance_lookahead(ps->ctx, ui))
+        advance = 1;
+      if (!ps->paused && !ui->advancing && advance_background(ps->ctx, ui))
+        advance = 1;
       int after_page_count = send(page_count, ui->eng);
       fflush(stdout);
 
@@ -1287,8 +1291,20 @@ bool texpresso_main(struct persistent_state *ps)
       {
         if (advance)
           continue;
-        if (!stdin_eof)
-          wakeup_poll_thread(poll_stdin_pipe, 'c');
+        // Wait for the displayed root if it has to advance or to look
+        // ahead, and for the other roots until they are complete (unless
+        // the displayed page is not available yet)
+        int worker_fds[MAX_ROOTS], worker_count = 0;
+        for (int i = 0; i < ui->root_count && !ps->paused; i++)
+        {
+          txp_engine *eng = ui->roots[i];
+          if (eng == ui->eng ? (ui->advancing || need_lookahead(ui))
+                             : (!ui->advancing &&
+                                send(get_status, eng) == DOC_RUNNING))
+            worker_fds[worker_count++] = send(wait_fd, eng);
+        }
+        reactor_arm(reactor, stdin_eof ? -1 : STDIN_FILENO,
+                    worker_fds, worker_count);
         has_event = SDL_WaitEvent(&e);
         if (!has_event)
         {
@@ -1469,7 +1485,7 @@ bool texpresso_main(struct persistent_state *ps)
     if (e.type == ps->custom_event)
     {
       int page_count;
-      *(char *)e.user.data1 = 0;
+      SDL_AtomicSet((SDL_atomic_t *)e.user.data1, 0);
       switch (e.user.code)
       {
         case SCAN_EVENT:
@@ -1478,27 +1494,19 @@ bool texpresso_main(struct persistent_state *ps)
             quit = reload = 1;
             continue;
           }
-          send(begin_changes, ui->eng, ps->ctx);
+          begin_changes_all(ps->ctx, ui);
           flush_changes(ps, ui);
-          send(detect_changes, ui->eng, ps->ctx);
-          if (send(end_changes, ui->eng, ps->ctx))
-          {
-            if (!ps->paused)
-              send(step, ui->eng, ps->ctx, true);
+          detect_changes_all(ps->ctx, ui);
+          if (end_changes_all(ps->ctx, ui, ps->paused))
             schedule_event(RELOAD_EVENT);
-          }
           break;
 
         case RENDER_EVENT:
           render(ps->ctx, ui);
-          send(begin_changes, ui->eng, ps->ctx);
+          begin_changes_all(ps->ctx, ui);
           flush_changes(ps, ui);
-          if (send(end_changes, ui->eng, ps->ctx))
-          {
-            if (!ps->paused)
-              send(step, ui->eng, ps->ctx, true);
+          if (end_changes_all(ps->ctx, ui, ps->paused))
             schedule_event(RELOAD_EVENT);
-          }
           break;
 
         case RELOAD_EVENT:
@@ -1514,6 +1522,7 @@ bool texpresso_main(struct persistent_state *ps)
           break;
 
         case STDIN_EVENT:
+        case WORKER_EVENT:
           break;
       }
     }
@@ -1526,19 +1535,14 @@ bool texpresso_main(struct persistent_state *ps)
     }
   }
 
-  {
-    int status = 0;
-    wakeup_poll_thread(poll_stdin_pipe, 'q');
-    SDL_WaitThread(poll_stdin_thread, &status);
-    close(poll_stdin_pipe[0]);
-    close(poll_stdin_pipe[1]);
-  }
+  reactor_free(reactor);
 
   SDL_DelEventWatch(repaint_on_resize, &repaint_on_resize_env);
 
   if (ps->initial.initialized && ps->initial.display_list)
     fz_drop_display_list(ps->ctx, ps->initial.display_list);
   ps->initial.initialized = 1;
+  ps->initial.root = ui->root;
   ps->initial.page = ui->page;
   ps->initial.need_synctex = ui->need_synctex;
   ps->initial.zoom = ui->zoom;
@@ -1548,7 +1552,9 @@ bool texpresso_main(struct persistent_state *ps)
     fz_keep_display_list(ps->ctx, ps->initial.display_list);
 
   txp_renderer_free(ps->ctx, ui->doc_renderer);
-  send(destroy, ui->eng, ps->ctx);
+  for (int i = 0; i < ui->root_count; i++)
+    send(destroy, ui->roots[i], ps->ctx);
+  fz_free(ps->ctx, ui->search);
 
   return reload;
 }
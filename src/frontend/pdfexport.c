@@ -0,0 +1,212 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include "pdfexport.h"
+#include "trace.h"
+
+typedef struct
+{
+  fz_document_writer *writer;
+  fz_display_list **lists;
+  int count;
+
+  // lists[written..produced) are waiting for the writer
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int written, produced;
+  bool failed;
+} export_job;
+
+static void write_page(fz_context *ctx, fz_document_writer *writer,
+                       fz_display_list *dl)
+{
+  fz_rect box = fz_bound_display_list(ctx, dl);
+  fz_device *dev = fz_begin_page(ctx, writer, box);
+  fz_run_display_list(ctx, dl, dev, fz_identity, fz_infinite_rect, NULL);
+  fz_end_page(ctx, writer);
+}
+
+// Write the pages produced so far, or, if `wait` is set, all pages as they
+// are produced. After a failure, pages are only released.
+static void write_pages(fz_context *ctx, export_job *job, bool wait)
+{
+  while (1)
+  {
+    pthread_mutex_lock(&job->lock);
+    int i = job->written;
+    while (wait && i >= job->produced && i < job->count)
+      pthread_cond_wait(&job->cond, &job->lock);
+    bool done = i >= job->produced || i >= job->count;
+    bool failed = job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (done)
+      break;
+
+    fz_display_list *dl = job->lists[i];
+    job->lists[i] = NULL;
+
+    if (!failed)
+    {
+      fz_try(ctx)
+        write_page(ctx, job->writer, dl);
+      fz_catch(ctx)
+      {
+        fprintf(stderr, "[export] cannot write page %d: %s\n", i + 1,
+                fz_caught_message(ctx));
+        pthread_mutex_lock(&job->lock);
+        job->failed = 1;
+        pthread_mutex_unlock(&job->lock);
+      }
+    }
+    fz_drop_display_list(ctx, dl);
+
+    pthread_mutex_lock(&job->lock);
+    job->written = i + 1;
+    pthread_mutex_unlock(&job->lock);
+  }
+}
+
+typedef struct
+{
+  fz_context *ctx;
+  export_job *job;
+} writer_thread;
+
+static void *writer_main(void *data)
+{
+  writer_thread *w = data;
+  write_pages(w->ctx, w->job, 1);
+  return NULL;
+}
+
+static void publish(export_job *job, int produced, bool failed)
+{
+  pthread_mutex_lock(&job->lock);
+  job->produced = produced;
+  if (failed)
+  {
+    job->failed = 1;
+    job->count = produced;
+  }
+  pthread_cond_signal(&job->cond);
+  pthread_mutex_unlock(&job->lock);
+}
+
+static bool has_failed(export_job *job)
+{
+  pthread_mutex_lock(&job->lock);
+  bool failed = job->failed;
+  pthread_mutex_unlock(&job->lock);
+  return failed;
+}
+
+int txp_export_pdf(fz_context *ctx, txp_engine *eng, const char *path)
+{
+  trace_time start = trace_now();
+  int count = send(page_count, eng);
+  // While running, the last page is not complete
+  if (send(get_status, eng) == DOC_RUNNING && count > 0)
+    count -= 1;
+
+  export_job job = {
+    .lists = calloc(count + 1, sizeof(fz_display_list *)),
+    .count = count,
+  };
+  if (!job.lists)
+    abort();
+
+  fz_try(ctx)
+    job.writer = fz_new_pdf_writer(ctx, path, "compress");
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[export] cannot open %s: %s\n", path,
+            fz_caught_message(ctx));
+    free(job.lists);
+    return -1;
+  }
+
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  // Only a context with locks can be cloned, write on this thread otherwise
+  writer_thread w = { .ctx = fz_clone_context(ctx), .job = &job };
+  pthread_t thread;
+  bool threaded = w.ctx && pthread_create(&thread, NULL, writer_main, &w) == 0;
+
+  for (int page = 0; page < count && !has_failed(&job); page++)
+  {
+    fz_display_list *dl = NULL;
+    fz_var(dl);
+
+    fz_try(ctx)
+      dl = send(render_page, eng, ctx, page);
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[export] cannot render page %d: %s\n", page + 1,
+              fz_caught_message(ctx));
+      publish(&job, page, 1);
+      break;
+    }
+
+    job.lists[page] = dl;
+    publish(&job, page + 1, 0);
+    if (!threaded)
+      write_pages(ctx, &job, 0);
+  }
+
+  // Stop the writer if production ended early
+  publish(&job, job.produced, job.produced < job.count);
+  if (threaded)
+    pthread_join(thread, NULL);
+  else
+    write_pages(ctx, &job, 0);
+  if (w.ctx)
+    fz_drop_context(w.ctx);
+
+  fz_try(ctx)
+  {
+    if (!job.failed)
+      fz_close_document_writer(ctx, job.writer);
+  }
+  fz_always(ctx)
+    fz_drop_document_writer(ctx, job.writer);
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[export] cannot write %s: %s\n", path,
+            fz_caught_message(ctx));
+    job.failed = 1;
+  }
+
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  free(job.lists);
+
+  trace_span("export", "pdf", start, job.count);
+  if (job.failed)
+    return -1;
+  fprintf(stderr, "[export] wrote %d pages to %s\n", job.count, path);
+  return job.count;
+}
@@ -0,0 +1,48 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef PDFEXPORT_H_
+#define PDFEXPORT_H_
+
+#include <stdbool.h>
+#include <mupdf/fitz.h>
+#include "engine.h"
+
+/* Export the document to PDF from the display lists of its pages.
+ *
+ * MuPDF's PDF writer replays each page display list, so no external
+ * xdvipdfmx run is needed. Display lists are produced on the calling thread
+ * (the engine is not thread-safe) while a second thread writes the pages
+ * already produced; this requires a context created with locking functions,
+ * otherwise everything happens on the calling thread.
+ *
+ * While the document is being typeset, only the pages that are complete are
+ * exported.
+ */
+
+// Write the pages of `eng` to `path`. Returns the number of pages written,
+// or -1 if the export failed.
+int txp_export_pdf(fz_context *ctx, txp_engine *eng, const char *path);
+
+#endif // PDFEXPORT_H_
@@ -0,0 +1,321 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <mupdf/fitz.h>
+#include "picache.h"
+#include "fz_util.h"
+
+#ifndef __APPLE__
+# define st_mtime_ns(st) ((st)->st_mtim.tv_nsec)
+#else
+# define st_mtime_ns(st) ((st)->st_mtimespec.tv_nsec)
+#endif
+
+#define PICACHE_MAGIC "texpresso-pic-bounds 1"
+
+typedef struct
+{
+  unsigned long hash;
+  char *path;
+  int type, page;
+  pic_fingerprint fp;
+  float bounds[4];
+} picentry;
+
+struct picache_s
+{
+  int count, cap;
+  picentry *table;
+
+  // Persistent storage, entries are appended as they are stored
+  FILE *file;
+};
+
+/* Fingerprints */
+
+void pic_fingerprint_stat(fz_context *ctx, const struct stat *st, pic_fingerprint *fp)
+{
+  int64_t fields[5] = {
+    st->st_dev, st->st_ino, st->st_size, st->st_mtime, st_mtime_ns(st)
+  };
+  fz_md5 md5;
+  fz_md5_init(&md5);
+  fz_md5_update(&md5, (const unsigned char *)fields, sizeof(fields));
+  fz_md5_final(&md5, fp->digest);
+}
+
+void pic_fingerprint_data(fz_context *ctx, fz_buffer *buf, pic_fingerprint *fp)
+{
+  fz_md5 md5;
+  fz_md5_init(&md5);
+  if (buf)
+    fz_md5_update(&md5, buf->data, buf->len);
+  fz_md5_final(&md5, fp->digest);
+}
+
+/* Hashtable */
+
+static unsigned long
+entry_hash(const char *path, int type, int page)
+{
+  unsigned long hash = 0;
+  int c;
+
+  while ((c = (unsigned char)*path++))
+    hash = c + (hash << 6) + (hash << 16) - hash;
+  hash = type + (hash << 6) + (hash << 16) - hash;
+  hash = page + (hash << 6) + (hash << 16) - hash;
+
+  return hash * 2654435761;
+}
+
+static picentry *table_get(int cap, picentry *table, unsigned long hash,
+                           const char *path, int type, int page)
+{
+  unsigned long mask = cap - 1;
+  int index = hash & mask;
+
+  while (table[index].path)
+  {
+    picentry *e = &table[index];
+    if (e->hash == hash && e->type == type && e->page == page &&
+        strcmp(e->path, path) == 0)
+      break;
+    index = (index + 1) & mask;
+  }
+  return &table[index];
+}
+
+static void table_grow(fz_context *ctx, picache_t *pc)
+{
+  int cap = pc->cap * 2;
+  picentry *table = fz_malloc_struct_array(ctx, cap, picentry);
+  for (int i = 0; i < pc->cap; ++i)
+  {
+    picentry *e = &pc->table[i];
+    if (e->path)
+      *table_get(cap, table, e->hash, e->path, e->type, e->page) = *e;
+  }
+  fz_free(ctx, pc->table);
+  pc->table = table;
+  pc->cap = cap;
+}
+
+// Returns true if the entry is new or changed
+static bool table_set(fz_context *ctx, picache_t *pc, const char *path,
+                      const pic_fingerprint *fp, const struct pic_cache *pic)
+{
+  unsigned long hash = entry_hash(path, pic->type, pic->page);
+  picentry *e = table_get(pc->cap, pc->table, hash, path, pic->type, pic->page);
+
+  if (e->path)
+  {
+    if (memcmp(&e->fp, fp, sizeof(*fp)) == 0 &&
+        memcmp(e->bounds, pic->bounds, sizeof(e->bounds)) == 0)
+      return 0;
+  }
+  else
+  {
+    e->hash = hash;
+    e->path = fz_strdup(ctx, path);
+    e->type = pic->type;
+    e->page = pic->page;
+    pc->count += 1;
+  }
+
+  e->fp = *fp;
+  memcpy(e->bounds, pic->bounds, sizeof(e->bounds));
+
+  if (pc->count * 4 >= pc->cap * 3)
+    table_grow(ctx, pc);
+
+  return 1;
+}
+
+/* Persistence */
+
+static void write_entry(FILE *f, const char *path, const pic_fingerprint *fp,
+                        const struct pic_cache *pic)
+{
+  for (int i = 0; i < 16; ++i)
+    fprintf(f, "%02x", fp->digest[i]);
+  fprintf(f, " %d %d %a %a %a %a %s\n", pic->type, pic->page,
+          pic->bounds[0], pic->bounds[1], pic->bounds[2], pic->bounds[3],
+          path);
+}
+
+static bool parse_entry(char *line, pic_fingerprint *fp, struct pic_cache *pic,
+                        const char **path)
+{
+  for (int i = 0; i < 16; ++i)
+  {
+    unsigned int byte;
+    if (sscanf(line + 2 * i, "%2x", &byte) != 1)
+      return 0;
+    fp->digest[i] = byte;
+  }
+
+  int n = 0;
+  if (sscanf(line + 32, " %d %d %a %a %a %a %n", &pic->type, &pic->page,
+             &pic->bounds[0], &pic->bounds[1],
+             &pic->bounds[2], &pic->bounds[3], &n) != 6 || n == 0)
+    return 0;
+
+  char *p = line + 32 + n;
+  size_t len = strlen(p);
+  if (len == 0 || p[len - 1] != '\n')
+    return 0;
+  p[len - 1] = 0;
+  *path = p;
+  return 1;
+}
+
+// Returns the number of lines read, or -1 if the file is not a cache
+static int load_entries(fz_context *ctx, picache_t *pc, FILE *f)
+{
+  char *line = NULL;
+  size_t cap = 0;
+  int lines = 0;
+
+  if (getline(&line, &cap, f) == -1 ||
+      strncmp(line, PICACHE_MAGIC "\n", sizeof(PICACHE_MAGIC)) != 0)
+  {
+    free(line);
+    return -1;
+  }
+
+  while (getline(&line, &cap, f) != -1)
+  {
+    pic_fingerprint fp;
+    struct pic_cache pic;
+    const char *path;
+    lines += 1;
+    if (parse_entry(line, &fp, &pic, &path))
+      table_set(ctx, pc, path, &fp, &pic);
+  }
+
+  free(line);
+  return lines;
+}
+
+// Rewrite the file with only the live entries
+static bool save_entries(picache_t *pc, const char *path)
+{
+  // Room for the path, a dot, a pid and the terminator
+  size_t size = strlen(path) + 24;
+  char *tmp = malloc(size);
+  if (!tmp)
+    return 0;
+  snprintf(tmp, size, "%s.%d", path, (int)getpid());
+
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+  {
+    free(tmp);
+    return 0;
+  }
+
+  fprintf(f, "%s\n", PICACHE_MAGIC);
+  for (int i = 0; i < pc->cap; ++i)
+  {
+    picentry *e = &pc->table[i];
+    if (!e->path)
+      continue;
+    struct pic_cache pic = {.type = e->type, .page = e->page};
+    memcpy(pic.bounds, e->bounds, sizeof(pic.bounds));
+    write_entry(f, e->path, &e->fp, &pic);
+  }
+
+  bool ok = fclose(f) == 0 && rename(tmp, path) == 0;
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  return ok;
+}
+
+picache_t *picache_new(fz_context *ctx, const char *path)
+{
+  picache_t *pc = fz_malloc_struct(ctx, picache_t);
+  pc->cap = 64;
+  pc->table = fz_malloc_struct_array(ctx, pc->cap, picentry);
+
+  if (!path)
+    return pc;
+
+  int lines = -1;
+  FILE *f = fopen(path, "r");
+  if (f)
+  {
+    lines = load_entries(ctx, pc, f);
+    fclose(f);
+    fprintf(stderr, "[picache] loaded %d entries from %s\n", pc->count, path);
+  }
+
+  // Compact the log when it is mostly made of stale entries
+  if (lines == -1 || (lines > 64 && lines > 2 * pc->count))
+    if (!save_entries(pc, path))
+      fprintf(stderr, "[picache] cannot write %s: %s\n", path, strerror(errno));
+
+  pc->file = fopen(path, "a");
+  if (!pc->file)
+    fprintf(stderr, "[picache] cannot open %s: %s\n", path, strerror(errno));
+
+  return pc;
+}
+
+void picache_free(fz_context *ctx, picache_t *pc)
+{
+  if (pc->file)
+    fclose(pc->file);
+  for (int i = 0; i < pc->cap; ++i)
+    if (pc->table[i].path)
+      fz_free(ctx, pc->table[i].path);
+  fz_free(ctx, pc->table);
+  fz_free(ctx, pc);
+}
+
+bool picache_get(picache_t *pc, const char *path, const pic_fingerprint *fp,
+                 int type, int page, float bounds[4])
+{
+  unsigned long hash = entry_hash(path, type, page);
+  picentry *e = table_get(pc->cap, pc->table, hash, path, type, page);
+  if (!e->path || memcmp(&e->fp, fp, sizeof(*fp)) != 0)
+    return 0;
+  memcpy(bounds, e->bounds, sizeof(e->bounds));
+  return 1;
+}
+
+void picache_set(fz_context *ctx, picache_t *pc, const char *path,
+                 const pic_fingerprint *fp, const struct pic_cache *pic)
+{
+  if (!table_set(ctx, pc, path, fp, pic) || !pc->file)
+    return;
+  write_entry(pc->file, path, fp, pic);
+  fflush(pc->file);
+}
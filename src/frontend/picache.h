@@ -0,0 +1,63 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef PICACHE_H_
+#define PICACHE_H_
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <mupdf/fitz/context.h>
+#include <mupdf/fitz/buffer.h>
+#include "sprotocol.h"
+
+/* Cache of picture bounds, answering GPIC/SPIC queries.
+ *
+ * Entries are indexed by (path, type, page) and remember a fingerprint of the
+ * file they were computed from: a lookup only succeeds if the file has not
+ * changed.  When backed by a file, entries are appended to it as they are
+ * stored and reloaded by the next session. */
+
+typedef struct picache_s picache_t;
+
+typedef struct {
+  unsigned char digest[16];
+} pic_fingerprint;
+
+// Fingerprint of a file as found on disk (device, inode, size and mtime)
+void pic_fingerprint_stat(fz_context *ctx, const struct stat *st, pic_fingerprint *fp);
+
+// Fingerprint of a file from its contents (for files not backed by the disk)
+void pic_fingerprint_data(fz_context *ctx, fz_buffer *buf, pic_fingerprint *fp);
+
+// Create a cache. If path is not NULL, load entries from it and
+// record new entries there.
+picache_t *picache_new(fz_context *ctx, const char *path);
+void picache_free(fz_context *ctx, picache_t *pc);
+
+bool picache_get(picache_t *pc, const char *path, const pic_fingerprint *fp,
+                 int type, int page, float bounds[4]);
+void picache_set(fz_context *ctx, picache_t *pc, const char *path,
+                 const pic_fingerprint *fp, const struct pic_cache *pic);
+
+#endif // PICACHE_H_
@@ -0,0 +1,269 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+#include "reactor.h"
+#include "sprotocol.h"
+
+#define REACTOR_WAKE 4
+
+struct reactor_s
+{
+  void (*notify)(enum reactor_source source);
+
+  // Main thread -> reactor thread: 'c' to re-arm, 'q' to quit
+  int wake[2];
+  pthread_t thread;
+#ifdef __linux__
+  int epfd;
+#endif
+
+  // Descriptors requested by the last reactor_arm call
+  pthread_mutex_t lock;
+  int want_stdin, want_worker_count;
+  int want_workers[REACTOR_MAX_WORKERS];
+};
+
+#ifdef __linux__
+static void epoll_watch(reactor_t *r, int fd, uint32_t source)
+{
+  struct epoll_event ev = {0,};
+  ev.events = EPOLLIN;
+  if (source != REACTOR_WAKE)
+    ev.events |= EPOLLONESHOT;
+  ev.data.u32 = source;
+
+  // The worker fd might have been closed and its number reused since the last
+  // time it was armed: always start from a fresh registration.
+  epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    perror("[reactor] epoll_ctl");
+}
+
+static void epoll_unwatch(reactor_t *r, int fd)
+{
+  // Fails harmlessly if the descriptor was closed since it was armed
+  epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+#endif
+
+// Stop watching descriptors armed by the reactor thread
+static void disarm_stdin(reactor_t *r, int *stdin_fd)
+{
+#ifdef __linux__
+  if (*stdin_fd != -1)
+    epoll_unwatch(r, *stdin_fd);
+#endif
+  *stdin_fd = -1;
+}
+
+static void disarm_workers(reactor_t *r, const int *worker_fds,
+                           int *worker_count)
+{
+#ifdef __linux__
+  for (int i = 0; i < *worker_count; i++)
+    epoll_unwatch(r, worker_fds[i]);
+#endif
+  *worker_count = 0;
+}
+
+static void *reactor_main(void *data)
+{
+  reactor_t *r = data;
+  int stdin_fd = -1, worker_count = 0;
+  int worker_fds[REACTOR_MAX_WORKERS];
+
+  while (1)
+  {
+    int ready = 0;
+    bool wake = 0;
+
+#ifdef __linux__
+    struct epoll_event evs[REACTOR_MAX_WORKERS + 2];
+    int n = epoll_wait(r->epfd, evs, REACTOR_MAX_WORKERS + 2, -1);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      pabort();
+    }
+    for (int i = 0; i < n; i++)
+    {
+      if (evs[i].data.u32 == REACTOR_WAKE)
+        wake = 1;
+      else
+        ready |= evs[i].data.u32;
+    }
+#else
+    struct pollfd fds[REACTOR_MAX_WORKERS + 2];
+    int nfds = 0;
+    fds[nfds++] = (struct pollfd){.fd = r->wake[0], .events = POLLRDNORM};
+    if (stdin_fd != -1)
+      fds[nfds++] = (struct pollfd){.fd = stdin_fd, .events = POLLRDNORM};
+    for (int i = 0; i < worker_count; i++)
+      fds[nfds++] = (struct pollfd){.fd = worker_fds[i], .events = POLLRDNORM};
+    int n = poll(fds, nfds, -1);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      pabort();
+    }
+    for (int i = 0; i < nfds; i++)
+    {
+      if (!(fds[i].revents & (POLLRDNORM | POLLHUP | POLLERR)))
+        continue;
+      if (fds[i].fd == r->wake[0])
+        wake = 1;
+      else if (fds[i].fd == stdin_fd)
+        ready |= REACTOR_STDIN;
+      else
+        ready |= REACTOR_WORKER;
+    }
+#endif
+
+    // One-shot: a source is not watched anymore after being reported, nor are
+    // the other workers armed with the one that became ready
+    if (ready & REACTOR_STDIN)
+    {
+      disarm_stdin(r, &stdin_fd);
+      r->notify(REACTOR_STDIN);
+    }
+    if (ready & REACTOR_WORKER)
+    {
+      disarm_workers(r, worker_fds, &worker_count);
+      r->notify(REACTOR_WORKER);
+    }
+
+    if (!wake)
+      continue;
+
+    char buf[64];
+    ssize_t len = read(r->wake[0], buf, sizeof(buf));
+    if (len == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      pabort();
+    }
+    if (len == 0)
+      return NULL;
+    for (ssize_t i = 0; i < len; i++)
+      if (buf[i] == 'q')
+        return NULL;
+
+    // Descriptors that are not wanted anymore must not wake the reactor
+    disarm_stdin(r, &stdin_fd);
+    disarm_workers(r, worker_fds, &worker_count);
+
+    pthread_mutex_lock(&r->lock);
+    stdin_fd = r->want_stdin;
+    worker_count = r->want_worker_count;
+    for (int i = 0; i < worker_count; i++)
+      worker_fds[i] = r->want_workers[i];
+    pthread_mutex_unlock(&r->lock);
+
+#ifdef __linux__
+    if (stdin_fd != -1)
+      epoll_watch(r, stdin_fd, REACTOR_STDIN);
+    for (int i = 0; i < worker_count; i++)
+      epoll_watch(r, worker_fds[i], REACTOR_WORKER);
+#endif
+  }
+}
+
+static void reactor_send(reactor_t *r, char c)
+{
+  while (1)
+  {
+    int n = write(r->wake[1], &c, 1);
+    if (n == 1)
+      break;
+    if (n == -1 && errno == EINTR)
+      continue;
+    perror("[reactor] write");
+    break;
+  }
+}
+
+reactor_t *reactor_new(void (*notify)(enum reactor_source source))
+{
+  reactor_t *r = calloc(1, sizeof(reactor_t));
+  if (!r)
+    pabort();
+
+  r->notify = notify;
+  r->want_stdin = -1;
+  pthread_mutex_init(&r->lock, NULL);
+
+  if (pipe(r->wake) == -1)
+    pabort();
+
+#ifdef __linux__
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (r->epfd == -1)
+    pabort();
+  epoll_watch(r, r->wake[0], REACTOR_WAKE);
+#endif
+
+  if (pthread_create(&r->thread, NULL, reactor_main, r) != 0)
+    pabort();
+
+  return r;
+}
+
+void reactor_free(reactor_t *r)
+{
+  reactor_send(r, 'q');
+  pthread_join(r->thread, NULL);
+#ifdef __linux__
+  close(r->epfd);
+#endif
+  close(r->wake[0]);
+  close(r->wake[1]);
+  pthread_mutex_destroy(&r->lock);
+  free(r);
+}
+
+void reactor_arm(reactor_t *r, int stdin_fd, const int *worker_fds,
+                 int worker_count)
+{
+  pthread_mutex_lock(&r->lock);
+  r->want_stdin = stdin_fd;
+  r->want_worker_count = 0;
+  for (int i = 0; i < worker_count && i < REACTOR_MAX_WORKERS; i++)
+    if (worker_fds[i] != -1)
+      r->want_workers[r->want_worker_count++] = worker_fds[i];
+  pthread_mutex_unlock(&r->lock);
+  reactor_send(r, 'c');
+}
@@ -0,0 +1,58 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <stdbool.h>
+
+/* The reactor watches the file descriptors the driver is waiting on (editor
+ * commands on stdin and the sockets of the active TeX workers) from a
+ * background thread.  It uses epoll on Linux and poll elsewhere.
+ *
+ * Watches are one-shot: when a descriptor becomes readable, the reactor calls
+ * `notify` once and stops watching it until the main thread calls
+ * `reactor_arm` again.  The main thread can thus block on SDL events only and
+ * be woken as soon as one of the descriptors is ready.
+ */
+
+typedef struct reactor_s reactor_t;
+
+#define REACTOR_MAX_WORKERS 8
+
+enum reactor_source {
+  REACTOR_STDIN = 1,
+  REACTOR_WORKER = 2,
+};
+
+reactor_t *reactor_new(void (*notify)(enum reactor_source source));
+void reactor_free(reactor_t *r);
+
+// Watch `stdin_fd` (-1 to ignore) and the `worker_count` descriptors of
+// `worker_fds` (at most REACTOR_MAX_WORKERS, -1 entries are ignored) until one
+// becomes ready. Descriptors armed by a previous call are replaced.
+void reactor_arm(reactor_t *r, int stdin_fd, const int *worker_fds,
+                 int worker_count);
+
+#endif // REACTOR_H_
@@ -23,9 +23,16 @@
  */
 
 #include "renderer.h"
+#include "trace.h"
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 static float clampf(float x, float min, float max)
 {
@@ -46,6 +53,20 @@ typedef struct
   float scale;
 } texture_state;
 
+// Pages are rendered black on white, then each channel is remapped linearly
+// so that black becomes the foreground color and white the background:
+//   out = round((v * light + (255 - v) * dark) / 255)
+// The mapping is tabulated for the scalar path; the SIMD kernels compute the
+// same function 16 pixels at a time.
+typedef struct
+{
+  bool identity;
+  uint8_t dark[3], light[3];
+  uint8_t lut[3][256];
+  // 16-bit coefficients for the 6 groups of 8 bytes of a 48 bytes block
+  uint16_t coef_dark[6][8], coef_light[6][8];
+} color_theme;
+
 #define SELECTION_RECT_COUNT 400
 
 struct txp_renderer_s
@@ -68,6 +89,7 @@ struct txp_renderer_s
   fz_point scale_factor;
 
   uint32_t cached_bg, cached_fg;
+  color_theme theme;
 };
 
 static void txp_get_colors(txp_renderer_config *config, uint32_t *bg, uint32_t *fg)
@@ -91,6 +113,30 @@ static void txp_get_colors(txp_renderer_config *config, uint32_t *bg, uint32_t *
   *bg = cbg;
 }
 
+static unsigned div255(unsigned x)
+{
+  x += 128;
+  return (x + (x >> 8)) >> 8;
+}
+
+static void theme_init(color_theme *t, uint32_t bg, uint32_t fg)
+{
+  t->identity = (bg == 0xFFFFFF && fg == 0x000000);
+  for (int c = 0; c < 3; ++c)
+  {
+    // BGR order
+    t->dark[c] = (fg >> (8 * c)) & 0xFF;
+    t->light[c] = (bg >> (8 * c)) & 0xFF;
+    for (int v = 0; v < 256; ++v)
+      t->lut[c][v] = div255(v * t->light[c] + (255 - v) * t->dark[c]);
+  }
+  for (int i = 0; i < 48; ++i)
+  {
+    t->coef_dark[i / 8][i % 8] = t->dark[i % 3];
+    t->coef_light[i / 8][i % 8] = t->light[i % 3];
+  }
+}
+
 txp_renderer *txp_renderer_new(fz_context *ctx, SDL_Renderer *sdl)
 {
   txp_renderer *self;
@@ -103,6 +149,7 @@ txp_renderer *txp_renderer_new(fz_context *ctx, SDL_Renderer *sdl)
     self->config.foreground_color = 0x000000;
     self->config.themed_color = 1;
     self->config.invert_color = 0;
+    theme_init(&self->theme, 0xFFFFFF, 0x000000);
   }
   fz_catch(ctx)
   {
@@ -315,39 +362,82 @@ static int fz_irect_area(fz_irect r)
   return (r.x1 - r.x0) * (r.y1 - r.y0);
 }
 
-#define remap(v, bp, wp) (bp) + ((v) * (wp - bp)) / 255
-
-static void invert_pixmap(fz_context *ctx, fz_pixmap *pix, uint32_t black, uint32_t white)
+// Apply the theme to `len` bytes (a whole number of pixels) from `src` to
+// `dst`, which can be equal.
+static void theme_bytes(const color_theme *t, uint8_t *dst, const uint8_t *src,
+                        int len)
 {
-  uint8_t *data0 = fz_pixmap_samples(ctx, pix);
-  int stride = fz_pixmap_stride(ctx, pix);
-  int width = fz_pixmap_width(ctx, pix);
-  int height = fz_pixmap_height(ctx, pix);
-
-  // 0x282c34
-  uint8_t dark[3] = {
-      (black >> 0) & 0xFF,
-      (black >> 8) & 0xFF,
-      (black >> 16) & 0xFF,
-  };
-  uint8_t light[3] = {
-      (white >> 0) & 0xFF,
-      (white >> 8) & 0xFF,
-      (white >> 16) & 0xFF,
-  };
+  int i = 0;
 
-  for (int y = 0; y < height; ++y)
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i full = _mm_set1_epi16(255);
+  const __m128i half = _mm_set1_epi16(128);
+  for (; i + 48 <= len; i += 48)
   {
-    uint8_t *data = data0 + stride * y;
-    for (int x = 0; x < width; ++x, data += 3)
+    __m128i out[3];
+    for (int k = 0; k < 3; ++k)
     {
-      data[0] = remap(data[0], dark[0], light[0]);
-      data[1] = remap(data[1], dark[1], light[1]);
-      data[2] = remap(data[2], dark[2], light[2]);
+      __m128i v = _mm_loadu_si128((const __m128i *)(src + i + 16 * k));
+      __m128i r[2];
+      for (int h = 0; h < 2; ++h)
+      {
+        __m128i x = h ? _mm_unpackhi_epi8(v, zero) : _mm_unpacklo_epi8(v, zero);
+        __m128i l = _mm_loadu_si128((const __m128i *)t->coef_light[2 * k + h]);
+        __m128i d = _mm_loadu_si128((const __m128i *)t->coef_dark[2 * k + h]);
+        x = _mm_add_epi16(_mm_mullo_epi16(x, l),
+                          _mm_mullo_epi16(_mm_sub_epi16(full, x), d));
+        x = _mm_add_epi16(x, half);
+        r[h] = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+      }
+      out[k] = _mm_packus_epi16(r[0], r[1]);
     }
+    for (int k = 0; k < 3; ++k)
+      _mm_storeu_si128((__m128i *)(dst + i + 16 * k), out[k]);
+  }
+#elif defined(__ARM_NEON)
+  uint8x16_t full = vdupq_n_u8(255);
+  uint8x8_t dark[3], light[3];
+  for (int c = 0; c < 3; ++c)
+  {
+    dark[c] = vdup_n_u8(t->dark[c]);
+    light[c] = vdup_n_u8(t->light[c]);
+  }
+  for (; i + 48 <= len; i += 48)
+  {
+    uint8x16x3_t px = vld3q_u8(src + i);
+    for (int c = 0; c < 3; ++c)
+    {
+      uint8x16_t v = px.val[c], nv = vsubq_u8(full, v);
+      uint16x8_t lo = vmull_u8(vget_low_u8(v), light[c]);
+      uint16x8_t hi = vmull_u8(vget_high_u8(v), light[c]);
+      lo = vaddq_u16(vmlal_u8(lo, vget_low_u8(nv), dark[c]), vdupq_n_u16(128));
+      hi = vaddq_u16(vmlal_u8(hi, vget_high_u8(nv), dark[c]), vdupq_n_u16(128));
+      px.val[c] = vcombine_u8(vshrn_n_u16(vsraq_n_u16(lo, lo, 8), 8),
+                              vshrn_n_u16(vsraq_n_u16(hi, hi, 8), 8));
+    }
+    vst3q_u8(dst + i, px);
+  }
+#endif
+
+  for (; i < len; i += 3)
+  {
+    dst[i + 0] = t->lut[0][src[i + 0]];
+    dst[i + 1] = t->lut[1][src[i + 1]];
+    dst[i + 2] = t->lut[2][src[i + 2]];
   }
 }
 
+// Apply the theme to pixels rendered in place, in the texture memory
+static void theme_pixels(const color_theme *t, uint8_t *pixels, int pitch,
+                         int width, int height)
+{
+  if (t->identity)
+    return;
+  for (int y = 0; y < height; ++y)
+    theme_bytes(t, pixels + pitch * y, pixels + pitch * y, width * 3);
+}
+
 static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels, int pitch,
                         int x, int y, fz_irect r, float scale)
 {
@@ -374,11 +464,6 @@ static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, voi
   fz_run_display_list(ctx, self->contents, dev, fz_identity, bounds, NULL);
   fz_close_device(ctx, dev);
   fz_drop_device(ctx, dev);
-
-  uint32_t bg, fg;
-  txp_get_colors(&self->config, &bg, &fg);
-  //if (bg != 0x00FFFFFF || fg != 0x00000000)
-    invert_pixmap(ctx, pm, fg, bg);
   fz_drop_pixmap(ctx, pm);
 }
 
@@ -388,17 +473,37 @@ static void render_inc_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds,
   render_rect(ctx, self, bounds, pixels, 0, x + r.x0 - n.x0, y + r.y0 - n.y0, r, scale);
 }
 
-static void update_sdl_texture(SDL_Texture *t, int pitch, void *pixels,
+// Upload pixels to the texture, applying the theme while copying so that
+// they are touched only once
+static void update_sdl_texture(SDL_Texture *t, const color_theme *theme,
+                               int pitch, uint8_t *pixels,
                                int x0, int y0, int x1, int y1)
 {
   if (x0 < x1 && y0 < y1)
   {
     SDL_Rect r = (SDL_Rect){.x=x0, .y=y0, .w=x1-x0, .h=y1-y0};
-    SDL_UpdateTexture(t, &r, pixels, pitch);
+    if (theme->identity)
+    {
+      SDL_UpdateTexture(t, &r, pixels, pitch);
+      return;
+    }
+
+    void *dst;
+    int dst_pitch;
+    if (SDL_LockTexture(t, &r, &dst, &dst_pitch) != 0)
+    {
+      fprintf(stderr, "[render] cannot lock texture: %s\n", SDL_GetError());
+      return;
+    }
+    for (int y = 0; y < r.h; ++y)
+      theme_bytes(theme, (uint8_t *)dst + dst_pitch * y, pixels + pitch * y,
+                  r.w * 3);
+    SDL_UnlockTexture(t);
   }
 }
 
-static void upload_texture_rect(SDL_Texture *tex, fz_irect rect, void *pixels)
+static void upload_texture_rect(SDL_Texture *tex, const color_theme *theme,
+                                fz_irect rect, uint8_t *pixels)
 {
   // Size of target texture
   int tw, th;
@@ -457,7 +562,7 @@ static void upload_texture_rect(SDL_Texture *tex, fz_irect rect, void *pixels)
       //         x[i].c1 - x[i].c0, y[j].c1 - y[j].c0);
       // fprintf(stderr, " delta = %d (dx:%d dy:%d)\n", x[i].delta + y[j].delta,
       //         x[i].delta / 3, y[j].delta / pitch);
-      update_sdl_texture(tex, pitch, pixels + x[i].delta + y[j].delta, x[i].c0,
+      update_sdl_texture(tex, theme, pitch, pixels + x[i].delta + y[j].delta, x[i].c0,
                          y[j].c0, x[i].c1, y[j].c1);
     }
 }
@@ -477,22 +582,6 @@ static void render_sdl_texture(SDL_Renderer *r, SDL_Texture *t,
 }
 
 
-typedef struct timespec stopclock_t;
-
-static void stopclock_start(stopclock_t *sc)
-{
-  clock_gettime(CLOCK_MONOTONIC, sc);
-}
-
-static int stopclock_reset_us(stopclock_t *sc)
-{
-  stopclock_t stop;
-  clock_gettime(CLOCK_MONOTONIC, &stop);
-  int result = ((stop.tv_sec - sc->tv_sec) * 1000 * 1000) + (stop.tv_nsec - sc->tv_nsec) / 1000;
-  *sc = stop;
-  return result;
-}
-
 static void render_texture_rect(SDL_Renderer *self, int rx, int ry, SDL_Texture *t, fz_irect rect)
 {
   // Size of source texture
@@ -613,43 +702,44 @@ static void update_texture(fz_context *ctx,
 
       void *pixels = self->scratch->data;
 
-      stopclock_t sc;
-      stopclock_start(&sc);
-
       if (!fz_is_empty_irect(tl))
       {
+        trace_time start = trace_now();
         render_inc_rect(ctx, self, bounds, pixels, x, y, n, tl, scale);
-        fprintf(stderr, "render tl: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, tl, pixels);
-        fprintf(stderr, "upload tl: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  tl: %d pixels\n", fz_irect_area(tl));
+        trace_span("render", "raster tl", start, fz_irect_area(tl));
+        start = trace_now();
+        upload_texture_rect(self->tex, &self->theme, tl, pixels);
+        trace_span("render", "upload tl", start, fz_irect_area(tl));
       }
 
       if (!fz_is_empty_irect(tr))
       {
+        trace_time start = trace_now();
         render_inc_rect(ctx, self, bounds, pixels, x, y, n, tr, scale);
-        fprintf(stderr, "render tr: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, tr, pixels);
-        fprintf(stderr, "upload tr: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  tr: %d pixels\n", fz_irect_area(tr));
+        trace_span("render", "raster tr", start, fz_irect_area(tr));
+        start = trace_now();
+        upload_texture_rect(self->tex, &self->theme, tr, pixels);
+        trace_span("render", "upload tr", start, fz_irect_area(tr));
       }
 
       if (!fz_is_empty_irect(bl))
       {
+        trace_time start = trace_now();
         render_inc_rect(ctx, self, bounds, pixels, x, y, n, bl, scale);
-        fprintf(stderr, "render bl: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, bl, pixels);
-        fprintf(stderr, "upload bl: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  bl: %d pixels\n", fz_irect_area(bl));
+        trace_span("render", "raster bl", start, fz_irect_area(bl));
+        start = trace_now();
+        upload_texture_rect(self->tex, &self->theme, bl, pixels);
+        trace_span("render", "upload bl", start, fz_irect_area(bl));
       }
 
       if (!fz_is_empty_irect(br))
       {
+        trace_time start = trace_now();
         render_inc_rect(ctx, self, bounds, pixels, x, y, n, br, scale);
-        fprintf(stderr, "render br: %dus\n", stopclock_reset_us(&sc));
-        upload_texture_rect(self->tex, br, pixels);
-        fprintf(stderr, "upload br: %dus\n", stopclock_reset_us(&sc));
-        fprintf(stderr, "  br: %d pixels\n", fz_irect_area(br));
+        trace_span("render", "raster br", start, fz_irect_area(br));
+        start = trace_now();
+        upload_texture_rect(self->tex, &self->theme, br, pixels);
+        trace_span("render", "upload br", start, fz_irect_area(br));
       }
       done = 1;
     }
@@ -682,8 +772,12 @@ static void update_texture(fz_context *ctx,
     SDL_LockTexture(self->tex, &lock_rect, &pixels, &pitch);
   }
 
+  trace_time start = trace_now();
   fz_irect full_rect = fz_make_irect(0, 0, w, h);
   render_rect(ctx, self, bounds, pixels, pitch, x, y, full_rect, scale);
+  if (!STRESS)
+    theme_pixels(&self->theme, pixels, pitch, w, h);
+  trace_span("render", "raster", start, w * h);
 
   self->st.x = x;
   self->st.y = y;
@@ -708,7 +802,7 @@ static void update_texture(fz_context *ctx,
 
   if (STRESS)
   {
-    upload_texture_rect(self->tex, self->st.rect, pixels);
+    upload_texture_rect(self->tex, &self->theme, self->st.rect, pixels);
   }
 
   // fprintf(stderr, "[txp_renderer] updated texture, new pixels: %d\n", w * h);
@@ -754,6 +848,7 @@ void txp_renderer_render(fz_context *ctx, txp_renderer *self)
   {
     self->cached_bg = bg;
     self->cached_fg = fg;
+    theme_init(&self->theme, bg, fg);
     clear_texture(self);
   }
 
@@ -939,6 +1034,18 @@ bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt)
   return set_quads(ctx, self, &q, count);
 }
 
+bool txp_renderer_select_text(fz_context *ctx, txp_renderer *self, const char *needle)
+{
+  fz_stext_page *page = get_stext(ctx, self);
+  if (!page)
+    return 0;
+
+  fz_quad quads[SELECTION_RECT_COUNT];
+  int count = fz_search_stext_page(ctx, page, needle, NULL, quads,
+                                   SELECTION_RECT_COUNT);
+  return set_quads(ctx, self, quads, count);
+}
+
 bool txp_renderer_select_word(fz_context *ctx, txp_renderer *self, fz_point pt)
 {
   fz_stext_page *page = get_stext(ctx, self);
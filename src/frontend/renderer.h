@@ -78,6 +78,8 @@ bool txp_renderer_start_selection(fz_context *ctx, txp_renderer *self, fz_point
 bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point pt);
 bool txp_renderer_select_word(fz_context *ctx, txp_renderer *self, fz_point pt);
 bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt);
+// Select the occurrences of `needle` on the page (case insensitive)
+bool txp_renderer_select_text(fz_context *ctx, txp_renderer *self, const char *needle);
 void txp_renderer_screen_size(fz_context *ctx, txp_renderer *self, int *w, int *h);
 fz_point txp_renderer_screen_to_document(fz_context *ctx, txp_renderer *self, fz_point pt);
 fz_point txp_renderer_document_to_screen(fz_context *ctx, txp_renderer *self, fz_point pt);
@@ -219,6 +219,8 @@ const char *query_to_string(enum query q)
     CASE(Q,SPIC);
     CASE(Q,CHLD);
     CASE(Q,MTIM);
+    CASE(Q,PROF);
+    CASE(Q,DIAG);
   }
 }
 
@@ -242,6 +244,7 @@ const char *ask_to_string(enum ask q)
   switch (q)
   {
     CASE(C,FLSH);
+    CASE(C,SNAP);
   }
 }
 
@@ -423,6 +426,15 @@ void log_query(FILE *f, query_t *r)
     case Q_CHLD:
       fprintf(f, "CHLD(pid:%d, fd:%d)\n", r->chld.pid, r->chld.fd);
       return;
+    case Q_PROF:
+      fprintf(f, "PROF(%d)\n", r->prof.size);
+      return;
+    case Q_DIAG:
+      fprintf(f, "DIAG(%c%c%c%c, \"%s\", %d, \"%.*s\")\n",
+              r->diag.kind & 0xFF, (r->diag.kind >> 8) & 0xFF,
+              (r->diag.kind >> 16) & 0xFF, (r->diag.kind >> 24) & 0xFF,
+              r->diag.file, r->diag.line, r->diag.size, r->diag.msg);
+      return;
   }
   mabort();
 }
@@ -545,6 +557,26 @@ bool channel_read_query(channel_t *t, int fd, query_t *r)
         t->passed_fd = -1;
         break;
       }
+    case Q_PROF:
+      {
+        r->prof.size = read_u32(t, fd);
+        if (!read_bytes(t, fd, 0, r->prof.size))
+          return 0;
+        r->prof.buf = t->buf;
+        break;
+      }
+    case Q_DIAG:
+      {
+        r->diag.kind = read_u32(t, fd);
+        r->diag.line = read_u32(t, fd);
+        int pos_file = read_zstr(t, fd, &pos);
+        r->diag.size = read_u32(t, fd);
+        if (!read_bytes(t, fd, pos, r->diag.size))
+          return 0;
+        r->diag.file = &t->buf[pos_file];
+        r->diag.msg = &t->buf[pos];
+        break;
+      }
     default:
     {
       fprintf(stderr, "unexpected tag: %c%c%c%c\n",
@@ -566,6 +598,7 @@ void channel_write_ask(channel_t *t, int fd, ask_t *a)
   switch (a->tag)
   {
     case C_FLSH: break;
+    case C_SNAP: break;
     default: mabort();
   }
 }
@@ -61,6 +61,8 @@ enum query {
   Q_GPIC = PACK('G','P','I','C'),
   Q_SPIC = PACK('S','P','I','C'),
   Q_CHLD = PACK('C','H','L','D'),
+  Q_PROF = PACK('P','R','O','F'),
+  Q_DIAG = PACK('D','I','A','G'),
 };
 
 enum txp_file_kind
@@ -91,6 +93,13 @@ enum txp_file_kind
   TXP_KIND_OTHER         = PACK('O','T','H','R'),
 };
 
+enum txp_diag_kind
+{
+  TXP_DIAG_ERROR   = PACK('E','R','R', 0 ),
+  TXP_DIAG_WARNING = PACK('W','A','R','N'),
+  TXP_DIAG_BADBOX  = PACK('B','O','X', 0 ),
+};
+
 struct pic_cache {
   int type, page;
   float bounds[4];
@@ -139,6 +148,17 @@ typedef struct {
       char *path;
       struct pic_cache cache;
     } spic;
+    struct {
+      int size;
+      char *buf;
+    } prof;
+    struct {
+      enum txp_diag_kind kind;
+      int line;
+      char *file;
+      int size;
+      char *msg;
+    } diag;
   };
 } query_t;
 
@@ -182,6 +202,7 @@ typedef struct {
 
 enum ask {
   C_FLSH = PACK('F','L','S','H'),
+  C_SNAP = PACK('S','N','A','P'),
 };
 
 typedef struct {
@@ -215,4 +236,7 @@ void channel_flush(channel_t *t, int fd);
 void channel_reset(channel_t *t);
 
 void log_query(FILE *f, query_t *q);
+const char *query_to_string(enum query q);
+const char *answer_to_string(enum answer q);
+const char *ask_to_string(enum ask q);
 #endif /*!SPROTOCOL_H*/
@@ -0,0 +1,94 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "providers.h"
+#include "startup.h"
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#include <sys/syslimits.h>
+#else
+#include <linux/limits.h>
+#endif
+
+bool startup_executable_path(char *path, const char *argv0)
+{
+#ifdef __APPLE__
+  uint32_t size = PATH_MAX;
+  char exe_path[PATH_MAX];
+  if (_NSGetExecutablePath(exe_path, &size) == 0 && realpath(exe_path, path))
+    return 1;
+#else
+  if (realpath("/proc/self/exe", path))
+    return 1;
+#endif
+  return argv0 && realpath(argv0, path);
+}
+
+void startup_find_engine(char *engine_path, const char *exe_path)
+{
+  const char *basename = exe_path ? strrchr(exe_path, '/') : NULL;
+  if (basename)
+  {
+    snprintf(engine_path, PATH_MAX, "%.*s/texpresso-xetex",
+             (int)(basename - exe_path), exe_path);
+    if (access(engine_path, X_OK) == 0)
+      return;
+  }
+  strcpy(engine_path, "texpresso-xetex");
+}
+
+char *startup_inclusion_path(int argc, const char **argv)
+{
+  int size = 1;
+  for (int i = 1; i + 1 < argc; i++)
+    if (strcmp(argv[i], "-I") == 0)
+      size += 1 + strlen(argv[++i]);
+
+  char *inclusion_path = malloc(size);
+  if (!inclusion_path) abort();
+  char *p = inclusion_path;
+  for (int i = 1; i + 1 < argc; i++)
+    if (strcmp(argv[i], "-I") == 0)
+      p = stpcpy(p, argv[++i]) + 1;
+  *p = '\0';
+  return inclusion_path;
+}
+
+bool startup_use_texlive(bool use_texlive, bool use_tectonic)
+{
+  if (!use_tectonic && !use_texlive)
+    use_texlive = texlive_available();
+  if ((use_texlive && !texlive_available()) ||
+      (!use_texlive && !tectonic_available()))
+  {
+    fprintf(stderr, "[fatal] cannot find tectonic nor kpsewhich (texlive)\n");
+    exit(1);
+  }
+  return use_texlive;
+}
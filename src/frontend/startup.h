@@ -0,0 +1,50 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef STARTUP_H_
+#define STARTUP_H_
+
+#include <stdbool.h>
+
+/* Setup shared by the programs that drive TeX workers (texpresso,
+ * texpresso-bench and texpresso-headless). */
+
+// Absolute path of the running executable, falling back to `argv0`.
+// `path` has room for PATH_MAX bytes.
+bool startup_executable_path(char *path, const char *argv0);
+
+// Path of texpresso-xetex: next to `exe_path` if it is there, otherwise the
+// bare name, to be looked up in PATH. `exe_path` can be NULL, `engine_path`
+// has room for PATH_MAX bytes.
+void startup_find_engine(char *engine_path, const char *exe_path);
+
+// The directories of the "-I path" arguments as consecutive null-terminated
+// strings, followed by an empty one. Release with free().
+char *startup_inclusion_path(int argc, const char **argv);
+
+// Whether TeX packages are loaded from TeXlive rather than tectonic: the
+// requested provider, or the available one. Exit if it is missing.
+bool startup_use_texlive(bool use_texlive, bool use_tectonic);
+
+#endif // STARTUP_H_
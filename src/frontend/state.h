@@ -46,9 +46,6 @@ typedef struct fileentry_s {
   struct stat fs_stat;
   fz_buffer *fs_data;
 
-  // Cached picture information
-  struct pic_cache pic_cache;
-  
   // State of the file in the text editor (or NULL if unedited)
   fz_buffer *edit_data;
   bool promised;
@@ -85,6 +82,11 @@ fileentry_t *filesystem_lookup_or_create(fz_context *ctx, filesystem_t *fs, cons
 fileentry_t *filesystem_lookup(filesystem_t *fs, const char *path);
 fileentry_t *filesystem_scan(filesystem_t *fs, int *index);
 
+// Read a file from disk and store its status in `st`.
+// Contents are shared by all the engines of the process (for instance when
+// several documents load the same packages) until the file changes.
+fz_buffer *filesystem_read_file(fz_context *ctx, const char *path, struct stat *st);
+
 log_t *log_new(fz_context *ctx);
 void log_free(fz_context *ctx, log_t *log);
 mark_t log_snapshot(fz_context *ctx, log_t *log);
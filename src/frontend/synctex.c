@@ -121,6 +121,9 @@ struct synctex_s
   struct int_buffer input_off, page_off, close_off, close_inp;
   int bol, cur;
 
+  /* Whether the stream uses the binary encoding (detected from first byte) */
+  bool binary;
+
   /* Backward search state */
 
   /* Step 0. Initiating search. */
@@ -255,6 +258,43 @@ static const uint8_t *string_skip_prefix(const uint8_t *string, const char *pref
   return string;
 }
 
+static void record_page(fz_context *ctx, synctex_t *stx, int offset, int index, int is_closing)
+{
+  if (index != stx->page_off.len / 2 + 1 || is_closing != (stx->page_off.len & 1))
+  {
+    fprintf(stderr, "[synctex] Invalid page index: index=%d/is_closing=%d expected=%d/%d\n",
+            index, is_closing, stx->page_off.len / 2 + 1, stx->page_off.len & 1);
+    myabort();
+  }
+  ib_append(ctx, &stx->page_off, offset);
+}
+
+static void record_input(fz_context *ctx, synctex_t *stx, int offset, int index,
+                         const uint8_t *name, int len)
+{
+  if (index != stx->input_off.len + 1)
+  {
+    fprintf(stderr, "[synctex] Invalid input index: index=%d expected=%d\n",
+            index, stx->input_off.len + 1);
+    myabort();
+  }
+  ib_append(ctx, &stx->input_off, offset);
+  editor_notify_file_opened(index, (const char *)name, len);
+}
+
+static void record_close(fz_context *ctx, synctex_t *stx, int offset, int index)
+{
+  fprintf(stderr, "[synctex] Closed input: %d\n", index);
+  index -= 1;
+  if (index < 0 || index >= stx->input_off.len) myabort();
+  if (synctex_input_closed(ctx, stx, index))
+    myabort();
+  stx->input_off.ptr[index] = -stx->input_off.ptr[index];
+  if (stx->close_off.len != stx->close_inp.len) myabort();
+  ib_append(ctx, &stx->close_off, offset);
+  ib_append(ctx, &stx->close_inp, index);
+}
+
 static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, const uint8_t *bol, uint8_t *eol)
 {
   int index = 0;
@@ -265,15 +305,8 @@ static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, co
   {
     case '{': case '}':
     {
-      int is_closing = (c == '}');
       if (!(bol = string_parse_int(bol, &index))) break;
-      if (index != stx->page_off.len / 2 + 1 || is_closing != (stx->page_off.len & 1))
-      {
-        fprintf(stderr, "[synctex] Invalid page index: index=%d/is_closing=%d expected=%d/%d\n",
-                index, is_closing, stx->page_off.len / 2 + 1, stx->page_off.len & 1);
-        myabort();
-      }
-      ib_append(ctx, &stx->page_off, offset);
+      record_page(ctx, stx, offset, index, c == '}');
       break;
     }
 
@@ -282,29 +315,14 @@ static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, co
       if (!(bol = string_skip_prefix(bol, "nput:"))) break;
       if (!(bol = string_parse_int(bol, &index))) break;
       if (!(bol = string_skip_prefix(bol, ":"))) break;
-      if (index != stx->input_off.len + 1)
-      {
-        fprintf(stderr, "[synctex] Invalid input index: index=%d expected=%d\n",
-                index, stx->input_off.len + 1);
-        myabort();
-      }
-      ib_append(ctx, &stx->input_off, offset);
-      editor_notify_file_opened(index, (const char *)bol, eol - bol);
+      record_input(ctx, stx, offset, index, bol, eol - bol);
       break;
     }
 
     case '/':
     {
       if (!(bol = string_parse_int(bol, &index))) break;
-      fprintf(stderr, "[synctex] Closed input: %d\n", index);
-      index -= 1;
-      if (index < 0 || index >= stx->input_off.len) myabort();
-      if (synctex_input_closed(ctx, stx, index))
-        myabort();
-      stx->input_off.ptr[index] = -stx->input_off.ptr[index];
-      if (stx->close_off.len != stx->close_inp.len) myabort();
-      ib_append(ctx, &stx->close_off, offset);
-      ib_append(ctx, &stx->close_inp, index);
+      record_close(ctx, stx, offset, index);
       break;
     }
 
@@ -313,6 +331,133 @@ static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, co
   }
 }
 
+/* Binary encoding
+ *
+ * When talking to TeXpresso, the engine encodes SyncTeX records in binary
+ * (see xetex-synctex.c). The stream starts with a 0 byte. Each record is the
+ * character that would start the textual line, followed by integer fields as
+ * zigzag LEB128 varints. Tags, lines and positions are coded as differences
+ * with the previous record, starting from 0 at each sheet.
+ * An input record is followed by the file name, whose length is its second
+ * field.
+ */
+
+#define BIN_HEADER 0
+
+// Number of integer fields of a binary record, -1 for an unknown opcode
+static int bin_field_count(uint8_t op)
+{
+  switch (op)
+  {
+    case ')': case ']': case '>':
+      return 0;
+    case BIN_HEADER: case '{': case '}': case '<': case '/': case 'P':
+      return 1;
+    case 'O': case 'I':
+      return 2;
+    case 'f':
+      return 3;
+    case 'x': case 'g': case '$':
+      return 4;
+    case 'k':
+      return 5;
+    case '(': case '[': case 'h': case 'v': case 'r':
+      return 7;
+    default:
+      return -1;
+  }
+}
+
+static const uint8_t *bin_parse_int(const uint8_t *ptr, const uint8_t *lim, int *i)
+{
+  uint32_t u = 0;
+  for (int shift = 0; ptr < lim && shift < 35; shift += 7)
+  {
+    uint8_t b = *ptr++;
+    u |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80))
+    {
+      *i = (int)(u >> 1) ^ -(int)(u & 1);
+      return ptr;
+    }
+  }
+  return NULL;
+}
+
+// Size of the record starting at ptr, or 0 if it is not complete yet
+static int bin_record_size(const uint8_t *ptr, const uint8_t *lim)
+{
+  int count = bin_field_count(*ptr), value = 0;
+  if (count < 0)
+  {
+    fprintf(stderr, "[synctex] Invalid binary record: %d\n", *ptr);
+    myabort();
+  }
+
+  const uint8_t *p = ptr + 1;
+  for (int i = 0; i < count; i++)
+    if (!(p = bin_parse_int(p, lim, &value)))
+      return 0;
+
+  if (*ptr == 'I')
+  {
+    if (value < 0) myabort();
+    if (lim - p < value)
+      return 0;
+    p += value;
+  }
+
+  return p - ptr;
+}
+
+static void synctex_process_record(fz_context *ctx, synctex_t *stx, int offset,
+                                   const uint8_t *ptr, const uint8_t *lim)
+{
+  int index = 0, len = 0;
+  uint8_t c = *ptr++;
+
+  switch (c)
+  {
+    case '{': case '}':
+      bin_parse_int(ptr, lim, &index);
+      record_page(ctx, stx, offset, index, c == '}');
+      break;
+
+    case 'I':
+      ptr = bin_parse_int(ptr, lim, &index);
+      ptr = bin_parse_int(ptr, lim, &len);
+      record_input(ctx, stx, offset, index, ptr, len);
+      break;
+
+    case '/':
+      bin_parse_int(ptr, lim, &index);
+      record_close(ctx, stx, offset, index);
+      break;
+
+    default:
+      break;
+  }
+}
+
+// Rollbacks happen at snapshots, where the engine is between two records:
+// the binary stream is always cut at a record boundary.
+static void synctex_update_binary(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
+{
+  const uint8_t *ptr = buf->data, *lim = buf->data + buf->len;
+  int cur = stx->cur;
+
+  while (cur < buf->len)
+  {
+    int size = bin_record_size(ptr + cur, lim);
+    if (size == 0)
+      break;
+    synctex_process_record(ctx, stx, cur, ptr + cur, ptr + cur + size);
+    cur += size;
+  }
+
+  stx->bol = stx->cur = cur;
+}
+
 void synctex_update(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
 {
   int cur = stx->cur, len = buf->len;
@@ -324,6 +469,15 @@ void synctex_update(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
     return;
   }
 
+  if (cur == 0)
+    stx->binary = (buf->data[0] == BIN_HEADER);
+
+  if (stx->binary)
+  {
+    synctex_update_binary(ctx, stx, buf);
+    return;
+  }
+
   uint8_t *ptr = buf->data;
   int bol = stx->bol;
 
@@ -394,37 +548,6 @@ static const uint8_t *nextline(const uint8_t *ptr)
   return ptr + 1;
 }
 
-static const uint8_t *
-skip_tree(const uint8_t *ptr, uint8_t open, uint8_t close)
-{
-  int nest = 1;
-  while (nest > 0)
-  {
-    if (*ptr == open)
-      nest += 1;
-    else if (*ptr == close)
-      nest -= 1;
-    else if (*ptr == '}')
-      break;
-    ptr = nextline(ptr);
-  }
-  return ptr;
-}
-
-static const uint8_t *
-skip_record(const uint8_t *ptr, struct record *r)
-{
-  switch (r->kind)
-  {
-    case STEX_ENTER_H:
-      return skip_tree(ptr, '(', ')');
-    case STEX_ENTER_V:
-      return skip_tree(ptr, '[', ']');
-    default:
-      return ptr;
-  }
-}
-
 static _Bool
 parse_link(const uint8_t **ptr, struct link *link)
 {
@@ -544,6 +667,204 @@ parse_line(const uint8_t *ptr, struct record *r)
   return nextline(ptr);
 }
 
+/* Sequential access to the records of a page, in either encoding */
+
+struct reader
+{
+  const uint8_t *ptr, *lim;
+  bool binary;
+
+  // Base of the delta coding of binary records
+  struct link link;
+  struct point point;
+};
+
+static void reader_init(synctex_t *stx, fz_buffer *buf, int offset, struct reader *rd)
+{
+  *rd = (struct reader){
+    .ptr = buf->data + offset,
+    .lim = buf->data + buf->len,
+    .binary = stx->binary,
+  };
+}
+
+static const uint8_t *
+bin_parse_delta(const uint8_t *ptr, const uint8_t *lim, int *base)
+{
+  int delta = 0;
+  if ((ptr = bin_parse_int(ptr, lim, &delta)))
+    *base += delta;
+  return ptr;
+}
+
+static bool
+bin_read_record(struct reader *rd, struct record *r)
+{
+  const uint8_t *ptr = rd->ptr, *lim = rd->lim;
+  if (ptr >= lim || *ptr == '}')
+    return 0;
+
+  int has_node = 1, has_size = 0, has_width = 0;
+
+  *r = (struct record){0, };
+
+  if (*ptr == 'f')
+  {
+    // Form reference: not a node, but its point moves the base of the deltas
+    int objnum;
+    ptr += 1;
+    if (!(ptr = bin_parse_int(ptr, lim, &objnum)) ||
+        !(ptr = bin_parse_delta(ptr, lim, &rd->point.x)) ||
+        !(ptr = bin_parse_delta(ptr, lim, &rd->point.y)))
+      myabort();
+    r->kind = STEX_OTHER;
+    rd->ptr = ptr;
+    return 1;
+  }
+
+  switch (*ptr)
+  {
+    case 'x': r->kind = STEX_CURRENT; break;
+    case 'k': r->kind = STEX_KERN; has_width = 1; break;
+    case 'g': r->kind = STEX_GLUE; break;
+    case '$': r->kind = STEX_MATH; break;
+    case '(': r->kind = STEX_ENTER_H; has_size = 1; break;
+    case '[': r->kind = STEX_ENTER_V; has_size = 1; break;
+    case 'h': case 'v': case 'r':
+      r->kind = STEX_OTHER; has_size = 1; break;
+    case ')': r->kind = STEX_LEAVE_H; has_node = 0; break;
+    case ']': r->kind = STEX_LEAVE_V; has_node = 0; break;
+    case '{':
+      rd->link = (struct link){0, };
+      rd->point = (struct point){0, };
+      // fall through
+    default:
+      r->kind = STEX_OTHER; has_node = 0; break;
+  }
+
+  if (!has_node)
+  {
+    int size = bin_record_size(ptr, lim);
+    if (size == 0) myabort();
+    rd->ptr = ptr + size;
+    return 1;
+  }
+
+  ptr += 1;
+  if (!(ptr = bin_parse_delta(ptr, lim, &rd->link.tag)) ||
+      !(ptr = bin_parse_delta(ptr, lim, &rd->link.line)) ||
+      !(ptr = bin_parse_delta(ptr, lim, &rd->point.x)) ||
+      !(ptr = bin_parse_delta(ptr, lim, &rd->point.y)))
+    myabort();
+
+  r->link = rd->link;
+  r->link.column = -1;
+  r->point = rd->point;
+
+  if (has_width || has_size)
+    if (!(ptr = bin_parse_int(ptr, lim, &r->size.width)))
+      myabort();
+
+  if (has_size)
+    if (!(ptr = bin_parse_int(ptr, lim, &r->size.height)) ||
+        !(ptr = bin_parse_int(ptr, lim, &r->size.depth)))
+      myabort();
+
+  rd->ptr = ptr;
+  return 1;
+}
+
+static bool read_record(struct reader *rd, struct record *r)
+{
+  if (rd->binary)
+    return bin_read_record(rd, r);
+  if (!rd->ptr)
+    return 0;
+  rd->ptr = parse_line(rd->ptr, r);
+  return rd->ptr != NULL;
+}
+
+static const uint8_t *
+skip_tree(const uint8_t *ptr, uint8_t open, uint8_t close)
+{
+  int nest = 1;
+  while (nest > 0)
+  {
+    if (*ptr == open)
+      nest += 1;
+    else if (*ptr == close)
+      nest -= 1;
+    else if (*ptr == '}')
+      break;
+    ptr = nextline(ptr);
+  }
+  return ptr;
+}
+
+static void
+bin_skip_tree(struct reader *rd, enum kind open, enum kind close)
+{
+  // Binary records are delta coded: skipped records still have to be decoded
+  struct record r;
+  int nest = 1;
+  while (nest > 0 && read_record(rd, &r))
+  {
+    if (r.kind == open)
+      nest += 1;
+    else if (r.kind == close)
+      nest -= 1;
+  }
+}
+
+static void
+skip_record(struct reader *rd, struct record *r)
+{
+  switch (r->kind)
+  {
+    case STEX_ENTER_H:
+      if (rd->binary)
+        bin_skip_tree(rd, STEX_ENTER_H, STEX_LEAVE_H);
+      else
+        rd->ptr = skip_tree(rd->ptr, '(', ')');
+      break;
+    case STEX_ENTER_V:
+      if (rd->binary)
+        bin_skip_tree(rd, STEX_ENTER_V, STEX_LEAVE_V);
+      else
+        rd->ptr = skip_tree(rd->ptr, '[', ']');
+      break;
+    default:
+      break;
+  }
+}
+
+// Name of the input declared by the record at offset
+static int input_name(synctex_t *stx, fz_buffer *buf, int offset, const char **name)
+{
+  const uint8_t *ptr = &buf->data[offset];
+
+  if (stx->binary)
+  {
+    int tag, len;
+    ptr = bin_parse_int(ptr + 1, buf->data + buf->len, &tag);
+    ptr = bin_parse_int(ptr, buf->data + buf->len, &len);
+    *name = (const char *)ptr;
+    return len;
+  }
+
+  while (*ptr != ':')
+    ptr++;
+  ptr++;
+  while (*ptr != ':')
+    ptr++;
+  ptr++;
+  *name = (const char *)ptr;
+  const uint8_t *fend = ptr;
+  while (*fend != '\n')
+    fend++;
+  return (fend - ptr);
+}
+
 struct candidate {
   float area;
   fz_irect rect;
@@ -562,21 +883,12 @@ static int get_filename(synctex_t *stx, fz_buffer *buf, struct candidate *c, int
   if (tag <= 0)
     return 0;
 
-  const uint8_t *filename = &buf->data[int_abs(stx->input_off.ptr[tag - 1])];
-  while (*filename != ':')
-    filename++;
-  filename++;
-  while (*filename != ':')
-    filename++;
-  filename++;
-  const uint8_t *fend = filename;
-  while (*fend != '\n')
-    fend++;
-  int len = (fend - filename);
+  const char *filename;
+  int len = input_name(stx, buf, int_abs(stx->input_off.ptr[tag - 1]), &filename);
 
   if (len)
   {
-    c->filename = (const char *)filename;
+    c->filename = filename;
     c->len = len;
   }
 
@@ -586,13 +898,13 @@ static int get_filename(synctex_t *stx, fz_buffer *buf, struct candidate *c, int
 }
 
 static void
-parse_tree(synctex_t *stx, fz_buffer *buf, const uint8_t *ptr, int x, int y, struct candidate *c)
+parse_tree(synctex_t *stx, fz_buffer *buf, struct reader *rd, int x, int y, struct candidate *c)
 {
   int nest = 0;
   struct size saved[256];
 
   struct record r = {0,};
-  while ((ptr = parse_line(ptr, &r)))
+  while (read_record(rd, &r))
   {
     fz_irect rect;
     rect.x0 = r.point.x;
@@ -642,7 +954,7 @@ parse_tree(synctex_t *stx, fz_buffer *buf, const uint8_t *ptr, int x, int y, str
           nest += 1;
         }
         else
-          ptr = skip_record(ptr, &r);
+          skip_record(rd, &r);
         break;
       case STEX_LEAVE_H:
       case STEX_LEAVE_V:
@@ -661,19 +973,7 @@ static int get_input(fz_buffer *buf,
                       int index,
                       const char **name)
 {
-  const char *filename =
-    (const char *)&buf->data[int_abs(stx->input_off.ptr[index])];
-  while (*filename != ':')
-    filename++;
-  filename++;
-  while (*filename != ':')
-    filename++;
-  filename++;
-  *name = filename;
-  const char *fend = filename;
-  while (*fend != '\n')
-    fend++;
-  return (fend - filename);
+  return input_name(stx, buf, int_abs(stx->input_off.ptr[index]), name);
 }
 
 void synctex_scan(fz_context *ctx,
@@ -690,12 +990,13 @@ void synctex_scan(fz_context *ctx,
   int bop, eop;
   synctex_page_offset(ctx, stx, page, &bop, &eop);
 
-  const uint8_t *ptr = &buf->data[bop];
+  struct reader rd;
+  reader_init(stx, buf, bop, &rd);
 
   struct candidate c = {0,};
   c.area = INFINITY;
 
-  parse_tree(stx, buf, ptr, x, y, &c);
+  parse_tree(stx, buf, &rd, x, y, &c);
   if (c.link.tag)
   {
     const char *fname;
@@ -775,11 +1076,11 @@ static bool synctex_find_input(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
   return 0;
 }
 
-static const uint8_t *synctex_page_pointer(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int page)
+static void synctex_page_reader(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int page, struct reader *rd)
 {
   int bop, eop;
   synctex_page_offset(ctx, stx, page, &bop, &eop);
-  return &buf->data[bop];
+  reader_init(stx, buf, bop, rd);
 }
 
 static void synctex_clear_search(synctex_t *stx)
@@ -792,14 +1093,15 @@ synctex_backscan_page(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int page,
 {
   int tag = stx->input_tag + 1;
   int line = stx->target_line;
-  const uint8_t *ptr = synctex_page_pointer(ctx, stx, buf, page);
+  struct reader rd;
+  synctex_page_reader(ctx, stx, buf, page, &rd);
 
   struct record r = {0,}, r0;
   r0.link.tag = -1;
 
   int had_record = 0;
 
-  while ((ptr = parse_line(ptr, &r)))
+  while (read_record(&rd, &r))
   {
     // Remember the first location of the page to skip it:
     // it is the location where the shipout procedure was invoked
@@ -0,0 +1,117 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#define _GNU_SOURCE
+#include <string.h>
+#include "textindex.h"
+
+static bool is_space(int c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+         c == 0xA0 || (c >= 0x2000 && c <= 0x200B) || c == 0x3000;
+}
+
+fz_buffer *txp_text_normalize(fz_context *ctx, const char *text, size_t len)
+{
+  fz_buffer *out = fz_new_buffer(ctx, len + 1);
+  const char *ptr = text, *lim = text + len;
+  bool space = 0;
+
+  fz_try(ctx)
+  {
+    while (ptr < lim)
+    {
+      int c;
+      ptr += fz_chartorune(&c, ptr);
+      if (is_space(c))
+        space = 1;
+      else
+      {
+        if (space && out->len > 0)
+          fz_append_byte(ctx, out, ' ');
+        space = 0;
+        fz_append_rune(ctx, out, fz_tolower(c));
+      }
+    }
+    fz_terminate_buffer(ctx, out);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_buffer(ctx, out);
+    fz_rethrow(ctx);
+  }
+
+  return out;
+}
+
+fz_buffer *txp_text_from_stext(fz_context *ctx, fz_stext_page *page)
+{
+  fz_buffer *raw = fz_new_buffer_from_stext_page(ctx, page);
+  fz_buffer *text = NULL;
+
+  fz_try(ctx)
+  {
+    fz_terminate_buffer(ctx, raw);
+    text = txp_text_normalize(ctx, (const char *)raw->data, raw->len);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_buffer(ctx, raw);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return text;
+}
+
+fz_buffer *txp_text_from_display_list(fz_context *ctx, fz_display_list *dl)
+{
+  fz_stext_page *page = fz_new_stext_page_from_display_list(ctx, dl, NULL);
+  fz_buffer *text = NULL;
+
+  fz_try(ctx)
+  {
+    text = txp_text_from_stext(ctx, page);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_stext_page(ctx, page);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return text;
+}
+
+bool txp_text_contains(fz_buffer *text, fz_buffer *needle)
+{
+  if (needle->len == 0)
+    return 0;
+  return memmem(text->data, text->len, needle->data, needle->len) != NULL;
+}
@@ -0,0 +1,45 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+
+#ifndef TEXTINDEX_H_
+#define TEXTINDEX_H_
+
+#include <stdbool.h>
+#include <mupdf/fitz.h>
+
+/* Text of the pages, as indexed for searching.
+ *
+ * Characters are converted to lower case and runs of whitespace to a single
+ * space, so that a needle normalized the same way can be found with a plain
+ * byte comparison.  The buffers are NUL-terminated. */
+
+fz_buffer *txp_text_normalize(fz_context *ctx, const char *text, size_t len);
+fz_buffer *txp_text_from_stext(fz_context *ctx, fz_stext_page *page);
+fz_buffer *txp_text_from_display_list(fz_context *ctx, fz_display_list *dl);
+
+// Does the page text contain the (normalized) needle
+bool txp_text_contains(fz_buffer *text, fz_buffer *needle);
+
+#endif // TEXTINDEX_H_
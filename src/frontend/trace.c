@@ -0,0 +1,108 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+#define TRACE_CAPACITY 16384
+
+typedef struct
+{
+  const char *cat, *name;
+  trace_time ts, dur;
+  int arg;
+} trace_event;
+
+static trace_event events[TRACE_CAPACITY];
+static unsigned int events_count;
+
+trace_time trace_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (trace_time)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record(const char *cat, const char *name,
+                   trace_time ts, trace_time dur, int arg)
+{
+  trace_event *e = &events[events_count % TRACE_CAPACITY];
+  events_count += 1;
+  e->cat = cat;
+  e->name = name;
+  e->ts = ts;
+  e->dur = dur;
+  e->arg = arg;
+}
+
+void trace_span(const char *cat, const char *name, trace_time start, int arg)
+{
+  record(cat, name, start, trace_now() - start, arg);
+}
+
+void trace_instant(const char *cat, const char *name, int arg)
+{
+  record(cat, name, trace_now(), -1, arg);
+}
+
+bool trace_export(const char *path)
+{
+  FILE *f = fopen(path, "w");
+  if (!f)
+  {
+    perror("[trace] cannot open output");
+    return 0;
+  }
+
+  unsigned int first = 0, count = events_count;
+  if (count > TRACE_CAPACITY)
+  {
+    first = count - TRACE_CAPACITY;
+    count = TRACE_CAPACITY;
+  }
+
+  int pid = getpid();
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (unsigned int i = 0; i < count; i++)
+  {
+    trace_event *e = &events[(first + i) % TRACE_CAPACITY];
+    fprintf(f, "%s{\"cat\":\"%s\",\"name\":\"%s\",\"pid\":%d,\"tid\":1,"
+               "\"ts\":%lld,",
+            i == 0 ? "" : ",\n", e->cat, e->name, pid, (long long)e->ts);
+    if (e->dur < 0)
+      fprintf(f, "\"ph\":\"i\",\"s\":\"t\",");
+    else
+      fprintf(f, "\"ph\":\"X\",\"dur\":%lld,", (long long)e->dur);
+    fprintf(f, "\"args\":{\"arg\":%d}}", e->arg);
+  }
+  fprintf(f, "\n]}\n");
+
+  bool ok = !ferror(f);
+  if (fclose(f) != 0)
+    ok = 0;
+  fprintf(stderr, "[trace] exported %d events to %s\n", count, path);
+  return ok;
+}
@@ -0,0 +1,56 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Lightweight tracing of the driver pipeline.
+ *
+ * Spans are recorded in a fixed-size ring buffer (the oldest ones are
+ * overwritten) and can be exported at any time in the Chrome trace event
+ * format, to be loaded in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Names and categories are not copied: they must be static strings.
+ * Tracing is only meant to be used from the main thread.
+ */
+
+typedef int64_t trace_time;
+
+// Current time in microseconds (monotonic clock)
+trace_time trace_now(void);
+
+// Record a span that started at `start` and ends now.
+// `arg` is attached to the event (page number, trace position, ...).
+void trace_span(const char *cat, const char *name, trace_time start, int arg);
+
+// Record an instantaneous event
+void trace_instant(const char *cat, const char *name, int arg);
+
+// Write the content of the ring buffer to `path` as a JSON trace
+bool trace_export(const char *path);
+
+#endif // TRACE_H_
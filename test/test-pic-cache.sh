@@ -0,0 +1,39 @@
+#!/bin/bash
+# Test the persistent cache of picture bounds: a first session stores the
+# bounds of a picture, a second session answers TeX from the cache, before
+# the picture is opened, so it is neither opened nor parsed again.
+set -e
+
+CACHE=$(mktemp -d /tmp/texpresso-cache-XXXXXX)
+LOG1=$(mktemp /tmp/texpresso-log-XXXXXX)
+LOG2=$(mktemp /tmp/texpresso-log-XXXXXX)
+
+cleanup() {
+  rm -rf "$CACHE" "$LOG1" "$LOG2"
+}
+trap cleanup EXIT
+
+TARGET="texpresso_logo_v2.png"
+
+run() {
+  XDG_CACHE_HOME="$CACHE" build/texpresso-headless -pages 1 \
+    -o "$CACHE/picfile" test/picfile.tex > /dev/null 2> "$1"
+}
+
+run "$LOG1"
+grep -q "\[picache\] .*$TARGET: storing bounds" "$LOG1" || {
+  echo "FAIL: first session did not store the bounds of $TARGET"
+  exit 1
+}
+
+run "$LOG2"
+grep -q "\[picache\] .*$TARGET: using cached bounds" "$LOG2" || {
+  echo "FAIL: second session did not use the cached bounds of $TARGET"
+  exit 1
+}
+if grep -q "\[picache\] .*$TARGET: storing bounds" "$LOG2"; then
+  echo "FAIL: second session parsed $TARGET again"
+  exit 1
+fi
+
+echo "PASS: pic-cache test"